@@ -23,6 +23,9 @@ extern "C" {
 #define EUSERS			87	/* Too many users */
 #define EBUSY			16	/* Device or resource busy */
 #define ETIMEDOUT		110 /* Connection timed out */
+#define EOPNOTSUPP		95	/* Operation not supported */
+#define EINPROGRESS		115	/* Operation now in progress */
+#define ENOENT			02	/* No such file or directory */
 
 #ifdef __cplusplus
 }
@@ -50,6 +50,14 @@ int hal_comm_accept(int sockfd, uint64_t *addr);
 /* Blocking operation. Returns -ETIMEOUT */
 int hal_comm_connect(int sockfd, uint64_t *addr);
 
+/*
+ * Milliseconds until the next call to hal_comm is due: the next timer
+ * deadline, but a few ms while the radio listens without an IRQ line
+ * (NRF24_CMD_GET_IRQ) since its RX FIFO must then be polled. 0 if work
+ * is pending, -1 if nothing is scheduled.
+ */
+int hal_comm_next_timeout(void);
+
 #ifdef __cplusplus
 }
 #endif
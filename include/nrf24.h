@@ -34,6 +34,24 @@ int nrf24_mac2str(const struct nrf24_mac *, char *);
 /* Converts string to nrf24_mac address */
 int nrf24_str2mac(const char *, struct nrf24_mac *);
 
+#ifndef ARDUINO
+/*
+ * hal_comm state of one radio: each instance opens a radio of its own
+ * (SIM0 gives one simulated node per open). The hal_comm functions
+ * apply to the instance selected, the one built in at start.
+ */
+struct nrf24_comm;
+
+/* New instance, not selected: NULL if out of memory */
+struct nrf24_comm *nrf24_comm_new(void);
+
+/* Frees an instance deinitialized */
+void nrf24_comm_free(struct nrf24_comm *);
+
+/* Selects an instance, NULL the built in one: returns the previous */
+struct nrf24_comm *nrf24_comm_select(struct nrf24_comm *);
+#endif
+
 /* Generic response for all commands */
 #define MGMT_CMD_NRF24_RSP			0x0101
 struct mgmt_cmd_nrf24_rsp {
@@ -112,6 +130,113 @@ struct mgmt_cmd_nrf24_scan_params {
 	uint8_t filter;			/* 0: report all, 1: skip dupplicated */
 } __attribute__ ((packed));
 
+/*
+ * Synchronous command: link features offered to the things (gateway)
+ * or accepted from the gateway (thing), applied to new connections.
+ * ACK payloads: downlink fragments ride the ACKs of the thing frames
+ * instead of a PTX turnaround of the gateway. Some nRF24L01+PA+LNA
+ * modules lose ACKs carrying payloads: disabled by default.
+ * Rate adaptation: links move between 250kbps, 1Mbps and 2Mbps, the
+ * management channel stays at 1Mbps.
+ * Power control: each side lowers the TX power of its frames while the
+ * peer receives them strongly, presence and connection stay at 0dBm.
+ * Channel hopping: links move between the data channels
+ * (MGMT_CMD_NRF24_DATA_CHANNELS) as the gateway announces.
+ */
+#define MGMT_CMD_NRF24_LINK_FEATURES		0x010A
+struct mgmt_cmd_nrf24_link_features {
+	uint8_t features;		/* NRF24_LINK_F_* */
+	uint16_t ack_wait;		/* ms, 0: default. Gateway: wait for a
+					   thing frame, then PTX. Thing: polls
+					   after its messages */
+} __attribute__ ((packed));
+
+#define NRF24_LINK_F_ACK_PAY			0x01
+/* Gateway: data rate of each link adapted to its retransmissions */
+#define NRF24_LINK_F_RATE			0x02
+/* Both sides: TX power of each link adapted, POWER_IND from the peer */
+#define NRF24_LINK_F_POWER			0x04
+/*
+ * Gateway: slow hopping between the data channels, CHANNEL_IND. With a
+ * single one, the links only follow it as it changes.
+ */
+#define NRF24_LINK_F_HOP			0x08
+
+/* Data rates: RATE_IND control PDU and NRF24_CMD_SET_DATA_RATE */
+#define NRF24_RATE_250K				0
+#define NRF24_RATE_1M				1
+#define NRF24_RATE_2M				2
+
+/* TX power: NRF24_CMD_SET_POWER, 6dB steps */
+#define NRF24_POWER_18DBM			0	/* -18dBm */
+#define NRF24_POWER_12DBM			1
+#define NRF24_POWER_6DBM			2
+#define NRF24_POWER_0DBM			3
+
+/*
+ * Synchronous command: reports MGMT_EVT_NRF24_LINK_STATS for the link
+ * to mac, or for every link if mac is 0. The events are read from the
+ * management socket, one at a time.
+ */
+#define MGMT_CMD_NRF24_LINK_STATS		0x010B
+struct mgmt_cmd_nrf24_link_stats {
+	struct nrf24_mac mac;		/* Peer, 0: all links */
+} __attribute__ ((packed));
+
+/*
+ * Synchronous command: auto retransmission (ARD and ARC) of the frames
+ * this side sends on its links, from the next one. Pipe: ARD from 2ms
+ * to 4ms by pipe index, 15 retransmissions. Adaptive: the shortest ARD
+ * receiving the ACKs (payloads included) at the link rate, longer when
+ * retransmissions are frequent, fewer retransmissions at 250kbps and
+ * while the peer doesn't answer.
+ */
+#define MGMT_CMD_NRF24_RETR_POLICY		0x010C
+struct mgmt_cmd_nrf24_retr_policy {
+	uint8_t policy;			/* NRF24_RETR_POLICY_* */
+} __attribute__ ((packed));
+
+#define NRF24_RETR_POLICY_PIPE			0
+#define NRF24_RETR_POLICY_ADAPTIVE		1
+
+/*
+ * Synchronous command (gateway): data channels of the links connected
+ * from now on, given in turn by pipe in CONNECT_REQ, and the channels
+ * NRF24_LINK_F_HOP links hop between. count 0: every link on the
+ * default data channel. The management channel can't be one of them.
+ * NRF24_LINK_F_HOP links leave the channels withdrawn, the others keep
+ * theirs.
+ */
+#define MGMT_CMD_NRF24_DATA_CHANNELS		0x010D
+#define NRF24_DATA_CHANNELS_MAX			8
+struct mgmt_cmd_nrf24_data_channels {
+	uint8_t count;
+	uint8_t channels[NRF24_DATA_CHANNELS_MAX];
+} __attribute__ ((packed));
+
+/* nRF24L01 driver: channels at 1Mbps and 250kbps, 2Mbps up to 54 */
+#define NRF24_DATA_CH_MIN			10
+#define NRF24_DATA_CH_MAX			116
+#define NRF24_DATA_CH_MAX_2M			54
+/* CONNECT_REQ and presences: the things look for the gateway there */
+#define NRF24_MGMT_CHANNEL			20
+
+/*
+ * Synchronous command (gateway): carrier sense (RPD) of the channels
+ * first to last, one channel per MGMT slot, right before it: samples
+ * listens of ~170us in each of slots slots. The links keep their RAW
+ * slots. Reported by MGMT_EVT_NRF24_SURVEY, replaces the survey in
+ * progress. Radios without RPD (AIR0): -EOPNOTSUPP.
+ */
+#define MGMT_CMD_NRF24_SURVEY			0x010E
+#define NRF24_SURVEY_SAMPLES_MAX		32	/* ~5ms */
+struct mgmt_cmd_nrf24_survey {
+	uint8_t first;			/* NRF24_DATA_CH_MIN to */
+	uint8_t last;			/* NRF24_DATA_CH_MAX */
+	uint8_t samples;		/* Per slot, 1 to 32 */
+	uint8_t slots;			/* Per channel */
+} __attribute__ ((packed));
+
 /* Sent after detecting activity on data channel: pipe1 to pipe5*/
 #define MGMT_EVT_NRF24_CONNECTED		0x0201 /* PHY connected */
 struct mgmt_evt_nrf24_connected {
@@ -157,6 +282,46 @@ struct mgmt_evt_nrf24_key {
 	uint8_t key[0];			/* FIXME: size? */
 } __attribute__ ((packed));
 
+/*
+ * Counters of a link since its connection. TX: frames sent as PTX (not
+ * the fragments on ACK payloads), RX: frames read. RPD is sampled as
+ * each frame is read, radios without RPD (AIR0) report no samples.
+ */
+#define MGMT_EVT_NRF24_LINK_STATS		0x0207
+struct mgmt_evt_nrf24_link_stats {
+	struct nrf24_mac mac;		/* Peer */
+	uint32_t duration;		/* ms since the connection */
+	uint32_t tx_frames;		/* Acknowledged */
+	uint32_t tx_bytes;
+	uint32_t tx_lost;		/* Not acknowledged: MAX_RT */
+	uint32_t retransmits;		/* ARC_CNT, lost frames included */
+	uint32_t rx_frames;
+	uint32_t rx_bytes;
+	uint32_t rx_dropped;		/* Fragments not reassembled */
+	uint32_t rx_flushed;		/* Frames lost retuning the radio */
+	uint32_t rpd_samples;
+	uint32_t rpd_high;		/* RPD set: above -64dBm */
+	uint32_t airtime;		/* us, both ways, retransmissions
+					   included, ACKs excluded */
+	uint8_t rate;			/* NRF24_RATE_* */
+	uint8_t power;			/* NRF24_POWER_* to the peer */
+	uint8_t channel;		/* Data channel */
+} __attribute__ ((packed));
+
+/*
+ * Survey of count channels from first, as they are done: busy[i] is the
+ * share (%) of the samples of channel first + i that heard a carrier
+ * above -64dBm. The survey ends with the event reaching last.
+ */
+#define MGMT_EVT_NRF24_SURVEY			0x0208
+#define NRF24_SURVEY_EVT_CHANNELS		32
+struct mgmt_evt_nrf24_survey {
+	uint8_t first;
+	uint8_t count;
+	uint8_t last;			/* Of the survey */
+	uint8_t busy[NRF24_SURVEY_EVT_CHANNELS];
+} __attribute__ ((packed));
+
 struct mgmt_nrf24_header {
 	uint16_t opcode;	/* Command/Response/Event opcode */
 	uint8_t index;		/* Multi adapter: index */
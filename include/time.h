@@ -16,6 +16,9 @@ extern "C" {
 
 uint32_t hal_time_ms(void);
 uint32_t hal_time_us(void);
+/* Monotonic and wrap-free: not affected by wall clock adjustments */
+uint64_t hal_time64_ms(void);
+uint64_t hal_time64_us(void);
 void hal_delay_ms(uint32_t ms);
 void hal_delay_us(uint32_t us);
 int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __HAL_TIMER_H__
+#define __HAL_TIMER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* No timer armed: hal_timer_run() and hal_timer_next() return it */
+#define HAL_TIMER_NONE		UINT32_MAX
+
+struct hal_timer;
+
+typedef void (*hal_timer_func_t) (struct hal_timer *timer, void *user_data);
+
+/*
+ * struct hal_timer - millisecond timer, embedded by the user
+ * @next: next timer in the same wheel slot
+ * @pprev: reference pointing to this timer: O(1) cancel
+ * @expires: absolute expiration time (hal_time_ms() base)
+ * @func: expiration callback
+ * @user_data: callback argument
+ *
+ * Timers are kept in a hierarchical timing wheel: arm, cancel and
+ * expire are O(1) regardless of the number of armed timers.
+ */
+struct hal_timer {
+	struct hal_timer *next;
+	struct hal_timer **pprev;
+	uint32_t expires;
+	hal_timer_func_t func;
+	void *user_data;
+};
+
+void hal_timer_init(struct hal_timer *timer, hal_timer_func_t func,
+							void *user_data);
+
+/* Re-arming a pending timer moves its deadline */
+void hal_timer_arm(struct hal_timer *timer, uint32_t timeout_ms);
+void hal_timer_cancel(struct hal_timer *timer);
+int hal_timer_pending(const struct hal_timer *timer);
+
+/*
+ * Runs the callbacks of the expired timers. Returns the amount of
+ * milliseconds until the next deadline, allowing the caller to sleep.
+ */
+uint32_t hal_timer_run(uint32_t now);
+uint32_t hal_timer_next(uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_TIMER_H__ */
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #ifdef ARDUINO
@@ -24,13 +25,53 @@
 #include "phy_driver.h"
 
 struct phy_driver *driver_ops[] = {
-	&nrf24l01
+	&nrf24l01,
+#ifndef ARDUINO
+	&nrf24l01_sim,	/* In-memory radios: tests and benchmarks */
+	&nrf24l01_air,	/* Radios of several processes: tools/etherd */
+#endif
 };
 
 /* ARRAY SIZE */
 #define PHY_DRIVERS_COUNTER	((int) (sizeof(driver_ops) \
 				 / sizeof(driver_ops[0])))
 
+#ifndef ARDUINO
+/*
+ * Radios of the drivers opened more than once (multi_open): their
+ * descriptors follow the driver indexes.
+ */
+#define PHY_RADIOS_MAX		64
+#define PHY_RADIO(sockfd)	(&radios[(sockfd) - PHY_DRIVERS_COUNTER])
+
+struct phy_radio {
+	struct phy_driver *ops;
+	int fd;
+};
+
+static struct phy_radio radios[PHY_RADIOS_MAX];
+
+static int radio_open(struct phy_driver *ops)
+{
+	int i, fd;
+
+	for (i = 0; i < PHY_RADIOS_MAX && radios[i].ops; i++)
+		;
+
+	if (i == PHY_RADIOS_MAX)
+		return -EMFILE;
+
+	fd = ops->open(ops->pathname);
+	if (fd < 0)
+		return fd;
+
+	radios[i].ops = ops;
+	radios[i].fd = fd;
+
+	return PHY_DRIVERS_COUNTER + i;
+}
+#endif
+
 int phy_open(const char *pathname)
 {
 	uint8_t i;
@@ -46,6 +87,12 @@ int phy_open(const char *pathname)
 	if (sockfd < 0)
 		return sockfd;
 
+#ifndef ARDUINO
+	/* Already open: another radio of the driver, if it has several */
+	if (driver_ops[sockfd]->ref_open && driver_ops[sockfd]->multi_open)
+		return radio_open(driver_ops[sockfd]);
+#endif
+
 	/* If not open */
 	if (driver_ops[sockfd]->ref_open == 0) {
 		/* Open the driver - returns fd */
@@ -63,6 +110,18 @@ int phy_open(const char *pathname)
 
 int phy_close(int sockfd)
 {
+#ifndef ARDUINO
+	if (sockfd >= PHY_DRIVERS_COUNTER &&
+			sockfd < PHY_DRIVERS_COUNTER + PHY_RADIOS_MAX) {
+		if (PHY_RADIO(sockfd)->ops == NULL)
+			return -EINVAL;
+
+		PHY_RADIO(sockfd)->ops->close(PHY_RADIO(sockfd)->fd);
+		PHY_RADIO(sockfd)->ops = NULL;
+		return 0;
+	}
+#endif
+
 	if (sockfd < 0 || sockfd > PHY_DRIVERS_COUNTER)
 		return -EINVAL;
 
@@ -81,15 +140,33 @@ int phy_close(int sockfd)
 
 ssize_t phy_read(int sockfd, void *buffer, size_t len)
 {
+#ifndef ARDUINO
+	if (sockfd >= PHY_DRIVERS_COUNTER)
+		return PHY_RADIO(sockfd)->ops->read(PHY_RADIO(sockfd)->fd,
+								buffer, len);
+#endif
+
 	return driver_ops[sockfd]->read(driver_ops[sockfd]->fd, buffer, len);
 }
 
 ssize_t phy_write(int sockfd, const void *buffer, size_t len)
 {
+#ifndef ARDUINO
+	if (sockfd >= PHY_DRIVERS_COUNTER)
+		return PHY_RADIO(sockfd)->ops->write(PHY_RADIO(sockfd)->fd,
+								buffer, len);
+#endif
+
 	return driver_ops[sockfd]->write(driver_ops[sockfd]->fd, buffer, len);
 }
 
 int phy_ioctl(int sockfd, int cmd, void *arg)
 {
+#ifndef ARDUINO
+	if (sockfd >= PHY_DRIVERS_COUNTER)
+		return PHY_RADIO(sockfd)->ops->ioctl(PHY_RADIO(sockfd)->fd,
+								cmd, arg);
+#endif
+
 	return driver_ops[sockfd]->ioctl(driver_ops[sockfd]->fd, cmd, arg);
 }
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "include/time.h"
+#include "phy_driver_private.h"
+#include "phy_driver_nrf24.h"
+#include "phy_driver_air.h"
+
+/*
+ * One radio per process, as the SPI nRF24L01: the broker owns the air,
+ * this side keeps the RX FIFO and runs the auto retransmissions. While
+ * a frame is on the air the node is in PTX and doesn't receive.
+ */
+
+#define AIR_CHANNEL_DEFAULT	10
+#define AIR_ARC			15
+#define AIR_FIFO_SIZE		16	/* Frames queued until phy_read() */
+#define AIR_STATUS_TIMEOUT_MS	100	/* Broker not answering */
+
+struct air_msg {
+	struct air_hdr hdr;
+	union {
+		struct air_radio radio;
+		struct air_tx tx;
+		struct air_tx_status status;
+		struct air_rx rx;
+	};
+} __attribute__ ((packed));
+
+static struct air_radio radio;
+static struct air_radio radio_sent;
+static struct air_rx fifo[AIR_FIFO_SIZE];
+static uint8_t fifo_head;
+static uint8_t fifo_count;
+static uint16_t tx_seq;
+static uint8_t tx_pid;
+
+static int radio_update(int sockfd)
+{
+	struct air_msg msg;
+
+	if (memcmp(&radio, &radio_sent, sizeof(radio)) == 0)
+		return 0;
+
+	memset(&msg.hdr, 0, sizeof(msg.hdr));
+	msg.hdr.op = AIR_OP_RADIO;
+	msg.radio = radio;
+
+	if (send(sockfd, &msg, sizeof(msg.hdr) + sizeof(msg.radio),
+							MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	radio_sent = radio;
+
+	return 0;
+}
+
+static void fifo_push(const struct air_rx *rx)
+{
+	/* Full: the frame is lost, the broker acked it already */
+	if (fifo_count == AIR_FIFO_SIZE)
+		return;
+
+	fifo[(fifo_head + fifo_count) % AIR_FIFO_SIZE] = *rx;
+	fifo_count++;
+}
+
+static void fifo_flush(void)
+{
+	fifo_head = 0;
+	fifo_count = 0;
+}
+
+/* Queues received frames, returns the next message of other type */
+static ssize_t air_recv(int sockfd, struct air_msg *msg, int flags)
+{
+	ssize_t len;
+
+	for (;;) {
+		len = recv(sockfd, msg, sizeof(*msg), flags);
+		if (len < 0)
+			return -errno;
+
+		if (len < (ssize_t) sizeof(msg->hdr))
+			continue;
+
+		if (msg->hdr.op != AIR_OP_RX)
+			return len;
+
+		if (radio.rx && msg->rx.len <= AIR_PAYLOAD_SIZE)
+			fifo_push(&msg->rx);
+	}
+}
+
+static int wait_status(int sockfd, uint16_t seq, struct air_tx_status *st)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	struct air_msg msg;
+	uint32_t start = hal_time_ms();
+	int timeout;
+	ssize_t len;
+
+	for (;;) {
+		len = air_recv(sockfd, &msg, MSG_DONTWAIT);
+		if (len >= (ssize_t) (sizeof(msg.hdr) + sizeof(msg.status)) &&
+				msg.hdr.op == AIR_OP_TX_STATUS &&
+				msg.hdr.seq == seq) {
+			*st = msg.status;
+			return 0;
+		}
+
+		if (len < 0 && len != -EAGAIN)
+			return len;
+
+		timeout = AIR_STATUS_TIMEOUT_MS -
+					(int) (hal_time_ms() - start);
+		if (timeout <= 0)
+			return -ETIMEDOUT;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			return -errno;
+	}
+}
+
+static int air_open(const char *pathname)
+{
+	struct sockaddr_un addr;
+	const char *name;
+	socklen_t len;
+	int sockfd, err;
+
+	name = getenv(AIR_ADDRESS_ENV);
+	if (name == NULL || *name == '\0')
+		name = pathname;
+
+	sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		return -errno;
+
+	/* Autobind: the broker answers to an abstract address */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (bind(sockfd, (struct sockaddr *) &addr,
+						sizeof(sa_family_t)) < 0)
+		goto fail;
+
+	strncpy(addr.sun_path + 1, name, sizeof(addr.sun_path) - 2);
+	len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+	if (connect(sockfd, (struct sockaddr *) &addr, len) < 0)
+		goto fail;
+
+	memset(&radio, 0, sizeof(radio));
+	/* Forces the first update: attaches to the broker */
+	memset(&radio_sent, 0xff, sizeof(radio_sent));
+	radio.channel = AIR_CHANNEL_DEFAULT;
+	radio.rx = 1;
+	fifo_flush();
+
+	err = radio_update(sockfd);
+	if (err < 0) {
+		close(sockfd);
+		return err;
+	}
+
+	return sockfd;
+
+fail:
+	err = -errno;
+	close(sockfd);
+	return err;
+}
+
+static void air_close(int sockfd)
+{
+	struct air_hdr hdr = { .op = AIR_OP_DETACH };
+
+	send(sockfd, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(sockfd);
+}
+
+static ssize_t air_write(int sockfd, const void *buffer, size_t len)
+{
+	const struct nrf24_io_pack *p = buffer;
+	struct air_msg msg;
+	struct air_tx_status status;
+	uint8_t attempt;
+	int err;
+
+	if (p->pipe >= AIR_PIPES || len == 0 || len > AIR_PAYLOAD_SIZE)
+		return -EINVAL;
+
+	memset(&msg.hdr, 0, sizeof(msg.hdr));
+	msg.hdr.op = AIR_OP_TX;
+	memcpy(msg.tx.aa, radio.aa[p->pipe], AIR_AA_SIZE);
+	/* As nrf24l01_set_ptx(): pipe0 (broadcast) is never acked */
+	msg.tx.ack = (p->pipe != 0 && (radio.pipe_ack & (1 << p->pipe)));
+	msg.tx.pid = tx_pid = (tx_pid + 1) & 0x03;
+	msg.tx.len = len;
+	memcpy(msg.tx.payload, p->payload, len);
+
+	for (attempt = 0; ; attempt++) {
+		msg.hdr.seq = ++tx_seq;
+		if (send(sockfd, &msg, sizeof(msg.hdr) +
+				offsetof(struct air_tx, payload) + len,
+						MSG_NOSIGNAL) < 0)
+			return -errno;
+
+		err = wait_status(sockfd, msg.hdr.seq, &status);
+		if (err < 0)
+			return err;
+
+		if (!msg.tx.ack || status.acked)
+			break;
+
+		if (attempt >= AIR_ARC)
+			return -ETIMEDOUT;
+
+		/* ARD as nrf24l01_set_ptx(): (pipe * 2) + 5, 250us steps */
+		hal_delay_us(((p->pipe * 2) + 5 + 1) * 250);
+	}
+
+	return len;
+}
+
+static ssize_t air_read(int sockfd, void *buffer, size_t len)
+{
+	struct nrf24_io_pack *p = buffer;
+	struct air_msg msg;
+	struct air_rx *rx;
+
+	/* RX frames to the FIFO, stale TX status discarded */
+	while (fifo_count < AIR_FIFO_SIZE &&
+			air_recv(sockfd, &msg, MSG_DONTWAIT) >= 0)
+		;
+
+	if (fifo_count == 0)
+		return -EAGAIN;
+
+	/* Only the pipe at the head of the RX FIFO can be read */
+	rx = &fifo[fifo_head];
+	if (rx->pipe != p->pipe)
+		return -EAGAIN;
+
+	fifo_head = (fifo_head + 1) % AIR_FIFO_SIZE;
+	fifo_count--;
+
+	if (len > rx->len)
+		len = rx->len;
+
+	memcpy(p->payload, rx->payload, len);
+
+	return len;
+}
+
+static int air_ioctl(int sockfd, int cmd, void *arg)
+{
+	struct addr_pipe *addrpipe;
+	struct air_msg msg;
+	int pipe, ch, err = 0;
+
+	/* No IRQ: frames wait in the socket while the FIFO is full */
+	if (cmd == NRF24_CMD_GET_IRQ)
+		return -ENOSYS;
+
+	/*
+	 * The broker has no radio statistics, retransmissions are fixed
+	 * and every frame reaches the radios of the channel
+	 */
+	if (cmd == NRF24_CMD_GET_RETRANSMITS || cmd == NRF24_CMD_GET_RPD ||
+			cmd == NRF24_CMD_SURVEY || cmd == NRF24_CMD_SET_RETR ||
+			cmd == NRF24_CMD_SET_POWER ||
+			cmd == NRF24_CMD_GET_FLUSHED)
+		return -EOPNOTSUPP;
+
+	switch (cmd) {
+	case NRF24_CMD_SET_PIPE:
+		addrpipe = arg;
+		if (addrpipe->pipe >= AIR_PIPES)
+			return -EINVAL;
+
+		/* As the nRF24, an open pipe keeps its address */
+		if (radio.pipe_en & (1 << addrpipe->pipe))
+			break;
+
+		memcpy(radio.aa[addrpipe->pipe], addrpipe->aa, AIR_AA_SIZE);
+		radio.pipe_en |= (1 << addrpipe->pipe);
+		if (addrpipe->ack)
+			radio.pipe_ack |= (1 << addrpipe->pipe);
+		else
+			radio.pipe_ack &= ~(1 << addrpipe->pipe);
+		break;
+	case NRF24_CMD_RESET_PIPE:
+		pipe = *((int *) arg);
+		if (pipe < 0 || pipe >= AIR_PIPES)
+			return -EINVAL;
+
+		radio.pipe_en &= ~(1 << pipe);
+		radio.pipe_ack &= ~(1 << pipe);
+		break;
+	case NRF24_CMD_SET_CHANNEL:
+		ch = *((int *) arg);
+		if (ch < 0 || ch > 125)
+			return -EINVAL;
+
+		if (ch == radio.channel)
+			break;
+
+		/* As nrf24l01_set_channel(): RX FIFO flushed */
+		while (air_recv(sockfd, &msg, MSG_DONTWAIT) >= 0)
+			;
+		fifo_flush();
+		radio.channel = ch;
+		break;
+	case NRF24_CMD_SET_STANDBY:
+		radio.rx = 0;
+		return radio_update(sockfd);
+	case NRF24_CMD_ENABLE_ACK_PAYLOAD:
+		/* The broker doesn't carry ACK payloads */
+		if (*((int *) arg))
+			err = -EOPNOTSUPP;
+		break;
+	case NRF24_CMD_SET_DATA_RATE:
+		/* The broker ignores the data rate */
+		err = -EOPNOTSUPP;
+		break;
+	default:
+		err = -EINVAL;
+	}
+
+	radio.rx = 1;
+	radio_update(sockfd);
+
+	return err;
+}
+
+struct phy_driver nrf24l01_air = {
+	.name = "AIR0",
+	.pathname = AIR_DEFAULT_ADDRESS,
+	.open = air_open,
+	.close = air_close,
+	.read = air_read,
+	.write = air_write,
+	.ioctl = air_ioctl,
+	.ref_open = 0,
+	.fd = -1,
+};
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Virtual air: "AIR0" radios of separate processes attach to the
+ * tools/etherd broker over unix datagram sockets. Each node reports its
+ * radio configuration (channel, PRX/standby, pipe addresses), the broker
+ * delivers frames by channel and access address, applies loss, airtime
+ * and collisions, and answers every transmission with its ACK status.
+ */
+
+#define AIR_DEFAULT_ADDRESS	"nrf24air"	/* Abstract socket name */
+#define AIR_ADDRESS_ENV		"NRF24_AIR"	/* Overrides the default */
+
+#define AIR_PIPES		6
+#define AIR_AA_SIZE		5
+#define AIR_PAYLOAD_SIZE	32
+
+enum air_op {
+	AIR_OP_RADIO = 1,	/* Node: radio configuration, attaches */
+	AIR_OP_TX,		/* Node: one transmission */
+	AIR_OP_TX_STATUS,	/* Broker: end of the transmission */
+	AIR_OP_RX,		/* Broker: frame received */
+	AIR_OP_DETACH,		/* Node: closing */
+};
+
+struct air_hdr {
+	uint8_t op;
+	uint8_t reserved;
+	uint16_t seq;		/* TX and TX_STATUS */
+} __attribute__ ((packed));
+
+struct air_radio {
+	uint8_t channel;
+	uint8_t rx;		/* PRX: standby nodes don't receive */
+	uint8_t pipe_en;	/* EN_RXADDR */
+	uint8_t pipe_ack;	/* EN_AA */
+	uint8_t aa[AIR_PIPES][AIR_AA_SIZE];
+} __attribute__ ((packed));
+
+struct air_tx {
+	uint8_t aa[AIR_AA_SIZE];
+	uint8_t ack;		/* Acknowledgment requested */
+	uint8_t pid;		/* Retransmissions keep the packet id */
+	uint8_t len;
+	uint8_t payload[AIR_PAYLOAD_SIZE];
+} __attribute__ ((packed));
+
+struct air_tx_status {
+	uint8_t acked;
+	uint8_t collided;
+} __attribute__ ((packed));
+
+struct air_rx {
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t payload[AIR_PAYLOAD_SIZE];
+} __attribute__ ((packed));
+
+#define AIR_MSG_MAX		(sizeof(struct air_hdr) + sizeof(struct air_tx))
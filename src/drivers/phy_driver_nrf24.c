@@ -19,18 +19,76 @@
 #include <unistd.h>
 #endif
 
+#include "include/nrf24.h"
 #include "nrf24l01.h"
 #include "nrf24l01_io.h"
 #include "phy_driver_private.h"
 #include "phy_driver_nrf24.h"
 
+#define ACK_PAYLOADS_MAX	3	/* TX FIFO entries */
+
 uint8_t broadcast_addr[5] = {0x8D, 0xD9, 0xBE, 0x96, 0xDE};
 
+/* NRF24_RATE_* to RF_SETUP */
+static const uint8_t data_rates[] = {
+	[NRF24_RATE_250K] = NRF24_DR_250KBPS,
+	[NRF24_RATE_1M] = NRF24_DR_1MBPS,
+	[NRF24_RATE_2M] = NRF24_DR_2MBPS,
+};
+
+/* ACK payloads by pipe: loaded again after each TX FIFO flush */
+static struct nrf24_ack_payload ack_payloads[NRF24_PIPE_MAX + 1];
+static uint8_t ack_pipes;
+
+static void ack_payload_load(int spi_fd)
+{
+	uint8_t pipe;
+
+	nrf24l01_flush_ack_data(spi_fd);
+
+	for (pipe = 0; pipe <= NRF24_PIPE_MAX; pipe++) {
+		if (ack_pipes & (1 << pipe))
+			nrf24l01_prx_ack_data(spi_fd, pipe,
+					ack_payloads[pipe].payload,
+					ack_payloads[pipe].len);
+	}
+}
+
+static int ack_payload_set(const struct nrf24_ack_payload *ap)
+{
+	uint8_t pipe, count = 0;
+
+	if (ap->pipe > NRF24_PIPE_MAX || ap->len > NRF24_PAYLOAD_SIZE)
+		return -EINVAL;
+
+	if (ap->len == 0) {
+		ack_pipes &= ~(1 << ap->pipe);
+		return 0;
+	}
+
+	for (pipe = 0; pipe <= NRF24_PIPE_MAX; pipe++) {
+		if (pipe != ap->pipe && (ack_pipes & (1 << pipe)))
+			count++;
+	}
+
+	if (count == ACK_PAYLOADS_MAX)
+		return -EBUSY;
+
+	ack_payloads[ap->pipe] = *ap;
+	ack_pipes |= (1 << ap->pipe);
+
+	return 0;
+}
+
 static ssize_t nrf24l01_write(int spi_fd, const void *buffer, size_t len)
 {
 	int err;
 	struct nrf24_io_pack *p = (struct nrf24_io_pack *) buffer;
 
+	/* ACK payloads share the TX FIFO: they would go out first */
+	if (ack_pipes)
+		nrf24l01_flush_ack_data(spi_fd);
+
 	/* Puts the radio in TX mode  enabling Acknowledgment */
 	nrf24l01_set_ptx(spi_fd, p->pipe);
 
@@ -50,6 +108,9 @@ static ssize_t nrf24l01_write(int spi_fd, const void *buffer, size_t len)
 
 	nrf24l01_set_prx(spi_fd, broadcast_addr);
 
+	if (ack_pipes)
+		ack_payload_load(spi_fd);
+
 	/*
 	 * On success, the number of bytes written is returned
 	 * Otherwise, -1 is returned.
@@ -63,10 +124,14 @@ static ssize_t nrf24l01_read(int spi_fd, void *buffer, size_t len)
 	ssize_t length = -1;
 	struct nrf24_io_pack *p = (struct nrf24_io_pack *) buffer;
 	/* If the pipe available */
-	if (nrf24l01_prx_pipe_available(spi_fd) == p->pipe)
+	if (nrf24l01_prx_pipe_available(spi_fd) == p->pipe) {
 		/* Copy data to buffer */
 		length = nrf24l01_prx_data(spi_fd, p->payload, len);
 
+		/* Its ACK carried the payload of the pipe */
+		ack_pipes &= ~(1 << p->pipe);
+	}
+
 	/*
 	 * On success, the number of bytes read is returned
 	 * Otherwise, -1 is returned.
@@ -97,12 +162,56 @@ static int nrf24l01_open(const char *pathname)
 
 static void nrf24l01_close(int spi_fd)
 {
+	ack_pipes = 0;
 	nrf24l01_deinit(spi_fd);
 }
 
 static int nrf24l01_ioctl(int spi_fd, int cmd, void *arg)
 {
-	int err = 0;
+	int err = 0, rate;
+
+	/* Read only: the radio stays in PRX */
+	if (cmd == NRF24_CMD_GET_RETRANSMITS) {
+		*((int *) arg) = NRF24_OBSERVE_TX_ARC(
+				(uint8_t) nrf24l01_observe_tx(spi_fd));
+		return 0;
+	}
+
+	/* IRQ pin not wired (RX_DR masked): hal_comm polls the RX FIFO */
+	if (cmd == NRF24_CMD_GET_IRQ)
+		return -ENOSYS;
+
+	if (cmd == NRF24_CMD_GET_RPD) {
+		*((int *) arg) = nrf24l01_rpd(spi_fd);
+		return 0;
+	}
+
+	if (cmd == NRF24_CMD_GET_FLUSHED) {
+		struct nrf24_flushed *flushed = arg;
+
+		flushed->frames = nrf24l01_rx_flushed(spi_fd, flushed->pipe);
+		return 0;
+	}
+
+	/* Applied by the next nrf24l01_set_ptx() */
+	if (cmd == NRF24_CMD_SET_RETR) {
+		struct nrf24_retr *retr = (struct nrf24_retr *) arg;
+		uint8_t ard = (retr->ard == NRF24_RETR_PIPE ?
+					NRF24_RETR_DEFAULT : retr->ard);
+
+		if (nrf24l01_set_retr(spi_fd, retr->pipe, ard, retr->arc) < 0)
+			return -EINVAL;
+
+		return 0;
+	}
+
+	/* NRF24_POWER_* are the RF_PWR values, applied by set_ptx too */
+	if (cmd == NRF24_CMD_SET_POWER) {
+		if (nrf24l01_set_power(spi_fd, *((int *) arg)) < 0)
+			return -EINVAL;
+
+		return 0;
+	}
 
 	/* Set standby to set registers */
 	nrf24l01_set_standby(spi_fd);
@@ -131,13 +240,49 @@ static int nrf24l01_ioctl(int spi_fd, int cmd, void *arg)
 	case NRF24_CMD_SET_STANDBY:
 		break;
 
+	case NRF24_CMD_SURVEY:
+		{
+			struct nrf24_survey *survey = arg;
+
+			err = nrf24l01_survey(spi_fd, survey->channel,
+							survey->samples);
+			if (err >= 0) {
+				survey->hits = err;
+				err = 0;
+			}
+		}
+		break;
+
+	case NRF24_CMD_ENABLE_ACK_PAYLOAD:
+		err = nrf24l01_set_ack_payload(spi_fd, *((int *) arg));
+		ack_pipes = 0;
+		break;
+
+	case NRF24_CMD_SET_ACK_PAYLOAD:
+		err = ack_payload_set(arg);
+		break;
+
+	case NRF24_CMD_SET_DATA_RATE:
+		rate = *((int *) arg);
+		if (rate < NRF24_RATE_250K || rate > NRF24_RATE_2M)
+			err = -EINVAL;
+		else
+			err = nrf24l01_set_data_rate(spi_fd,
+							data_rates[rate]);
+		break;
+
 	default:
 		err = -1;
 	}
 
-	if (cmd != NRF24_CMD_SET_STANDBY)
+	if (cmd != NRF24_CMD_SET_STANDBY) {
 		nrf24l01_set_prx(spi_fd, broadcast_addr);
 
+		/* Channel switches flush the TX FIFO too */
+		if (ack_pipes)
+			ack_payload_load(spi_fd);
+	}
+
 	return err;
 }
 
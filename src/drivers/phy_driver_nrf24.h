@@ -23,6 +23,64 @@ enum nrf24_cmds {
 				NRF24_CMD_SET_ADDRESS_PIPE,
 				NRF24_CMD_SET_POWER,
 				NRF24_CMD_SET_STANDBY,
+				/* >= 0: RX frames raise an IRQ */
+				NRF24_CMD_GET_IRQ,
+				NRF24_CMD_ENABLE_ACK_PAYLOAD,
+				NRF24_CMD_SET_ACK_PAYLOAD,
+				NRF24_CMD_SET_DATA_RATE,
+				NRF24_CMD_GET_RETRANSMITS,
+				NRF24_CMD_GET_RPD,
+				NRF24_CMD_SET_RETR,
+				NRF24_CMD_SURVEY,
+				NRF24_CMD_GET_FLUSHED,
+};
+
+/*
+ * NRF24_CMD_SET_DATA_RATE: int, NRF24_RATE_* (include/nrf24.h).
+ * NRF24_CMD_GET_RETRANSMITS: int, retransmissions of the last frame
+ * written (OBSERVE_TX ARC_CNT), without leaving the current mode.
+ * NRF24_CMD_GET_RPD: int, 1 if the last frame received was above -64dBm
+ * (RPD), without leaving the current mode.
+ * NRF24_CMD_SET_RETR: struct nrf24_retr, without leaving the current mode.
+ * NRF24_CMD_SET_POWER: int, NRF24_POWER_* (include/nrf24.h) of the frames
+ * written from now on, without leaving the current mode.
+ * NRF24_CMD_SURVEY: struct nrf24_survey, back to PRX on its channel.
+ * NRF24_CMD_GET_FLUSHED: struct nrf24_flushed, without leaving the
+ * current mode.
+ */
+
+/*
+ * Auto retransmission of the frames written on pipe: delay ((ard + 1) *
+ * 250us, ard 0 to 15) and count (arc 0 to 15), kept until changed.
+ * NRF24_RETR_PIPE as ard restores the delay by pipe index.
+ */
+#define NRF24_RETR_PIPE			0xff
+struct nrf24_retr {
+	uint8_t pipe;
+	uint8_t ard;
+	uint8_t arc;
+};
+
+/*
+ * Carrier sense of channel: hits of samples listens (~170us each) found
+ * a signal above -64dBm (RPD). Frames received on a different channel
+ * are flushed, as by NRF24_CMD_SET_CHANNEL.
+ */
+struct nrf24_survey {
+	uint8_t channel;
+	uint8_t samples;
+	uint8_t hits;
+};
+
+/*
+ * Frames received on pipe and still in the RX FIFO when the channel
+ * changed (NRF24_CMD_SET_CHANNEL, NRF24_CMD_SURVEY), since the radio
+ * was opened: discarded. Reading the FIFO first keeps them. A lower
+ * bound on the nRF24L01: the frames go to the pipe at the head.
+ */
+struct nrf24_flushed {
+	uint8_t pipe;
+	uint32_t frames;
 };
 
 /* Used to set pipe address*/
@@ -31,3 +89,14 @@ struct addr_pipe {
 	bool ack;
 	uint8_t aa[5];
 };
+
+/*
+ * Payload of the ACKs sent on pipe (NRF24_CMD_SET_ACK_PAYLOAD), until
+ * a frame is read from pipe: replaces the previous one, len 0 removes
+ * it. The driver keeps it across transmissions and channel switches.
+ */
+struct nrf24_ack_payload {
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
+};
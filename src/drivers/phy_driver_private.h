@@ -20,6 +20,7 @@
  * @ioctl: function to device-specific input/output operations
  * @ref_open: reference driver open
  * @fd: driver fd
+ * @multi_open: each open after the first one gets another radio
  *
  * This 'driver' intends to be an abstraction for Radio technologies or
  * proxy for other services using TCP or any socket based communication.
@@ -36,6 +37,12 @@ struct phy_driver {
 	int (*ioctl) (int sockfd, int cmd, void *arg);
 	int ref_open;
 	int fd;
+	bool multi_open;
 };
 
 extern struct phy_driver nrf24l01;
+
+#ifndef ARDUINO
+extern struct phy_driver nrf24l01_sim;
+extern struct phy_driver nrf24l01_air;
+#endif
@@ -0,0 +1,1058 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "include/time.h"
+#include "include/nrf24.h"
+#include "phy_driver_private.h"
+#include "phy_driver_nrf24.h"
+#include "phy_driver_sim.h"
+
+/*
+ * Radio model: a frame reaches the nodes listening on the channel of
+ * the transmitter with a pipe open on the destination address, as
+ * Enhanced ShockBurst does. Auto-ack, packet ids (duplicates are acked
+ * but not delivered), the 3 entries RX FIFO and retransmissions follow
+ * the nRF24L01 behavior; frames and ACKs are dropped with the configured
+ * probability, and with the interference of their channel (Wi-Fi or
+ * another network: sim_set_interference()). Not thread safe: nodes run
+ * in the thread of hal_comm.
+ *
+ * With collisions, a transmission is logged on the air, lasts its
+ * airtime (hal_delay_us(): a virtual clock may run other nodes in the
+ * meantime) and is received only if no other frame overlapped it on
+ * the channel, or if it is capture dB above the strongest one. A node
+ * doesn't receive while it transmits. ACKs go through the same model.
+ *
+ * An ACK may carry the payload loaded on the pipe (EN_ACK_PAY): it is
+ * taken by the first acknowledgment of a new packet and sent again with
+ * the ACKs of its retransmissions. The transmitter waits for the ACK
+ * during its ARD only: a longer ACK is missed, as the nRF24L01+ datasheet
+ * warns (500us at 250kbps even without payload).
+ *
+ * Receivers only hear transmitters at their own data rate. The weaker
+ * level of the two nodes stands for the path loss of the link, lowered
+ * by the TX power reduction of the transmitter: close to the sensitivity
+ * of the data rate (nRF24L01+: -94dBm at 250kbps, -85dBm at 1Mbps,
+ * -82dBm at 2Mbps), frames and ACKs are lost more often.
+ */
+
+#define SIM_CHANNEL_DEFAULT	10
+#define SIM_ARC_DEFAULT		15
+#define SIM_BITRATE_DEFAULT	1000000
+#define SIM_AIR_LOG		128	/* Recent transmissions */
+#define SIM_ACK_PAYLOADS	3	/* TX FIFO depth */
+#define SIM_MARGIN_MIN		-3	/* dB: nothing received below */
+#define SIM_RPD_LEVEL		-64	/* dBm: RPD set at or above */
+#define SIM_SURVEY_US		170	/* Carrier sense sample: TSTBY2A + AGC */
+#define SIM_ACK_SETTLE		130	/* us: PTX to RX before the ACK */
+
+/* Loss (ppm) by dB of margin above the sensitivity, from SIM_MARGIN_MIN */
+static const uint32_t margin_loss[] = {
+	1000000, 900000, 700000, 400000, 200000, 80000, 30000, 10000
+};
+
+struct sim_rx {
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t payload[SIM_PAYLOAD_SIZE];
+};
+
+/* Last packet accepted on a pipe: duplicate detection */
+struct sim_last {
+	bool valid;
+	uint8_t src;
+	uint8_t pid;
+	uint32_t crc;
+};
+
+struct sim_node {
+	bool used;
+	bool rx;		/* PRX: standby nodes don't receive */
+	uint8_t channel;
+	uint8_t pipe_en;	/* EN_RXADDR */
+	uint8_t pipe_ack;	/* EN_AA */
+	uint8_t aa[SIM_PIPES][SIM_AA_SIZE];
+	struct sim_rx fifo[SIM_FIFO_SIZE];
+	uint8_t fifo_head;
+	uint8_t fifo_count;
+	uint8_t pid;		/* 2 bits, as the nRF24 PID */
+	struct sim_last last[SIM_PIPES];
+	int8_t level;		/* dBm, as heard by the other nodes */
+	uint8_t ack_loaded;	/* Pipes with an ACK payload waiting */
+	uint8_t ack_sent;	/* Sent with the ACK of the last packet */
+	struct sim_rx ack[SIM_PIPES];
+	uint32_t bitrate;	/* bit/s, 0: sim_params.bitrate */
+	uint8_t arc_cnt;	/* Retransmissions of the last sim_write() */
+	uint8_t retr_pipes;	/* sim_node_set_retr(): ard and arc set */
+	uint16_t ard[SIM_PIPES];	/* us */
+	uint8_t arc[SIM_PIPES];
+	bool rpd;		/* Last packet received above SIM_RPD_LEVEL */
+	int8_t power;		/* dB: TX power, 0 (full) to -18 */
+	uint32_t flushed[SIM_PIPES];	/* Dropped by a channel change */
+	sim_irq_func_t irq;
+	void *irq_data;
+};
+
+/* Transmission on the air: frame or ACK */
+struct sim_air {
+	uint64_t start;		/* hal_time64_us() */
+	uint64_t end;
+	uint8_t channel;
+	uint8_t src;
+	int8_t level;
+};
+
+static struct sim_node nodes[SIM_NODES_MAX];
+static struct sim_air air[SIM_AIR_LOG];
+static unsigned int air_next;
+
+static struct sim_params params = {
+	.loss = 0,
+	.arc = SIM_ARC_DEFAULT,
+	.ard = 0,
+	.bitrate = SIM_BITRATE_DEFAULT,
+	.realtime = false,
+	.seed = 1,
+	.collisions = false,
+	.capture = 0,
+};
+
+static struct sim_stats stats;
+static uint32_t interference[SIM_CHANNEL_MAX + 1];	/* Loss, ppm */
+static uint32_t random_state = 1;
+static sim_tap_func_t tap_func;
+static void *tap_data;
+
+static inline bool node_valid(int node)
+{
+	return node >= 0 && node < SIM_NODES_MAX && nodes[node].used;
+}
+
+/* xorshift32: deterministic for a given seed */
+static uint32_t sim_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+
+	return random_state;
+}
+
+static bool sim_lost(uint8_t channel)
+{
+	if ((params.loss == 0 || sim_random() % 1000000 >= params.loss) &&
+			(interference[channel] == 0 ||
+			 sim_random() % 1000000 >= interference[channel]))
+		return false;
+
+	stats.lost++;
+
+	return true;
+}
+
+static inline uint32_t node_bitrate(const struct sim_node *node)
+{
+	return node->bitrate ? node->bitrate : params.bitrate;
+}
+
+static inline uint32_t node_ard(const struct sim_node *node, uint8_t pipe)
+{
+	return (node->retr_pipes & (1 << pipe)) ? node->ard[pipe] :
+								sim_ard(pipe);
+}
+
+static inline uint8_t node_arc(const struct sim_node *node, uint8_t pipe)
+{
+	return (node->retr_pipes & (1 << pipe)) ? node->arc[pipe] :
+								params.arc;
+}
+
+/* The weaker level of the nodes, at the TX power of the transmitter */
+static inline int path_level(const struct sim_node *from,
+						const struct sim_node *to)
+{
+	return (from->level < to->level ? from->level : to->level) +
+								from->power;
+}
+
+/* Frame or ACK from a to b below the sensitivity of the rate */
+static bool sim_faded(const struct sim_node *a, const struct sim_node *b,
+							uint32_t bitrate)
+{
+	int sensitivity, margin;
+
+	if (bitrate <= 250000)
+		sensitivity = -94;
+	else if (bitrate <= 1000000)
+		sensitivity = -85;
+	else
+		sensitivity = -82;
+
+	margin = path_level(a, b) - sensitivity;
+	margin -= SIM_MARGIN_MIN;
+	if (margin >= (int) (sizeof(margin_loss) / sizeof(margin_loss[0])))
+		return false;
+
+	if (margin > 0 && sim_random() % 1000000 >= margin_loss[margin])
+		return false;
+
+	stats.lost++;
+
+	return true;
+}
+
+/* FNV-1a, stands for the packet CRC */
+static uint32_t sim_crc(const uint8_t *payload, size_t len)
+{
+	uint32_t crc = 2166136261U;
+
+	while (len--) {
+		crc ^= *payload++;
+		crc *= 16777619U;
+	}
+
+	return crc;
+}
+
+static int match_pipe(const struct sim_node *node, const uint8_t *aa)
+{
+	int pipe;
+
+	for (pipe = 0; pipe < SIM_PIPES; pipe++) {
+		if ((node->pipe_en & (1 << pipe)) &&
+				memcmp(node->aa[pipe], aa, SIM_AA_SIZE) == 0)
+			return pipe;
+	}
+
+	return -1;
+}
+
+void sim_set_params(const struct sim_params *new_params)
+{
+	params = *new_params;
+	if (params.arc > SIM_ARC_DEFAULT)
+		params.arc = SIM_ARC_DEFAULT;
+	if (params.bitrate == 0)
+		params.bitrate = SIM_BITRATE_DEFAULT;
+	/* Overlaps only exist if transmissions take time */
+	if (params.collisions)
+		params.realtime = true;
+
+	random_state = params.seed ? params.seed : 1;
+}
+
+int sim_set_interference(uint8_t channel, uint32_t loss)
+{
+	if (channel > SIM_CHANNEL_MAX || loss > 1000000)
+		return -EINVAL;
+
+	interference[channel] = loss;
+
+	return 0;
+}
+
+void sim_get_params(struct sim_params *out)
+{
+	*out = params;
+}
+
+void sim_get_stats(struct sim_stats *out)
+{
+	*out = stats;
+}
+
+void sim_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void sim_set_tap(sim_tap_func_t func, void *user_data)
+{
+	tap_func = func;
+	tap_data = user_data;
+}
+
+/* Preamble, address, 9 bits control field, payload and 16 bits CRC */
+static uint32_t airtime_at(size_t len, uint32_t bitrate)
+{
+	uint32_t bits = (1 + SIM_AA_SIZE + len + 2) * 8 + 9;
+
+	return (bits * 1000000ULL + bitrate - 1) / bitrate;
+}
+
+uint32_t sim_airtime(size_t len)
+{
+	return airtime_at(len, params.bitrate);
+}
+
+/* As nrf24l01_set_ptx(): ARD register (pipe * 2) + 5, 250us steps */
+uint32_t sim_ard(uint8_t pipe)
+{
+	if (params.ard)
+		return params.ard;
+
+	return ((pipe * 2) + 5 + 1) * 250;
+}
+
+int sim_node_new(void)
+{
+	int node;
+
+	for (node = 0; node < SIM_NODES_MAX; node++) {
+		if (nodes[node].used)
+			continue;
+
+		memset(&nodes[node], 0, sizeof(nodes[node]));
+		nodes[node].used = true;
+		nodes[node].channel = SIM_CHANNEL_DEFAULT;
+		nodes[node].level = SIM_LEVEL_DEFAULT;
+
+		return node;
+	}
+
+	return -EUSERS;
+}
+
+void sim_node_free(int node)
+{
+	if (node_valid(node))
+		nodes[node].used = false;
+}
+
+void sim_node_set_irq(int node, sim_irq_func_t func, void *user_data)
+{
+	if (!node_valid(node))
+		return;
+
+	nodes[node].irq = func;
+	nodes[node].irq_data = user_data;
+}
+
+/* As nrf24l01_set_channel(): changing the channel flushes the FIFO */
+int sim_node_set_channel(int node, uint8_t channel)
+{
+	struct sim_rx *rx;
+	int i;
+
+	if (!node_valid(node) || channel > SIM_CHANNEL_MAX)
+		return -EINVAL;
+
+	if (nodes[node].channel != channel) {
+		for (i = 0; i < nodes[node].fifo_count; i++) {
+			rx = &nodes[node].fifo[(nodes[node].fifo_head + i) %
+							SIM_FIFO_SIZE];
+			nodes[node].flushed[rx->pipe]++;
+		}
+
+		stats.flushed += nodes[node].fifo_count;
+		nodes[node].fifo_count = 0;
+		nodes[node].channel = channel;
+	}
+
+	return 0;
+}
+
+int sim_node_get_channel(int node)
+{
+	if (!node_valid(node))
+		return -EINVAL;
+
+	return nodes[node].channel;
+}
+
+int sim_node_set_rx(int node, bool enable)
+{
+	if (!node_valid(node))
+		return -EINVAL;
+
+	nodes[node].rx = enable;
+
+	return 0;
+}
+
+int sim_node_set_level(int node, int8_t level)
+{
+	if (!node_valid(node))
+		return -EINVAL;
+
+	nodes[node].level = level;
+
+	return 0;
+}
+
+int sim_node_set_bitrate(int node, uint32_t bitrate)
+{
+	if (!node_valid(node))
+		return -EINVAL;
+
+	nodes[node].bitrate = bitrate;
+
+	return 0;
+}
+
+int sim_node_set_power(int node, int8_t power)
+{
+	if (!node_valid(node) || power > 0 || power < -18)
+		return -EINVAL;
+
+	nodes[node].power = power;
+
+	return 0;
+}
+
+int sim_node_get_rpd(int node)
+{
+	if (!node_valid(node))
+		return -EINVAL;
+
+	return nodes[node].rpd;
+}
+
+/* Carrier of another node heard above SIM_RPD_LEVEL now */
+static bool air_busy(const struct sim_node *n, uint8_t channel, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < SIM_AIR_LOG; i++) {
+		if (!air[i].end || air[i].channel != channel ||
+				&nodes[air[i].src] == n ||
+				now < air[i].start || now >= air[i].end)
+			continue;
+
+		if (path_level(&nodes[air[i].src], n) >= SIM_RPD_LEVEL)
+			return true;
+	}
+
+	return false;
+}
+
+int sim_node_survey(int node, uint8_t channel, uint8_t samples)
+{
+	int hits = 0;
+
+	if (sim_node_set_channel(node, channel) < 0)
+		return -EINVAL;
+
+	for (; samples > 0; samples--) {
+		/* The interference is busy that share of the time */
+		if ((interference[channel] &&
+			sim_random() % 1000000 < interference[channel]) ||
+				air_busy(&nodes[node], channel,
+						hal_time64_us()))
+			hits++;
+
+		if (params.realtime)
+			hal_delay_us(SIM_SURVEY_US);
+	}
+
+	return hits;
+}
+
+int sim_node_set_retr(int node, uint8_t pipe, uint16_t ard, uint8_t arc)
+{
+	struct sim_node *n;
+
+	if (!node_valid(node) || pipe >= SIM_PIPES || arc > SIM_ARC_DEFAULT)
+		return -EINVAL;
+
+	n = &nodes[node];
+	if (ard == 0) {
+		n->retr_pipes &= ~(1 << pipe);
+		return 0;
+	}
+
+	n->ard[pipe] = ard;
+	n->arc[pipe] = arc;
+	n->retr_pipes |= (1 << pipe);
+
+	return 0;
+}
+
+int sim_node_open_pipe(int node, uint8_t pipe, const uint8_t *aa, bool ack)
+{
+	struct sim_node *n;
+
+	if (!node_valid(node) || pipe >= SIM_PIPES)
+		return -EINVAL;
+
+	n = &nodes[node];
+	if (n->pipe_en & (1 << pipe))
+		return 0;
+
+	memcpy(n->aa[pipe], aa, SIM_AA_SIZE);
+	n->pipe_en |= (1 << pipe);
+	n->last[pipe].valid = false;
+
+	if (ack)
+		n->pipe_ack |= (1 << pipe);
+	else
+		n->pipe_ack &= ~(1 << pipe);
+
+	return 0;
+}
+
+int sim_node_close_pipe(int node, uint8_t pipe)
+{
+	if (!node_valid(node) || pipe >= SIM_PIPES)
+		return -EINVAL;
+
+	nodes[node].pipe_en &= ~(1 << pipe);
+	nodes[node].pipe_ack &= ~(1 << pipe);
+
+	return 0;
+}
+
+int sim_node_set_ack_payload(int node, uint8_t pipe, const void *payload,
+								size_t len)
+{
+	struct sim_node *n;
+	uint8_t loaded;
+	int i, count = 0;
+
+	if (!node_valid(node) || pipe >= SIM_PIPES ||
+					len > SIM_PAYLOAD_SIZE)
+		return -EINVAL;
+
+	n = &nodes[node];
+	if (len == 0) {
+		n->ack_loaded &= ~(1 << pipe);
+		return 0;
+	}
+
+	loaded = n->ack_loaded & ~(1 << pipe);
+	for (i = 0; i < SIM_PIPES; i++) {
+		if (loaded & (1 << i))
+			count++;
+	}
+
+	if (count >= SIM_ACK_PAYLOADS)
+		return -EBUSY;
+
+	n->ack[pipe].pipe = 0;
+	n->ack[pipe].len = len;
+	memcpy(n->ack[pipe].payload, payload, len);
+	n->ack_loaded |= (1 << pipe);
+	n->ack_sent &= ~(1 << pipe);
+
+	return 0;
+}
+
+/* ACK payload reaching the RX FIFO of the transmitter */
+static void ack_payload_deliver(struct sim_node *tx, const struct sim_rx *ack)
+{
+	if (tx->fifo_count == SIM_FIFO_SIZE) {
+		stats.overflows++;
+		return;
+	}
+
+	tx->fifo[(tx->fifo_head + tx->fifo_count) % SIM_FIFO_SIZE] = *ack;
+	tx->fifo_count++;
+	stats.ack_payloads++;
+}
+
+/* Length of the payload of the ACK, 0 if none: consumed by new packets */
+static uint8_t ack_payload_take(struct sim_node *rx, uint8_t pipe, bool new)
+{
+	if (new) {
+		rx->ack_sent &= ~(1 << pipe);
+		if (rx->ack_loaded & (1 << pipe)) {
+			rx->ack_loaded &= ~(1 << pipe);
+			rx->ack_sent |= (1 << pipe);
+		}
+	}
+
+	if (!(rx->ack_sent & (1 << pipe)))
+		return 0;
+
+	return rx->ack[pipe].len;
+}
+
+static struct sim_air *air_start(uint8_t src, uint8_t channel,
+							uint32_t airtime)
+{
+	struct sim_air *entry = &air[air_next];
+
+	air_next = (air_next + 1) % SIM_AIR_LOG;
+
+	entry->start = hal_time64_us();
+	entry->end = entry->start + airtime;
+	entry->channel = channel;
+	entry->src = src;
+	entry->level = nodes[src].level + nodes[src].power;
+
+	return entry;
+}
+
+static inline bool air_overlap(const struct sim_air *a,
+						const struct sim_air *b)
+{
+	return a->start < b->end && b->start < a->end;
+}
+
+/* Half duplex: node transmitted during the entry */
+static bool air_transmitting(uint8_t node, const struct sim_air *entry)
+{
+	int i;
+
+	for (i = 0; i < SIM_AIR_LOG; i++) {
+		if (&air[i] != entry && air[i].src == node &&
+				air[i].end && air_overlap(&air[i], entry))
+			return true;
+	}
+
+	return false;
+}
+
+/* Once the entry ended: lost to an overlapping frame or captured */
+static bool air_collided(const struct sim_air *entry)
+{
+	int i, strongest = INT8_MIN - 1;
+
+	for (i = 0; i < SIM_AIR_LOG; i++) {
+		if (&air[i] == entry || air[i].src == entry->src ||
+				air[i].channel != entry->channel ||
+				!air[i].end || !air_overlap(&air[i], entry))
+			continue;
+
+		if (air[i].level > strongest)
+			strongest = air[i].level;
+	}
+
+	if (strongest < INT8_MIN)
+		return false;
+
+	if (entry->level - strongest >= params.capture) {
+		stats.captures++;
+		return false;
+	}
+
+	stats.collisions++;
+
+	return true;
+}
+
+/* The transmitter listens for the ACK until its ARD is over */
+static bool ack_heard(const struct sim_node *tx, uint8_t pipe, uint8_t len,
+							uint32_t bitrate)
+{
+	if (SIM_ACK_SETTLE + airtime_at(len, bitrate) <= node_ard(tx, pipe))
+		return true;
+
+	stats.ack_missed++;
+
+	return false;
+}
+
+/*
+ * ACKs of the receivers in the mask, sent together after the frame and
+ * carrying ack_len bytes each: mask of the ones received.
+ */
+static uint64_t air_acks(uint8_t tx, uint64_t ackers,
+						const uint8_t *ack_len)
+{
+	struct sim_air *entry[SIM_NODES_MAX];
+	uint32_t airtime, longest = 0;
+	uint64_t received = 0;
+	int i, count = 0;
+
+	for (i = 0; i < SIM_NODES_MAX; i++) {
+		if (!(ackers & (1ULL << i)))
+			continue;
+
+		airtime = airtime_at(ack_len[i], node_bitrate(&nodes[tx]));
+		if (airtime > longest)
+			longest = airtime;
+		entry[count++] = air_start(i, nodes[tx].channel, airtime);
+	}
+
+	hal_delay_us(longest);
+
+	for (i = 0; i < count; i++) {
+		stats.airtime += entry[i]->end - entry[i]->start;
+		if (air_collided(entry[i]) || sim_lost(nodes[tx].channel) ||
+				sim_faded(&nodes[entry[i]->src], &nodes[tx],
+						node_bitrate(&nodes[tx])))
+			continue;
+
+		received |= (1ULL << entry[i]->src);
+		stats.acks++;
+	}
+
+	return received;
+}
+
+int sim_node_send(int node, uint8_t pipe, const void *payload, size_t len,
+							uint8_t attempt)
+{
+	struct sim_node *tx, *rx;
+	struct sim_frame frame;
+	struct sim_rx *entry;
+	struct sim_last *last;
+	struct sim_air *on_air = NULL;
+	uint64_t irqs = 0, ackers = 0, received;
+	uint8_t ack_len[SIM_NODES_MAX];
+	uint8_t ack_pipe[SIM_NODES_MAX];
+	uint32_t crc, airtime, bitrate;
+	bool acked = false, ack_rx, collided = false, new;
+	int i, rxpipe, delivered = 0;
+
+	if (!node_valid(node) || pipe >= SIM_PIPES || len == 0 ||
+						len > SIM_PAYLOAD_SIZE)
+		return -EINVAL;
+
+	tx = &nodes[node];
+
+	/* A new packet gets a new id, retransmissions keep it */
+	if (attempt == 0)
+		tx->pid = (tx->pid + 1) & 0x03;
+	else
+		stats.retransmits++;
+
+	frame.src = node;
+	frame.channel = tx->channel;
+	memcpy(frame.aa, tx->aa[pipe], SIM_AA_SIZE);
+	/* As nrf24l01_set_ptx(): pipe0 (broadcast) is never acked */
+	frame.ack = (pipe != 0 && (tx->pipe_ack & (1 << pipe)));
+	frame.len = len;
+	memcpy(frame.payload, payload, len);
+
+	crc = sim_crc(frame.payload, len);
+	bitrate = node_bitrate(tx);
+	airtime = airtime_at(len, bitrate);
+	stats.frames++;
+
+	/* Received at the end of the frame, once the overlaps are known */
+	if (params.collisions) {
+		on_air = air_start(node, frame.channel, airtime);
+		hal_delay_us(airtime);
+		collided = air_collided(on_air);
+	}
+
+	for (i = 0; i < SIM_NODES_MAX; i++) {
+		rx = &nodes[i];
+		if (i == node || !rx->used || !rx->rx ||
+					rx->channel != frame.channel ||
+					node_bitrate(rx) != bitrate)
+			continue;
+
+		rxpipe = match_pipe(rx, frame.aa);
+		if (rxpipe < 0 || collided ||
+				(on_air && air_transmitting(i, on_air)) ||
+				sim_lost(frame.channel) ||
+				sim_faded(tx, rx, bitrate))
+			continue;
+
+		/* As sim_faded(): the weaker level stands for the path */
+		rx->rpd = (path_level(tx, rx) >= SIM_RPD_LEVEL);
+		ack_rx = frame.ack && (rx->pipe_ack & (1 << rxpipe));
+		last = &rx->last[rxpipe];
+
+		/* Same PID and CRC: ACK lost, the copy isn't delivered */
+		new = (!ack_rx || !last->valid || last->src != node ||
+				last->pid != tx->pid || last->crc != crc);
+		if (new) {
+			if (rx->fifo_count == SIM_FIFO_SIZE) {
+				/* Packet discarded and not acknowledged */
+				stats.overflows++;
+				continue;
+			}
+
+			entry = &rx->fifo[(rx->fifo_head + rx->fifo_count) %
+							SIM_FIFO_SIZE];
+			entry->pipe = rxpipe;
+			entry->len = len;
+			memcpy(entry->payload, frame.payload, len);
+			rx->fifo_count++;
+
+			last->valid = true;
+			last->src = node;
+			last->pid = tx->pid;
+			last->crc = crc;
+
+			delivered++;
+			irqs |= (1ULL << i);
+		}
+
+		if (!ack_rx)
+			continue;
+
+		ack_len[i] = ack_payload_take(rx, rxpipe, new);
+		ack_pipe[i] = rxpipe;
+
+		if (on_air) {
+			ackers |= (1ULL << i);
+			continue;
+		}
+
+		airtime += airtime_at(ack_len[i], bitrate);
+		if (sim_lost(frame.channel) || sim_faded(rx, tx, bitrate) ||
+				!ack_heard(tx, pipe, ack_len[i], bitrate))
+			continue;
+
+		if (ack_len[i])
+			ack_payload_deliver(tx, &rx->ack[rxpipe]);
+
+		acked = true;
+		stats.acks++;
+	}
+
+	stats.airtime += airtime;
+
+	if (ackers) {
+		received = air_acks(node, ackers, ack_len);
+
+		for (i = 0; i < SIM_NODES_MAX; i++) {
+			if (!(received & (1ULL << i)) ||
+				!ack_heard(tx, pipe, ack_len[i], bitrate))
+				continue;
+
+			if (ack_len[i])
+				ack_payload_deliver(tx,
+						&nodes[i].ack[ack_pipe[i]]);
+			acked = true;
+		}
+	}
+
+	if (tap_func)
+		tap_func(&frame, delivered, acked, tap_data);
+
+	if (params.realtime && !on_air)
+		hal_delay_us(airtime);
+
+	/* IRQ line: the receivers may drain their FIFO */
+	for (i = 0; irqs && i < SIM_NODES_MAX; i++) {
+		if (!(irqs & (1ULL << i)))
+			continue;
+
+		irqs &= ~(1ULL << i);
+		if (nodes[i].used && nodes[i].irq)
+			nodes[i].irq(i, nodes[i].irq_data);
+	}
+
+	if (!frame.ack || acked)
+		return 0;
+
+	if (attempt >= node_arc(tx, pipe))
+		stats.failed++;
+
+	return -EAGAIN;
+}
+
+int sim_node_pipe_available(int node)
+{
+	struct sim_node *n;
+
+	if (!node_valid(node))
+		return -EINVAL;
+
+	n = &nodes[node];
+	if (n->fifo_count == 0)
+		return -EAGAIN;
+
+	return n->fifo[n->fifo_head].pipe;
+}
+
+ssize_t sim_node_recv(int node, uint8_t *pipe, void *payload, size_t len)
+{
+	struct sim_node *n;
+	struct sim_rx *entry;
+
+	if (!node_valid(node))
+		return -EINVAL;
+
+	n = &nodes[node];
+	if (n->fifo_count == 0)
+		return -EAGAIN;
+
+	entry = &n->fifo[n->fifo_head];
+	n->fifo_head = (n->fifo_head + 1) % SIM_FIFO_SIZE;
+	n->fifo_count--;
+
+	if (len > entry->len)
+		len = entry->len;
+
+	if (pipe)
+		*pipe = entry->pipe;
+	memcpy(payload, entry->payload, len);
+
+	return len;
+}
+
+/* phy_driver: the hal_comm side, mirrors phy_driver_nrf24.c */
+
+static int sim_open(const char *pathname)
+{
+	int node;
+
+	node = sim_node_new();
+	if (node < 0)
+		return node;
+
+	sim_node_set_rx(node, true);
+
+	return node;
+}
+
+static void sim_close(int node)
+{
+	sim_node_free(node);
+}
+
+static ssize_t sim_write(int node, const void *buffer, size_t len)
+{
+	const struct nrf24_io_pack *p = buffer;
+	const struct sim_node *n = &nodes[node];
+	uint8_t attempt;
+	int err;
+
+	/* Auto retransmit: up to arc times, ard apart */
+	for (attempt = 0; ; attempt++) {
+		err = sim_node_send(node, p->pipe, p->payload, len, attempt);
+		if (err != -EAGAIN || attempt >= node_arc(n, p->pipe))
+			break;
+
+		if (params.realtime)
+			hal_delay_us(node_ard(n, p->pipe));
+	}
+
+	nodes[node].arc_cnt = attempt;
+
+	/* Back to PRX, as nrf24l01_write() */
+	sim_node_set_rx(node, true);
+
+	if (err < 0)
+		return (err == -EAGAIN ? -ETIMEDOUT : err);
+
+	return len;
+}
+
+static ssize_t sim_read(int node, void *buffer, size_t len)
+{
+	struct nrf24_io_pack *p = buffer;
+
+	/* Only the pipe at the head of the RX FIFO can be read */
+	if (sim_node_pipe_available(node) != p->pipe)
+		return -EAGAIN;
+
+	return sim_node_recv(node, NULL, p->payload, len);
+}
+
+static int sim_ioctl(int node, int cmd, void *arg)
+{
+	static const uint32_t bitrates[] = {
+		[NRF24_RATE_250K] = 250000,
+		[NRF24_RATE_1M] = 1000000,
+		[NRF24_RATE_2M] = 2000000,
+	};
+	struct addr_pipe *addrpipe;
+	struct nrf24_ack_payload *ackpay;
+	struct nrf24_retr *retr;
+	struct nrf24_survey *survey;
+	struct nrf24_flushed *flushed;
+	int err = 0, rate, power;
+
+	/* Frames raise the IRQ of the node if its owner set one */
+	if (cmd == NRF24_CMD_GET_IRQ)
+		return (nodes[node].irq ? 0 : -ENOSYS);
+
+	switch (cmd) {
+	case NRF24_CMD_SET_PIPE:
+		addrpipe = arg;
+		err = sim_node_open_pipe(node, addrpipe->pipe, addrpipe->aa,
+							addrpipe->ack);
+		break;
+	case NRF24_CMD_RESET_PIPE:
+		err = sim_node_close_pipe(node, *((int *) arg));
+		break;
+	case NRF24_CMD_SET_CHANNEL:
+		err = sim_node_set_channel(node, *((int *) arg));
+		break;
+	case NRF24_CMD_SET_STANDBY:
+		return sim_node_set_rx(node, false);
+	case NRF24_CMD_ENABLE_ACK_PAYLOAD:
+		nodes[node].ack_loaded = 0;
+		nodes[node].ack_sent = 0;
+		break;
+	case NRF24_CMD_SET_ACK_PAYLOAD:
+		ackpay = arg;
+		err = sim_node_set_ack_payload(node, ackpay->pipe,
+						ackpay->payload, ackpay->len);
+		break;
+	case NRF24_CMD_SET_DATA_RATE:
+		rate = *((int *) arg);
+		if (rate < NRF24_RATE_250K || rate > NRF24_RATE_2M)
+			err = -EINVAL;
+		else
+			err = sim_node_set_bitrate(node, bitrates[rate]);
+		break;
+	case NRF24_CMD_GET_RETRANSMITS:
+		*((int *) arg) = nodes[node].arc_cnt;
+		return 0;
+	case NRF24_CMD_SURVEY:
+		survey = arg;
+		err = sim_node_survey(node, survey->channel, survey->samples);
+		if (err >= 0) {
+			survey->hits = err;
+			err = 0;
+		}
+		break;
+	case NRF24_CMD_GET_RPD:
+		*((int *) arg) = nodes[node].rpd;
+		return 0;
+	case NRF24_CMD_GET_FLUSHED:
+		flushed = arg;
+		if (flushed->pipe >= SIM_PIPES)
+			return -EINVAL;
+
+		flushed->frames = nodes[node].flushed[flushed->pipe];
+		return 0;
+	case NRF24_CMD_SET_POWER:
+		power = *((int *) arg);
+		if (power < NRF24_POWER_18DBM || power > NRF24_POWER_0DBM)
+			return -EINVAL;
+
+		/* Applies to the next frames: the radio stays as it is */
+		return sim_node_set_power(node,
+					(power - NRF24_POWER_0DBM) * 6);
+	case NRF24_CMD_SET_RETR:
+		retr = arg;
+		if (retr->ard != NRF24_RETR_PIPE && retr->ard > 15)
+			return -EINVAL;
+
+		return sim_node_set_retr(node, retr->pipe,
+				retr->ard == NRF24_RETR_PIPE ? 0 :
+				(retr->ard + 1) * 250, retr->arc);
+	default:
+		err = -EINVAL;
+	}
+
+	sim_node_set_rx(node, true);
+
+	return err;
+}
+
+struct phy_driver nrf24l01_sim = {
+	.name = "SIM0",
+	.pathname = NULL,
+	.open = sim_open,
+	.read = sim_read,
+	.write = sim_write,
+	.ioctl = sim_ioctl,
+	.close = sim_close,
+	.ref_open = 0,
+	.fd = -1,
+	.multi_open = true
+};
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Simulated nRF24 radios sharing an in-memory air. Each open of "SIM0"
+ * gets another node, the lowest free one: the hal_comm instances of a
+ * gateway and its things (nrf24_comm_new()) run in the same process.
+ * Other nodes (sniffers, jammers) are driven through the sim_node
+ * functions.
+ */
+
+#define SIM_NODES_MAX		64
+#define SIM_FIFO_SIZE		3	/* nRF24 RX FIFO depth */
+#define SIM_PIPES		6
+#define SIM_AA_SIZE		5
+#define SIM_PAYLOAD_SIZE	32
+#define SIM_CHANNEL_MAX		125
+#define SIM_LEVEL_DEFAULT	-60	/* dBm */
+
+struct sim_params {
+	uint32_t loss;		/* Frame and ACK loss, parts per million */
+	uint8_t arc;		/* Retransmissions: 0 to 15 */
+	uint16_t ard;		/* Retransmit delay (us), 0: per pipe */
+	uint32_t bitrate;	/* Air data rate (bit/s): airtime */
+	bool realtime;		/* Transmissions last their airtime */
+	uint32_t seed;		/* Loss pattern: same seed, same losses */
+	bool collisions;	/* Overlapping frames collide: realtime */
+	uint8_t capture;	/* dB: the stronger frame of a collision wins */
+};
+
+struct sim_stats {
+	uint64_t frames;	/* Transmissions, retries included */
+	uint64_t retransmits;
+	uint64_t acks;
+	uint64_t lost;		/* Frames and ACKs dropped by loss */
+	uint64_t overflows;	/* Receiver RX FIFO full */
+	uint64_t failed;	/* No ACK after arc retransmissions */
+	uint64_t airtime;	/* Air busy time (us): frames and ACKs */
+	uint64_t collisions;	/* Frames and ACKs lost to an overlap */
+	uint64_t captures;	/* Frames and ACKs that survived one */
+	uint64_t ack_payloads;	/* Delivered to the transmitter */
+	uint64_t ack_missed;	/* Longer than the ARD of the transmitter */
+	uint64_t flushed;	/* RX FIFO frames dropped by a channel change */
+};
+
+/* Transmitted frame, reported to the tap before delivery */
+struct sim_frame {
+	uint8_t src;		/* Node */
+	uint8_t channel;
+	uint8_t aa[SIM_AA_SIZE];
+	bool ack;		/* Acknowledgment requested */
+	uint8_t len;
+	uint8_t payload[SIM_PAYLOAD_SIZE];
+};
+
+/* Frame available in the RX FIFO: runs in the transmitter context */
+typedef void (*sim_irq_func_t) (int node, void *user_data);
+/* delivered: amount of receivers, acked: the transmitter got an ACK */
+typedef void (*sim_tap_func_t) (const struct sim_frame *frame,
+				int delivered, bool acked, void *user_data);
+
+void sim_set_params(const struct sim_params *params);
+void sim_get_params(struct sim_params *params);
+/* Frame and ACK loss (ppm) on channel, added to sim_params.loss */
+int sim_set_interference(uint8_t channel, uint32_t loss);
+void sim_get_stats(struct sim_stats *stats);
+void sim_reset_stats(void);
+void sim_set_tap(sim_tap_func_t func, void *user_data);
+
+/* Airtime (us) of a frame carrying len bytes, 0 for an ACK */
+uint32_t sim_airtime(size_t len);
+/* Delay before the retransmission of a frame sent on pipe, by default */
+uint32_t sim_ard(uint8_t pipe);
+
+/* New node: standby on channel 10, all pipes closed */
+int sim_node_new(void);
+void sim_node_free(int node);
+void sim_node_set_irq(int node, sim_irq_func_t func, void *user_data);
+int sim_node_set_channel(int node, uint8_t channel);
+int sim_node_get_channel(int node);
+/* Standby nodes don't receive */
+int sim_node_set_rx(int node, bool enable);
+/* Level (dBm) of the node at the other nodes: capture effect */
+int sim_node_set_level(int node, int8_t level);
+/* Data rate (bit/s) of the node, 0: sim_params.bitrate */
+int sim_node_set_bitrate(int node, uint32_t bitrate);
+/* TX power (dB, 0 to -18): the node is heard that much weaker */
+int sim_node_set_power(int node, int8_t power);
+/* RPD of the last packet received: 1 at or above -64 dBm */
+int sim_node_get_rpd(int node);
+/*
+ * Samples of channel found busy (RPD): by its interference, or by the
+ * frames of nodes heard at or above -64 dBm. Moves the node to channel.
+ */
+int sim_node_survey(int node, uint8_t channel, uint8_t samples);
+/*
+ * ARD (us) and ARC of the frames sent on pipe, as SETUP_RETR: ard 0
+ * restores sim_ard() and sim_params.arc.
+ */
+int sim_node_set_retr(int node, uint8_t pipe, uint16_t ard, uint8_t arc);
+/* As the nRF24, an open pipe keeps its address until closed */
+int sim_node_open_pipe(int node, uint8_t pipe, const uint8_t *aa, bool ack);
+int sim_node_close_pipe(int node, uint8_t pipe);
+/*
+ * Payload of the next ACK sent on pipe, len 0 removes it. It reaches
+ * the RX FIFO of the transmitter as a pipe 0 frame. Up to 3 pipes (TX
+ * FIFO depth), -EBUSY otherwise.
+ */
+int sim_node_set_ack_payload(int node, uint8_t pipe, const void *payload,
+								size_t len);
+
+/*
+ * One transmission to the address of pipe: 0 if acknowledged (or the
+ * pipe has no auto-ack), -EAGAIN otherwise. attempt 0 sends a new
+ * packet, retransmissions (attempt > 0) keep its id: the receiver acks
+ * them but drops the copy. Retransmitting, waiting the ARD, is up to
+ * the caller: the last attempt (ARC of the pipe) counts as failed.
+ */
+int sim_node_send(int node, uint8_t pipe, const void *payload, size_t len,
+							uint8_t attempt);
+
+/* Pipe of the first frame of the RX FIFO or -EAGAIN */
+int sim_node_pipe_available(int node);
+ssize_t sim_node_recv(int node, uint8_t *pipe, void *payload, size_t len);
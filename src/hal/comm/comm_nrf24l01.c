@@ -7,6 +7,7 @@
  *
  */
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
@@ -23,6 +24,7 @@
 #include "include/nrf24.h"
 #include "include/comm.h"
 #include "include/time.h"
+#include "include/timer.h"
 #include "phy_driver.h"
 #include "phy_driver_nrf24.h"
 #include "nrf24l01_ll.h"
@@ -30,27 +32,50 @@
 #define _MIN(a, b)		((a) < (b) ? (a) : (b))
 #define DATA_SIZE 128
 #define MGMT_SIZE 32
+#define MGMT_EVT_SIZE 64	/* MGMT_EVT_NRF24_LINK_STATS */
 #define MGMT_TIMEOUT 10
 #define RAW_TIMEOUT 60
-
-/* Global to know if listen function was called */
-static uint8_t listen = 0;
-
-static struct nrf24_mac addr_gw = {.address.uint64 = 0};
-
-static struct nrf24_mac addr_slave = {.address.uint64 = 0 };
+#define RADIO_POLL_MS 1		/* No IRQ line: RX FIFO polling */
+#define ACK_WAIT_MS RAW_TIMEOUT	/* ACK payloads: default wait */
+#define ACK_POLL_MS 1		/* Slave polls after its messages */
+#define RATE_BASE NRF24_RATE_1M	/* MGMT slot and new links */
+#define TUNE_SLOT_MS 5		/* RAW sub-slot of each link channel and rate
+				   in use */
+#define RATE_CHECK_MS 120	/* Master: waits RATE_IND back */
+#define RATE_HOLD_MS 1000	/* Before probing a higher rate */
+#define RATE_HOLD_MAX_MS 64000	/* Doubles after each failed probe */
+#define RATE_SAMPLES 16		/* Frames at a rate before probing up */
+#define RATE_SAMPLES_DOWN 4
+#define RATE_PROBE_SAMPLES 64	/* Going down before: the probe failed */
+#define RATE_UP 4		/* Retransmissions per frame x16: 0.25 */
+#define RATE_DOWN 16		/* 1: each one costs an ARD */
+#define RATE_FAILED 16		/* Retransmissions counted for a failure */
+#define RETR_ARC_MIN 3		/* Adaptive: peer out of reach */
+#define RETR_ARC_MAX 15
+#define RETR_FAILS 4		/* Frames lost in a row: out of reach */
+#define RETR_SPREAD 16		/* Retransmissions per frame x16: ARDs apart */
+#define RETR_BUDGET_US (RAW_TIMEOUT * 500)	/* Frame and retries: half
+						   of the RAW slot */
+#define POWER_SAMPLES 32	/* Frames at a power before lowering it */
+#define POWER_UP 16		/* Retransmissions per frame x16: 1 */
+#define POWER_DOWN 4		/* 0.25, as RATE_UP */
+#define POWER_REFRESH 4		/* Windows between strong POWER_INDs */
+#define HOP_MS 2000		/* Master: on each channel of a hopping link */
+#define HOP_CHECK_MS 250	/* Master: waits CHANNEL_IND back, a few
+				   RAW slots */
+#define HOP_BAD RATE_DOWN	/* Retransmissions per frame x16 on leaving
+				   a channel: skipped by the next hops */
+#define DRAIN_PASSES 3		/* Before retuning: nRF24 RX FIFO depth */
 
 /* Structure to save broadcast context */
 struct nrf24_mgmt {
 	int8_t pipe;
-	uint8_t buffer_rx[MGMT_SIZE];
+	uint8_t buffer_rx[MGMT_EVT_SIZE];
 	size_t len_rx;
 	uint8_t buffer_tx[MGMT_SIZE];
 	size_t len_tx;
 };
 
-static struct nrf24_mgmt mgmt = {.pipe = -1, .len_rx = 0};
-
 /* Structure to save peers context */
 struct nrf24_data {
 	int8_t pipe;
@@ -59,26 +84,79 @@ struct nrf24_data {
 	uint8_t buffer_tx[DATA_SIZE];
 	size_t len_tx;
 	uint8_t seqnumber_tx;
+	bool tx_failing;	/* buffer_tx failed once at least */
+	uint32_t tx_fail_ms;	/* Its first failure, hal_time_ms() */
 	uint8_t seqnumber_rx;
 	size_t offset_rx;
-	unsigned long keepalive_wait;
 	uint8_t keepalive;
+	uint8_t events;
+	uint8_t features;	/* Negotiated: NRF24_LINK_F_* */
+	uint8_t ctrl;		/* Control PDUs to send */
+	uint8_t ack_next;	/* Fragment loaded (master) or expected */
+	uint8_t ack_msg;	/* Message of ack_next */
+	uint8_t ack_loaded;	/* Master: message on the ACKs */
+	uint8_t polls;		/* Slave: polls sent after a message */
+	uint8_t rate;		/* NRF24_RATE_* of the link */
+	uint8_t rate_prev;	/* Back to it if the new rate is unheard */
+	uint8_t rate_ind;	/* Rate of the RATE_IND to send */
+	bool rate_check;	/* New rate: slave RATE_IND not sent yet or
+				   not received by the master */
+	uint8_t rate_fails;	/* Transmissions failed in a row */
+	uint32_t rate_fail_ms;	/* First of them, hal_time_ms() */
+	uint8_t rate_samples;	/* Master: frames sent at this rate */
+	uint16_t retries;	/* Master: retransmissions per frame x16 */
+	uint16_t rate_hold;	/* Master: ms before probing higher */
+	struct nrf24_retr retr;	/* Of the pipe: NRF24_CMD_SET_RETR */
+	uint16_t retr_avg;	/* Retransmissions per frame x16 */
+	uint8_t retr_fails;	/* Frames not acknowledged in a row */
+	uint8_t power;		/* NRF24_POWER_* to the peer */
+	uint8_t power_frames;	/* Frames sent at this power */
+	uint8_t power_rpd;	/* POWER_IND of the peer, 0: none since */
+	uint8_t rpd_frames;	/* Frames received in the RPD window */
+	uint8_t rpd_high;	/* Of them, above -64 dBm */
+	uint8_t rpd_ind;	/* Last POWER_IND sent */
+	uint8_t rpd_windows;	/* Since then */
+	uint8_t channel;	/* Data channel of the link */
+	uint8_t channel_home;	/* Of CONNECT_REQ */
+	uint8_t channel_prev;	/* Back to it if the new one is unheard */
+	uint8_t channel_ind;	/* Channel of the CHANNEL_IND to send */
+	bool channel_check;	/* As rate_check, for the channel */
+	uint8_t channel_fails;	/* Transmissions failed in a row */
+	bool channels_shared;	/* The master serves other data channels */
+	uint16_t hop;		/* Master: hopping sequence state */
+	uint8_t hop_bad;	/* Master: data channels skipped, by index */
+	struct hal_timer keepalive_timer;
+	struct hal_timer timeout_timer;
+	struct hal_timer ack_timer;
+	struct hal_timer rate_timer;
+	struct hal_timer hop_timer;
 	struct nrf24_mac mac;
+	/* Counters: mac, duration and rate are set when reported */
+	struct mgmt_evt_nrf24_link_stats stats;
+	uint32_t connected;	/* hal_time_ms() */
+	uint32_t flushed;	/* NRF24_CMD_GET_FLUSHED then */
 };
 
+/* Peer events raised by timers, handled on the peer RAW slot */
+#define PEER_EVT_KEEPALIVE	0x01	/* Keepalive request is due */
+#define PEER_EVT_TIMEOUT	0x02	/* Keepalive timeout */
+#define PEER_EVT_ACK_WAIT	0x04	/* ACK payload not taken in time */
+#define PEER_EVT_RATE_PROBE	0x08	/* A higher rate may be tried */
+#define PEER_EVT_STATS		0x10	/* MGMT_CMD_NRF24_LINK_STATS */
+#define PEER_EVT_HOP		0x20	/* Next channel of the sequence */
+
+/*
+ * Control PDUs pending: FEATURE_IND and ACK_POLL (slave), RATE_IND,
+ * POWER_IND and CHANNEL_IND
+ */
+#define PEER_CTRL_FEATURE_IND	0x01
+#define PEER_CTRL_ACK_POLL	0x02
+#define PEER_CTRL_RATE_IND	0x04
+#define PEER_CTRL_POWER_IND	0x08
+#define PEER_CTRL_CHANNEL_IND	0x10
+
 #ifndef ARDUINO	/* If gateway then 5 peers */
-static struct nrf24_data peers[5] = {
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0}
-};
+#define CONNECTION_COUNTER	5
 
 /* TODO: TODO: Get this values from config file
  * Access Address for each pipe
@@ -93,10 +171,7 @@ static uint8_t aa_pipes[6][5] = {
 };
 
 #else	/* If slave then 1 peer */
-static struct nrf24_data peers[1] = {
-	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0,
-		.seqnumber_rx = 0, .offset_rx = 0},
-};
+#define CONNECTION_COUNTER	1
 
 /* TODO: TODO: Get this value from config file
  * Access Address for pipe 0
@@ -108,18 +183,6 @@ static uint8_t aa_pipes[1][5] = {
 
 #endif
 
-/* ARRAY SIZE */
-#define CONNECTION_COUNTER	((int) (sizeof(peers) \
-				 / sizeof(peers[0])))
-
-/* Global to save driver index */
-static int driverIndex = -1;
-/* Channel to management and raw data */
-static int channel_mgmt = 20;
-static int channel_raw = 10;
-static uint16_t window_bcast = 5;	/* ms */
-static uint16_t interval_bcast = 6;	/* ms */
-
 enum {
 	START_MGMT,
 	MGMT,
@@ -134,24 +197,323 @@ enum {
 	TIMEOUT_INTERVAL
 };
 
+/* Gateway: MGMT_CMD_NRF24_SURVEY, channel by channel up to last */
+struct channel_survey {
+	uint8_t channel;
+	uint8_t last;
+	uint8_t samples;
+	uint8_t slots;
+	uint8_t slot;
+	uint16_t hits;
+	struct mgmt_evt_nrf24_survey evt;	/* Done, not reported yet */
+};
+
+/*
+ * State of a hal_comm instance: one per radio. Programs run the default
+ * one, simulators a gateway and its things in the same process.
+ */
+struct nrf24_comm {
+	/* Global to know if listen function was called */
+	uint8_t listen;
+	struct nrf24_mac addr_gw;
+	struct nrf24_mac addr_slave;
+	/* Link features: offered (master) or accepted (slave) */
+	uint8_t link_features;
+	uint16_t ack_wait;
+	/* Slave: offered by the last CONNECT_REQ */
+	uint8_t offered_features;
+	uint8_t offered_channels;
+	struct nrf24_mgmt mgmt;
+	struct nrf24_data peers[CONNECTION_COUNTER];
+	/* Global to save driver index */
+	int driverIndex;
+	/* Channel to management and raw data */
+	int channel_mgmt;
+	int channel_raw;
+	uint16_t window_bcast;		/* ms */
+	uint16_t interval_bcast;	/* ms */
+	/* Slot and presence state machines: advanced by timers */
+	uint8_t state;
+	uint8_t presence_state;
+	struct hal_timer slot_timer;
+	struct hal_timer window_timer;
+	struct hal_timer interval_timer;
+	/* Channel and rate of the radio: RAW serves each link tune in turn */
+	int radio_channel;
+	int radio_rate;
+	int radio_power;
+	bool tune_due;
+	uint8_t tune_index;
+	struct hal_timer tune_timer;
+	/* Gateway: MGMT_CMD_NRF24_DATA_CHANNELS, none: channel_raw */
+	uint8_t data_channels[NRF24_DATA_CHANNELS_MAX];
+	uint8_t data_channels_count;
+	struct channel_survey survey;
+	/* ARC_CNT and RPD counted: MGMT_CMD_NRF24_LINK_STATS received */
+	bool radio_stats;
+	/* MGMT_CMD_NRF24_RETR_POLICY: NRF24_RETR_POLICY_* */
+	uint8_t retr_policy;
+};
+
+#define PEER_INIT	{.pipe = -1, .len_rx = 0, .seqnumber_tx = 0, \
+			.seqnumber_rx = 0, .offset_rx = 0}
+
+#ifndef ARDUINO
+#define PEERS_INIT	{ PEER_INIT, PEER_INIT, PEER_INIT, PEER_INIT, \
+			PEER_INIT }
+#else
+#define PEERS_INIT	{ PEER_INIT }
+#endif
+
+#define COMM_INIT {						\
+	.listen = 0,						\
+	.addr_gw = {.address.uint64 = 0},			\
+	.addr_slave = {.address.uint64 = 0},			\
+	.link_features = 0,					\
+	.ack_wait = ACK_WAIT_MS,				\
+	.offered_features = 0,					\
+	.offered_channels = 0,					\
+	.mgmt = {.pipe = -1, .len_rx = 0},			\
+	.peers = PEERS_INIT,					\
+	.driverIndex = -1,					\
+	.channel_mgmt = NRF24_MGMT_CHANNEL,			\
+	.channel_raw = 10,					\
+	.window_bcast = 5,					\
+	.interval_bcast = 6,					\
+	.state = START_MGMT,					\
+	.presence_state = PRESENCE,				\
+	.radio_channel = -1,					\
+	.radio_rate = RATE_BASE,				\
+	.radio_power = NRF24_POWER_0DBM,			\
+	.tune_due = false,					\
+	.tune_index = 0,					\
+	.data_channels_count = 0,				\
+	.survey = {.channel = 1, .last = 0},			\
+	.radio_stats = false,					\
+	.retr_policy = NRF24_RETR_POLICY_PIPE,			\
+}
+
+static struct nrf24_comm comm_default = COMM_INIT;
+/* Instance the hal_comm functions apply to: nrf24_comm_select() */
+static struct nrf24_comm *comm = &comm_default;
+
+/* Peer of one of its timers */
+#define TIMER_PEER(timer, member) ((struct nrf24_data *) \
+		((uint8_t *) (timer) - offsetof(struct nrf24_data, member)))
+
 /* Local functions */
+/* Timers of an instance may expire as another one runs: user_data */
+static void slot_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+
+	/* MGMT and RAW slots alternate */
+	instance->state = (instance->state == MGMT ? START_RAW : START_MGMT);
+}
+
+static void window_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+
+	if (instance->presence_state == TIMEOUT_WINDOW)
+		instance->presence_state = STANDBY;
+}
+
+static void interval_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+
+	instance->presence_state = PRESENCE;
+}
+
+static void tune_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+
+	/* Next RAW sub-slot */
+	instance->tune_due = true;
+}
+
+static void keepalive_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_data *peer = TIMER_PEER(timer, keepalive_timer);
+
+	/* Sends keepalive request every NRF24_KEEPALIVE_SEND_MS */
+	peer->events |= PEER_EVT_KEEPALIVE;
+	hal_timer_arm(timer, NRF24_KEEPALIVE_SEND_MS);
+}
+
+static void timeout_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_data *peer = TIMER_PEER(timer, timeout_timer);
+
+	/* Disconnect event is generated on the peer slot */
+	peer->events |= PEER_EVT_TIMEOUT;
+}
+
+static void ack_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+	struct nrf24_data *peer = TIMER_PEER(timer, ack_timer);
+
+	/* Master: no progress, the message goes out as PTX frames */
+	if (instance->addr_slave.address.uint64 == 0) {
+		peer->events |= PEER_EVT_ACK_WAIT;
+		return;
+	}
+
+	/* Slave: the answer to its message may be waiting on the ACKs */
+	peer->ctrl |= PEER_CTRL_ACK_POLL;
+	peer->polls++;
+
+	/* Backs off: polls 1, 3, 7, 15... ms after, up to ack_wait */
+	if ((ACK_POLL_MS << (peer->polls + 1)) - ACK_POLL_MS <=
+							instance->ack_wait)
+		hal_timer_arm(timer, ACK_POLL_MS << peer->polls);
+}
+
+/*
+ * Master: hold over, or RATE_IND not back from the slave. It may have
+ * been lost after its ACK: the previous rate is announced at the new one.
+ */
+static void rate_hold_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_comm *instance = user_data;
+	struct nrf24_data *peer = TIMER_PEER(timer, rate_timer);
+
+	/* Slave: the check of the master is over, write_ctrl() gives up */
+	if (instance->addr_slave.address.uint64 != 0)
+		return;
+
+	if (!peer->rate_check) {
+		peer->events |= PEER_EVT_RATE_PROBE;
+		return;
+	}
+
+	if (peer->rate_prev < peer->rate)
+		peer->rate_hold = _MIN(peer->rate_hold * 2, RATE_HOLD_MAX_MS);
+
+	peer->rate_ind = peer->rate_prev;
+	peer->ctrl |= PEER_CTRL_RATE_IND;
+}
+
+/* Master: on a channel long enough, or CHANNEL_IND not back: as above */
+static void hop_expired(struct hal_timer *timer, void *user_data)
+{
+	struct nrf24_data *peer = TIMER_PEER(timer, hop_timer);
+
+	if (!peer->channel_check) {
+		peer->events |= PEER_EVT_HOP;
+		return;
+	}
+
+	peer->channel_ind = peer->channel_prev;
+	peer->ctrl |= PEER_CTRL_CHANNEL_IND;
+}
+
+/* Activity from/to peer: restart keepalive timers */
+static void peer_alive(struct nrf24_data *peer)
+{
+	hal_timer_arm(&peer->timeout_timer, NRF24_KEEPALIVE_TIMEOUT_MS);
+
+	/* If keepalive is enabled */
+	if (peer->keepalive)
+		hal_timer_arm(&peer->keepalive_timer, NRF24_KEEPALIVE_SEND_MS);
+
+	peer->events &= ~(PEER_EVT_KEEPALIVE | PEER_EVT_TIMEOUT);
+}
+
+static void peer_release(struct nrf24_data *peer)
+{
+	hal_timer_cancel(&peer->keepalive_timer);
+	hal_timer_cancel(&peer->timeout_timer);
+	hal_timer_cancel(&peer->ack_timer);
+	hal_timer_cancel(&peer->rate_timer);
+	hal_timer_cancel(&peer->hop_timer);
+	peer->keepalive = 0;
+	peer->events = 0;
+	peer->features = 0;
+	peer->ctrl = 0;
+	peer->ack_loaded = 0;
+	peer->rate = RATE_BASE;
+	comm->tune_due = true;
+}
+
+/* Frames of the pipe flushed by the radio, 0 if it doesn't count them */
+static uint32_t pipe_flushed(int spi_fd, int pipe)
+{
+	struct nrf24_flushed flushed = {.pipe = pipe, .frames = 0};
+
+	if (phy_ioctl(spi_fd, NRF24_CMD_GET_FLUSHED, &flushed) < 0)
+		return 0;
+
+	return flushed.frames;
+}
+
 static inline int alloc_pipe(void)
 {
 	uint8_t i;
 
 	for (i = 0; i < CONNECTION_COUNTER; i++) {
-		if (peers[i].pipe == -1) {
-
-			peers[i].keepalive_wait = 0;
-			peers[i].keepalive = 0;
-			peers[i].mac.address.uint64 = 0;
-			peers[i].len_rx = 0;
-			peers[i].seqnumber_rx = 0;
-			peers[i].seqnumber_tx = 0;
-			peers[i].offset_rx = 0;
+		if (comm->peers[i].pipe == -1) {
+
+			comm->peers[i].keepalive = 0;
+			comm->peers[i].events = 0;
+			hal_timer_init(&comm->peers[i].keepalive_timer,
+					keepalive_expired, comm);
+			hal_timer_init(&comm->peers[i].timeout_timer,
+					timeout_expired, comm);
+			hal_timer_init(&comm->peers[i].ack_timer,
+					ack_expired, comm);
+			hal_timer_init(&comm->peers[i].rate_timer,
+					rate_hold_expired, comm);
+			hal_timer_init(&comm->peers[i].hop_timer,
+					hop_expired, comm);
+			hal_timer_arm(&comm->peers[i].timeout_timer,
+					NRF24_KEEPALIVE_TIMEOUT_MS);
+			comm->peers[i].mac.address.uint64 = 0;
+			comm->peers[i].len_rx = 0;
+			comm->peers[i].seqnumber_rx = 0;
+			comm->peers[i].seqnumber_tx = 0;
+			comm->peers[i].offset_rx = 0;
+			comm->peers[i].features = 0;
+			comm->peers[i].ctrl = 0;
+			comm->peers[i].ack_next = 0;
+			comm->peers[i].ack_msg = 0;
+			comm->peers[i].ack_loaded = 0;
+			comm->peers[i].polls = 0;
+			comm->peers[i].rate = RATE_BASE;
+			comm->peers[i].rate_prev = RATE_BASE;
+			comm->peers[i].rate_check = false;
+			comm->peers[i].rate_fails = 0;
+			comm->peers[i].rate_samples = 0;
+			comm->peers[i].retries = 0;
+			comm->peers[i].rate_hold = RATE_HOLD_MS;
+			comm->peers[i].retr_avg = 0;
+			comm->peers[i].retr_fails = 0;
+			comm->peers[i].power = NRF24_POWER_0DBM;
+			comm->peers[i].power_frames = 0;
+			comm->peers[i].power_rpd = 0;
+			comm->peers[i].rpd_frames = 0;
+			comm->peers[i].rpd_high = 0;
+			comm->peers[i].rpd_ind = 0;
+			comm->peers[i].rpd_windows = 0;
+			comm->peers[i].channel = comm->channel_raw;
+			comm->peers[i].channel_home = comm->channel_raw;
+			comm->peers[i].channel_prev = comm->channel_raw;
+			comm->peers[i].channel_check = false;
+			comm->peers[i].channel_fails = 0;
+			comm->peers[i].channels_shared = false;
+			comm->peers[i].hop = 1;
+			comm->tune_due = true;
+			memset(&comm->peers[i].stats, 0,
+					sizeof(comm->peers[i].stats));
+			comm->peers[i].connected = hal_time_ms();
+			comm->peers[i].flushed =
+				pipe_flushed(comm->driverIndex, i+1);
 			/* one peer for pipe*/
-			peers[i].pipe = i+1;
-			return peers[i].pipe;
+			comm->peers[i].pipe = i+1;
+			return comm->peers[i].pipe;
 		}
 	}
 
@@ -159,10 +521,746 @@ static inline int alloc_pipe(void)
 	return -1;
 }
 
+static void radio_set_rate(int spi_fd, int rate)
+{
+	if (rate != comm->radio_rate &&
+			phy_ioctl(spi_fd, NRF24_CMD_SET_DATA_RATE, &rate) == 0)
+		comm->radio_rate = rate;
+}
+
+static void radio_set_channel(int spi_fd, int channel)
+{
+	if (channel != comm->radio_channel &&
+			phy_ioctl(spi_fd, NRF24_CMD_SET_CHANNEL, &channel) == 0)
+		comm->radio_channel = channel;
+}
+
+/* NRF0 takes 2Mbps up to NRF24_DATA_CH_MAX_2M: channel first going to it */
+static void radio_tune(int spi_fd, int channel, int rate)
+{
+	if (rate == NRF24_RATE_2M) {
+		radio_set_channel(spi_fd, channel);
+		radio_set_rate(spi_fd, rate);
+	} else {
+		radio_set_rate(spi_fd, rate);
+		radio_set_channel(spi_fd, channel);
+	}
+}
+
+static inline bool peer_tuned(const struct nrf24_data *peer)
+{
+	return peer->channel == comm->radio_channel &&
+				peer->rate == comm->radio_rate;
+}
+
+/*
+ * Next RAW sub-slot: the following channel and rate with links, alone if
+ * only one. The radio hears one of them at a time.
+ */
+static void tune_slot(int spi_fd)
+{
+	uint8_t channel[CONNECTION_COUNTER], rate[CONNECTION_COUNTER];
+	int i, j, count = 0;
+
+	comm->tune_due = false;
+
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		if (comm->peers[i].pipe == -1)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (channel[j] == comm->peers[i].channel &&
+						rate[j] == comm->peers[i].rate)
+				break;
+		}
+
+		if (j == count) {
+			channel[count] = comm->peers[i].channel;
+			rate[count++] = comm->peers[i].rate;
+		}
+	}
+
+	if (count == 0) {
+		channel[count] = comm->channel_raw;
+		rate[count++] = RATE_BASE;
+	}
+
+	comm->tune_index = (comm->tune_index + 1) % count;
+	radio_tune(spi_fd, channel[comm->tune_index], rate[comm->tune_index]);
+
+	if (count > 1)
+		hal_timer_arm(&comm->tune_timer, TUNE_SLOT_MS);
+	else
+		hal_timer_cancel(&comm->tune_timer);
+}
+
+/*
+ * Link at a new rate. check: the slave sends RATE_IND back at the new
+ * rate, failing it returns to the previous one. The master holds its
+ * data until it receives it, for RATE_CHECK_MS at most.
+ */
+static void peer_set_rate(struct nrf24_data *peer, uint8_t rate, bool check)
+{
+	peer->rate_prev = peer->rate;
+	peer->rate = rate;
+	peer->rate_check = check;
+	peer->rate_fails = 0;
+	peer->rate_samples = 0;
+	peer->retries = 0;
+	comm->tune_due = true;
+
+	/* Master: probes the next rate up once the hold is over */
+	if (comm->addr_slave.address.uint64 == 0) {
+		peer->events &= ~PEER_EVT_RATE_PROBE;
+		hal_timer_arm(&peer->rate_timer, check ? RATE_CHECK_MS :
+							peer->rate_hold);
+	} else if (check)
+		hal_timer_arm(&peer->rate_timer, RATE_CHECK_MS);
+}
+
+/* Master: RATE_IND to send, the hold grows with the failed probes */
+static void rate_request(struct nrf24_data *peer, uint8_t rate)
+{
+	if (rate < peer->rate && peer->rate_prev < peer->rate &&
+				peer->rate_samples < RATE_PROBE_SAMPLES)
+		peer->rate_hold = _MIN(peer->rate_hold * 2, RATE_HOLD_MAX_MS);
+	else if (rate < peer->rate)
+		peer->rate_hold = RATE_HOLD_MS;
+
+	peer->rate_ind = rate;
+	peer->ctrl |= PEER_CTRL_RATE_IND;
+}
+
+/* Master: retransmissions of the last frame sent to the peer */
+static void rate_adapt(struct nrf24_data *peer, int arc)
+{
+	/* Moving average over about 8 frames: the decay rounds up to 0 */
+	peer->retries += arc * 2 - (peer->retries + 7) / 8;
+	if (peer->rate_samples < UINT8_MAX)
+		peer->rate_samples++;
+
+	/* One change of the link at a time */
+	if ((peer->ctrl & (PEER_CTRL_RATE_IND | PEER_CTRL_CHANNEL_IND)) ||
+							peer->channel_check)
+		return;
+
+	if (peer->rate > NRF24_RATE_250K &&
+			peer->rate_samples >= RATE_SAMPLES_DOWN &&
+			peer->retries > RATE_DOWN)
+		rate_request(peer, peer->rate - 1);
+	else if (peer->rate < NRF24_RATE_2M &&
+			(peer->events & PEER_EVT_RATE_PROBE) &&
+			peer->rate_samples >= RATE_SAMPLES &&
+			peer->retries < RATE_UP &&
+			(peer->rate + 1 < NRF24_RATE_2M ||
+			 peer->channel <= NRF24_DATA_CH_MAX_2M))
+		rate_request(peer, peer->rate + 1);
+}
+
+/* Frame sent to the peer: err < 0 if not acknowledged, else ARC_CNT */
+static void rate_tx(struct nrf24_data *peer, int err, int arc)
+{
+	/*
+	 * Master: RATE_IND back from the slave tells. Slave: the master
+	 * adapts the link once FEATURE_IND tells it supports rates.
+	 */
+	if (!(peer->features & NRF24_LINK_F_RATE) || (peer->rate_check &&
+			comm->addr_slave.address.uint64 == 0) ||
+			(peer->ctrl & PEER_CTRL_FEATURE_IND))
+		return;
+
+	if (err >= 0) {
+		peer->rate_check = false;
+		peer->rate_fails = 0;
+	} else if (peer->rate_check) {
+		/* Slave: the master may get to the new rate later */
+		if (comm->addr_slave.address.uint64 != 0 &&
+				hal_timer_pending(&peer->rate_timer))
+			return;
+
+		/* The peer didn't follow: back to the previous rate */
+		peer_set_rate(peer, peer->rate_prev, false);
+		return;
+	} else {
+		if (peer->rate_fails == 0)
+			peer->rate_fail_ms = hal_time_ms();
+		if (peer->rate_fails < UINT8_MAX)
+			peer->rate_fails++;
+
+		/*
+		 * Over the slots of the other rates and MGMT as well:
+		 * the peer does the same
+		 */
+		if (peer->rate_fails >= NRF24_RATE_FAILS &&
+				hal_time_ms() - peer->rate_fail_ms >=
+						NRF24_RATE_FAILS_MS &&
+				peer->rate != NRF24_RATE_250K) {
+			peer_set_rate(peer, NRF24_RATE_250K, false);
+			return;
+		}
+
+		/* Peer away (its MGMT slot): once for the average */
+		if (peer->rate_fails > 1)
+			return;
+	}
+
+	/* Slave: the master decides */
+	if (comm->addr_slave.address.uint64 != 0)
+		return;
+
+	rate_adapt(peer, err < 0 ? RATE_FAILED : arc);
+}
+
+/*
+ * Frame received from the peer: the link works at the rate of the radio.
+ * Master: the slave may not have followed it down to 250kbps.
+ */
+static void rate_rx(struct nrf24_data *peer)
+{
+	if (!(peer->features & NRF24_LINK_F_RATE))
+		return;
+
+	peer->rate_fails = 0;
+
+	if (comm->addr_slave.address.uint64 == 0 && !peer->rate_check &&
+					peer->rate != comm->radio_rate)
+		peer_set_rate(peer, comm->radio_rate, false);
+}
+
+/*
+ * Link on a new channel. check: the slave sends CHANNEL_IND back on it,
+ * failing it returns to the previous one. The master holds its data
+ * until it receives it, for HOP_CHECK_MS at most.
+ */
+static void peer_set_channel(struct nrf24_data *peer, uint8_t channel,
+								bool check)
+{
+	peer->channel_prev = peer->channel;
+	peer->channel = channel;
+	peer->channel_check = check;
+	peer->channel_fails = 0;
+	comm->tune_due = true;
+
+	/* Master: next hop once on the channel long enough */
+	if (comm->addr_slave.address.uint64 == 0 &&
+				(peer->features & NRF24_LINK_F_HOP)) {
+		peer->events &= ~PEER_EVT_HOP;
+		hal_timer_arm(&peer->hop_timer, check ? HOP_CHECK_MS : HOP_MS);
+	}
+}
+
+/* Master: hopping sequence of the link, from its CONNECT_REQ */
+static uint16_t hop_seed(const struct nrf24_ll_mgmt_connect *connect)
+{
+	uint16_t seed = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(connect->aa); i++)
+		seed = ((seed << 5) | (seed >> 11)) ^ connect->aa[i];
+
+	for (i = 0; i < sizeof(connect->dst_addr.address.b); i++)
+		seed = ((seed << 5) | (seed >> 11)) ^
+					connect->dst_addr.address.b[i];
+
+	/* xorshift: never 0 */
+	return seed ? seed : 1;
+}
+
+/*
+ * Master: next channel of the sequence, another of the data channels.
+ * xorshift16 (7, 9, 8): each link hops its own way. Channels left after
+ * HOP_BAD retransmissions are skipped until all the others are too, or
+ * the link is heard well on them again. 2Mbps links stay up to
+ * NRF24_DATA_CH_MAX_2M, they skip a hop to a higher channel.
+ */
+static uint8_t hop_next(struct nrf24_data *peer)
+{
+	uint8_t channel, others;
+	int i, j;
+
+	if (comm->data_channels_count == 0)
+		return peer->channel;
+
+	/* Alone: the links left on a former data channel move to it */
+	if (comm->data_channels_count == 1) {
+		channel = comm->data_channels[0];
+		goto done;
+	}
+
+	peer->hop ^= peer->hop << 7;
+	peer->hop ^= peer->hop >> 9;
+	peer->hop ^= peer->hop << 8;
+
+	for (i = 0; i < comm->data_channels_count; i++) {
+		if (comm->data_channels[i] == peer->channel)
+			break;
+	}
+
+	others = (1 << comm->data_channels_count) - 1;
+	if (i < comm->data_channels_count) {
+		others &= ~(1 << i);
+		if (peer->retr_avg > HOP_BAD)
+			peer->hop_bad |= (1 << i);
+		else
+			peer->hop_bad &= ~(1 << i);
+	}
+
+	if ((peer->hop_bad & others) == others)
+		peer->hop_bad = 0;
+
+	j = (i + 1 + peer->hop % (comm->data_channels_count - 1)) %
+					comm->data_channels_count;
+	while (j == i || (peer->hop_bad & (1 << j)))
+		j = (j + 1) % comm->data_channels_count;
+
+	channel = comm->data_channels[j];
+
+done:
+	if (peer->rate == NRF24_RATE_2M && channel > NRF24_DATA_CH_MAX_2M)
+		return peer->channel;
+
+	return channel;
+}
+
+/* Master: CHANNEL_IND for the next hop, once no other change is pending */
+static void channel_hop(struct nrf24_data *peer)
+{
+	uint8_t channel;
+
+	if (!(peer->events & PEER_EVT_HOP) || peer->rate_check ||
+			(peer->ctrl & (PEER_CTRL_RATE_IND |
+						PEER_CTRL_CHANNEL_IND)))
+		return;
+
+	peer->events &= ~PEER_EVT_HOP;
+
+	channel = hop_next(peer);
+	if (channel == peer->channel) {
+		hal_timer_arm(&peer->hop_timer, HOP_MS);
+		return;
+	}
+
+	peer->channel_ind = channel;
+	peer->ctrl |= PEER_CTRL_CHANNEL_IND;
+}
+
+/* Frame sent to the peer: err < 0 if not acknowledged. As rate_tx() */
+static void channel_tx(struct nrf24_data *peer, int err)
+{
+	/* Master: CHANNEL_IND back from the slave tells */
+	if (!(peer->features & NRF24_LINK_F_HOP) || (peer->channel_check &&
+				comm->addr_slave.address.uint64 == 0))
+		return;
+
+	if (err >= 0) {
+		peer->channel_check = false;
+		peer->channel_fails = 0;
+		return;
+	}
+
+	/*
+	 * The master hears one data channel at a time: a single failure
+	 * doesn't tell. Slave checking: the master didn't follow.
+	 */
+	if (++peer->channel_fails < NRF24_CHANNEL_FAILS)
+		return;
+
+	if (peer->channel_check)
+		peer_set_channel(peer, peer->channel_prev, false);
+	else if (peer->channel != peer->channel_home)
+		/* The peer does the same */
+		peer_set_channel(peer, peer->channel_home, false);
+}
+
+/* Frame received from the peer: the link works on its channel */
+static void channel_rx(struct nrf24_data *peer)
+{
+	if (!(peer->features & NRF24_LINK_F_HOP))
+		return;
+
+	peer->channel_fails = 0;
+}
+
+/* us on air at the radio rate: preamble, address, PCF, payload, CRC */
+static uint32_t frame_airtime(size_t len)
+{
+	static const uint16_t kbps[] = { 250, 1000, 2000 };
+
+	return ((1 + 5 + len + 2) * 8 + 9) * 1000UL / kbps[comm->radio_rate];
+}
+
+/*
+ * Auto retransmission policy (MGMT_CMD_NRF24_RETR_POLICY): ARD and ARC
+ * of the frame of len bytes about to be sent to the peer.
+ */
+typedef void (*retr_policy_t) (const struct nrf24_data *peer, size_t len,
+						struct nrf24_retr *retr);
+
+/* Fixed: ARD by pipe index, as nrf24l01_set_ptx() */
+static void retr_pipe(const struct nrf24_data *peer, size_t len,
+						struct nrf24_retr *retr)
+{
+	retr->ard = NRF24_RETR_PIPE;
+	retr->arc = RETR_ARC_MAX;
+}
+
+/* nRF24L01+ datasheet: shortest ARD (us) receiving ack_len bytes ACKs */
+static uint16_t retr_ard_min(uint8_t rate, uint8_t ack_len)
+{
+	switch (rate) {
+	case NRF24_RATE_250K:
+		/* 500us even without payload */
+		return ack_len == 0 ? 500 : 750 + ((ack_len - 1) / 8) * 250;
+	case NRF24_RATE_2M:
+		return ack_len <= 15 ? 250 : 500;
+	default:
+		return ack_len <= 5 ? 250 : 500;
+	}
+}
+
+/*
+ * Adaptive: the shortest ARD the ACKs allow while retransmissions are
+ * rare. Frequent ones (collisions, a full RX FIFO) spread the ARDs, by
+ * pipe on the master and by address on the slaves. ARC is bounded by
+ * the time a frame and its retransmissions may take in the RAW slot,
+ * and drops to the minimum while the peer doesn't answer.
+ */
+static void retr_adaptive(const struct nrf24_data *peer, size_t len,
+						struct nrf24_retr *retr)
+{
+	uint8_t ack_len = 0, spread;
+	uint16_t ard;
+	uint32_t arc;
+
+	/* Slave: the master may load a fragment on the ACKs */
+	if (comm->addr_slave.address.uint64 != 0 &&
+				(peer->features & NRF24_LINK_F_ACK_PAY))
+		ack_len = NRF24_PAYLOAD_SIZE;
+
+	ard = retr_ard_min(peer->rate, ack_len);
+	if (peer->retr_avg >= RETR_SPREAD) {
+		spread = (comm->addr_slave.address.uint64 == 0 ? peer->pipe :
+						comm->addr_slave.address.b[0]);
+		ard += (1 + spread % 4) * 250;
+	}
+
+	arc = RETR_BUDGET_US / (frame_airtime(len) + ard) - 1;
+	if (arc > RETR_ARC_MAX)
+		arc = RETR_ARC_MAX;
+	if (arc < RETR_ARC_MIN || peer->retr_fails >= RETR_FAILS)
+		arc = RETR_ARC_MIN;
+
+	retr->ard = ard / 250 - 1;
+	retr->arc = arc;
+}
+
+static const retr_policy_t retr_policies[] = {
+	[NRF24_RETR_POLICY_PIPE] = retr_pipe,
+	[NRF24_RETR_POLICY_ADAPTIVE] = retr_adaptive,
+};
+
+/* Before writing len bytes to the peer: ARD and ARC of the policy */
+static void retr_set(int spi_fd, struct nrf24_data *peer, size_t len)
+{
+	struct nrf24_retr retr = { .pipe = peer->pipe };
+
+	retr_policies[comm->retr_policy](peer, len, &retr);
+	if (retr.ard == peer->retr.ard && retr.arc == peer->retr.arc)
+		return;
+
+	/* AIR0: the broker retransmits as it does */
+	if (phy_ioctl(spi_fd, NRF24_CMD_SET_RETR, &retr) == 0)
+		peer->retr = retr;
+}
+
+static void radio_set_power(int spi_fd, int power)
+{
+	if (power != comm->radio_power &&
+			phy_ioctl(spi_fd, NRF24_CMD_SET_POWER, &power) == 0)
+		comm->radio_power = power;
+}
+
+/* Before writing len bytes to the peer: its ARD, ARC and power */
+static void tx_prepare(int spi_fd, struct nrf24_data *peer, size_t len)
+{
+	retr_set(spi_fd, peer, len);
+	radio_set_power(spi_fd, peer->power);
+}
+
+static void peer_set_power(struct nrf24_data *peer, uint8_t power)
+{
+	peer->power = power;
+	peer->power_frames = 0;
+}
+
+/*
+ * Frame sent to the peer, err < 0 if not acknowledged. One step down
+ * after POWER_SAMPLES frames with few retransmissions, if the peer tells
+ * it hears us strong: its next POWER_IND allows the following step. Up
+ * on retransmissions, back to the maximum on a lost frame.
+ */
+static void power_tx(struct nrf24_data *peer, int err)
+{
+	if (!(peer->features & NRF24_LINK_F_POWER))
+		return;
+
+	/* A single frame lost: the peer may be away, in its MGMT slot */
+	if (err < 0) {
+		if (peer->retr_fails > 1 && peer->power != NRF24_POWER_0DBM)
+			peer_set_power(peer, NRF24_POWER_0DBM);
+		return;
+	}
+
+	if (peer->power_frames < UINT8_MAX)
+		peer->power_frames++;
+
+	if (peer->power_frames < POWER_SAMPLES)
+		return;
+
+	if (peer->retr_avg > POWER_UP && peer->power < NRF24_POWER_0DBM) {
+		peer_set_power(peer, peer->power + 1);
+	} else if (peer->retr_avg < POWER_DOWN &&
+				peer->power_rpd >= NRF24_POWER_RPD &&
+				peer->power > NRF24_POWER_18DBM) {
+		peer_set_power(peer, peer->power - 1);
+		peer->power_rpd = 0;
+	}
+}
+
+/*
+ * Frame received from the peer, rpd: above -64 dBm. POWER_IND tells the
+ * share of each window once it crosses NRF24_POWER_RPD, and again every
+ * POWER_REFRESH windows while above it.
+ */
+static void power_rx(struct nrf24_data *peer, int rpd)
+{
+	uint8_t high;
+	bool strong;
+
+	if (!(peer->features & NRF24_LINK_F_POWER))
+		return;
+
+	peer->rpd_high += (rpd != 0);
+	if (++peer->rpd_frames < NRF24_POWER_WINDOW)
+		return;
+
+	high = peer->rpd_high * 100 / peer->rpd_frames;
+	strong = (high >= NRF24_POWER_RPD);
+	peer->rpd_frames = 0;
+	peer->rpd_high = 0;
+
+	if (strong == (peer->rpd_ind >= NRF24_POWER_RPD) &&
+			(!strong || ++peer->rpd_windows < POWER_REFRESH))
+		return;
+
+	peer->rpd_ind = high;
+	peer->rpd_windows = 0;
+	peer->ctrl |= PEER_CTRL_POWER_IND;
+}
+
+/* Frame written to the peer, err < 0 if not acknowledged */
+static void link_tx(int spi_fd, struct nrf24_data *peer, size_t len, int err)
+{
+	int arc = 0;
+
+	/*
+	 * OBSERVE_TX only for the statistics, the adaptive retransmissions,
+	 * the power control and the rate adaptation of the master. Drivers
+	 * without it (AIR0) report no retransmission.
+	 */
+	if (comm->radio_stats ||
+			comm->retr_policy != NRF24_RETR_POLICY_PIPE ||
+			(peer->features & NRF24_LINK_F_POWER) ||
+			(err >= 0 && (peer->features & NRF24_LINK_F_RATE) &&
+			comm->addr_slave.address.uint64 == 0))
+		phy_ioctl(spi_fd, NRF24_CMD_GET_RETRANSMITS, &arc);
+
+	peer->stats.retransmits += arc;
+	peer->stats.airtime += (arc + 1) * frame_airtime(len);
+	if (err < 0) {
+		peer->stats.tx_lost++;
+		if (peer->retr_fails < UINT8_MAX)
+			peer->retr_fails++;
+	} else {
+		peer->stats.tx_frames++;
+		peer->stats.tx_bytes += len;
+		peer->retr_fails = 0;
+	}
+
+	/* Moving average over about 8 frames, as rate_adapt() */
+	peer->retr_avg += arc * 2 - (peer->retr_avg + 7) / 8;
+
+	rate_tx(peer, err, arc);
+	channel_tx(peer, err);
+	power_tx(peer, err);
+}
+
+/* Frame read from the peer */
+static void link_rx(int spi_fd, struct nrf24_data *peer, size_t len)
+{
+	int rpd;
+
+	peer->stats.rx_frames++;
+	peer->stats.rx_bytes += len;
+	peer->stats.airtime += frame_airtime(len);
+
+	/* RPD only for the statistics and the power control */
+	if ((comm->radio_stats || (peer->features & NRF24_LINK_F_POWER)) &&
+			phy_ioctl(spi_fd, NRF24_CMD_GET_RPD, &rpd) == 0) {
+		peer->stats.rpd_samples++;
+		peer->stats.rpd_high += rpd;
+		power_rx(peer, rpd);
+	}
+
+	rate_rx(peer);
+	channel_rx(peer);
+}
+
+/* MGMT_EVT_NRF24_LINK_STATS of the next link asked for */
+static void link_stats_evt(void)
+{
+	struct mgmt_nrf24_header *evt =
+			(struct mgmt_nrf24_header *) comm->mgmt.buffer_rx;
+	struct mgmt_evt_nrf24_link_stats *stats =
+			(struct mgmt_evt_nrf24_link_stats *) evt->payload;
+	int i;
+
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		if (comm->peers[i].pipe != -1 &&
+				(comm->peers[i].events & PEER_EVT_STATS))
+			break;
+	}
+
+	if (i == CONNECTION_COUNTER)
+		return;
+
+	comm->peers[i].events &= ~PEER_EVT_STATS;
+
+	evt->opcode = MGMT_EVT_NRF24_LINK_STATS;
+	evt->index = 0;
+	memcpy(stats, &comm->peers[i].stats, sizeof(*stats));
+	stats->mac.address.uint64 = comm->peers[i].mac.address.uint64;
+	stats->duration = hal_time_ms() - comm->peers[i].connected;
+	stats->rate = comm->peers[i].rate;
+	stats->power = comm->peers[i].power;
+	stats->channel = comm->peers[i].channel;
+	stats->rx_flushed = pipe_flushed(comm->driverIndex,
+				comm->peers[i].pipe) - comm->peers[i].flushed;
+
+	comm->mgmt.len_rx = sizeof(*evt) + sizeof(*stats);
+}
+
+/*
+ * Gateway: samples of the channel surveyed, before the MGMT slot, the
+ * frames left on the data channel read
+ */
+static void survey_slot(int spi_fd)
+{
+	struct channel_survey *survey = &comm->survey;
+	struct nrf24_survey sample;
+
+	if (survey->channel > survey->last ||
+			survey->evt.count == NRF24_SURVEY_EVT_CHANNELS)
+		return;
+
+	/* NRF0 takes the channels above NRF24_DATA_CH_MAX_2M at 1Mbps */
+	radio_set_rate(spi_fd, RATE_BASE);
+
+	sample.channel = survey->channel;
+	sample.samples = survey->samples;
+	if (phy_ioctl(spi_fd, NRF24_CMD_SURVEY, &sample) == 0) {
+		survey->hits += sample.hits;
+		comm->radio_channel = survey->channel;
+	} else
+		/* Counted as quiet, the radio channel unknown */
+		comm->radio_channel = -1;
+
+	if (++survey->slot < survey->slots)
+		return;
+
+	survey->evt.busy[survey->evt.count++] = survey->hits * 100 /
+					(survey->samples * survey->slots);
+	survey->hits = 0;
+	survey->slot = 0;
+	survey->channel++;
+}
+
+/* MGMT_EVT_NRF24_SURVEY once a full event or the last channel is done */
+static void survey_evt(void)
+{
+	struct channel_survey *survey = &comm->survey;
+	struct mgmt_nrf24_header *evt =
+			(struct mgmt_nrf24_header *) comm->mgmt.buffer_rx;
+
+	if (survey->evt.count == 0 || (survey->channel <= survey->last &&
+			survey->evt.count < NRF24_SURVEY_EVT_CHANNELS))
+		return;
+
+	evt->opcode = MGMT_EVT_NRF24_SURVEY;
+	evt->index = 0;
+	memcpy(evt->payload, &survey->evt, sizeof(survey->evt));
+	comm->mgmt.len_rx = sizeof(*evt) + sizeof(survey->evt);
+
+	survey->evt.first = survey->channel;
+	survey->evt.count = 0;
+}
+
+/* RATE_IND received: the master announces, the slave confirms */
+static void rate_ind(struct nrf24_data *peer, uint8_t rate)
+{
+	if (!(peer->features & NRF24_LINK_F_RATE) || rate > NRF24_RATE_2M)
+		return;
+
+	if (comm->addr_slave.address.uint64 != 0) {
+		peer_set_rate(peer, rate, rate != peer->rate);
+		peer->rate_ind = rate;
+		peer->ctrl |= PEER_CTRL_RATE_IND;
+		return;
+	}
+
+	if (!peer->rate_check || rate != peer->rate)
+		return;
+
+	peer->rate_check = false;
+	hal_timer_arm(&peer->rate_timer, peer->rate_hold);
+}
+
+/* CHANNEL_IND received: the master announces, the slave confirms */
+static void channel_ind(struct nrf24_data *peer, uint8_t channel)
+{
+	if (!(peer->features & NRF24_LINK_F_HOP) ||
+			channel < NRF24_DATA_CH_MIN ||
+			channel > NRF24_DATA_CH_MAX)
+		return;
+
+	if (comm->addr_slave.address.uint64 != 0) {
+		peer_set_channel(peer, channel, channel != peer->channel);
+		peer->channel_ind = channel;
+		peer->ctrl |= PEER_CTRL_CHANNEL_IND;
+		return;
+	}
+
+	if (!peer->channel_check || channel != peer->channel)
+		return;
+
+	peer->channel_check = false;
+	hal_timer_arm(&peer->hop_timer, HOP_MS);
+}
+
+/* POWER_IND received: how strong the peer hears us */
+static void power_ind(struct nrf24_data *peer, uint8_t rpd)
+{
+	if (!(peer->features & NRF24_LINK_F_POWER))
+		return;
+
+	peer->power_rpd = (rpd > 100 ? 100 : rpd);
+}
+
 static int write_disconnect(int spi_fd, int sockfd, struct nrf24_mac dst,
 				struct nrf24_mac src)
 {
 	int err;
+	size_t len;
 	struct nrf24_io_pack p;
 	struct nrf24_ll_data_pdu *opdu =
 		(struct nrf24_ll_data_pdu *)p.payload;
@@ -176,10 +1274,11 @@ static int write_disconnect(int spi_fd, int sockfd, struct nrf24_mac dst,
 	ctrl->opcode = NRF24_LL_CRTL_OP_DISCONNECT;
 	disconnect->dst_addr.address.uint64 = dst.address.uint64;
 	disconnect->src_addr.address.uint64 = src.address.uint64;
-	err = phy_write(spi_fd, &p,
-					sizeof(struct nrf24_ll_data_pdu) +
-					sizeof(struct nrf24_ll_crtl_pdu) +
-					sizeof(struct nrf24_ll_disconnect));
+	len = sizeof(struct nrf24_ll_data_pdu) +
+		sizeof(struct nrf24_ll_crtl_pdu) +
+		sizeof(struct nrf24_ll_disconnect);
+	tx_prepare(spi_fd, &comm->peers[sockfd-1], len);
+	err = phy_write(spi_fd, &p, len);
 
 	if (err < 0)
 		return err;
@@ -191,6 +1290,7 @@ static int write_keepalive(int spi_fd, int sockfd, int keepalive_op,
 				struct nrf24_mac dst, struct nrf24_mac src)
 {
 	int err;
+	size_t len;
 	/* Assemble keep alive packet */
 	struct nrf24_io_pack p;
 	struct nrf24_ll_data_pdu *opdu =
@@ -209,10 +1309,12 @@ static int write_keepalive(int spi_fd, int sockfd, int keepalive_op,
 	kpalive->dst_addr.address.uint64 = dst.address.uint64;
 	kpalive->src_addr.address.uint64 = src.address.uint64;
 	/* Sends keep alive packet */
-	err = phy_write(spi_fd, &p,
-					sizeof(struct nrf24_ll_data_pdu) +
-					sizeof(struct nrf24_ll_crtl_pdu) +
-					sizeof(struct nrf24_ll_keepalive));
+	len = sizeof(struct nrf24_ll_data_pdu) +
+		sizeof(struct nrf24_ll_crtl_pdu) +
+		sizeof(struct nrf24_ll_keepalive);
+	tx_prepare(spi_fd, &comm->peers[sockfd-1], len);
+	err = phy_write(spi_fd, &p, len);
+	link_tx(spi_fd, &comm->peers[sockfd-1], len, err);
 
 	if (err < 0)
 		return err;
@@ -222,31 +1324,157 @@ static int write_keepalive(int spi_fd, int sockfd, int keepalive_op,
 
 static int check_keepalive(int spi_fd, int sockfd)
 {
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+	int err;
 
-	int err = 0;
-
-	/* Check if timeout occurred */
-	if (hal_timeout(hal_time_ms(), peers[sockfd-1].keepalive_wait,
-		NRF24_KEEPALIVE_TIMEOUT_MS) > 0)
+	/* Timeout flagged by timeout_timer */
+	if (peer->events & PEER_EVT_TIMEOUT)
 		return -ETIMEDOUT;
 
-	/* If keepalive is disable */
-	if (peers[sockfd-1].keepalive == 0)
+	/* Keepalive request flagged by keepalive_timer, in its sub-slot */
+	if (!(peer->events & PEER_EVT_KEEPALIVE) || !peer_tuned(peer))
+		return 0;
+
+	peer->events &= ~PEER_EVT_KEEPALIVE;
+
+	/* Sends keepalive packet */
+	err = write_keepalive(spi_fd, sockfd, NRF24_LL_CRTL_OP_KEEPALIVE_REQ,
+						peer->mac, comm->addr_slave);
+
+	/*
+	 * Rate and hopping links: sent again soon, a master gone down to
+	 * 250kbps or back to the previous channel is followed once the
+	 * failures are enough
+	 */
+	if (err < 0 && (peer->features &
+				(NRF24_LINK_F_RATE | NRF24_LINK_F_HOP)))
+		hal_timer_arm(&peer->keepalive_timer, TUNE_SLOT_MS);
+
+	/* ACK payload links: the master doesn't answer, its ACK does */
+	if (err == 0 && (peer->features & NRF24_LINK_F_ACK_PAY))
+		peer_alive(peer);
+
+	/* Not acknowledged (-ETIMEDOUT of the phy): not the link timeout */
+	return (err < 0 ? -EAGAIN : err);
+}
+
+/*
+ * Slave: FEATURE_IND, ACK_POLL, RATE_IND and CHANNEL_IND back, master:
+ * RATE_IND and CHANNEL_IND. Both: POWER_IND, when nothing else is pending.
+ */
+static int write_ctrl(int spi_fd, int sockfd)
+{
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+	struct nrf24_io_pack p;
+	struct nrf24_ll_data_pdu *opdu =
+		(struct nrf24_ll_data_pdu *)p.payload;
+	struct nrf24_ll_crtl_pdu *ctrl =
+		(struct nrf24_ll_crtl_pdu *)opdu->payload;
+	struct nrf24_ll_feature_ind *ind =
+		(struct nrf24_ll_feature_ind *) ctrl->payload;
+	struct nrf24_ll_ack_poll *poll =
+		(struct nrf24_ll_ack_poll *) ctrl->payload;
+	struct nrf24_ll_rate_ind *rate =
+		(struct nrf24_ll_rate_ind *) ctrl->payload;
+	struct nrf24_ll_channel_ind *channel =
+		(struct nrf24_ll_channel_ind *) ctrl->payload;
+	struct nrf24_ll_power_ind *power =
+		(struct nrf24_ll_power_ind *) ctrl->payload;
+	size_t len = sizeof(struct nrf24_ll_data_pdu) +
+					sizeof(struct nrf24_ll_crtl_pdu);
+	int err;
+
+	if (peer->ctrl & PEER_CTRL_FEATURE_IND) {
+		ctrl->opcode = NRF24_LL_CRTL_OP_FEATURE_IND;
+		ind->features = peer->features;
+		len += sizeof(struct nrf24_ll_feature_ind);
+	} else if (peer->ctrl & PEER_CTRL_ACK_POLL) {
+		ctrl->opcode = NRF24_LL_CRTL_OP_ACK_POLL;
+		poll->next = peer->ack_next;
+		poll->msg = peer->ack_msg;
+		len += sizeof(struct nrf24_ll_ack_poll);
+	} else if (peer->ctrl & PEER_CTRL_RATE_IND) {
+		ctrl->opcode = NRF24_LL_CRTL_OP_RATE_IND;
+		rate->rate = peer->rate_ind;
+		len += sizeof(struct nrf24_ll_rate_ind);
+	} else if (peer->ctrl & PEER_CTRL_CHANNEL_IND) {
+		ctrl->opcode = NRF24_LL_CRTL_OP_CHANNEL_IND;
+		channel->channel = peer->channel_ind;
+		len += sizeof(struct nrf24_ll_channel_ind);
+	} else if (peer->ctrl & PEER_CTRL_POWER_IND) {
+		ctrl->opcode = NRF24_LL_CRTL_OP_POWER_IND;
+		power->rpd = peer->rpd_ind;
+		len += sizeof(struct nrf24_ll_power_ind);
+	} else
+		return -EAGAIN;
+
+	opdu->lid = NRF24_PDU_LID_CONTROL;
+	p.pipe = sockfd;
+
+	/* Not acknowledged: sent again on the next RAW slot */
+	tx_prepare(spi_fd, peer, len);
+	err = phy_write(spi_fd, &p, len);
+	link_tx(spi_fd, peer, len, err);
+
+	/*
+	 * Not sent again: the master asks again if the statistics still
+	 * tell so. The slave sends it back until the master is done
+	 * checking the new rate (its radio gets to the rate on its next
+	 * sub-slot), then returns to the previous rate. The master
+	 * checking a new rate: the slave didn't follow.
+	 */
+	if (ctrl->opcode == NRF24_LL_CRTL_OP_RATE_IND) {
+		if (err < 0 && comm->addr_slave.address.uint64 != 0 &&
+				hal_timer_pending(&peer->rate_timer))
+			return err;
+
+		peer->ctrl &= ~PEER_CTRL_RATE_IND;
+		if (comm->addr_slave.address.uint64 != 0)
+			return (err < 0 ? err : 0);
+
+		if (err >= 0)
+			peer_set_rate(peer, peer->rate_ind, true);
+		else if (peer->rate_check)
+			peer_set_rate(peer, peer->rate_prev, false);
+
+		return (err < 0 ? err : 0);
+	}
+
+	/*
+	 * As RATE_IND, the master hops again later. The slave sends it
+	 * again while checking: the master may be on another channel.
+	 */
+	if (ctrl->opcode == NRF24_LL_CRTL_OP_CHANNEL_IND) {
+		peer->ctrl &= ~PEER_CTRL_CHANNEL_IND;
+		if (comm->addr_slave.address.uint64 != 0) {
+			if (err < 0 && peer->channel_check)
+				peer->ctrl |= PEER_CTRL_CHANNEL_IND;
+			return (err < 0 ? err : 0);
+		}
+
+		if (err >= 0)
+			peer_set_channel(peer, peer->channel_ind, true);
+		else if (peer->channel_check)
+			peer_set_channel(peer, peer->channel_prev, false);
+		else
+			hal_timer_arm(&peer->hop_timer, HOP_MS);
+
+		return (err < 0 ? err : 0);
+	}
+
+	if (err < 0)
 		return err;
 
-	/* Sends keepalive request every NRF24_KEEPALIVE_SEND_MS */
-	if (hal_timeout(hal_time_ms(), peers[sockfd-1].keepalive_wait,
-		peers[sockfd-1].keepalive * NRF24_KEEPALIVE_SEND_MS) > 0) {
-		/* Sends keepalive packet */
-		err = write_keepalive(spi_fd, sockfd,
-				NRF24_LL_CRTL_OP_KEEPALIVE_REQ,
-				peers[sockfd-1].mac, addr_slave);
-
-		peers[sockfd-1].keepalive += 1;
-	}
+	if (ctrl->opcode == NRF24_LL_CRTL_OP_FEATURE_IND)
+		peer->ctrl &= ~PEER_CTRL_FEATURE_IND;
+	else if (ctrl->opcode == NRF24_LL_CRTL_OP_ACK_POLL)
+		peer->ctrl &= ~PEER_CTRL_ACK_POLL;
+	else
+		peer->ctrl &= ~PEER_CTRL_POWER_IND;
 
+	peer_alive(peer);
 
-	return err;
+	return 0;
 }
 
 static int write_mgmt(int spi_fd)
@@ -255,20 +1483,22 @@ static int write_mgmt(int spi_fd)
 	struct nrf24_io_pack p;
 
 	/* If nothing to do */
-	if (mgmt.len_tx == 0)
+	if (comm->mgmt.len_tx == 0)
 		return -EAGAIN;
 
 	/* Set pipe to be sent */
 	p.pipe = 0;
 	/* Copy buffer_tx to payload */
-	memcpy(p.payload, mgmt.buffer_tx, mgmt.len_tx);
+	memcpy(p.payload, comm->mgmt.buffer_tx, comm->mgmt.len_tx);
 
-	err = phy_write(spi_fd, &p, mgmt.len_tx);
+	/* Unknown links: full power */
+	radio_set_power(spi_fd, NRF24_POWER_0DBM);
+	err = phy_write(spi_fd, &p, comm->mgmt.len_tx);
 	if (err < 0)
 		return err;
 
 	/* Reset len_tx */
-	mgmt.len_tx = 0;
+	comm->mgmt.len_tx = 0;
 
 	return err;
 }
@@ -279,6 +1509,13 @@ static int read_mgmt(int spi_fd)
 	struct nrf24_io_pack p;
 	struct nrf24_ll_mgmt_pdu *ipdu = (struct nrf24_ll_mgmt_pdu *)p.payload;
 
+	/*
+	 * If already has something in rx buffer then return BUSY: the
+	 * frame waits in the RX FIFO, counted by the radio if flushed
+	 */
+	if (comm->mgmt.len_rx != 0)
+		return -EBUSY;
+
 	/* Read from management pipe */
 	p.pipe = 0;
 	p.payload[0] = 0;
@@ -287,17 +1524,13 @@ static int read_mgmt(int spi_fd)
 	if (ilen < 0)
 		return -EAGAIN;
 
-	/* If already has something in rx buffer then return BUSY*/
-	if (mgmt.len_rx != 0)
-		return -EBUSY;
-
 	switch (ipdu->type) {
 	/* If is a presente type */
 	case NRF24_PDU_TYPE_PRESENCE:
 	{
 		/* Event header structure */
 		struct mgmt_nrf24_header *evt =
-			(struct mgmt_nrf24_header *) mgmt.buffer_rx;
+			(struct mgmt_nrf24_header *) comm->mgmt.buffer_rx;
 		/* Event presence structure */
 		struct mgmt_evt_nrf24_bcast_presence *evt_presence =
 			(struct mgmt_evt_nrf24_bcast_presence *)evt->payload;
@@ -310,7 +1543,7 @@ static int read_mgmt(int spi_fd)
 		/* Copy source address */
 		evt_presence->mac.address.uint64 = mac->address.uint64;
 
-		mgmt.len_rx = sizeof(struct nrf24_mac) +
+		comm->mgmt.len_rx = sizeof(struct nrf24_mac) +
 				sizeof(struct mgmt_nrf24_header);
 	}
 		break;
@@ -319,7 +1552,7 @@ static int read_mgmt(int spi_fd)
 	{
 		/* Event header structure */
 		struct mgmt_nrf24_header *evt =
-			(struct mgmt_nrf24_header *) mgmt.buffer_rx;
+			(struct mgmt_nrf24_header *) comm->mgmt.buffer_rx;
 		/* Event connect structure */
 		struct mgmt_evt_nrf24_connected *evt_connect =
 			(struct mgmt_evt_nrf24_connected *)evt->payload;
@@ -339,8 +1572,11 @@ static int read_mgmt(int spi_fd)
 		evt_connect->channel = connect->channel;
 		/* Copy access address */
 		memcpy(evt_connect->aa, connect->aa, sizeof(aa_pipes[0]));
+		/* Negotiated by hal_comm_accept() */
+		comm->offered_features = connect->features;
+		comm->offered_channels = connect->channels;
 
-		mgmt.len_rx = sizeof(struct mgmt_nrf24_header) +
+		comm->mgmt.len_rx = sizeof(struct mgmt_nrf24_header) +
 				sizeof(struct mgmt_evt_nrf24_connected);
 
 	}
@@ -353,25 +1589,194 @@ static int read_mgmt(int spi_fd)
 	return ilen;
 }
 
+/* Fragment nseq of the message to send: PDU length, 0 past the end */
+static size_t data_frag(const struct nrf24_data *peer, uint8_t nseq,
+					struct nrf24_ll_data_pdu *opdu)
+{
+	size_t offset = nseq * NRF24_PW_MSG_SIZE;
+	size_t plen;
+
+	if (offset >= peer->len_tx)
+		return 0;
+
+	plen = _MIN(peer->len_tx - offset, NRF24_PW_MSG_SIZE);
+	opdu->lid = (offset + plen < peer->len_tx) ?
+			NRF24_PDU_LID_DATA_FRAG : NRF24_PDU_LID_DATA_END;
+	opdu->nseq = nseq;
+	memcpy(opdu->payload, peer->buffer_tx + offset, plen);
+
+	return plen + DATA_HDR_SIZE;
+}
+
+/* Master: fragment ack_next rides the next ACK on the slave pipe */
+static int load_ack(int spi_fd, int sockfd)
+{
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+	struct nrf24_ack_payload ap;
+	struct nrf24_ll_data_pdu *opdu =
+		(struct nrf24_ll_data_pdu *) ap.payload;
+
+	ap.pipe = sockfd;
+	ap.len = data_frag(peer, peer->ack_next, opdu);
+	opdu->rfu = peer->ack_msg;
+
+	return phy_ioctl(spi_fd, NRF24_CMD_SET_ACK_PAYLOAD, &ap);
+}
+
+static void unload_ack(int spi_fd, int sockfd)
+{
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+	struct nrf24_ack_payload ap;
+
+	ap.pipe = sockfd;
+	ap.len = 0;
+	phy_ioctl(spi_fd, NRF24_CMD_SET_ACK_PAYLOAD, &ap);
+
+	hal_timer_cancel(&peer->ack_timer);
+	peer->events &= ~PEER_EVT_ACK_WAIT;
+	peer->ack_loaded = 0;
+}
+
+/*
+ * Master, NRF24_LINK_F_ACK_PAY links: the message is sent on the ACKs
+ * of the slave frames, -EINPROGRESS until the slave polls past its last
+ * fragment. Without progress for ack_wait ms or if the TX FIFO is full,
+ * the message goes out as PTX frames.
+ */
+static int write_ack(int spi_fd, int sockfd)
+{
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+
+	if (peer->ack_loaded) {
+		if (!(peer->events & PEER_EVT_ACK_WAIT))
+			return -EINPROGRESS;
+
+		unload_ack(spi_fd, sockfd);
+		return -ETIMEDOUT;
+	}
+
+	peer->ack_next = 0;
+	peer->ack_msg++;
+	if (load_ack(spi_fd, sockfd) < 0)
+		return -EBUSY;
+
+	peer->ack_loaded = 1;
+	hal_timer_arm(&peer->ack_timer, comm->ack_wait);
+
+	return -EINPROGRESS;
+}
+
+/*
+ * Master: the ACK of a slave frame carried fragment ack_next. ACK_POLL
+ * tells the fragment the slave expects (next) and its message, other
+ * frames are assumed to have taken the fragment.
+ */
+static void ack_taken(int spi_fd, int sockfd,
+				const struct nrf24_ll_ack_poll *poll)
+{
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
+	int next = -1;
+
+	if (!peer->ack_loaded)
+		return;
+
+	/* Polling for a previous message: not started this one */
+	if (poll)
+		next = (poll->msg == peer->ack_msg ? poll->next : 0);
+
+	/* Polled past the last fragment: message delivered */
+	if (next >= 0 &&
+			(size_t) next * NRF24_PW_MSG_SIZE >= peer->len_tx) {
+		unload_ack(spi_fd, sockfd);
+		peer->len_tx = 0;
+		peer->seqnumber_tx = 0;
+		peer_alive(peer);
+		return;
+	}
+
+	/* Went out on this ACK: the slave gets the following one */
+	if (next < 0 || next == peer->ack_next) {
+		/* Only polls confirm the progress */
+		if (next >= 0)
+			hal_timer_arm(&peer->ack_timer, comm->ack_wait);
+
+		next = peer->ack_next;
+		if ((size_t) next * NRF24_PW_MSG_SIZE < peer->len_tx)
+			next++;
+	}
+
+	/* Past the last fragment: nothing loaded, waits for the poll */
+	peer->ack_next = next;
+	load_ack(spi_fd, sockfd);
+}
+
+/* Slave: copy of the message it has, the confirmation was lost */
+static bool ack_duplicate(struct nrf24_data *peer,
+					const struct nrf24_ll_data_pdu *ipdu)
+{
+	/* Complete: ack_next past its END fragment */
+	if (ipdu->lid == NRF24_PDU_LID_CONTROL ||
+			ipdu->rfu != peer->ack_msg ||
+			peer->seqnumber_rx != 0 || peer->ack_next == 0)
+		return false;
+
+	peer->ctrl |= PEER_CTRL_ACK_POLL;
+
+	return true;
+}
+
+/* Slave: fragment of the master taken from an ACK, polls the next one */
+static void ack_received(struct nrf24_data *peer,
+			const struct nrf24_ll_data_pdu *ipdu, size_t len_rx)
+{
+	/* Previous message not read yet: fragment discarded */
+	if (ipdu->lid == NRF24_PDU_LID_CONTROL || len_rx != 0)
+		return;
+
+	peer->ack_msg = ipdu->rfu;
+
+	/* Complete: polling past the END fragment confirms it at once */
+	if (ipdu->lid == NRF24_PDU_LID_DATA_END && peer->len_rx != 0) {
+		peer->ack_next = ipdu->nseq + 1;
+		peer->ctrl |= PEER_CTRL_ACK_POLL;
+		hal_timer_cancel(&peer->ack_timer);
+		return;
+	}
+
+	/* Leaves the master time to load the next one */
+	peer->ack_next = peer->seqnumber_rx;
+	peer->polls = 0;
+	hal_timer_arm(&peer->ack_timer, ACK_POLL_MS);
+}
+
 static int write_raw(int spi_fd, int sockfd)
 {
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
 	int err;
 	struct nrf24_io_pack p;
 	struct nrf24_ll_data_pdu *opdu = (void *)p.payload;
 	size_t plen, left;
 
 	/* If has nothing to send, returns EBUSY */
-	if (peers[sockfd-1].len_tx == 0)
+	if (peer->len_tx == 0)
 		return -EAGAIN;
 
 	/* If len is larger than the maximum message size */
-	if (peers[sockfd-1].len_tx > DATA_SIZE)
+	if (peer->len_tx > DATA_SIZE)
 		return -EINVAL;
 
+	/* Master: on the ACKs of the slave frames if negotiated */
+	if (comm->addr_slave.address.uint64 == 0 &&
+			(peer->features & NRF24_LINK_F_ACK_PAY)) {
+		err = write_ack(spi_fd, sockfd);
+		if (err == -EINPROGRESS)
+			return err;
+	}
+
 	/* Set pipe to be sent */
 	p.pipe = sockfd;
 	/* Amount of bytes to be sent */
-	left = peers[sockfd-1].len_tx;
+	left = peer->len_tx;
 
 	while (left) {
 
@@ -393,56 +1798,104 @@ static int write_raw(int spi_fd, int sockfd)
 			NRF24_PDU_LID_DATA_FRAG : NRF24_PDU_LID_DATA_END;
 
 		/* Packet sequence number */
-		opdu->nseq = peers[sockfd-1].seqnumber_tx;
+		opdu->nseq = peer->seqnumber_tx;
 
 		/* Offset = len - left */
-		memcpy(opdu->payload, peers[sockfd-1].buffer_tx +
-			(peers[sockfd-1].len_tx - left), plen);
+		memcpy(opdu->payload, peer->buffer_tx +
+			(peer->len_tx - left), plen);
 
 		/* Send packet */
+		tx_prepare(spi_fd, peer, plen + DATA_HDR_SIZE);
 		err = phy_write(spi_fd, &p, plen + DATA_HDR_SIZE);
+		link_tx(spi_fd, peer, plen + DATA_HDR_SIZE, err);
 		/*
 		 * If write error then reset tx len
-		 * and sequence number
+		 * and sequence number. Rate links and shared data
+		 * channels: sent again for NRF24_RATE_FAILS_MS first, the
+		 * master may be on the sub-slots of the others.
 		 */
 		if (err < 0) {
-			peers[sockfd-1].len_tx = 0;
-			peers[sockfd-1].seqnumber_tx = 0;
+			if (!peer->tx_failing) {
+				peer->tx_failing = true;
+				peer->tx_fail_ms = hal_time_ms();
+			}
+
+			if ((peer->rate_fails || peer->channels_shared) &&
+					hal_time_ms() - peer->tx_fail_ms <
+						NRF24_RATE_FAILS_MS) {
+				peer->seqnumber_tx = 0;
+				return err;
+			}
+
+			peer->len_tx = 0;
+			peer->seqnumber_tx = 0;
 			return err;
 		}
 
 		left -= plen;
-		peers[sockfd-1].seqnumber_tx++;
+		peer->seqnumber_tx++;
 	}
 
 	/* Restart keepalive timeout */
-	peers[sockfd-1].keepalive_wait = hal_time_ms();
-	if (peers[sockfd-1].keepalive >= 1)
-		peers[sockfd-1].keepalive = 1;
+	peer_alive(peer);
+
+	/* Slave: the answer may be waiting on the ACKs of its polls */
+	if (comm->addr_slave.address.uint64 != 0 &&
+			(peer->features & NRF24_LINK_F_ACK_PAY)) {
+		peer->polls = 0;
+		hal_timer_arm(&peer->ack_timer, ACK_POLL_MS);
+	}
 
-	err = peers[sockfd-1].len_tx;
+	err = peer->len_tx;
 
 	/* Resets controls */
-	peers[sockfd-1].len_tx = 0;
-	peers[sockfd-1].seqnumber_tx = 0;
+	peer->len_tx = 0;
+	peer->seqnumber_tx = 0;
 
 	return err;
 }
 
+/* Slave on ACK payload links: master fragments arrive on pipe 0 */
+static ssize_t read_pdu(int spi_fd, int sockfd, struct nrf24_io_pack *p)
+{
+	ssize_t ilen;
+
+	p->pipe = sockfd;
+	p->payload[0] = 0;
+	ilen = phy_read(spi_fd, p, NRF24_MTU);
+	if (ilen > 0 || comm->addr_slave.address.uint64 == 0 ||
+			!(comm->peers[sockfd-1].features &
+						NRF24_LINK_F_ACK_PAY))
+		return ilen;
+
+	p->pipe = 0;
+
+	return phy_read(spi_fd, p, NRF24_MTU);
+}
+
 static int read_raw(int spi_fd, int sockfd)
 {
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
 	ssize_t ilen;
-	size_t plen;
+	size_t plen, len_rx;
+	const struct nrf24_ll_ack_poll *polled;
 	struct nrf24_io_pack p;
 	const struct nrf24_ll_data_pdu *ipdu = (void *)p.payload;
+	int count = 0;
 
-	p.pipe = sockfd;
-	p.payload[0] = 0;
 	/*
 	 * Reads the data while to exist,
-	 * on success, the number of bytes read is returned
+	 * returns the number of PDUs read
 	 */
-	while ((ilen = phy_read(spi_fd, &p, NRF24_MTU)) > 0) {
+	while ((ilen = read_pdu(spi_fd, sockfd, &p)) > 0) {
+		count++;
+		polled = NULL;
+		len_rx = peer->len_rx;
+		link_rx(spi_fd, peer, ilen);
+
+		if (p.pipe == 0 && ack_duplicate(peer, ipdu))
+			continue;
+
 		/* Check if is data or Control */
 		switch (ipdu->lid) {
 
@@ -457,41 +1910,100 @@ static int read_raw(int spi_fd, int sockfd)
 
 			struct nrf24_ll_disconnect *disconnect =
 				(struct nrf24_ll_disconnect *) ctrl->payload;
+
+			struct nrf24_ll_feature_ind *ind =
+				(struct nrf24_ll_feature_ind *) ctrl->payload;
+
+			struct nrf24_ll_ack_poll *poll =
+				(struct nrf24_ll_ack_poll *) ctrl->payload;
+
+			struct nrf24_ll_rate_ind *rate =
+				(struct nrf24_ll_rate_ind *) ctrl->payload;
+
+			struct nrf24_ll_channel_ind *channel =
+				(struct nrf24_ll_channel_ind *) ctrl->payload;
+
+			struct nrf24_ll_power_ind *power =
+				(struct nrf24_ll_power_ind *) ctrl->payload;
 			/*
-			 * If is keep alive then resets keepalive_wait
+			 * If is keep alive then restarts keepalive timers
 			 * Slave side
 			 */
 			if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_RSP &&
 				kpalive->src_addr.address.uint64 ==
-				peers[sockfd-1].mac.address.uint64 &&
+				peer->mac.address.uint64 &&
 				kpalive->dst_addr.address.uint64 ==
-				addr_slave.address.uint64) {
-				peers[sockfd-1].keepalive_wait = hal_time_ms();
-				peers[sockfd-1].keepalive = 1;
-			}
+				comm->addr_slave.address.uint64)
+				peer_alive(peer);
 
 			/*
-			 * If is keep alive then resets keepalive_wait
+			 * If is keep alive then restarts keepalive timers
 			 * NRFD side
 			 */
 
 			if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ &&
 				kpalive->src_addr.address.uint64 ==
-				peers[sockfd-1].mac.address.uint64 &&
+				peer->mac.address.uint64 &&
 				kpalive->dst_addr.address.uint64 ==
-				addr_gw.address.uint64) {
-				peers[sockfd-1].keepalive_wait = hal_time_ms();
-				write_keepalive(spi_fd, sockfd,
-					NRF24_LL_CRTL_OP_KEEPALIVE_RSP,
-					peers[sockfd-1].mac,
-					addr_gw);
+				comm->addr_gw.address.uint64) {
+				peer_alive(peer);
+				/*
+				 * ACK payload links: the ACK is the response.
+				 * Read after its sub-slot: the slave asks again
+				 */
+				if (!(peer->features & NRF24_LINK_F_ACK_PAY) &&
+							peer_tuned(peer))
+					write_keepalive(spi_fd, sockfd,
+						NRF24_LL_CRTL_OP_KEEPALIVE_RSP,
+						peer->mac,
+						comm->addr_gw);
+			}
+
+			/* Features the slave accepts: NRFD side */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_FEATURE_IND) {
+				peer->features =
+					ind->features & comm->link_features;
+				/* First probe after RATE_HOLD_MS */
+				if (peer->features & NRF24_LINK_F_RATE)
+					hal_timer_arm(&peer->rate_timer,
+							peer->rate_hold);
+				/* First hop after HOP_MS */
+				if (peer->features & NRF24_LINK_F_HOP)
+					hal_timer_arm(&peer->hop_timer,
+								HOP_MS);
+				peer_alive(peer);
+			}
+
+			/* Rate of the link: both sides */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_RATE_IND) {
+				rate_ind(peer, rate->rate);
+				peer_alive(peer);
+			}
+
+			/* Channel of the link: both sides */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_CHANNEL_IND) {
+				channel_ind(peer, channel->channel);
+				peer_alive(peer);
+			}
+
+			/* How strong the peer hears us: both sides */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_POWER_IND) {
+				power_ind(peer, power->rpd);
+				peer_alive(peer);
+			}
+
+			/* Fragment the slave expects: NRFD side */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_ACK_POLL) {
+				polled = poll;
+				peer_alive(peer);
 			}
 
 			/* If packet is disconnect request */
 			else if (ctrl->opcode == NRF24_LL_CRTL_OP_DISCONNECT
-						&& mgmt.len_rx == 0) {
+						&& comm->mgmt.len_rx == 0) {
 				struct mgmt_nrf24_header *evt =
-				(struct mgmt_nrf24_header *) mgmt.buffer_rx;
+					(struct mgmt_nrf24_header *)
+							comm->mgmt.buffer_rx;
 
 				struct mgmt_evt_nrf24_disconnected *evt_discon =
 				(struct mgmt_evt_nrf24_disconnected *)
@@ -501,11 +2013,15 @@ static int read_raw(int spi_fd, int sockfd)
 
 				evt_discon->mac.address.uint64 =
 					disconnect->src_addr.address.uint64;
-				mgmt.len_rx =
+				comm->mgmt.len_rx =
 					sizeof(struct mgmt_nrf24_header) +
 				sizeof(struct mgmt_evt_nrf24_disconnected);
 			}
 
+			/* Event pending: the keepalive timeout reports it */
+			else if (ctrl->opcode == NRF24_LL_CRTL_OP_DISCONNECT)
+				peer->stats.rx_dropped++;
+
 		}
 			break;
 
@@ -513,68 +2029,111 @@ static int read_raw(int spi_fd, int sockfd)
 		case NRF24_PDU_LID_DATA_FRAG:
 		case NRF24_PDU_LID_DATA_END:
 			/* Restart keepalive timeout */
-			peers[sockfd-1].keepalive_wait = hal_time_ms();
-			if (peers[sockfd-1].keepalive >= 1)
-				peers[sockfd-1].keepalive = 1;
+			peer_alive(peer);
 
-			if (peers[sockfd-1].len_rx != 0)
-				break; /* Discard packet */
+			if (peer->len_rx != 0) {
+				/* Discard packet */
+				peer->stats.rx_dropped++;
+				break;
+			}
 
 			/* Reset offset if sequence number is zero */
 			if (ipdu->nseq == 0) {
-				peers[sockfd-1].offset_rx = 0;
-				peers[sockfd-1].seqnumber_rx = 0;
+				peer->offset_rx = 0;
+				peer->seqnumber_rx = 0;
 			}
 
 			/* If sequence number error */
-			if (peers[sockfd-1].seqnumber_rx < ipdu->nseq)
+			if (peer->seqnumber_rx < ipdu->nseq) {
+				peer->stats.rx_dropped++;
 				break;
 				/*
 				 * TODO: disconnect, data error!?!?!?
 				 * Illegal byte sequence
 				 */
+			}
 
-			if (peers[sockfd-1].seqnumber_rx > ipdu->nseq)
+			if (peer->seqnumber_rx > ipdu->nseq)
 				break; /* Discard packet duplicated */
 
 			/* Payloag length = input length - header size */
 			plen = ilen - DATA_HDR_SIZE;
 
 			if (ipdu->lid == NRF24_PDU_LID_DATA_FRAG &&
-				plen < NRF24_PW_MSG_SIZE)
+				plen < NRF24_PW_MSG_SIZE) {
+				peer->stats.rx_dropped++;
 				break;
 				/*
 				 * TODO: disconnect, data error!?!?!?
 				 * Not a data message
 				 */
+			}
 
 			/* Reads no more than DATA_SIZE bytes */
-			if (peers[sockfd-1].offset_rx + plen > DATA_SIZE)
-				plen = DATA_SIZE - peers[sockfd-1].offset_rx;
+			if (peer->offset_rx + plen > DATA_SIZE)
+				plen = DATA_SIZE - peer->offset_rx;
 
-			memcpy(peers[sockfd-1].buffer_rx +
-				peers[sockfd-1].offset_rx, ipdu->payload, plen);
-			peers[sockfd-1].offset_rx += plen;
-			peers[sockfd-1].seqnumber_rx++;
+			memcpy(peer->buffer_rx +
+				peer->offset_rx, ipdu->payload, plen);
+			peer->offset_rx += plen;
+			peer->seqnumber_rx++;
 
 			/* If is DATA_END then put in rx buffer */
 			if (ipdu->lid == NRF24_PDU_LID_DATA_END) {
 				/* Sets packet length read */
-				peers[sockfd-1].len_rx =
-					peers[sockfd-1].offset_rx;
+				peer->len_rx =
+					peer->offset_rx;
 
 				/*
 				 * If the complete msg is received,
 				 * resets the controls
 				 */
-				peers[sockfd-1].seqnumber_rx = 0;
-				peers[sockfd-1].offset_rx = 0;
+				peer->seqnumber_rx = 0;
+				peer->offset_rx = 0;
 			}
 			break;
 		}
+
+		if (p.pipe == 0)
+			/* Slave: taken from the ACK of one of its frames */
+			ack_received(peer, ipdu, len_rx);
+		else
+			/* Master: this frame got the loaded ACK payload */
+			ack_taken(spi_fd, sockfd, polled);
 	}
 
-	return 0;
+	return count;
+}
+
+/*
+ * Before retuning: the radio flushes its RX FIFO changing the channel,
+ * read the frames left first. Each pass reads the links in turn, frames
+ * of another pipe at the head of the FIFO waiting for theirs.
+ */
+static void radio_drain(int spi_fd)
+{
+	int pass, i, count, err;
+
+	for (pass = 0; pass < DRAIN_PASSES; pass++) {
+		count = 0;
+
+		/* Presence and CONNECT_REQ: left while one is pending */
+		while (comm->radio_channel == comm->channel_mgmt) {
+			err = read_mgmt(spi_fd);
+			if (err == -EAGAIN || err == -EBUSY)
+				break;
+
+			count++;
+		}
+
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			if (comm->peers[i].pipe != -1)
+				count += read_raw(spi_fd, comm->peers[i].pipe);
+		}
+
+		if (count == 0)
+			break;
+	}
 }
 
 /*
@@ -589,127 +2148,175 @@ static void presence_connect(int spi_fd)
 	struct nrf24_mac *payload =
 				(struct nrf24_mac *) opdu->payload;
 	size_t len;
-	static unsigned long start;
-	/* Start timeout */
-	static uint8_t state = PRESENCE;
 
-	switch (state) {
+	switch (comm->presence_state) {
 	case PRESENCE:
 		/* Send Presence */
-		if (addr_slave.address.uint64 == 0)
+		if (comm->addr_slave.address.uint64 == 0)
 			break;
 
 		p.pipe = 0;
 		opdu->type = NRF24_PDU_TYPE_PRESENCE;
-		payload->address.uint64 = addr_slave.address.uint64;
+		payload->address.uint64 = comm->addr_slave.address.uint64;
 		len = sizeof(struct nrf24_ll_mgmt_pdu)+sizeof(struct nrf24_mac);
+		radio_set_power(spi_fd, NRF24_POWER_0DBM);
 		phy_write(spi_fd, &p, len);
-		/* Init time */
-		start = hal_time_ms();
-		state = TIMEOUT_WINDOW;
+		/* Window and interval start together */
+		hal_timer_arm(&comm->window_timer, comm->window_bcast);
+		hal_timer_arm(&comm->interval_timer, comm->interval_bcast);
+		comm->presence_state = TIMEOUT_WINDOW;
 		break;
 	case TIMEOUT_WINDOW:
-		if (hal_timeout(hal_time_ms(), start, window_bcast) > 0)
-			state = STANDBY;
-
+		/* Waiting window_timer */
 		break;
 	case STANDBY:
 		phy_ioctl(spi_fd, NRF24_CMD_SET_STANDBY, NULL);
-		state = TIMEOUT_INTERVAL;
+		comm->presence_state = TIMEOUT_INTERVAL;
 		break;
 	case TIMEOUT_INTERVAL:
-		if (hal_timeout(hal_time_ms(), start, interval_bcast) > 0)
-			state = PRESENCE;
-
+		/* Waiting interval_timer */
 		break;
 	}
 }
 
-static void running(void)
+/* RAW slot: frames of the link and its data */
+static void raw_link(int sockfd)
 {
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
 
-	static int state = START_MGMT;
-	/* Index peers */
-	static int sockIndex = 1;
-	static unsigned long start;
+	/* Check if pipe is allocated */
+	if (peer->pipe != -1) {
+		read_raw(comm->driverIndex, sockfd);
+		/*
+		 * Links on other channels or at other rates wait for
+		 * their sub-slot, the master's data for the slave on a
+		 * new channel or at a new rate
+		 */
+		if (peer_tuned(peer)) {
+			if (comm->addr_slave.address.uint64 == 0)
+				channel_hop(peer);
+
+			write_ctrl(comm->driverIndex, sockfd);
+			if (!((peer->rate_check || peer->channel_check) &&
+				comm->addr_slave.address.uint64 == 0))
+				write_raw(comm->driverIndex, sockfd);
+		}
 
-	switch (state) {
+		/*
+		 * If keepalive is enabled
+		 * Check if timeout occurred and generates
+		 * disconnect event
+		 */
 
-	case START_MGMT:
-		/* Set channel to management channel */
-		phy_ioctl(driverIndex, NRF24_CMD_SET_CHANNEL, &channel_mgmt);
-		/* Start timeout */
-		start = hal_time_ms();
-		/* Go to next state */
-		state = MGMT;
-		break;
+		if (check_keepalive(comm->driverIndex, sockfd) == -ETIMEDOUT &&
+			comm->mgmt.len_rx == 0) {
 
-	case MGMT:
-		/* Check if 10ms timeout occurred */
-		if (hal_timeout(hal_time_ms(), start, MGMT_TIMEOUT) > 0)
-			state = START_RAW;
+			struct mgmt_nrf24_header *evt =
+				(struct mgmt_nrf24_header *)
+							comm->mgmt.buffer_rx;
 
-		if (listen)
-			presence_connect(driverIndex);
+			struct mgmt_evt_nrf24_disconnected *evt_discon =
+				(struct mgmt_evt_nrf24_disconnected *)
+								evt->payload;
 
-		read_mgmt(driverIndex);
-		write_mgmt(driverIndex);
-		break;
+			evt->opcode = MGMT_EVT_NRF24_DISCONNECTED;
 
-	case START_RAW:
-		/* Set channel to data channel */
-		phy_ioctl(driverIndex, NRF24_CMD_SET_CHANNEL, &channel_raw);
-		/* Start timeout */
-		start = hal_time_ms();
+			evt_discon->mac.address.uint64 =
+				peer->mac.address.uint64;
+			comm->mgmt.len_rx =
+				sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_evt_nrf24_disconnected);
 
-		/* Go to next state */
-		state = RAW;
-		break;
+			/* Notify again if peer remains silent */
+			peer->events &= ~PEER_EVT_TIMEOUT;
+			hal_timer_arm(&peer->timeout_timer,
+					NRF24_KEEPALIVE_TIMEOUT_MS);
 
-	case RAW:
-		/* Check if 60ms timeout occurred */
-		if (hal_timeout(hal_time_ms(), start, RAW_TIMEOUT) > 0)
-			state = START_MGMT;
+			/* TODO: Send disconnect packet to slave */
+		}
+	}
+}
 
-		/* Check if pipe is allocated */
-		if (peers[sockIndex-1].pipe != -1) {
-			read_raw(driverIndex, sockIndex);
-			write_raw(driverIndex, sockIndex);
+/*
+ * RAW slot starting: ms it lasts. Slave listening: up to an MGMT slot
+ * longer at random, its MGMT slots (and presences) don't stay out of
+ * the ones of the master.
+ */
+static uint32_t raw_slot(void)
+{
+	uint8_t jitter;
 
-			/*
-			 * If keepalive is enabled
-			 * Check if timeout occurred and generates
-			 * disconnect event
-			 */
+	if (comm->listen && comm->addr_slave.address.uint64 != 0) {
+		hal_getrandom(&jitter, sizeof(jitter));
+		return RAW_TIMEOUT + jitter % MGMT_TIMEOUT;
+	}
 
-			if (check_keepalive(driverIndex, sockIndex) == -ETIMEDOUT &&
-				mgmt.len_rx == 0) {
+	return RAW_TIMEOUT;
+}
 
-				struct mgmt_nrf24_header *evt =
-					(struct mgmt_nrf24_header *) mgmt.buffer_rx;
+static void running(void)
+{
+	int sockfd;
 
-				struct mgmt_evt_nrf24_disconnected *evt_discon =
-					(struct mgmt_evt_nrf24_disconnected *)evt->payload;
+	/* Expire keepalive, presence and slot timers */
+	hal_timer_run(hal_time_ms());
 
-				evt->opcode = MGMT_EVT_NRF24_DISCONNECTED;
+	/* One MGMT_EVT_NRF24_LINK_STATS at a time, the survey after */
+	if (comm->mgmt.len_rx == 0)
+		link_stats_evt();
+	if (comm->mgmt.len_rx == 0)
+		survey_evt();
 
-				evt_discon->mac.address.uint64 =
-					peers[sockIndex-1].mac.address.uint64;
-				mgmt.len_rx =
-					sizeof(struct mgmt_nrf24_header) +
-					sizeof(struct mgmt_evt_nrf24_disconnected);
+	switch (comm->state) {
 
-				peers[sockIndex-1].keepalive_wait
-					= hal_time_ms();
+	case START_MGMT:
+		/* Things connect at the base rate */
+		hal_timer_cancel(&comm->tune_timer);
+		/* Frames of the last RAW sub-slot read on its tune */
+		radio_drain(comm->driverIndex);
+		/* once the channel surveyed, if any, is sampled */
+		survey_slot(comm->driverIndex);
+		/* on the management channel */
+		radio_tune(comm->driverIndex, comm->channel_mgmt, RATE_BASE);
+		/* slot_timer switches to START_RAW after 10ms */
+		hal_timer_arm(&comm->slot_timer, MGMT_TIMEOUT);
+		/* Go to next state */
+		comm->state = MGMT;
+		break;
 
-				/* TODO: Send disconnect packet to slave */
-			}
-		}
+	case MGMT:
+		if (comm->listen)
+			presence_connect(comm->driverIndex);
+
+		read_mgmt(comm->driverIndex);
+		write_mgmt(comm->driverIndex);
+		break;
+
+	case START_RAW:
+		/* slot_timer switches to START_MGMT after 60ms */
+		hal_timer_arm(&comm->slot_timer, raw_slot());
+		/* Presences and CONNECT_REQ read on the management channel */
+		radio_drain(comm->driverIndex);
+		/*
+		 * First sub-slot: links on the data channel and at the rate
+		 * after the current ones
+		 */
+		tune_slot(comm->driverIndex);
 
-		sockIndex++;
-		/* Resets sockIndex if sockIndex > CONNECTION_COUNTER */
-		if (sockIndex > CONNECTION_COUNTER)
-			sockIndex = 1;
+		/* Go to next state */
+		comm->state = RAW;
+		break;
+
+	case RAW:
+		/* Every link on each call: their frames pile up otherwise */
+		for (sockfd = 1; sockfd <= CONNECTION_COUNTER; sockfd++)
+			raw_link(sockfd);
+
+		/* Once the frames heard on the tune of the sub-slot are read */
+		if (comm->tune_due) {
+			radio_drain(comm->driverIndex);
+			tune_slot(comm->driverIndex);
+		}
 
 		break;
 
@@ -719,16 +2326,41 @@ static void running(void)
 /* Global functions */
 int hal_comm_init(const char *pathname, struct nrf24_mac *mac)
 {
+	uint8_t i;
+
 	/* If driver not opened */
-	if (driverIndex != -1)
+	if (comm->driverIndex != -1)
 		return -EPERM;
 
 	/* Open driver and returns the driver index */
-	driverIndex = phy_open(pathname);
-	if (driverIndex < 0)
-		return driverIndex;
+	comm->driverIndex = phy_open(pathname);
+	if (comm->driverIndex < 0)
+		return comm->driverIndex;
+
+	comm->addr_gw.address.uint64 = mac->address.uint64;
 
-	addr_gw.address.uint64 = mac->address.uint64;
+	hal_timer_init(&comm->slot_timer, slot_expired, comm);
+	hal_timer_init(&comm->window_timer, window_expired, comm);
+	hal_timer_init(&comm->interval_timer, interval_expired, comm);
+	hal_timer_init(&comm->tune_timer, tune_expired, comm);
+
+	/* The driver opens the radio with the ARD by pipe index */
+	for (i = 0; i < CONNECTION_COUNTER; i++) {
+		comm->peers[i].retr.pipe = i + 1;
+		comm->peers[i].retr.ard = NRF24_RETR_PIPE;
+		comm->peers[i].retr.arc = RETR_ARC_MAX;
+	}
+
+	comm->state = START_MGMT;
+	comm->presence_state = PRESENCE;
+	/* The driver opens the radio at the base rate */
+	comm->radio_rate = RATE_BASE;
+	comm->tune_due = false;
+	/* on a channel set by the first slot */
+	comm->radio_channel = -1;
+	comm->tune_index = 0;
+	/* and at full power */
+	comm->radio_power = NRF24_POWER_0DBM;
 
 	return 0;
 }
@@ -739,21 +2371,40 @@ int hal_comm_deinit(void)
 	uint8_t i;
 
 	/* If try to close driver with no driver open */
-	if (driverIndex == -1)
+	if (comm->driverIndex == -1)
 		return -EPERM;
 
 	/* Clear all peers*/
 	for (i = 0; i < CONNECTION_COUNTER; i++) {
-		if (peers[i].pipe != -1)
-			peers[i].pipe = -1;
+		if (comm->peers[i].pipe != -1) {
+			peer_release(&comm->peers[i]);
+			comm->peers[i].pipe = -1;
+		}
 	}
+
+	hal_timer_cancel(&comm->slot_timer);
+	hal_timer_cancel(&comm->window_timer);
+	hal_timer_cancel(&comm->interval_timer);
+	hal_timer_cancel(&comm->tune_timer);
+
+	/* Management socket and pending PDUs: a new init starts clean */
+	comm->data_channels_count = 0;
+	comm->survey.channel = comm->survey.last + 1;
+	comm->survey.evt.count = 0;
+	comm->mgmt.pipe = -1;
+	comm->mgmt.len_rx = 0;
+	comm->mgmt.len_tx = 0;
+	comm->link_features = 0;
+	comm->ack_wait = ACK_WAIT_MS;
+	comm->retr_policy = NRF24_RETR_POLICY_PIPE;
+
 	/* Close driver */
-	err = phy_close(driverIndex);
+	err = phy_close(comm->driverIndex);
 	if (err < 0)
 		return err;
 
 	/* Dereferencing driverIndex */
-	driverIndex = -1;
+	comm->driverIndex = -1;
 
 	return err;
 }
@@ -768,25 +2419,25 @@ int hal_comm_socket(int domain, int protocol)
 		return -EPERM;
 
 	/* If not initialized */
-	if (driverIndex == -1)
+	if (comm->driverIndex == -1)
 		return -EPERM;	/* Operation not permitted */
 
 	switch (protocol) {
 
 	case HAL_COMM_PROTO_MGMT:
 		/* If Management, disable ACK and returns 0 */
-		if (mgmt.pipe == 0)
+		if (comm->mgmt.pipe == 0)
 			return -EUSERS; /* Returns too many users */
 		ap.ack = false;
 		retval = 0;
-		mgmt.pipe = 0;
+		comm->mgmt.pipe = 0;
 		break;
 
 	case HAL_COMM_PROTO_RAW:
-		if (mgmt.pipe == -1) {
+		if (comm->mgmt.pipe == -1) {
 			/* If Management is not open*/
 			ap.ack = false;
-			mgmt.pipe = 0;
+			comm->mgmt.pipe = 0;
 			retval = 0;
 			break;
 		}
@@ -811,33 +2462,237 @@ int hal_comm_socket(int domain, int protocol)
 	memcpy(ap.aa, aa_pipes[retval], sizeof(aa_pipes[retval]));
 
 	/* Open pipe */
-	phy_ioctl(driverIndex, NRF24_CMD_SET_PIPE, &ap);
+	phy_ioctl(comm->driverIndex, NRF24_CMD_SET_PIPE, &ap);
 
 	return retval;
 }
 
 int hal_comm_close(int sockfd)
 {
-	if (driverIndex == -1)
+	struct nrf24_data *peer;
+
+	if (comm->driverIndex == -1)
 		return -EPERM;
 
 	/* Pipe 0 is not closed because ACK arrives in this pipe */
-	if (sockfd >= 1 && sockfd <= 5 && peers[sockfd-1].pipe != -1) {
+	if (sockfd >= 1 && sockfd <= 5 && comm->peers[sockfd-1].pipe != -1) {
+		peer = &comm->peers[sockfd-1];
 		/* Send disconnect packet */
-		if (addr_slave.address.uint64 != 0)
+		if (comm->addr_slave.address.uint64 != 0)
 			/* Slave side */
-			write_disconnect(driverIndex, sockfd,
-					peers[sockfd-1].mac, addr_slave);
+			write_disconnect(comm->driverIndex, sockfd,
+					peer->mac, comm->addr_slave);
+		/* Message on the ACKs of the pipe */
+		if (peer->ack_loaded)
+			unload_ack(comm->driverIndex, sockfd);
 		/* Free pipe */
-		peers[sockfd-1].pipe = -1;
-		phy_ioctl(driverIndex, NRF24_CMD_RESET_PIPE, &sockfd);
-		/* Disable to send keep alive request */
-		peers[sockfd-1].keepalive = 0;
+		peer->pipe = -1;
+		phy_ioctl(comm->driverIndex, NRF24_CMD_RESET_PIPE, &sockfd);
+		/* Disable keepalive request and timeout */
+		peer_release(peer);
 	}
 
 	return 0;
 }
 
+static ssize_t write_mgmt_cmd(const void *buffer, size_t count)
+{
+	const struct mgmt_nrf24_header *hdr = buffer;
+	const struct mgmt_cmd_nrf24_link_features *features =
+		(const struct mgmt_cmd_nrf24_link_features *) hdr->payload;
+	const struct mgmt_cmd_nrf24_link_stats *stats =
+		(const struct mgmt_cmd_nrf24_link_stats *) hdr->payload;
+	const struct mgmt_cmd_nrf24_retr_policy *retr =
+		(const struct mgmt_cmd_nrf24_retr_policy *) hdr->payload;
+	const struct mgmt_cmd_nrf24_data_channels *channels =
+		(const struct mgmt_cmd_nrf24_data_channels *) hdr->payload;
+	const struct mgmt_cmd_nrf24_survey *cmd_survey =
+		(const struct mgmt_cmd_nrf24_survey *) hdr->payload;
+	struct nrf24_survey sample;
+	struct nrf24_data *peer;
+	uint8_t j;
+	int enable, rate = RATE_BASE, found = 0;
+	uint8_t i;
+
+	if (comm->driverIndex == -1)
+		return -EPERM;
+
+	if (count < sizeof(struct mgmt_nrf24_header))
+		return -EINVAL;
+
+	switch (hdr->opcode) {
+	case MGMT_CMD_NRF24_LINK_FEATURES:
+		if (count < sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_cmd_nrf24_link_features))
+			return -EINVAL;
+
+		/* Drivers without data rates (AIR0) keep the link rate */
+		if ((features->features & NRF24_LINK_F_RATE) &&
+				phy_ioctl(comm->driverIndex,
+					NRF24_CMD_SET_DATA_RATE, &rate) < 0)
+			return -EOPNOTSUPP;
+
+		/* Nor transmit power (AIR0) */
+		if ((features->features & NRF24_LINK_F_POWER) &&
+				phy_ioctl(comm->driverIndex, NRF24_CMD_SET_POWER,
+							&comm->radio_power) < 0)
+			return -EOPNOTSUPP;
+
+		/* Radios or drivers without ACK payloads keep basic links */
+		enable = !!(features->features & NRF24_LINK_F_ACK_PAY);
+		if (phy_ioctl(comm->driverIndex, NRF24_CMD_ENABLE_ACK_PAYLOAD,
+						&enable) < 0 && enable)
+			return -EOPNOTSUPP;
+
+		comm->link_features = features->features &
+				(NRF24_LINK_F_ACK_PAY | NRF24_LINK_F_RATE |
+				NRF24_LINK_F_POWER | NRF24_LINK_F_HOP);
+		comm->ack_wait = features->ack_wait ? features->ack_wait :
+								ACK_WAIT_MS;
+
+		/* Established links lose the features withdrawn */
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			if (comm->peers[i].ack_loaded)
+				unload_ack(comm->driverIndex, i + 1);
+			comm->peers[i].features &= comm->link_features;
+			/* Slaves still adapting recover by reconnecting */
+			if (!(comm->peers[i].features & NRF24_LINK_F_RATE))
+				comm->peers[i].rate = RATE_BASE;
+			if (!(comm->peers[i].features & NRF24_LINK_F_POWER))
+				peer_set_power(&comm->peers[i],
+							NRF24_POWER_0DBM);
+			if (!(comm->peers[i].features & NRF24_LINK_F_HOP)) {
+				hal_timer_cancel(&comm->peers[i].hop_timer);
+				comm->peers[i].events &= ~PEER_EVT_HOP;
+				comm->peers[i].ctrl &= ~PEER_CTRL_CHANNEL_IND;
+				comm->peers[i].channel_check = false;
+				comm->peers[i].channel =
+						comm->peers[i].channel_home;
+			}
+		}
+
+		/* Base rate set: the sub-slots start again */
+		if (comm->link_features & NRF24_LINK_F_RATE)
+			comm->radio_rate = RATE_BASE;
+		comm->tune_due = true;
+		break;
+	case MGMT_CMD_NRF24_LINK_STATS:
+		if (count < sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_cmd_nrf24_link_stats))
+			return -EINVAL;
+
+		/* Radio counters from now on */
+		comm->radio_stats = true;
+
+		/* Reported by running() as the management socket is read */
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			if (comm->peers[i].pipe == -1 ||
+					(stats->mac.address.uint64 != 0 &&
+					stats->mac.address.uint64 !=
+					comm->peers[i].mac.address.uint64))
+				continue;
+
+			comm->peers[i].events |= PEER_EVT_STATS;
+			found++;
+		}
+
+		if (found == 0 && stats->mac.address.uint64 != 0)
+			return -ENOENT;
+		break;
+	case MGMT_CMD_NRF24_RETR_POLICY:
+		if (count < sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_cmd_nrf24_retr_policy))
+			return -EINVAL;
+
+		if (retr->policy >= sizeof(retr_policies) /
+						sizeof(retr_policies[0]))
+			return -EINVAL;
+
+		/* Drivers without it (AIR0) keep their retransmissions */
+		if (retr->policy != NRF24_RETR_POLICY_PIPE &&
+				phy_ioctl(comm->driverIndex, NRF24_CMD_SET_RETR,
+						&comm->peers[0].retr) < 0)
+			return -EOPNOTSUPP;
+
+		/* Applied as the next frame of each link is sent */
+		comm->retr_policy = retr->policy;
+		break;
+	case MGMT_CMD_NRF24_DATA_CHANNELS:
+		if (count < sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_cmd_nrf24_data_channels))
+			return -EINVAL;
+
+		if (channels->count > NRF24_DATA_CHANNELS_MAX)
+			return -EINVAL;
+
+		for (i = 0; i < channels->count; i++) {
+			if (channels->channels[i] < NRF24_DATA_CH_MIN ||
+				channels->channels[i] > NRF24_DATA_CH_MAX ||
+				channels->channels[i] == comm->channel_mgmt)
+				return -EINVAL;
+		}
+
+		memcpy(comm->data_channels, channels->channels, channels->count);
+		comm->data_channels_count = channels->count;
+
+		/*
+		 * Hopping links leave the channels withdrawn as soon as no
+		 * other change is pending, the others keep theirs
+		 */
+		for (i = 0; i < CONNECTION_COUNTER; i++) {
+			peer = &comm->peers[i];
+			peer->hop_bad = 0;
+			if (peer->pipe == -1 || !comm->data_channels_count ||
+				!(peer->features & NRF24_LINK_F_HOP))
+				continue;
+
+			for (j = 0; j < comm->data_channels_count; j++) {
+				if (comm->data_channels[j] == peer->channel)
+					break;
+			}
+
+			if (j == comm->data_channels_count)
+				peer->events |= PEER_EVT_HOP;
+		}
+		break;
+	case MGMT_CMD_NRF24_SURVEY:
+		if (count < sizeof(struct mgmt_nrf24_header) +
+				sizeof(struct mgmt_cmd_nrf24_survey))
+			return -EINVAL;
+
+		if (cmd_survey->first < NRF24_DATA_CH_MIN ||
+			cmd_survey->first > cmd_survey->last ||
+			cmd_survey->last > NRF24_DATA_CH_MAX ||
+			cmd_survey->samples == 0 ||
+			cmd_survey->samples > NRF24_SURVEY_SAMPLES_MAX ||
+			cmd_survey->slots == 0)
+			return -EINVAL;
+
+		/* Radios without RPD (AIR0): no sample, the radio stays */
+		sample.channel = (comm->radio_channel < 0 ? comm->channel_mgmt :
+							comm->radio_channel);
+		sample.samples = 0;
+		if (phy_ioctl(comm->driverIndex, NRF24_CMD_SURVEY, &sample) < 0)
+			return -EOPNOTSUPP;
+
+		comm->radio_channel = sample.channel;
+
+		/* Sampled by running() before each MGMT slot */
+		memset(&comm->survey, 0, sizeof(comm->survey));
+		comm->survey.channel = cmd_survey->first;
+		comm->survey.last = cmd_survey->last;
+		comm->survey.samples = cmd_survey->samples;
+		comm->survey.slots = cmd_survey->slots;
+		comm->survey.evt.first = cmd_survey->first;
+		comm->survey.evt.last = cmd_survey->last;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return count;
+}
+
 ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
 {
 	size_t length = 0;
@@ -851,33 +2706,34 @@ ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
 	/* If management */
 	if (sockfd == 0) {
 		/* If has something to read */
-		if (mgmt.len_rx != 0) {
+		if (comm->mgmt.len_rx != 0) {
 			/*
 			 * If the amount of bytes available
 			 * to be read is greather than count
 			 * then read count bytes
 			 */
-			length = mgmt.len_rx > count ? count : mgmt.len_rx;
+			length = comm->mgmt.len_rx > count ? count :
+							comm->mgmt.len_rx;
 			/* Copy rx buffer */
-			memcpy(buffer, mgmt.buffer_rx, length);
+			memcpy(buffer, comm->mgmt.buffer_rx, length);
 
 			/* Reset rx len */
-			mgmt.len_rx = 0;
+			comm->mgmt.len_rx = 0;
 		} else /* Return -EAGAIN has nothing to be read */
 			return -EAGAIN;
 
-	} else if (peers[sockfd-1].len_rx != 0) {
+	} else if (comm->peers[sockfd-1].len_rx != 0) {
 		/*
 		 * If the amount of bytes available
 		 * to be read is greather than count
 		 * then read count bytes
 		 */
-		length = peers[sockfd-1].len_rx > count ?
-				 count : peers[sockfd-1].len_rx;
+		length = comm->peers[sockfd-1].len_rx > count ?
+				 count : comm->peers[sockfd-1].len_rx;
 		/* Copy rx buffer */
-		memcpy(buffer, peers[sockfd-1].buffer_rx, length);
+		memcpy(buffer, comm->peers[sockfd-1].buffer_rx, length);
 		/* Reset rx len */
-		peers[sockfd-1].len_rx = 0;
+		comm->peers[sockfd-1].len_rx = 0;
 	} else
 		return -EAGAIN;
 
@@ -892,16 +2748,21 @@ ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
 	/* Run background procedures */
 	running();
 
+	/* Management commands */
+	if (sockfd == 0 && count != 0)
+		return write_mgmt_cmd(buffer, count);
+
 	if (sockfd < 1 || sockfd > 5 || count == 0 || count > DATA_SIZE)
 		return -EINVAL;
 
 	/* If already has something to write then returns busy */
-	if (peers[sockfd-1].len_tx != 0)
+	if (comm->peers[sockfd-1].len_tx != 0)
 		return -EBUSY;
 
 	/* Copy data to be write in tx buffer */
-	memcpy(peers[sockfd-1].buffer_tx, buffer, count);
-	peers[sockfd-1].len_tx = count;
+	memcpy(comm->peers[sockfd-1].buffer_tx, buffer, count);
+	comm->peers[sockfd-1].len_tx = count;
+	comm->peers[sockfd-1].tx_failing = false;
 
 	return count;
 }
@@ -909,7 +2770,7 @@ ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
 int hal_comm_listen(int sockfd)
 {
 	/* Init listen */
-	listen = 1;
+	comm->listen = 1;
 
 	return 0;
 }
@@ -919,7 +2780,7 @@ int hal_comm_accept(int sockfd, uint64_t *addr)
 
 	/* TODO: Run background procedures */
 	struct mgmt_nrf24_header *evt =
-				(struct mgmt_nrf24_header *) mgmt.buffer_rx;
+			(struct mgmt_nrf24_header *) comm->mgmt.buffer_rx;
 	struct mgmt_evt_nrf24_connected *evt_connect =
 			(struct mgmt_evt_nrf24_connected *)evt->payload;
 	struct addr_pipe p_addr;
@@ -928,13 +2789,13 @@ int hal_comm_accept(int sockfd, uint64_t *addr)
 	running();
 
 	/* Save slave address */
-	addr_slave.address.uint64 = *addr;
+	comm->addr_slave.address.uint64 = *addr;
 
-	if (mgmt.len_rx == 0)
+	if (comm->mgmt.len_rx == 0)
 		return -EAGAIN;
 
 	/* Free management read to receive new packet */
-	mgmt.len_rx = 0;
+	comm->mgmt.len_rx = 0;
 
 	if (evt->opcode != MGMT_EVT_NRF24_CONNECTED ||
 		evt_connect->dst.address.uint64 != *addr)
@@ -946,22 +2807,35 @@ int hal_comm_accept(int sockfd, uint64_t *addr)
 		return -EUSERS; /* Returns too many users */
 
 	/* If accept then stop listen */
-	listen = 0;
+	comm->listen = 0;
 
 	/* Set aa in pipe */
 	p_addr.pipe = pipe;
 	memcpy(p_addr.aa, evt_connect->aa, sizeof(evt_connect->aa));
 	p_addr.ack = 1;
 	/*open pipe*/
-	phy_ioctl(driverIndex, NRF24_CMD_SET_PIPE, &p_addr);
+	phy_ioctl(comm->driverIndex, NRF24_CMD_SET_PIPE, &p_addr);
 
 	/* Source address for keepalive message */
-	peers[pipe-1].mac.address.uint64 =
+	comm->peers[pipe-1].mac.address.uint64 =
 		evt_connect->src.address.uint64;
+	/* Data channel the master assigns to the link */
+	if (evt_connect->channel >= NRF24_DATA_CH_MIN &&
+			evt_connect->channel <= NRF24_DATA_CH_MAX) {
+		comm->peers[pipe-1].channel = evt_connect->channel;
+		comm->peers[pipe-1].channel_home = evt_connect->channel;
+		comm->peers[pipe-1].channel_prev = evt_connect->channel;
+	}
+	comm->peers[pipe-1].channels_shared = comm->offered_channels > 1;
+	/* Features of CONNECT_REQ supported here: told to the master */
+	comm->peers[pipe-1].features =
+			comm->offered_features & comm->link_features;
+	if (comm->peers[pipe-1].features)
+		comm->peers[pipe-1].ctrl |= PEER_CTRL_FEATURE_IND;
 	/* Enable peer to send keep alive request */
-	peers[pipe-1].keepalive = 1;
+	comm->peers[pipe-1].keepalive = 1;
 	/* Start timeout */
-	peers[pipe-1].keepalive_wait = hal_time_ms();
+	peer_alive(&comm->peers[pipe-1]);
 
 	/* Return pipe */
 	return pipe;
@@ -972,23 +2846,36 @@ int hal_comm_connect(int sockfd, uint64_t *addr)
 {
 
 	struct nrf24_ll_mgmt_pdu *opdu =
-		(struct nrf24_ll_mgmt_pdu *)mgmt.buffer_tx;
+		(struct nrf24_ll_mgmt_pdu *)comm->mgmt.buffer_tx;
 	struct nrf24_ll_mgmt_connect *payload =
 				(struct nrf24_ll_mgmt_connect *) opdu->payload;
+	struct nrf24_data *peer = &comm->peers[sockfd-1];
 	size_t len;
 
 	/* Run background procedures */
 	running();
 
 	/* If already has something to write then returns busy */
-	if (mgmt.len_tx != 0)
+	if (comm->mgmt.len_tx != 0)
 		return -EBUSY;
 
 	opdu->type = NRF24_PDU_TYPE_CONNECT_REQ;
 
-	payload->src_addr = addr_gw;
+	payload->src_addr = comm->addr_gw;
 	payload->dst_addr.address.uint64 = *addr;
-	payload->channel = channel_raw;
+	/* Data channels in turn by pipe: links spread over them */
+	if (comm->data_channels_count)
+		peer->channel = comm->data_channels[(sockfd - 1) %
+						comm->data_channels_count];
+	else
+		peer->channel = comm->channel_raw;
+	peer->channel_home = peer->channel;
+	peer->channel_prev = peer->channel;
+	payload->channel = peer->channel;
+	payload->features = comm->link_features;
+	payload->channels = comm->data_channels_count;
+	peer->channels_shared = comm->data_channels_count > 1;
+	memset(payload->rfu, 0, sizeof(payload->rfu));
 	/*
 	 * Set in payload the addr to be set in client.
 	 * sockfd contains the pipe allocated for the client
@@ -996,20 +2883,140 @@ int hal_comm_connect(int sockfd, uint64_t *addr)
 	 */
 	memcpy(payload->aa, aa_pipes[sockfd],
 		sizeof(aa_pipes[sockfd]));
+	/* NRF24_LINK_F_HOP: each link its own sequence */
+	peer->hop = hop_seed(payload);
+	peer->hop_bad = 0;
 
 	/* Source address for keepalive message */
-	peers[sockfd-1].mac.address.uint64 = *addr;
+	peer->mac.address.uint64 = *addr;
 
 	len = sizeof(struct nrf24_ll_mgmt_connect);
 	len += sizeof(struct nrf24_ll_mgmt_pdu);
 
 	/* Start timeout */
-	peers[sockfd-1].keepalive_wait = hal_time_ms();
-	mgmt.len_tx = len;
+	peer_alive(peer);
+	comm->mgmt.len_tx = len;
 
 	return 0;
 }
 
+int hal_comm_next_timeout(void)
+{
+	uint32_t next, poll = HAL_TIMER_NONE;
+	bool listening = (comm->state == MGMT);
+	struct nrf24_data *peer;
+	int i;
+
+	if (comm->driverIndex < 0)
+		return -1;
+
+	/* Event for the management socket or slot to start */
+	if ((comm->mgmt.pipe == 0 && comm->mgmt.len_rx) ||
+		comm->state == START_MGMT || comm->state == START_RAW)
+		return 0;
+
+	/* Presence to send, or the radio to put in standby after it */
+	if (comm->state == MGMT && comm->listen &&
+		comm->addr_slave.address.uint64 != 0 &&
+		(comm->presence_state == PRESENCE ||
+					comm->presence_state == STANDBY))
+		return 0;
+
+	/* Kept by write_mgmt() while the radio refuses it */
+	if (comm->state == MGMT && comm->mgmt.len_tx)
+		poll = RADIO_POLL_MS;
+
+	/* Sub-slot of the next tune to start */
+	if (comm->state == RAW && comm->tune_due)
+		return 0;
+
+	for (i = 0; comm->state == RAW && i < CONNECTION_COUNTER; i++) {
+		peer = &comm->peers[i];
+		if (peer->pipe == -1)
+			continue;
+
+		/* Timeout flagged by timeout_timer */
+		if (peer->events & PEER_EVT_TIMEOUT)
+			return 0;
+
+		/* Links on other tunes: up to their sub-slot */
+		if (!peer_tuned(peer))
+			continue;
+
+		/* Keepalive request flagged by keepalive_timer */
+		if (peer->events & PEER_EVT_KEEPALIVE)
+			return 0;
+
+		/*
+		 * Control PDUs: kept by write_ctrl() while not acknowledged,
+		 * the master's next hop once no other change is pending
+		 */
+		if (peer->ctrl || (peer->events & PEER_EVT_HOP))
+			poll = RADIO_POLL_MS;
+
+		/*
+		 * Data to send: written by the next run, unless on the ACKs
+		 * (the slave frames take it) or held for RATE_IND or
+		 * CHANNEL_IND back
+		 */
+		if (peer->len_tx && (!peer->ack_loaded ||
+					(peer->events & PEER_EVT_ACK_WAIT)) &&
+				!((peer->rate_check || peer->channel_check) &&
+					comm->addr_slave.address.uint64 == 0)) {
+			/* Failing: sent again after a poll */
+			if (!peer->tx_failing)
+				return 0;
+			poll = RADIO_POLL_MS;
+		}
+
+		listening = true;
+	}
+
+	/* No IRQ line to wake the caller: the RX FIFO is polled */
+	if (listening &&
+		phy_ioctl(comm->driverIndex, NRF24_CMD_GET_IRQ, NULL) < 0)
+		poll = RADIO_POLL_MS;
+
+	next = hal_timer_next(hal_time_ms());
+	if (poll < next)
+		next = poll;
+
+	return (next == HAL_TIMER_NONE ? -1 : (int) next);
+}
+
+#ifndef ARDUINO
+struct nrf24_comm *nrf24_comm_new(void)
+{
+	static const struct nrf24_comm comm_init = COMM_INIT;
+	struct nrf24_comm *instance;
+
+	instance = malloc(sizeof(*instance));
+	if (instance == NULL)
+		return NULL;
+
+	memcpy(instance, &comm_init, sizeof(*instance));
+
+	return instance;
+}
+
+void nrf24_comm_free(struct nrf24_comm *instance)
+{
+	if (comm == instance)
+		comm = &comm_default;
+
+	free(instance);
+}
+
+struct nrf24_comm *nrf24_comm_select(struct nrf24_comm *instance)
+{
+	struct nrf24_comm *prev = comm;
+
+	comm = (instance ? instance : &comm_default);
+
+	return prev;
+}
+#endif
+
 int nrf24_str2mac(const char *str, struct nrf24_mac *mac)
 {
 	/* Parse the input string into 8 bytes */
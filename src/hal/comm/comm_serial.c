@@ -7,39 +7,389 @@
  *
  */
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef ARDUINO
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr_errno.h>
 #include <avr_unistd.h>
 #else
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #endif
 
-#include <stdint.h>
-
 /* FIXME: Remove this header */
 #include "include/nrf24.h"
 
 #include "include/comm.h"
+#include "serial_link.h"
+
+/*
+ * Ring buffers are filled and drained by the USART interrupts on AVR.
+ * On Linux the same rings are serviced by port_poll(), called from
+ * read and write: the upper layer doesn't see the difference.
+ * Indexes are free running, RING_SIZE must be a power of two.
+ */
+#ifdef ARDUINO
+#define SERIAL_CHANNELS		2
+#define RING_SIZE		64
+typedef uint8_t ring_index_t;
+#else
+#define SERIAL_CHANNELS		SERIAL_LINK_CHANNELS
+#define RING_SIZE		4096
+typedef uint16_t ring_index_t;
+#endif
+
+#define RING_MASK		(RING_SIZE - 1)
+/* Rings moved by read and write: nothing else to wait for */
+#define SERIAL_POLL_MS		1
+
+struct ring {
+	uint8_t buffer[RING_SIZE];
+	volatile ring_index_t head;	/* Written by the producer only */
+	volatile ring_index_t tail;	/* Written by the consumer only */
+};
+
+struct serial_channel {
+	bool used;
+	uint16_t rx_len;		/* 0: no message available */
+	uint8_t rx[SERIAL_LINK_MTU];
+};
+
+static struct ring rx_ring;
+static struct ring tx_ring;
+static struct serial_link_decoder decoder;
+static struct serial_channel channels[SERIAL_CHANNELS];
+/* Encoded frame and decoded payload scratch buffers */
+static uint8_t frame[SERIAL_LINK_FRAME_MAX];
+static uint8_t payload[SERIAL_LINK_MTU];
+static uint8_t held_channel;
+static int16_t held_len = -1;
+static bool initialized = false;
+
+#ifndef ARDUINO
+static int ttyfd = -1;
+#endif
+
+static inline ring_index_t ring_count(const struct ring *ring)
+{
+	return (ring_index_t) (ring->head - ring->tail);
+}
+
+static inline ring_index_t ring_space(const struct ring *ring)
+{
+	return RING_SIZE - ring_count(ring);
+}
+
+#ifdef ARDUINO
+#define BAUD_TO_UBRR(b)		((F_CPU + 4UL * (b)) / (8UL * (b)) - 1)
+
+ISR(USART_RX_vect)
+{
+	uint8_t byte = UDR0;
+
+	/* Overrun: the byte is lost, CRC discards the frame */
+	if (ring_space(&rx_ring) == 0)
+		return;
+
+	rx_ring.buffer[rx_ring.head & RING_MASK] = byte;
+	rx_ring.head++;
+}
+
+ISR(USART_UDRE_vect)
+{
+	if (ring_count(&tx_ring) == 0) {
+		/* Nothing left: disable data register empty interrupt */
+		UCSR0B &= ~(1 << UDRIE0);
+		return;
+	}
+
+	UDR0 = tx_ring.buffer[tx_ring.tail & RING_MASK];
+	tx_ring.tail++;
+}
+
+static int port_open(const char *pathname)
+{
+	unsigned long baud = SERIAL_LINK_BAUD_DEFAULT;
+
+	/* pathname carries the baud rate only: "1000000" */
+	if (pathname)
+		baud = strtoul(pathname, NULL, 10);
+
+	if (baud == 0)
+		return -EINVAL;
+
+	/* Double speed mode: 1 Mbaud is exact at 16 MHz */
+	UBRR0 = BAUD_TO_UBRR(baud);
+	UCSR0A = (1 << U2X0);
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+	sei();
+
+	return 0;
+}
+
+static void port_close(void)
+{
+	UCSR0B = 0;
+}
+
+static void port_poll(void)
+{
+}
+
+static void port_kick(void)
+{
+	UCSR0B |= (1 << UDRIE0);
+}
+
+static int port_wait(void)
+{
+	return 0;
+}
+#else
+static int port_open(const char *pathname)
+{
+	if (pathname == NULL)
+		return -EINVAL;
+
+	ttyfd = serial_link_open(pathname);
+
+	return ttyfd < 0 ? ttyfd : 0;
+}
+
+static void port_close(void)
+{
+	close(ttyfd);
+	ttyfd = -1;
+}
+
+/* Emulates the receive and transmit interrupts */
+static void port_poll(void)
+{
+	ring_index_t index, len;
+	ssize_t nbytes;
+
+	while (ring_space(&rx_ring) > 0) {
+		index = rx_ring.head & RING_MASK;
+		len = ring_space(&rx_ring);
+		if (len > RING_SIZE - index)
+			len = RING_SIZE - index;
+
+		nbytes = read(ttyfd, rx_ring.buffer + index, len);
+		if (nbytes <= 0)
+			break;
+
+		rx_ring.head += nbytes;
+	}
+
+	while (ring_count(&tx_ring) > 0) {
+		index = tx_ring.tail & RING_MASK;
+		len = ring_count(&tx_ring);
+		if (len > RING_SIZE - index)
+			len = RING_SIZE - index;
+
+		nbytes = write(ttyfd, tx_ring.buffer + index, len);
+		if (nbytes <= 0)
+			break;
+
+		tx_ring.tail += nbytes;
+	}
+}
+
+static void port_kick(void)
+{
+	port_poll();
+}
+
+/* Waits until the tty accepts more bytes */
+static int port_wait(void)
+{
+	struct pollfd pfd = { .fd = ttyfd, .events = POLLOUT };
+
+	if (poll(&pfd, 1, 10) < 0 && errno != EINTR)
+		return -errno;
+
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -EIO;
+
+	return 0;
+}
+#endif
+
+/* Delivers the held frame: returns false if its channel is still busy */
+static bool rx_deliver(void)
+{
+	struct serial_channel *ch;
+
+	if (held_len < 0)
+		return true;
+
+	ch = &channels[held_channel];
+	if (ch->used && ch->rx_len)
+		return false;
+
+	/* Frames to closed channels are dropped */
+	if (ch->used) {
+		memcpy(ch->rx, payload, held_len);
+		ch->rx_len = held_len;
+	}
+
+	held_len = -1;
+
+	return true;
+}
+
+/*
+ * Moves the received frames to their channels. A frame addressed to a
+ * channel not read yet is held back and the ring is no longer consumed:
+ * the backpressure reaches the peer instead of dropping messages.
+ */
+static void rx_dispatch(void)
+{
+	uint8_t byte;
+	ssize_t len;
+
+	while (rx_deliver() && ring_count(&rx_ring) > 0) {
+		byte = rx_ring.buffer[rx_ring.tail & RING_MASK];
+		rx_ring.tail++;
+
+		len = serial_link_decode(&decoder, byte, &held_channel,
+						payload, sizeof(payload));
+		if (len <= 0 || held_channel >= SERIAL_CHANNELS)
+			continue;
+
+		held_len = len;
+	}
+}
+
+int hal_comm_init(const char *pathname, struct nrf24_mac *mac)
+{
+	int err;
+
+	if (initialized)
+		return -EALREADY;
+
+	memset(channels, 0, sizeof(channels));
+	rx_ring.head = rx_ring.tail = 0;
+	tx_ring.head = tx_ring.tail = 0;
+	serial_link_decoder_init(&decoder);
+	held_len = -1;
+
+	/* mac is not applied to serial ports */
+	err = port_open(pathname);
+	if (err < 0)
+		return err;
+
+	initialized = true;
+
+	return 0;
+}
+
+int hal_comm_deinit(void)
+{
+	if (!initialized)
+		return -EPERM;
+
+	port_close();
+	initialized = false;
+
+	return 0;
+}
 
 int hal_comm_socket(int domain, int protocol)
 {
-	return -ENOSYS;
+	int i;
+
+	if (domain != HAL_COMM_PF_SERIAL)
+		return -EPERM;
+
+	if (!initialized)
+		return -EPERM;
+
+	/* Management commands and events are not applied to serial */
+	if (protocol != HAL_COMM_PROTO_RAW)
+		return -EPROTONOSUPPORT;
+
+	/* Logical channel multiplexed over the serial link */
+	for (i = 0; i < SERIAL_CHANNELS; i++) {
+		if (channels[i].used)
+			continue;
+
+		channels[i].used = true;
+		channels[i].rx_len = 0;
+		return i;
+	}
+
+	return -EUSERS;
 }
 
 int hal_comm_close(int sockfd)
 {
-	return -ENOSYS;
+	if (sockfd < 0 || sockfd >= SERIAL_CHANNELS || !channels[sockfd].used)
+		return -EBADF;
+
+	channels[sockfd].used = false;
+	channels[sockfd].rx_len = 0;
+
+	return 0;
 }
 
 ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
 {
-	return -ENOSYS;
+	struct serial_channel *ch;
+	size_t len;
+
+	if (sockfd < 0 || sockfd >= SERIAL_CHANNELS || !channels[sockfd].used)
+		return -EBADF;
+
+	port_poll();
+	rx_dispatch();
+
+	ch = &channels[sockfd];
+	if (ch->rx_len == 0)
+		return -EAGAIN;
+
+	len = ch->rx_len < count ? ch->rx_len : count;
+	memcpy(buffer, ch->rx, len);
+	ch->rx_len = 0;
+
+	return len;
 }
 
 ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
 {
-	return -ENOSYS;
+	ssize_t flen, i;
+	int err;
+
+	if (sockfd < 0 || sockfd >= SERIAL_CHANNELS || !channels[sockfd].used)
+		return -EBADF;
+
+	flen = serial_link_encode(sockfd, buffer, count, frame);
+	if (flen < 0)
+		return flen;
+
+	/* Blocking write: frames larger than the ring are streamed */
+	for (i = 0; i < flen; i++) {
+		while (ring_space(&tx_ring) == 0) {
+			port_kick();
+			err = port_wait();
+			if (err < 0)
+				return err;
+		}
+
+		tx_ring.buffer[tx_ring.head & RING_MASK] = frame[i];
+		tx_ring.head++;
+	}
+
+	port_kick();
+
+	return count;
 }
 
 int hal_comm_listen(int sockfd)
@@ -62,3 +412,11 @@ int hal_comm_connect(int sockfd, uint64_t *addr)
 
 	return -ENOSYS;
 }
+
+int hal_comm_next_timeout(void)
+{
+	if (!initialized)
+		return -1;
+
+	return SERIAL_POLL_MS;
+}
@@ -48,9 +48,13 @@ struct nrf24_ll_mgmt_pdu {
 struct nrf24_ll_mgmt_connect {
 	struct nrf24_mac src_addr;	/* Source address */
 	struct nrf24_mac dst_addr;	/* Destination address */
-	uint8_t channel;	/* nRF24 channel: nRF24 spec page 25 */
+	uint8_t channel;	/* Data channel of the link: nRF24 spec
+				   page 25 */
 	uint8_t aa[5];		/* Access Address: nRF24 spec page 28 */
-	uint64_t rfu;		/* Reserved for future use */
+	uint8_t features;	/* Offered by the master: NRF24_LINK_F_* */
+	uint8_t channels;	/* Data channels the master serves in turn,
+				   0: channel_raw only */
+	uint8_t rfu[6];		/* Reserved for future use */
 } __attribute__ ((packed));
 
 /*
@@ -75,7 +79,7 @@ struct nrf24_ll_mgmt_connect {
 struct nrf24_ll_data_pdu {
 	uint8_t lid:2;	/* 00 (data frag), 01 (data complete), 11: (control) */
 	uint8_t nseq:6;	/* Fragment sequence number */
-	uint8_t rfu;  /* Reserved for future use */
+	uint8_t rfu;  /* Reserved for future use, ACK payloads: message */
 	uint8_t payload[0];
 } __attribute__ ((packed));
 
@@ -119,3 +123,72 @@ struct nrf24_ll_disconnect {
 	struct nrf24_mac src_addr;	/* Source address */
 	struct nrf24_mac dst_addr;	/* Destination address */
 } __attribute__ ((packed));
+
+/*
+ * Slave to master, once connected: features of CONNECT_REQ the slave
+ * accepts. Old slaves don't send it, the link keeps the basic protocol.
+ */
+#define NRF24_LL_CRTL_OP_FEATURE_IND	0x05
+struct nrf24_ll_feature_ind {
+	uint8_t features;	/* NRF24_LINK_F_* */
+} __attribute__ ((packed));
+
+/*
+ * Slave to master, NRF24_LINK_F_ACK_PAY links: the master answers with
+ * the data fragment 'next' in the ACK of this or of the following slave
+ * frames. 'next' past the last fragment confirms the message. Messages
+ * are numbered (rfu of their data PDUs): the slave confirms again the
+ * copies of a message it has, a poll for an older message asks for the
+ * first fragment of the current one.
+ */
+#define NRF24_LL_CRTL_OP_ACK_POLL	0x06
+struct nrf24_ll_ack_poll {
+	uint8_t next;		/* Fragment (nseq) expected */
+	uint8_t msg;		/* Message of the fragment */
+} __attribute__ ((packed));
+
+/*
+ * NRF24_LINK_F_RATE links: data rate (NRF24_RATE_*) of the link from
+ * now on. The master switches once the PDU is acknowledged, the slave
+ * on reception and sends it back at the new rate: failing that, each
+ * side returns to the previous rate. NRF24_RATE_FAILS failures in a row,
+ * spread over NRF24_RATE_FAILS_MS at least (the master serves the other
+ * rates and MGMT meanwhile), bring both sides down to 250kbps, the
+ * longest range.
+ */
+#define NRF24_LL_CRTL_OP_RATE_IND	0x07
+struct nrf24_ll_rate_ind {
+	uint8_t rate;		/* NRF24_RATE_* */
+} __attribute__ ((packed));
+
+#define NRF24_RATE_FAILS		8
+#define NRF24_RATE_FAILS_MS		70
+
+/*
+ * NRF24_LINK_F_POWER links, both ways: share of the last
+ * NRF24_POWER_WINDOW frames of the peer received above -64dBm (RPD),
+ * sent as it crosses NRF24_POWER_RPD. The peer lowers its TX power only
+ * while it is above, and goes back up on retransmissions.
+ */
+#define NRF24_LL_CRTL_OP_POWER_IND	0x08
+struct nrf24_ll_power_ind {
+	uint8_t rpd;		/* Percent */
+} __attribute__ ((packed));
+
+#define NRF24_POWER_WINDOW		16
+#define NRF24_POWER_RPD			75
+
+/*
+ * NRF24_LINK_F_HOP links: data channel of the link from now on, as
+ * RATE_IND: the master switches once the PDU is acknowledged, the slave
+ * on reception and sends it back on the new channel. The master not
+ * receiving it announces the previous channel on the new one, the slave
+ * returns to it after NRF24_CHANNEL_FAILS failures in a row. As many
+ * failures otherwise bring both sides back to the channel of CONNECT_REQ.
+ */
+#define NRF24_LL_CRTL_OP_CHANNEL_IND	0x09
+struct nrf24_ll_channel_ind {
+	uint8_t channel;
+} __attribute__ ((packed));
+
+#define NRF24_CHANNEL_FAILS		8
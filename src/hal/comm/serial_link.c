@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "include/avr_errno.h"
+#include "include/avr_unistd.h"
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#endif
+
+#include "serial_link.h"
+
+#define CRC16_INIT		0xFFFF
+#define CRC16_POLY		0x1021
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+	uint8_t i;
+
+	while (len--) {
+		crc ^= (uint16_t) *data++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY :
+								crc << 1;
+	}
+
+	return crc;
+}
+
+/* Consistent Overhead Byte Stuffing: removes all 0x00 from data */
+static size_t cobs_encode(const uint8_t *data, size_t len, uint8_t *out)
+{
+	size_t code_idx = 0, out_idx = 1, i;
+	uint8_t code = 1;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] != 0) {
+			out[out_idx++] = data[i];
+			code++;
+		}
+
+		if (data[i] == 0 || code == 0xFF) {
+			out[code_idx] = code;
+			code = 1;
+			code_idx = out_idx++;
+		}
+	}
+
+	out[code_idx] = code;
+
+	return out_idx;
+}
+
+/* Decoding in place is safe: output never gets ahead of input */
+static ssize_t cobs_decode(uint8_t *data, size_t len)
+{
+	size_t in_idx = 0, out_idx = 0;
+	uint8_t code, i;
+
+	while (in_idx < len) {
+		code = data[in_idx++];
+		if (code == 0 || in_idx + code - 1 > len)
+			return -EBADMSG;
+
+		for (i = 1; i < code; i++)
+			data[out_idx++] = data[in_idx++];
+
+		/* Implicit zero, except after a full block or at the end */
+		if (code != 0xFF && in_idx < len)
+			data[out_idx++] = 0;
+	}
+
+	return out_idx;
+}
+
+void serial_link_decoder_init(struct serial_link_decoder *dec)
+{
+	dec->len = 0;
+	dec->discard = false;
+	dec->errors = 0;
+}
+
+ssize_t serial_link_encode(uint8_t channel, const void *payload,
+					size_t len, uint8_t *frame)
+{
+	uint8_t raw[SERIAL_LINK_RAW_MAX];
+	uint16_t crc;
+	size_t flen;
+
+	if (len > SERIAL_LINK_MTU)
+		return -EINVAL;
+
+	raw[0] = channel;
+	memcpy(raw + 1, payload, len);
+	crc = crc16(CRC16_INIT, raw, len + 1);
+	raw[len + 1] = crc & 0xFF;
+	raw[len + 2] = crc >> 8;
+
+	flen = cobs_encode(raw, len + 3, frame);
+	frame[flen++] = SERIAL_LINK_DELIMITER;
+
+	return flen;
+}
+
+ssize_t serial_link_decode(struct serial_link_decoder *dec, uint8_t byte,
+			uint8_t *channel, void *payload, size_t size)
+{
+	ssize_t rlen;
+	uint16_t crc;
+
+	if (byte != SERIAL_LINK_DELIMITER) {
+		if (dec->discard)
+			return -EAGAIN;
+
+		if (dec->len == sizeof(dec->buffer)) {
+			/* Frame too long: drop it */
+			dec->discard = true;
+			dec->errors++;
+			return -EBADMSG;
+		}
+
+		dec->buffer[dec->len++] = byte;
+		return -EAGAIN;
+	}
+
+	/* End of frame */
+	if (dec->discard || dec->len == 0) {
+		dec->discard = false;
+		dec->len = 0;
+		return -EAGAIN;
+	}
+
+	rlen = cobs_decode(dec->buffer, dec->len);
+	dec->len = 0;
+
+	if (rlen < 3)
+		goto invalid;
+
+	crc = dec->buffer[rlen - 2] | (dec->buffer[rlen - 1] << 8);
+	if (crc != crc16(CRC16_INIT, dec->buffer, rlen - 2))
+		goto invalid;
+
+	rlen -= 3;
+	if ((size_t) rlen > size)
+		goto invalid;
+
+	*channel = dec->buffer[0];
+	memcpy(payload, dec->buffer + 1, rlen);
+
+	return rlen;
+
+invalid:
+	dec->errors++;
+	return -EBADMSG;
+}
+
+#ifndef ARDUINO
+static speed_t baud2speed(unsigned long baud)
+{
+	switch (baud) {
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+	case 115200:
+		return B115200;
+	case 230400:
+		return B230400;
+	case 460800:
+		return B460800;
+	case 500000:
+		return B500000;
+	case 921600:
+		return B921600;
+	case 1000000:
+		return B1000000;
+	}
+
+	return B0;
+}
+
+int serial_link_open(const char *pathname)
+{
+	char path[64];
+	struct termios term;
+	unsigned long baud = SERIAL_LINK_BAUD_DEFAULT;
+	speed_t speed;
+	char *sep;
+	int fd, err;
+
+	strncpy(path, pathname, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+
+	/* Optional baud rate suffix: /dev/ttyUSB0:1000000 */
+	sep = strrchr(path, ':');
+	if (sep) {
+		*sep = '\0';
+		baud = strtoul(sep + 1, NULL, 10);
+	}
+
+	speed = baud2speed(baud);
+	if (speed == B0)
+		return -EINVAL;
+
+	fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (tcgetattr(fd, &term) < 0)
+		goto fail;
+
+	/* 8N1, no flow control, no line processing */
+	cfmakeraw(&term);
+	term.c_cflag &= ~(CSTOPB | CRTSCTS);
+	term.c_cflag |= CREAD | CLOCAL;
+	/* Non-blocking reads: frames are reassembled by the decoder */
+	term.c_cc[VMIN] = 0;
+	term.c_cc[VTIME] = 0;
+
+	cfsetospeed(&term, speed);
+	cfsetispeed(&term, speed);
+
+	tcflush(fd, TCIOFLUSH);
+	if (tcsetattr(fd, TCSANOW, &term) < 0)
+		goto fail;
+
+	return fd;
+
+fail:
+	err = -errno;
+	close(fd);
+	return err;
+}
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#ifndef __SERIAL_LINK_H__
+#define __SERIAL_LINK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Serial link frame: COBS encoded [channel][payload][CRC16], followed
+ * by a 0x00 delimiter. CRC16-CCITT (0x1021, initial value 0xFFFF) is
+ * computed over channel and payload and sent LSB first. Channels
+ * multiplex several logical links (things) over one serial port.
+ */
+#ifdef ARDUINO
+#define SERIAL_LINK_MTU			128	/* Things: RAM bound */
+#else
+#define SERIAL_LINK_MTU			257	/* Largest KNoT message */
+#endif
+#define SERIAL_LINK_CHANNELS		8
+#define SERIAL_LINK_DELIMITER		0x00
+#define SERIAL_LINK_BAUD_DEFAULT	115200
+
+/* channel + payload + CRC16, COBS overhead and delimiter */
+#define SERIAL_LINK_RAW_MAX		(SERIAL_LINK_MTU + 3)
+#define SERIAL_LINK_FRAME_MAX		(SERIAL_LINK_RAW_MAX + \
+					(SERIAL_LINK_RAW_MAX / 254) + 2)
+
+struct serial_link_decoder {
+	uint8_t buffer[SERIAL_LINK_FRAME_MAX];
+	size_t len;
+	bool discard;		/* Overflow: skip until next delimiter */
+	uint32_t errors;	/* CRC and framing errors */
+};
+
+void serial_link_decoder_init(struct serial_link_decoder *dec);
+
+/* Returns the amount of bytes written to frame, delimiter included */
+ssize_t serial_link_encode(uint8_t channel, const void *payload,
+					size_t len, uint8_t *frame);
+
+/*
+ * Feeds one byte to the decoder. Returns the payload length and sets
+ * channel when a frame is completed, -EAGAIN if more bytes are needed
+ * or -EBADMSG if the frame is invalid.
+ */
+ssize_t serial_link_decode(struct serial_link_decoder *dec, uint8_t byte,
+			uint8_t *channel, void *payload, size_t size);
+
+#ifndef ARDUINO
+/* Opens "path[:baud]" in raw non-blocking mode. Returns fd or -errno */
+int serial_link_open(const char *pathname);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SERIAL_LINK_H__ */
@@ -23,6 +23,37 @@ uint32_t hal_time_us(void)
 	return micros();
 }
 
+/*
+ * millis() wraps after ~49 days and micros() after ~71 minutes: the
+ * high word is extended on each wrap. Callers must sample the clock at
+ * least once per wrap period.
+ */
+uint64_t hal_time64_ms(void)
+{
+	static uint32_t last, high;
+	uint32_t now = millis();
+
+	if (now < last)
+		high++;
+
+	last = now;
+
+	return ((uint64_t) high << 32) | now;
+}
+
+uint64_t hal_time64_us(void)
+{
+	static uint32_t last, high;
+	uint32_t now = micros();
+
+	if (now < last)
+		high++;
+
+	last = now;
+
+	return ((uint64_t) high << 32) | now;
+}
+
 void hal_delay_ms(uint32_t ms)
 {
 	delay(ms);
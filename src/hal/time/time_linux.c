@@ -11,54 +11,98 @@
 #include <inttypes.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
 
 #include <linux/random.h>
 #include <sys/syscall.h>
 #include "include/time.h"
 
-#define MS 1
-#define US 0
+#define NSEC_PER_USEC		1000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define NSEC_PER_SEC		1000000000ULL
 
-static uint32_t get_time(uint8_t unit)
+/*
+ * Wakeup latency of clock_nanosleep() is in the order of 50-100us on
+ * the RPi. Delays are slept until this slack before the deadline and
+ * the remaining time is spun, keeping short delays (TSTBY2A: 130us)
+ * accurate.
+ */
+#define DELAY_SLACK_NS		(100 * NSEC_PER_USEC)
+
+/*
+ * CLOCK_MONOTONIC is not affected by NTP steps or settimeofday():
+ * time based timeouts (keepalive, slots) must not jump.
+ */
+static uint64_t get_time_ns(void)
 {
 	struct timespec spec;
-	uint32_t t;
-	long mult, div;
 
-	clock_gettime(CLOCK_REALTIME, &spec);
+	clock_gettime(CLOCK_MONOTONIC, &spec);
 
-	if (unit) {
-		mult = 1000;
-		div = 1.0e6;
-	} else {
-		mult = 1.0e6;
-		div = 1.0e3;
-	}
+	return (uint64_t) spec.tv_sec * NSEC_PER_SEC + spec.tv_nsec;
+}
+
+static void delay_ns(uint64_t ns)
+{
+	struct timespec deadline;
+	uint64_t end, wakeup;
+
+	end = get_time_ns() + ns;
 
-	t = (uint32_t)(spec.tv_sec * mult);
-	t += (uint32_t)(spec.tv_nsec / div);
+	if (ns > DELAY_SLACK_NS) {
+		wakeup = end - DELAY_SLACK_NS;
+		deadline.tv_sec = wakeup / NSEC_PER_SEC;
+		deadline.tv_nsec = wakeup % NSEC_PER_SEC;
 
-	return t;
+		/* Absolute deadline: restarting after a signal is safe */
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&deadline, NULL) == EINTR)
+			;
+	}
+
+	/* Spin the remaining sub-slack tail */
+	while (get_time_ns() < end)
+		;
 }
 
 uint32_t hal_time_ms(void)
 {
-	return get_time(MS);
+	return (uint32_t) (get_time_ns() / NSEC_PER_MSEC);
 }
 
 uint32_t hal_time_us(void)
 {
-	return get_time(US);
+	return (uint32_t) (get_time_ns() / NSEC_PER_USEC);
+}
+
+uint64_t hal_time64_ms(void)
+{
+	return get_time_ns() / NSEC_PER_MSEC;
+}
+
+uint64_t hal_time64_us(void)
+{
+	return get_time_ns() / NSEC_PER_USEC;
 }
 
 void hal_delay_ms(uint32_t ms)
 {
-	usleep(ms * 1000);
+	struct timespec deadline;
+	uint64_t end;
+
+	/* Millisecond delays don't need the spinning tail */
+	end = get_time_ns() + ms * NSEC_PER_MSEC;
+	deadline.tv_sec = end / NSEC_PER_SEC;
+	deadline.tv_nsec = end % NSEC_PER_SEC;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&deadline, NULL) == EINTR)
+		;
 }
 
 void hal_delay_us(uint32_t us)
 {
-	usleep(us);
+	delay_ns(us * NSEC_PER_USEC);
 }
 
 int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout)
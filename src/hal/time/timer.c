@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "include/time.h"
+#include "include/timer.h"
+
+/*
+ * Hierarchical timing wheel: 4 levels of 64 slots. Level 0 has 1ms
+ * resolution, level N slots span 64^N ms. Timers are placed by their
+ * distance to the wheel time and cascaded to the lower level when the
+ * wheel reaches their slot. Maximum timeout: 64^4 ms (~4.6 hours).
+ */
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+#define WHEEL_RANGE		(1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define LEVEL_SHIFT(l)		(WHEEL_BITS * (l))
+#define LEVEL_INDEX(t, l)	(((t) >> LEVEL_SHIFT(l)) & WHEEL_MASK)
+
+static struct hal_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+/* Next tick (ms) to be processed */
+static uint32_t wheel_time;
+/* Amount of armed timers */
+static uint16_t pending;
+
+static void timer_link(struct hal_timer *timer)
+{
+	struct hal_timer **slot;
+	uint32_t expires = timer->expires;
+	uint32_t delta = expires - wheel_time;
+	uint8_t level;
+
+	/* Already expired: run on the next tick */
+	if ((int32_t) delta < 0) {
+		expires = wheel_time;
+		delta = 0;
+	}
+
+	/* Out of range: clamp to the farthest slot */
+	if (delta >= WHEEL_RANGE) {
+		delta = WHEEL_RANGE - 1;
+		expires = wheel_time + delta;
+		timer->expires = expires;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (1UL << LEVEL_SHIFT(level + 1)))
+			break;
+	}
+
+	slot = &wheel[level][LEVEL_INDEX(expires, level)];
+
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void timer_unlink(struct hal_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* Moves the timers of a slot to the lower levels */
+static uint8_t cascade(uint8_t level, uint8_t index)
+{
+	struct hal_timer *timer, *list = wheel[level][index];
+
+	wheel[level][index] = NULL;
+
+	while (list) {
+		timer = list;
+		list = list->next;
+		timer_link(timer);
+	}
+
+	return index;
+}
+
+void hal_timer_init(struct hal_timer *timer, hal_timer_func_t func,
+							void *user_data)
+{
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expires = 0;
+	timer->func = func;
+	timer->user_data = user_data;
+}
+
+void hal_timer_arm(struct hal_timer *timer, uint32_t timeout_ms)
+{
+	uint32_t now = hal_time_ms();
+
+	if (timer->pprev)
+		timer_unlink(timer);
+	else
+		pending++;
+
+	/* Idle wheel: nothing to catch up, restart from now */
+	if (pending == 1)
+		wheel_time = now;
+
+	timer->expires = now + timeout_ms;
+	timer_link(timer);
+}
+
+void hal_timer_cancel(struct hal_timer *timer)
+{
+	if (timer->pprev == NULL)
+		return;
+
+	timer_unlink(timer);
+	pending--;
+}
+
+int hal_timer_pending(const struct hal_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+uint32_t hal_timer_run(uint32_t now)
+{
+	struct hal_timer *timer, *list;
+	uint8_t index, level;
+
+	while (pending && (int32_t) (now - wheel_time) >= 0) {
+		index = LEVEL_INDEX(wheel_time, 0);
+
+		/* Level N+1 cascades when level N wraps around */
+		for (level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+			index = cascade(level, LEVEL_INDEX(wheel_time, level));
+
+		index = LEVEL_INDEX(wheel_time, 0);
+		list = wheel[0][index];
+		wheel[0][index] = NULL;
+		if (list)
+			list->pprev = &list;
+
+		/* Timers armed from callbacks belong to the next ticks */
+		wheel_time++;
+
+		while (list) {
+			timer = list;
+			timer_unlink(timer);
+			pending--;
+			timer->func(timer, timer->user_data);
+		}
+	}
+
+	if (pending == 0)
+		wheel_time = now + 1;
+
+	return hal_timer_next(now);
+}
+
+uint32_t hal_timer_next(uint32_t now)
+{
+	uint32_t tick, next = HAL_TIMER_NONE, step;
+	uint8_t level, i;
+
+	if (pending == 0)
+		return HAL_TIMER_NONE;
+
+	/*
+	 * Bounded scan: first non empty slot of each level. Higher
+	 * levels report their cascade time, a lower bound of the
+	 * deadline of their timers.
+	 */
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		step = 1UL << LEVEL_SHIFT(level);
+		/* First tick aligned to this level, at or after wheel_time */
+		tick = (wheel_time + step - 1) & ~(step - 1);
+
+		for (i = 0; i < WHEEL_SIZE; i++, tick += step) {
+			if (wheel[level][LEVEL_INDEX(tick, level)] == NULL)
+				continue;
+
+			if (next == HAL_TIMER_NONE ||
+					(int32_t) (tick - next) < 0)
+				next = tick;
+			break;
+		}
+	}
+
+	if (next == HAL_TIMER_NONE)
+		return HAL_TIMER_NONE;
+
+	return (int32_t) (next - now) > 0 ? next - now : 0;
+}
@@ -32,11 +32,27 @@ static const pipe_reg_t pipe_reg[] = {
 	{ NRF24_AA_P5, NRF24_EN_RXADDR_P5, NRF24_RX_ADDR_P5, NRF24_RX_PW_P5 }
 };
 
+/*
+ * SETUP_RETR written by nrf24l01_set_ptx() for the pipes set in
+ * retr_pipes, the others use the ARD computed from the pipe index.
+ */
+static uint8_t pipe_retr[NRF24_PIPE_MAX + 1];
+static uint8_t retr_pipes;
+
+/* RF_SETUP power written by nrf24l01_set_ptx() once changed */
+static uint8_t tx_power = NRF24_POWER;
+static bool tx_power_due;
+
+/* Frames of each pipe still in the RX FIFO at a channel change */
+static uint32_t rx_flushed[NRF24_PIPE_MAX + 1];
+
 #define DATA_SIZE	sizeof(uint8_t)
 
 /* Time delay in microseconds (us) */
 #define TPD2STBY	5000
 #define TSTBY2A		130
+/* RX time before RPD is valid (Tdelay_AGC) */
+#define TRPD		40
 
 /* Send to spi transfer the read command
 * return the value that was read in reg
@@ -175,6 +191,8 @@ int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr)
 	value = inr(spi_fd, NRF24_RF_SETUP) & ~NRF24_RF_SETUP_MASK;
 	outr(spi_fd, NRF24_RF_SETUP, value | NRF24_RF_DR(NRF24_DATA_RATE)|
 			NRF24_RF_PWR(tx_pwr));
+	tx_power = tx_pwr;
+	tx_power_due = false;
 
 	/* Set address widths */
 	value = inr(spi_fd, NRF24_SETUP_AW) & ~NRF24_SETUP_AW_MASK;
@@ -189,8 +207,9 @@ int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr)
 
 	delay_us(TPD2STBY);
 
-	/* Disable Auto Retransmit Count */
+	/* Disable Auto Retransmit Count, ARD by pipe index */
 	outr(spi_fd, NRF24_SETUP_RETR, NRF24_RETR_ARC(NRF24_ARC_DISABLE));
+	retr_pipes = 0;
 
 	/* Disable all Auto Acknowledgment of pipes */
 	outr(spi_fd, NRF24_EN_AA, inr(spi_fd, NRF24_EN_AA)
@@ -203,7 +222,8 @@ int8_t nrf24l01_init(const char *dev, uint8_t tx_pwr)
 	/*
 	 * Features available:
 	 * EN_DPL Enable dynamic payload to all pipes -> Enable
-	 * EN_ACK_PAY: Enables Payload with ACK -> Disable
+	 * EN_ACK_PAY: Enables Payload with ACK -> Disable, see
+	 *	nrf24l01_set_ack_payload()
 	 * EN_DYN_ACK: Enables the W_TX_PAYLOAD_NOACK command -> Disable
 	 */
 
@@ -258,10 +278,14 @@ int8_t nrf24l01_deinit(int8_t spi_fd)
 * Bandwidth < 2MHz at 2Mbps
 * 2Mbps -> channel max is 54
 * 1Mbps -> channel max is 116
+* Changing the channel discards the frames left in the RX FIFO, see
+* nrf24l01_rx_flushed(), and the TX FIFO.
 */
 int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch)
 {
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
 	uint8_t max;
+	int8_t pipe;
 
 	max = NRF24_RF_DR(inr(spi_fd, NRF24_RF_SETUP)) == NRF24_DR_2MBPS ?
 			NRF24_CH_MAX_2MBPS : NRF24_CH_MAX_1MBPS;
@@ -271,6 +295,13 @@ int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch)
 
 	if (ch != NRF24_CH(inr(spi_fd, NRF24_RF_CH))) {
 		set_standby1();
+		/* Read out one by one to count them, FLUSH_RX the rest */
+		pipe = nrf24l01_prx_pipe_available(spi_fd);
+		while (pipe != NRF24_NO_PIPE && nrf24l01_prx_data(spi_fd,
+					payload, sizeof(payload)) > 0) {
+			rx_flushed[pipe]++;
+			pipe = nrf24l01_prx_pipe_available(spi_fd);
+		}
 		outr(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR
 			| NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
 		command(spi_fd, NRF24_FLUSH_TX);
@@ -282,6 +313,199 @@ int8_t nrf24l01_set_channel(int8_t spi_fd, uint8_t ch)
 	return 0;
 }
 
+/*
+* nrf24l01_set_data_rate:
+* dr: NRF24_DR_250KBPS, NRF24_DR_1MBPS or NRF24_DR_2MBPS.
+* Both ends of a link must use the same data rate.
+* 2Mbps occupies 2MHz: the current channel must be <= 54
+*/
+int8_t nrf24l01_set_data_rate(int8_t spi_fd, uint8_t dr)
+{
+	uint8_t value;
+
+	if (dr != NRF24_DR_250KBPS && dr != NRF24_DR_1MBPS &&
+						dr != NRF24_DR_2MBPS)
+		return -1;
+
+	if (dr == NRF24_DR_2MBPS &&
+		NRF24_CH(inr(spi_fd, NRF24_RF_CH)) > NRF24_CH_MAX_2MBPS)
+		return -1;
+
+	set_standby1();
+	value = inr(spi_fd, NRF24_RF_SETUP) & ~NRF24_RF_DR_MASK;
+	outr(spi_fd, NRF24_RF_SETUP, value | dr);
+
+	return 0;
+}
+
+/*
+* nrf24l01_set_power:
+* pwr: NRF24_PWR_18DBM to NRF24_PWR_0DBM, output power of the
+* frames sent from the next nrf24l01_set_ptx on. The ACKs sent
+* as PRX go out at the power of the last transmission.
+*/
+int8_t nrf24l01_set_power(int8_t spi_fd, uint8_t pwr)
+{
+	if (pwr > NRF24_PWR_0DBM)
+		return -1;
+
+	if (pwr != tx_power) {
+		tx_power = pwr;
+		tx_power_due = true;
+	}
+
+	return 0;
+}
+
+/*
+* nrf24l01_set_retr:
+* Auto Retransmit Delay (NRF24_ARD_*: (ard + 1) * 250us) and
+* Count (0 <= arc <= 15) used when transmitting on pipe, applied
+* by the next nrf24l01_set_ptx. NRF24_RETR_DEFAULT as ard restores
+* the delay by pipe index.
+*/
+int8_t nrf24l01_set_retr(int8_t spi_fd, uint8_t pipe, uint8_t ard,
+								uint8_t arc)
+{
+	if (pipe > NRF24_PIPE_MAX)
+		return -1;
+
+	if (ard == NRF24_RETR_DEFAULT) {
+		retr_pipes &= ~(1 << pipe);
+		return 0;
+	}
+
+	if (ard > NRF24_RETR_ARD_RD(NRF24_RETR_ARD_MASK) ||
+					arc > NRF24_RETR_ARC_MASK)
+		return -1;
+
+	pipe_retr[pipe] = NRF24_RETR_ARD(ard) | NRF24_RETR_ARC(arc);
+	retr_pipes |= 1 << pipe;
+
+	return 0;
+}
+
+/*
+* nrf24l01_observe_tx:
+* OBSERVE_TX of the last transmission: NRF24_OBSERVE_TX_ARC gives
+* the retransmissions, NRF24_OBSERVE_TX_PLOS the packets lost since
+* the last channel change.
+*/
+int8_t nrf24l01_observe_tx(int8_t spi_fd)
+{
+	return inr(spi_fd, NRF24_OBSERVE_TX);
+}
+
+/*
+* nrf24l01_rpd:
+* 1 if the last packet received was above -64dBm, 0 otherwise. The
+* nRF24L01 (not +) has Carrier Detect at this address instead.
+*/
+int8_t nrf24l01_rpd(int8_t spi_fd)
+{
+	return inr(spi_fd, NRF24_RPD) & NRF24_RPD_MASK;
+}
+
+/*
+* nrf24l01_rx_flushed:
+* Frames received on pipe and discarded by nrf24l01_set_channel() since
+* the start: the caller reads them first to keep them.
+*/
+uint32_t nrf24l01_rx_flushed(int8_t spi_fd, uint8_t pipe)
+{
+	return pipe > NRF24_PIPE_MAX ? 0 : rx_flushed[pipe];
+}
+
+/*
+* nrf24l01_survey:
+* Listens samples times on ch and returns how many found a carrier
+* above -64dBm (RPD), -1 if ch is out of range. RPD is cleared when
+* the receiver leaves RX, so each sample re-enters it. The radio is
+* left in Standby-I on ch, with the FIFOs flushed if ch changed.
+*/
+int8_t nrf24l01_survey(int8_t spi_fd, uint8_t ch, uint8_t samples)
+{
+	int8_t hits = 0;
+
+	if (nrf24l01_set_channel(spi_fd, ch) < 0)
+		return -1;
+
+	set_standby1();
+	outr(spi_fd, NRF24_CONFIG, inr(spi_fd, NRF24_CONFIG)
+			| NRF24_CFG_PRIM_RX);
+
+	for (; samples > 0; samples--) {
+		enable();
+		delay_us(TSTBY2A + TRPD);
+		if (nrf24l01_rpd(spi_fd))
+			hits++;
+		disable();
+	}
+
+	return hits;
+}
+
+/*
+* nrf24l01_set_ack_payload:
+* Enables or disables the payloads carried by the ACKs (EN_ACK_PAY).
+* Returns -1 if the radio doesn't keep the feature: nRF24L01 (not +)
+* without ACTIVATE, emulators. See the PA+LNA note in nrf24l01_init().
+*/
+int8_t nrf24l01_set_ack_payload(int8_t spi_fd, bool enable)
+{
+	uint8_t value;
+
+	set_standby1();
+
+	value = inr(spi_fd, NRF24_FEATURE) & ~NRF24_FT_EN_ACK_PAY;
+	if (enable)
+		value |= NRF24_FT_EN_ACK_PAY;
+	outr(spi_fd, NRF24_FEATURE, value);
+
+	if (!enable)
+		command(spi_fd, NRF24_FLUSH_TX);
+
+	if ((inr(spi_fd, NRF24_FEATURE) & NRF24_FT_EN_ACK_PAY) !=
+				(enable ? NRF24_FT_EN_ACK_PAY : 0))
+		return -1;
+
+	return 0;
+}
+
+/*
+* nrf24l01_prx_ack_data:
+* Payload of the next ACK sent on pipe (PRX, EN_ACK_PAY). The ACK
+* payloads wait in the TX FIFO (3 entries): a PTX transmission would
+* send them first, nrf24l01_flush_ack_data() them before.
+* Returns 1: TX FIFO full or 0: available locations.
+*/
+int8_t nrf24l01_prx_ack_data(int8_t spi_fd, uint8_t pipe, void *pdata,
+								uint16_t len)
+{
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
+
+	if (pipe > NRF24_PIPE_MAX || pdata == NULL || len == 0 ||
+						len > NRF24_PAYLOAD_SIZE)
+		return -1;
+
+	/* spi_transfer() overwrites the buffer */
+	memcpy(payload, pdata, len);
+
+	return ST_TX_STATUS(command_data(spi_fd, NRF24_W_ACK_PAYLOAD(pipe),
+							payload, len));
+}
+
+/*
+* nrf24l01_flush_ack_data:
+* Drops the ACK payloads not sent yet
+*/
+int8_t nrf24l01_flush_ack_data(int8_t spi_fd)
+{
+	command(spi_fd, NRF24_FLUSH_TX);
+
+	return 0;
+}
+
 /*
 * nrf24l01_open_pipe:
 * 0 <= pipe <= 5
@@ -371,10 +595,18 @@ int8_t nrf24l01_set_ptx(int8_t spi_fd, uint8_t pipe)
 		* retry periods to reduce data collisions
 		* compute ARD range: 1500us <= ARD[pipe] <= 4000us
 		*/
-		outr(spi_fd, NRF24_SETUP_RETR,
-			NRF24_RETR_ARD(((pipe * 2) + 5))
-			| NRF24_RETR_ARC(NRF24_ARC));
+		if (retr_pipes & (1 << pipe))
+			outr(spi_fd, NRF24_SETUP_RETR, pipe_retr[pipe]);
+		else
+			outr(spi_fd, NRF24_SETUP_RETR,
+				NRF24_RETR_ARD(((pipe * 2) + 5))
+				| NRF24_RETR_ARC(NRF24_ARC));
 	#endif
+	if (tx_power_due) {
+		outr(spi_fd, NRF24_RF_SETUP, (inr(spi_fd, NRF24_RF_SETUP)
+				& ~NRF24_RF_PWR_MASK) | NRF24_RF_PWR(tx_power));
+		tx_power_due = false;
+	}
 	outr(spi_fd, NRF24_STATUS, NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
 	outr(spi_fd, NRF24_CONFIG, inr(spi_fd, NRF24_CONFIG)
 			& ~NRF24_CFG_PRIM_RX);
@@ -467,6 +699,59 @@ int8_t nrf24l01_prx_pipe_available(int8_t spi_fd)
 	return (int8_t)pipe;
 }
 
+/*
+* nrf24l01_set_promisc:
+* Receives frames for any access address: 2 bytes addresses (SETUP_AW
+* 0b00, not documented) matching the noise before the preamble, 0x00,
+* then the preamble, 0xAA or 0x55 by the first address bit. The RX
+* payload holds the air frame: address, 9 bits control field, payload
+* and CRC. CRC, dynamic payloads and Auto Acknowledgment are disabled:
+* read with nrf24l01_prx_raw(). nrf24l01_init() restores the setup.
+*/
+int8_t nrf24l01_set_promisc(int8_t spi_fd)
+{
+	/* Noise byte first on air: the LSB is written first */
+	uint8_t addr0[2] = { 0xAA, 0x00 };
+	uint8_t addr1[2] = { 0x55, 0x00 };
+
+	set_standby1();
+
+	outr(spi_fd, NRF24_CONFIG, inr(spi_fd, NRF24_CONFIG)
+			& ~(NRF24_CFG_EN_CRC | NRF24_CFG_CRCO));
+	outr(spi_fd, NRF24_SETUP_AW, NRF24_AW_INVALID);
+	outr(spi_fd, NRF24_FEATURE, inr(spi_fd, NRF24_FEATURE)
+			& ~NRF24_FT_EN_DPL);
+	outr(spi_fd, NRF24_DYNPD, inr(spi_fd, NRF24_DYNPD)
+			& ~NRF24_DYNPD_MASK);
+	outr(spi_fd, NRF24_EN_AA, inr(spi_fd, NRF24_EN_AA)
+			& ~NRF24_EN_AA_MASK);
+
+	outr_data(spi_fd, NRF24_RX_ADDR_P0, addr0, sizeof(addr0));
+	outr_data(spi_fd, NRF24_RX_ADDR_P1, addr1, sizeof(addr1));
+	outr(spi_fd, NRF24_RX_PW_P0, NRF24_PAYLOAD_SIZE);
+	outr(spi_fd, NRF24_RX_PW_P1, NRF24_PAYLOAD_SIZE);
+	outr(spi_fd, NRF24_EN_RXADDR, (inr(spi_fd, NRF24_EN_RXADDR)
+			& ~NRF24_EN_RXADDR_MASK) | NRF24_EN_RXADDR_P0
+			| NRF24_EN_RXADDR_P1);
+
+	command(spi_fd, NRF24_FLUSH_RX);
+
+	return 0;
+}
+
+/*
+* nrf24l01_prx_raw:
+* Reads a NRF24_PAYLOAD_SIZE bytes static payload
+* (nrf24l01_set_promisc), returns its size
+*/
+int8_t nrf24l01_prx_raw(int8_t spi_fd, void *pdata)
+{
+	outr(spi_fd, NRF24_STATUS, NRF24_ST_RX_DR);
+	command_data(spi_fd, NRF24_R_RX_PAYLOAD, pdata, NRF24_PAYLOAD_SIZE);
+
+	return NRF24_PAYLOAD_SIZE;
+}
+
 /*nrf24l01_prx_data:
 * return the len of data received
 * Send command to read data width for the RX FIFO
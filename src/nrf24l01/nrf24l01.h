@@ -22,6 +22,9 @@
 /* Auto Retransmit Delay => 4 ms */
 #define NRF24_ARD		NRF24_ARD_40000US
 
+/* nrf24l01_set_retr: back to the retransmission setup by pipe index */
+#define NRF24_RETR_DEFAULT	0xff
+
 /* Address width is 5 bytes */
 #define NRF24_ADDR_WIDTHS		5
 
@@ -62,6 +65,20 @@ int8_t nrf24l01_set_prx(int8_t spi_fd, uint8_t *pipe0_addr);
 int8_t nrf24l01_prx_pipe_available(int8_t spi_fd);
 int8_t nrf24l01_prx_data(int8_t spi_fd, void *pdata, uint16_t len);
 int8_t nrf24l01_set_standby(int8_t spi_fd);
+int8_t nrf24l01_set_data_rate(int8_t spi_fd, uint8_t dr);
+int8_t nrf24l01_set_power(int8_t spi_fd, uint8_t pwr);
+int8_t nrf24l01_set_retr(int8_t spi_fd, uint8_t pipe, uint8_t ard,
+								uint8_t arc);
+int8_t nrf24l01_observe_tx(int8_t spi_fd);
+int8_t nrf24l01_rpd(int8_t spi_fd);
+int8_t nrf24l01_survey(int8_t spi_fd, uint8_t ch, uint8_t samples);
+uint32_t nrf24l01_rx_flushed(int8_t spi_fd, uint8_t pipe);
+int8_t nrf24l01_set_ack_payload(int8_t spi_fd, bool enable);
+int8_t nrf24l01_prx_ack_data(int8_t spi_fd, uint8_t pipe, void *pdata,
+								uint16_t len);
+int8_t nrf24l01_flush_ack_data(int8_t spi_fd);
+int8_t nrf24l01_set_promisc(int8_t spi_fd);
+int8_t nrf24l01_prx_raw(int8_t spi_fd, void *pdata);
 
 #ifdef __cplusplus
 } // extern "C"
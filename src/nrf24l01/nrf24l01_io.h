@@ -124,6 +124,19 @@
 #define NRF24_RETR_ARC(v)	(v & NRF24_RETR_ARC_MASK)
 #define NRF24_ARC_DISABLE				0b0000
 
+/* Transmit observe: lost packets (PLOS) and retransmissions (ARC) */
+#define NRF24_OBSERVE_TX			0x08
+#define NRF24_OBSERVE_TX_PLOS_MASK	0b11110000
+#define NRF24_OBSERVE_TX_ARC_MASK	0b00001111
+/* Packets lost after MAX_RT, cleared by writing RF_CH */
+#define NRF24_OBSERVE_TX_PLOS(v)	((v & NRF24_OBSERVE_TX_PLOS_MASK) >> 4)
+/* Retransmissions of the current packet */
+#define NRF24_OBSERVE_TX_ARC(v)	(v & NRF24_OBSERVE_TX_ARC_MASK)
+
+/* Received Power Detector: above -64dBm, latched on reception (+ only) */
+#define NRF24_RPD				0x09
+#define NRF24_RPD_MASK			0b00000001
+
 /* Setup of address widths (reset value: 0b00000011) */
 #define NRF24_SETUP_AW				0x03
 #define NRF24_SETUP_AW_RST		0b00000011
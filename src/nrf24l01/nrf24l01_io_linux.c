@@ -13,6 +13,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include "include/time.h"
 #include "nrf24l01_io.h"
 #include "spi.h"
 
@@ -61,12 +62,13 @@ static volatile unsigned	*gpio;
 
 void delay_us(float us)
 {
-	usleep(us);
+	/* usleep() overshoots TSTBY2A (130us) by 50-100us */
+	hal_delay_us(us);
 }
 
 void delay_ms(float ms)
 {
-	usleep((ms)*1000);
+	hal_delay_ms(ms);
 }
 
 void enable(void)
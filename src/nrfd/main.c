@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -33,15 +34,57 @@ static const char *opt_cfg = "/etc/knot/gatewayConfig.json";
 static const char *opt_host = NULL;
 static unsigned int opt_port = 9000;
 static const char *opt_spi = "/dev/spidev0.0";
+static const char *opt_radio = "NRF0";
 static int opt_channel = -1;
 static int opt_dbm = -255;
 static const char *opt_nodes = "/etc/knot/keys.json";
+static gboolean opt_ack_payload = FALSE;
+static gboolean opt_rate = FALSE;
+static gboolean opt_adaptive_retr = FALSE;
+static gboolean opt_power = FALSE;
+static struct mgmt_cmd_nrf24_data_channels opt_data_channels;
+static gboolean opt_hop = FALSE;
+static int opt_stats = 0;
+static int opt_survey = 0;
 
 static void sig_term(int sig)
 {
 	g_main_loop_quit(main_loop);
 }
 
+/* "10,40,70": rejected unless each one is a data channel */
+static gboolean parse_data_channels(const char *key, const char *value,
+					gpointer user_data, GError **gerr)
+{
+	struct mgmt_cmd_nrf24_data_channels *dc = &opt_data_channels;
+	const char *str = value;
+	char *end;
+	long ch;
+
+	dc->count = 0;
+	do {
+		errno = 0;
+		ch = strtol(str, &end, 10);
+		if (errno || end == str || (*end && *end != ',') ||
+				ch < NRF24_DATA_CH_MIN ||
+				ch > NRF24_DATA_CH_MAX ||
+				dc->count == NRF24_DATA_CHANNELS_MAX) {
+			g_set_error(gerr, G_OPTION_ERROR,
+				G_OPTION_ERROR_BAD_VALUE,
+				"%s %s: up to %d channels, %d to %d", key,
+				value, NRF24_DATA_CHANNELS_MAX,
+				NRF24_DATA_CH_MIN, NRF24_DATA_CH_MAX);
+			dc->count = 0;
+			return FALSE;
+		}
+
+		dc->channels[dc->count++] = ch;
+		str = end + 1;
+	} while (*end);
+
+	return TRUE;
+}
+
 /* Struct with the mac address of the known peers */
 static struct nrf24_mac known_peers[MAX_NODES];
 
@@ -59,6 +102,8 @@ static GOptionEntry options[] = {
 					"port", "Remote port" },
 	{ "spi", 'i', 0, G_OPTION_ARG_STRING, &opt_spi,
 					"spi", "SPI device path" },
+	{ "radio", 'r', 0, G_OPTION_ARG_STRING, &opt_radio,
+		"driver", "NRF0 (SPI, default) or AIR0 (tools/etherd)" },
 	{ "nodes", 'n', 0, G_OPTION_ARG_STRING, &opt_nodes,
 					"nodes", "Known nodes file path" },
 	{ "channel", 'c', 0, G_OPTION_ARG_INT, &opt_channel,
@@ -66,6 +111,23 @@ static GOptionEntry options[] = {
 	{ "tx", 't', 0, G_OPTION_ARG_INT, &opt_dbm,
 					"tx_power",
 		"TX power: transmition signal strength in dBm" },
+	{ "ack-payload", 'a', 0, G_OPTION_ARG_NONE, &opt_ack_payload,
+		NULL, "Downlink data on the ACKs of the things that accept" },
+	{ "rate", 'R', 0, G_OPTION_ARG_NONE, &opt_rate,
+		NULL, "Data rate of each link adapted to its retransmissions" },
+	{ "adaptive-retr", 'A', 0, G_OPTION_ARG_NONE, &opt_adaptive_retr,
+		NULL, "Retransmit delay and count adapted to each link" },
+	{ "power", 'P', 0, G_OPTION_ARG_NONE, &opt_power,
+		NULL, "TX power of each link lowered while it stays clean" },
+	{ "data-channels", 'd', 0, G_OPTION_ARG_CALLBACK, parse_data_channels,
+		"ch,ch,...", "Data channels of the links, in turn" },
+	{ "hop", 'H', 0, G_OPTION_ARG_NONE, &opt_hop,
+		NULL, "Links hop along the data channels" },
+	{ "stats", 's', 0, G_OPTION_ARG_INT, &opt_stats,
+		"seconds", "Prints the counters of each link periodically" },
+	{ "survey", 'S', 0, G_OPTION_ARG_INT, &opt_survey,
+		"seconds", "Data channels moved to the quietest, surveyed "
+			"at startup and periodically (followed with --hop)" },
 	{ NULL },
 };
 
@@ -178,11 +240,16 @@ int main(int argc, char *argv[])
 	printf("KNOT HAL phynrfd\n");
 	if (opt_host)
 		printf("Development mode: %s:%u\n", opt_host, opt_port);
-	else
+	else if (strcmp(opt_radio, "NRF0") == 0)
 		printf("Native SPI mode\n");
+	else
+		printf("Radio: %s\n", opt_radio);
 
-	err = manager_start(opt_cfg, opt_host, opt_port, opt_spi, opt_channel,
-								opt_dbm);
+	err = manager_start(opt_cfg, opt_host, opt_port, opt_spi, opt_radio,
+				opt_channel, opt_dbm, opt_ack_payload, opt_rate,
+				opt_adaptive_retr, opt_power,
+				&opt_data_channels, opt_hop, opt_stats,
+				opt_survey);
 	if (err < 0) {
 		g_main_loop_unref(main_loop);
 		return EXIT_FAILURE;
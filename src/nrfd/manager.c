@@ -8,6 +8,8 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -31,8 +33,22 @@
 
 #define KNOTD_UNIX_ADDRESS		"knot"
 #define MAX_PEERS 5
+#define RADIO_IDLE_MS		10	/* hal_comm without a deadline */
+#define SURVEY_SAMPLES		16	/* Per MGMT slot: ~3ms */
+#define SURVEY_SLOTS		2	/* Per channel: a sweep takes ~15s */
+#define SURVEY_MIGRATE		10	/* %: busier than the quietest */
+#define SURVEY_MGMT_BUSY	20	/* %: things may not connect */
 static int mgmtfd;
 static guint mgmtwatch;
+static guint statswatch;
+static guint surveywatch;
+
+/* Channel survey: busy share (%) of each channel, last sweep */
+static uint8_t survey_busy[NRF24_DATA_CH_MAX + 1];
+static bool survey_running;
+/* Data channels in use: as many as configured, one by default */
+static struct mgmt_cmd_nrf24_data_channels survey_dc;
+static uint8_t survey_count;
 
 struct peer {
 	uint64_t mac;
@@ -244,6 +260,155 @@ static int8_t clients_read()
 	return 0;
 }
 
+static void evt_link_stats(struct mgmt_nrf24_header *mhdr)
+{
+	struct mgmt_evt_nrf24_link_stats *evt =
+			(struct mgmt_evt_nrf24_link_stats *) mhdr->payload;
+	struct nrf24_mac mac;
+	char mac_str[24];
+
+	/* Packed event: the member may be unaligned */
+	memcpy(&mac, &evt->mac, sizeof(mac));
+	nrf24_mac2str(&mac, mac_str);
+	printf("%s: TX %u/%u (%u retransmits) RX %u (%u dropped, "
+		"%u flushed) RPD %u/%u airtime %u ms in %u s, rate %u "
+		"power %u channel %u\n",
+		mac_str, evt->tx_frames, evt->tx_frames + evt->tx_lost,
+		evt->retransmits, evt->rx_frames, evt->rx_dropped,
+		evt->rx_flushed, evt->rpd_high, evt->rpd_samples,
+		evt->airtime / 1000, evt->duration / 1000, evt->rate,
+		evt->power, evt->channel);
+}
+
+/* Data channels given to the things connecting, in turn */
+static int radio_data_channels(const struct mgmt_cmd_nrf24_data_channels *dc)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_data_channels)];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	mhdr->opcode = MGMT_CMD_NRF24_DATA_CHANNELS;
+	memcpy(mhdr->payload, dc, sizeof(*dc));
+
+	len = hal_comm_write(mgmtfd, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* A 2Mbps link takes two channels, and carriers spill over */
+static uint8_t busy_around(uint8_t ch)
+{
+	uint8_t busy = survey_busy[ch];
+
+	if (ch > NRF24_DATA_CH_MIN && survey_busy[ch - 1] > busy)
+		busy = survey_busy[ch - 1];
+	if (ch < NRF24_DATA_CH_MAX && survey_busy[ch + 1] > busy)
+		busy = survey_busy[ch + 1];
+
+	return busy;
+}
+
+/* Quietest channels, at least 3 apart and from the management one */
+static void survey_pick(struct mgmt_cmd_nrf24_data_channels *dc)
+{
+	int i, ch, best;
+
+	for (dc->count = 0; dc->count < survey_count; dc->count++) {
+		best = -1;
+		for (ch = NRF24_DATA_CH_MIN; ch <= NRF24_DATA_CH_MAX; ch++) {
+			if (abs(ch - NRF24_MGMT_CHANNEL) < 3)
+				continue;
+
+			for (i = 0; i < dc->count; i++) {
+				if (abs(ch - dc->channels[i]) < 3)
+					break;
+			}
+
+			if (i < dc->count)
+				continue;
+
+			if (best < 0 || busy_around(ch) < busy_around(best))
+				best = ch;
+		}
+
+		if (best < 0)
+			break;
+
+		dc->channels[dc->count] = best;
+	}
+}
+
+/* Busiest of the data channels, 0 if none */
+static uint8_t survey_worst(const struct mgmt_cmd_nrf24_data_channels *dc)
+{
+	uint8_t worst = 0;
+	int i;
+
+	for (i = 0; i < dc->count; i++) {
+		if (busy_around(dc->channels[i]) > worst)
+			worst = busy_around(dc->channels[i]);
+	}
+
+	return worst;
+}
+
+/*
+ * Survey done: the data channels move to the quietest ones once they
+ * are SURVEY_MIGRATE busier. Links of NRF24_LINK_F_HOP (--hop) follow,
+ * the others keep their channel until they reconnect.
+ */
+static void survey_done(void)
+{
+	struct mgmt_cmd_nrf24_data_channels dc;
+	uint8_t busy;
+	int i, err;
+
+	survey_running = false;
+
+	busy = busy_around(NRF24_MGMT_CHANNEL);
+	if (busy >= SURVEY_MGMT_BUSY)
+		fprintf(stderr, "Management channel %d %u%% busy\n",
+					NRF24_MGMT_CHANNEL, busy);
+
+	survey_pick(&dc);
+	if (dc.count == 0 || (survey_dc.count &&
+			survey_worst(&survey_dc) < survey_worst(&dc) +
+							SURVEY_MIGRATE))
+		return;
+
+	err = radio_data_channels(&dc);
+	if (err < 0) {
+		fprintf(stderr, "Data channels: %s(%d)\n", strerror(-err),
+									-err);
+		return;
+	}
+
+	survey_dc = dc;
+
+	printf("Data channels:");
+	for (i = 0; i < dc.count; i++)
+		printf(" %u (%u%% busy)", dc.channels[i],
+					busy_around(dc.channels[i]));
+	printf("\n");
+}
+
+static void evt_survey(struct mgmt_nrf24_header *mhdr)
+{
+	struct mgmt_evt_nrf24_survey *evt =
+			(struct mgmt_evt_nrf24_survey *) mhdr->payload;
+
+	if (evt->first < NRF24_DATA_CH_MIN || evt->count >
+			NRF24_DATA_CH_MAX - evt->first + 1)
+		return;
+
+	memcpy(&survey_busy[evt->first], evt->busy, evt->count);
+
+	if (evt->first + evt->count > evt->last)
+		survey_done();
+}
+
 static int8_t mgmt_read(void)
 {
 
@@ -280,23 +445,131 @@ static int8_t mgmt_read(void)
 	case MGMT_EVT_NRF24_DISCONNECTED:
 		evt_disconnected(mhdr);
 		break;
+
+	case MGMT_EVT_NRF24_LINK_STATS:
+		evt_link_stats(mhdr);
+		break;
+
+	case MGMT_EVT_NRF24_SURVEY:
+		evt_survey(mhdr);
+		break;
 	}
 	return 0;
 }
 
-static gboolean read_idle(gpointer user_data)
+/* Runs the radio when it has work to do, sleeps in between */
+static gboolean read_timeout(gpointer user_data)
 {
+	int timeout;
+
 	mgmt_read();
 	clients_read();
+
+	timeout = hal_comm_next_timeout();
+	if (timeout < 0)
+		timeout = RADIO_IDLE_MS;
+
+	mgmtwatch = g_timeout_add(timeout, read_timeout, NULL);
+
+	return FALSE;
+}
+
+/* Offers ACK payloads to the things connecting from now on */
+static int radio_link_features(uint8_t features)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_link_features)];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct mgmt_cmd_nrf24_link_features *cmd =
+		(struct mgmt_cmd_nrf24_link_features *) mhdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	mhdr->opcode = MGMT_CMD_NRF24_LINK_FEATURES;
+	cmd->features = features;
+
+	len = hal_comm_write(mgmtfd, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* ARD and ARC of the frames sent to the things */
+static int radio_retr_policy(uint8_t policy)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_retr_policy)];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct mgmt_cmd_nrf24_retr_policy *cmd =
+		(struct mgmt_cmd_nrf24_retr_policy *) mhdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	mhdr->opcode = MGMT_CMD_NRF24_RETR_POLICY;
+	cmd->policy = policy;
+
+	len = hal_comm_write(mgmtfd, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* Counters of every link, reported as MGMT_EVT_NRF24_LINK_STATS */
+static gboolean stats_timeout(gpointer user_data)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_link_stats)];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+
+	memset(buffer, 0, sizeof(buffer));
+	mhdr->opcode = MGMT_CMD_NRF24_LINK_STATS;
+	hal_comm_write(mgmtfd, buffer, sizeof(buffer));
+
 	return TRUE;
 }
 
-static int radio_init(const char *spi, uint8_t channel, uint8_t rfpwr,
-							struct nrf24_mac *mac)
+/* Carrier sense of the data channels, reported as MGMT_EVT_NRF24_SURVEY */
+static int radio_survey(void)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_survey)];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct mgmt_cmd_nrf24_survey *cmd =
+		(struct mgmt_cmd_nrf24_survey *) mhdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	mhdr->opcode = MGMT_CMD_NRF24_SURVEY;
+	cmd->first = NRF24_DATA_CH_MIN;
+	cmd->last = NRF24_DATA_CH_MAX;
+	cmd->samples = SURVEY_SAMPLES;
+	cmd->slots = SURVEY_SLOTS;
+
+	len = hal_comm_write(mgmtfd, buffer, sizeof(buffer));
+	if (len < 0)
+		return len;
+
+	survey_running = true;
+
+	return 0;
+}
+
+/* A new survey once the previous one is done */
+static gboolean survey_timeout(gpointer user_data)
+{
+	if (!survey_running)
+		radio_survey();
+
+	return TRUE;
+}
+
+static int radio_init(const char *spi, const char *radio, uint8_t channel,
+			uint8_t rfpwr, struct nrf24_mac *mac, uint8_t features,
+			uint8_t retr_policy,
+			const struct mgmt_cmd_nrf24_data_channels *dc,
+			int stats, int survey)
 {
 	int err;
 
-	err = hal_comm_init("NRF0", mac);
+	err = hal_comm_init(radio, mac);
 	if (err < 0)
 		return err;
 
@@ -304,7 +577,49 @@ static int radio_init(const char *spi, uint8_t channel, uint8_t rfpwr,
 	if (mgmtfd < 0)
 		goto done;
 
-	mgmtwatch = g_idle_add(read_idle, NULL);
+	/* Before the first CONNECT_REQ: none, the default data channel */
+	if (dc->count) {
+		err = radio_data_channels(dc);
+		if (err < 0)
+			fprintf(stderr, "Data channels: %s(%d)\n",
+						strerror(-err), -err);
+	}
+
+	/* Radio without the features: things keep the basic link */
+	if (features) {
+		err = radio_link_features(features);
+		if (err < 0)
+			fprintf(stderr, "Link features: %s(%d)\n",
+						strerror(-err), -err);
+	}
+
+	/* Radio without it: retransmissions by pipe index */
+	if (retr_policy != NRF24_RETR_POLICY_PIPE) {
+		err = radio_retr_policy(retr_policy);
+		if (err < 0)
+			fprintf(stderr, "Retransmission policy: %s(%d)\n",
+						strerror(-err), -err);
+	}
+
+	/* Radio without RPD: the data channels stay */
+	if (survey > 0) {
+		survey_dc = *dc;
+		survey_count = (dc->count ? dc->count : 1);
+		err = radio_survey();
+		if (err < 0)
+			fprintf(stderr, "Survey: %s(%d)\n",
+						strerror(-err), -err);
+		else
+			surveywatch = g_timeout_add_seconds(survey,
+							survey_timeout, NULL);
+	}
+
+	mgmtwatch = g_idle_add(read_timeout, NULL);
+	if (stats > 0) {
+		/* The radio counters start with the first request */
+		stats_timeout(NULL);
+		statswatch = g_timeout_add_seconds(stats, stats_timeout, NULL);
+	}
 
 	return 0;
 done:
@@ -329,6 +644,10 @@ static void radio_stop(void)
 	hal_comm_close(mgmtfd);
 	if (mgmtwatch)
 		g_source_remove(mgmtwatch);
+	if (statswatch)
+		g_source_remove(statswatch);
+	if (surveywatch)
+		g_source_remove(surveywatch);
 	hal_comm_deinit();
 }
 
@@ -521,9 +840,13 @@ done:
  * in the json configuration file
  */
 static int parse_config(const char *config, int *channel, int *dbm,
-							struct nrf24_mac *mac)
+				bool *ack_payload, bool *rate,
+				bool *adaptive_retr, bool *power,
+				struct mgmt_cmd_nrf24_data_channels *dc,
+				bool *hop, int *survey, struct nrf24_mac *mac)
 {
 	json_object *jobj, *obj_radio, *obj_tmp;
+	int i, ch;
 
 	int err = -EINVAL;
 
@@ -540,6 +863,39 @@ static int parse_config(const char *config, int *channel, int *dbm,
 	if (json_object_object_get_ex(obj_radio,  "TxPower", &obj_tmp))
 		*dbm = json_object_get_int(obj_tmp);
 
+	if (json_object_object_get_ex(obj_radio,  "AckPayload", &obj_tmp))
+		*ack_payload = json_object_get_boolean(obj_tmp);
+
+	if (json_object_object_get_ex(obj_radio,  "RateAdapt", &obj_tmp))
+		*rate = json_object_get_boolean(obj_tmp);
+
+	if (json_object_object_get_ex(obj_radio,  "AdaptiveRetr", &obj_tmp))
+		*adaptive_retr = json_object_get_boolean(obj_tmp);
+
+	if (json_object_object_get_ex(obj_radio,  "PowerControl", &obj_tmp))
+		*power = json_object_get_boolean(obj_tmp);
+
+	if (json_object_object_get_ex(obj_radio,  "DataChannels", &obj_tmp)) {
+		dc->count = json_object_array_length(obj_tmp);
+		if (dc->count > NRF24_DATA_CHANNELS_MAX)
+			goto done;
+
+		for (i = 0; i < dc->count; i++) {
+			ch = json_object_get_int(
+				json_object_array_get_idx(obj_tmp, i));
+			if (ch < NRF24_DATA_CH_MIN || ch > NRF24_DATA_CH_MAX)
+				goto done;
+
+			dc->channels[i] = ch;
+		}
+	}
+
+	if (json_object_object_get_ex(obj_radio,  "Hop", &obj_tmp))
+		*hop = json_object_get_boolean(obj_tmp);
+
+	if (json_object_object_get_ex(obj_radio,  "Survey", &obj_tmp))
+		*survey = json_object_get_int(obj_tmp);
+
 	if (json_object_object_get_ex(obj_radio,  "mac", &obj_tmp))
 		if (json_object_get_string(obj_tmp) != NULL)
 			nrf24_str2mac(json_object_get_string(obj_tmp), mac);
@@ -554,17 +910,32 @@ done:
 }
 
 int manager_start(const char *file, const char *host, int port,
-				const char *spi, int channel, int dbm)
+			const char *spi, const char *radio, int channel, int dbm,
+			bool ack_payload, bool rate, bool adaptive_retr,
+			bool power,
+			const struct mgmt_cmd_nrf24_data_channels *data_channels,
+			bool hop,
+			int stats, int survey)
 {
 	int cfg_channel = NRF24_CH_MIN, cfg_dbm = 0;
+	bool cfg_ack_payload = false, cfg_rate = false;
+	bool cfg_adaptive_retr = false, cfg_power = false, cfg_hop = false;
+	int cfg_survey = 0;
+	struct mgmt_cmd_nrf24_data_channels dc;
+	uint8_t features = 0, retr_policy = NRF24_RETR_POLICY_PIPE;
 	char *json_str;
 	struct nrf24_mac mac = {.address.uint64 = 0};
 	int err = -1;
 
+	memset(&dc, 0, sizeof(dc));
+
 	/* Command line arguments have higher priority */
 	json_str = load_config(file);
 	if (json_str != NULL) {
-		err = parse_config(json_str, &cfg_channel, &cfg_dbm, &mac);
+		err = parse_config(json_str, &cfg_channel, &cfg_dbm,
+					&cfg_ack_payload, &cfg_rate,
+					&cfg_adaptive_retr, &cfg_power, &dc,
+					&cfg_hop, &cfg_survey, &mac);
 
 		if (mac.address.uint64 == 0)
 			err = gen_save_mac(json_str, file, &mac);
@@ -588,8 +959,28 @@ int manager_start(const char *file, const char *host, int port,
 	if (dbm == -255)
 		dbm = cfg_dbm;
 
+	/* Replace the channels of the configuration file */
+	if (data_channels && data_channels->count)
+		dc = *data_channels;
+
+	if (ack_payload || cfg_ack_payload)
+		features |= NRF24_LINK_F_ACK_PAY;
+	if (rate || cfg_rate)
+		features |= NRF24_LINK_F_RATE;
+	if (power || cfg_power)
+		features |= NRF24_LINK_F_POWER;
+	/* Survey alone: the links keep their channel until they reconnect */
+	if (survey <= 0)
+		survey = cfg_survey;
+	if (hop || cfg_hop)
+		features |= NRF24_LINK_F_HOP;
+	if (adaptive_retr || cfg_adaptive_retr)
+		retr_policy = NRF24_RETR_POLICY_ADAPTIVE;
+
 	if (host == NULL)
-		return radio_init(spi, channel, dbm_int2rfpwr(dbm), &mac);
+		return radio_init(spi, radio, channel, dbm_int2rfpwr(dbm),
+					&mac, features, retr_policy, &dc,
+					stats, survey);
 	/*
 	 * TCP development mode: Linux connected to RPi(phynrfd radio
 	 * proxy). Connect to phynrfd routing all traffic over TCP.
@@ -8,5 +8,10 @@
  */
 
 int manager_start(const char *file, const char *host, int port,
-			const char *spi, int channel, int dbm);
+			const char *spi, const char *radio, int channel,
+			int dbm, bool ack_payload, bool rate,
+			bool adaptive_retr, bool power,
+			const struct mgmt_cmd_nrf24_data_channels *data_channels,
+			bool hop, int stats,
+			int survey);
 void manager_stop(void);
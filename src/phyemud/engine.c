@@ -0,0 +1,805 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include "phy_driver_private.h"
+#include "engine.h"
+
+/*
+ * Session engine: an accept thread connects each new thing to knotd
+ * and hands the session to one of the epoll workers (round robin).
+ * A session is owned by its worker until it is closed: forwarding
+ * runs without locks. Sessions live in slabs, indexed by id, and the
+ * epoll events carry the id and generation of the session: events of
+ * a session closed in the same batch are ignored.
+ */
+
+/* Application packet size maximum, same as knotd */
+#define PACKET_SIZE_MAX			512
+#define KNOTD_UNIX_ADDRESS		"knot"
+
+/*
+ * KNoT message: type (1 byte), payload length (1 byte) and payload.
+ * Largest message is 257 bytes: the receive buffer always has room
+ * for a complete message after the partial one being assembled.
+ */
+#define MSG_HDR_SIZE			2
+#define MSG_SIZE(buf)			(((uint8_t *) (buf))[1] + MSG_HDR_SIZE)
+#define MSG_BATCH_MAX			16
+
+#define EVENTS_MAX			128
+#define LISTENERS_MAX			(ENGINE_WORKERS_MAX + 8)
+/* Clients accepted per listener event: keeps workers responsive */
+#define ACCEPT_BATCH_MAX		64
+
+/* epoll data: generation (32 bits), session id and side (thing/knotd) */
+#define EV_THING			0
+#define EV_KNOTD			1
+#define EV_WAKEUP			UINT64_MAX
+#define EV_LISTENER(index)		(EV_WAKEUP - 1 - (index))
+#define EV_IS_LISTENER(data)		((data) != EV_WAKEUP && \
+					(data) >= EV_LISTENER(LISTENERS_MAX - 1))
+#define EV_LISTENER_INDEX(data)		(EV_WAKEUP - 1 - (data))
+#define EV_DATA(s, side)		(((uint64_t) (s)->gen << 32) | \
+					((s)->id << 1) | (side))
+#define EV_ID(data)			((uint32_t) (data) >> 1)
+#define EV_GEN(data)			((uint32_t) ((data) >> 32))
+#define EV_SIDE(data)			((data) & 1)
+
+/* Counters have a single writer: no locked instruction needed */
+#define STAT_ADD(stats, field, n)	__atomic_store_n(&(stats)->field, \
+					(stats)->field + (n), __ATOMIC_RELAXED)
+#define STAT_GET(stats, field)		__atomic_load_n(&(stats)->field, \
+					__ATOMIC_RELAXED)
+
+struct worker;
+
+struct session {
+	uint32_t id;		/* Index in the session table */
+	uint32_t gen;		/* Incremented when released */
+	bool in_use;
+	bool blocked;		/* knotd full: thing reads suspended */
+	int thing_fd;
+	int knotd_fd;
+	struct phy_driver *ops;
+	struct worker *worker;
+	struct session *next;	/* Free list or worker hand off list */
+	size_t rx_len;
+	uint8_t rx[PACKET_SIZE_MAX];	/* Incomplete messages from thing */
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int wakefd;
+	pthread_mutex_t lock;	/* Protects incoming and stop */
+	struct session *incoming;
+	bool stop;
+	struct engine_stats stats;
+};
+
+struct listener {
+	struct phy_driver *ops;
+	int sock;
+	int worker;		/* Accepting worker, -1: accept thread */
+};
+
+static struct session *slabs[ENGINE_SLABS];
+static unsigned int slab_count;
+static struct session *free_list;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct worker *workers;
+static unsigned int worker_count;
+static unsigned int worker_next;
+
+static struct listener listeners[LISTENERS_MAX];
+static unsigned int listener_count;
+static pthread_t accept_thread;
+static int accept_epfd = -1;
+static int accept_wakefd = -1;
+/* Written by the accept thread only */
+static struct engine_stats accept_stats;
+
+static int connect_knotd(void)
+{
+	struct sockaddr_un addr;
+	int sock, err;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	/* Represents unix socket from phyemud to knotd */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, KNOTD_UNIX_ADDRESS,
+					strlen(KNOTD_UNIX_ADDRESS));
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		goto fail;
+
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+		goto fail;
+
+	return sock;
+
+fail:
+	err = -errno;
+	close(sock);
+	return err;
+}
+
+static int slab_grow(void)
+{
+	struct session *slab;
+	int i;
+
+	if (slab_count == ENGINE_SLABS)
+		return -ENFILE;
+
+	slab = calloc(ENGINE_SLAB_SIZE, sizeof(*slab));
+	if (slab == NULL)
+		return -ENOMEM;
+
+	/* Lowest ids first */
+	for (i = ENGINE_SLAB_SIZE - 1; i >= 0; i--) {
+		slab[i].id = slab_count * ENGINE_SLAB_SIZE + i;
+		slab[i].thing_fd = -1;
+		slab[i].knotd_fd = -1;
+		slab[i].next = free_list;
+		free_list = &slab[i];
+	}
+
+	slabs[slab_count++] = slab;
+
+	return 0;
+}
+
+static struct session *session_alloc(void)
+{
+	struct session *session = NULL;
+
+	pthread_mutex_lock(&slab_lock);
+
+	if (free_list || slab_grow() == 0) {
+		session = free_list;
+		free_list = session->next;
+		session->next = NULL;
+		session->in_use = true;
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+
+	return session;
+}
+
+static void session_free(struct session *session)
+{
+	/* Invalidates events still queued for this session */
+	__atomic_store_n(&session->gen, session->gen + 1, __ATOMIC_RELEASE);
+
+	session->in_use = false;
+	session->thing_fd = -1;
+	session->knotd_fd = -1;
+	session->blocked = false;
+	session->rx_len = 0;
+
+	pthread_mutex_lock(&slab_lock);
+	session->next = free_list;
+	free_list = session;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+static struct session *session_lookup(uint64_t data)
+{
+	struct session *session;
+	uint32_t id = EV_ID(data);
+
+	if (id >= ENGINE_SESSIONS_MAX)
+		return NULL;
+
+	session = &slabs[id / ENGINE_SLAB_SIZE][id % ENGINE_SLAB_SIZE];
+	if (__atomic_load_n(&session->gen, __ATOMIC_ACQUIRE) != EV_GEN(data))
+		return NULL;
+
+	return session;
+}
+
+static void session_close(struct worker *worker, struct session *session)
+{
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->thing_fd, NULL);
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, session->knotd_fd, NULL);
+
+	session->ops->close(session->thing_fd);
+	close(session->knotd_fd);
+
+	STAT_ADD(&worker->stats, closed, 1);
+
+	session_free(session);
+}
+
+static int session_watch(struct worker *worker, struct session *session,
+					int op, int side, uint32_t events)
+{
+	struct epoll_event ev;
+	int fd = (side == EV_THING ? session->thing_fd : session->knotd_fd);
+
+	ev.events = events;
+	ev.data.u64 = EV_DATA(session, side);
+
+	if (epoll_ctl(worker->epfd, op, fd, &ev) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Size of the message at the start of buffer, transport header included:
+ * 0 if incomplete or -errno if invalid. hdrlen returns the amount of
+ * bytes stripped before forwarding to knotd.
+ */
+static ssize_t message_size(struct phy_driver *ops, const uint8_t *buffer,
+						size_t len, size_t *hdrlen)
+{
+	ssize_t size;
+
+	if (ops->frame)
+		size = ops->frame(buffer, len, hdrlen);
+	else {
+		*hdrlen = 0;
+		size = (len < MSG_HDR_SIZE ? 0 : MSG_SIZE(buffer));
+	}
+
+	if (size > 0 && (size_t) size > len)
+		return 0;
+
+	return size;
+}
+
+/*
+ * Forwards the complete messages buffered in the session to knotd:
+ * one datagram per message, sent in a single batch. Returns the
+ * amount of bytes consumed.
+ */
+static ssize_t forward_messages(struct worker *worker,
+						struct session *session)
+{
+	struct mmsghdr msgs[MSG_BATCH_MAX];
+	struct iovec iov[MSG_BATCH_MAX];
+	size_t frame_size[MSG_BATCH_MAX];
+	size_t offset = 0, sent_len = 0, hdrlen;
+	unsigned int count = 0, i;
+	ssize_t size;
+	int sent;
+
+	while (count < MSG_BATCH_MAX) {
+		size = message_size(session->ops, session->rx + offset,
+					session->rx_len - offset, &hdrlen);
+		if (size < 0 && count == 0)
+			return size;
+
+		if (size <= 0)
+			break;
+
+		iov[count].iov_base = session->rx + offset + hdrlen;
+		iov[count].iov_len = size - hdrlen;
+		frame_size[count] = size;
+		memset(&msgs[count], 0, sizeof(msgs[count]));
+		msgs[count].msg_hdr.msg_iov = &iov[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+
+		offset += size;
+		count++;
+	}
+
+	if (count == 0)
+		return 0;
+
+	sent = sendmmsg(session->knotd_fd, msgs, count, MSG_DONTWAIT);
+	if (sent < 0)
+		return (errno == EAGAIN ? 0 : -errno);
+
+	/* Messages not accepted by knotd remain buffered */
+	for (i = 0; i < (unsigned int) sent; i++)
+		sent_len += frame_size[i];
+
+	STAT_ADD(&worker->stats, msgs_up, sent);
+	STAT_ADD(&worker->stats, bytes_up, sent_len);
+
+	return sent_len;
+}
+
+/* Returns false if the session has been closed */
+static bool session_flush(struct worker *worker, struct session *session)
+{
+	ssize_t consumed;
+	size_t hdrlen;
+	bool blocked;
+
+	/* Several messages may arrive in a single read */
+	do {
+		consumed = forward_messages(worker, session);
+		if (consumed < 0) {
+			session_close(worker, session);
+			return false;
+		}
+
+		session->rx_len -= consumed;
+		memmove(session->rx, session->rx + consumed, session->rx_len);
+	} while (consumed > 0);
+
+	/* A complete message left behind: knotd is not reading */
+	blocked = message_size(session->ops, session->rx, session->rx_len,
+								&hdrlen) > 0;
+	if (blocked == session->blocked)
+		return true;
+
+	/* Stop reading the thing until knotd becomes writable */
+	session->blocked = blocked;
+	session_watch(worker, session, EPOLL_CTL_MOD, EV_THING,
+						blocked ? 0 : EPOLLIN);
+	session_watch(worker, session, EPOLL_CTL_MOD, EV_KNOTD,
+				blocked ? EPOLLIN | EPOLLOUT : EPOLLIN);
+
+	return true;
+}
+
+static void thing_event(struct worker *worker, struct session *session,
+							uint32_t events)
+{
+	ssize_t nbytes;
+
+	/* Hang up or error without data: thing is gone */
+	if (!(events & EPOLLIN)) {
+		session_close(worker, session);
+		return;
+	}
+
+	/*
+	 * At the moment there isn't a header describing the size of
+	 * the datagram. The field 'payload_len' (see buffer[1]) defined
+	 * at knot_protocol.h is being used to determine the expected
+	 * datagram length. Partial messages are kept in the session
+	 * until the next event: never wait for the remaining bytes.
+	 */
+	nbytes = session->ops->recv(session->thing_fd,
+				session->rx + session->rx_len,
+				sizeof(session->rx) - session->rx_len);
+	if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN &&
+							errno != EINTR)) {
+		session_close(worker, session);
+		return;
+	}
+
+	if (nbytes < 0)
+		return;
+
+	session->rx_len += nbytes;
+	session_flush(worker, session);
+}
+
+static void knotd_event(struct worker *worker, struct session *session,
+							uint32_t events)
+{
+	uint8_t buffer[PACKET_SIZE_MAX];
+	ssize_t nbytes;
+	int i;
+
+	if ((events & EPOLLOUT) && !session_flush(worker, session))
+		return;
+
+	if (!(events & EPOLLIN)) {
+		if (events & (EPOLLHUP | EPOLLERR))
+			session_close(worker, session);
+		return;
+	}
+
+	for (i = 0; i < MSG_BATCH_MAX; i++) {
+		nbytes = read(session->knotd_fd, buffer, sizeof(buffer));
+		if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (nbytes <= 0)
+			break;
+
+		if (session->ops->send(session->thing_fd, buffer,
+							nbytes) < 0) {
+			if (errno != EAGAIN)
+				break;
+
+			/* Thing not reading: datagram semantics, drop it */
+			STAT_ADD(&worker->stats, dropped, 1);
+			continue;
+		}
+
+		STAT_ADD(&worker->stats, msgs_down, 1);
+		STAT_ADD(&worker->stats, bytes_down, nbytes);
+	}
+
+	if (i < MSG_BATCH_MAX)
+		session_close(worker, session);
+}
+
+static void session_register(struct worker *worker, struct session *session)
+{
+	session->worker = worker;
+
+	if (session_watch(worker, session, EPOLL_CTL_ADD, EV_THING,
+							EPOLLIN) < 0 ||
+			session_watch(worker, session, EPOLL_CTL_ADD,
+						EV_KNOTD, EPOLLIN) < 0)
+		session_close(worker, session);
+}
+
+/* Connects a new thing to knotd. Returns NULL if rejected */
+static struct session *session_create(struct phy_driver *ops, int cli_sock,
+						struct engine_stats *stats)
+{
+	struct session *session;
+	int knotdfd;
+
+	if (fcntl(cli_sock, F_SETFL, O_NONBLOCK) < 0)
+		goto reject;
+
+	knotdfd = connect_knotd();
+	if (knotdfd < 0)
+		goto reject;
+
+	session = session_alloc();
+	if (session == NULL) {
+		close(knotdfd);
+		goto reject;
+	}
+
+	session->thing_fd = cli_sock;
+	session->knotd_fd = knotdfd;
+	session->ops = ops;
+
+	STAT_ADD(stats, accepted, 1);
+
+	return session;
+
+reject:
+	ops->close(cli_sock);
+	STAT_ADD(stats, rejected, 1);
+
+	return NULL;
+}
+
+/* Listener owned by this worker: its sessions stay local */
+static void worker_accept(struct worker *worker, struct listener *listener)
+{
+	struct session *session;
+	int cli_sock, i;
+
+	for (i = 0; i < ACCEPT_BATCH_MAX; i++) {
+		cli_sock = listener->ops->accept(listener->sock);
+		if (cli_sock < 0)
+			break;
+
+		session = session_create(listener->ops, cli_sock,
+							&worker->stats);
+		if (session)
+			session_register(worker, session);
+	}
+}
+
+/* Registers the sessions handed off by the accept thread */
+static bool worker_wakeup(struct worker *worker)
+{
+	struct session *list, *session;
+	uint64_t value;
+	bool stop;
+
+	if (read(worker->wakefd, &value, sizeof(value)) < 0 &&
+							errno != EAGAIN)
+		return true;
+
+	pthread_mutex_lock(&worker->lock);
+	list = worker->incoming;
+	worker->incoming = NULL;
+	stop = worker->stop;
+	pthread_mutex_unlock(&worker->lock);
+
+	while (list) {
+		session = list;
+		list = list->next;
+		session->next = NULL;
+		session_register(worker, session);
+	}
+
+	return stop;
+}
+
+static void *worker_loop(void *user_data)
+{
+	struct worker *worker = user_data;
+	struct epoll_event events[EVENTS_MAX];
+	struct session *session;
+	int n, i;
+
+	for (;;) {
+		n = epoll_wait(worker->epfd, events, EVENTS_MAX, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u64 == EV_WAKEUP) {
+				if (worker_wakeup(worker))
+					return NULL;
+				continue;
+			}
+
+			if (EV_IS_LISTENER(events[i].data.u64)) {
+				worker_accept(worker, &listeners[
+				EV_LISTENER_INDEX(events[i].data.u64)]);
+				continue;
+			}
+
+			/* Closed earlier in this batch */
+			session = session_lookup(events[i].data.u64);
+			if (session == NULL)
+				continue;
+
+			if (EV_SIDE(events[i].data.u64) == EV_THING)
+				thing_event(worker, session, events[i].events);
+			else
+				knotd_event(worker, session, events[i].events);
+		}
+	}
+
+	return NULL;
+}
+
+static void worker_wake(struct worker *worker)
+{
+	uint64_t value = 1;
+
+	if (write(worker->wakefd, &value, sizeof(value)) < 0)
+		perror("worker wakeup");
+}
+
+/* Runs on the accept thread: hands the session to a worker */
+static void session_start(struct phy_driver *ops, int cli_sock)
+{
+	struct session *session;
+	struct worker *worker;
+
+	session = session_create(ops, cli_sock, &accept_stats);
+	if (session == NULL)
+		return;
+
+	/* Sharding: the worker owns the session from now on */
+	worker = &workers[worker_next++ % worker_count];
+	session->worker = worker;
+
+	pthread_mutex_lock(&worker->lock);
+	session->next = worker->incoming;
+	worker->incoming = session;
+	pthread_mutex_unlock(&worker->lock);
+
+	worker_wake(worker);
+}
+
+static void *accept_loop(void *user_data)
+{
+	struct epoll_event events[LISTENERS_MAX + 1];
+	struct listener *listener;
+	int n, i, cli_sock;
+
+	for (;;) {
+		n = epoll_wait(accept_epfd, events, LISTENERS_MAX + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u64 == EV_WAKEUP)
+				return NULL;
+
+			listener = &listeners[EV_LISTENER_INDEX(
+							events[i].data.u64)];
+
+			/* A single event may carry several clients */
+			while ((cli_sock = listener->ops->accept(
+							listener->sock)) >= 0)
+				session_start(listener->ops, cli_sock);
+		}
+	}
+
+	return NULL;
+}
+
+int engine_add_listener(struct phy_driver *ops, int srv_sock, int worker)
+{
+	struct epoll_event ev;
+	int epfd;
+
+	if (listener_count == LISTENERS_MAX)
+		return -ENOSPC;
+
+	if (worker >= (int) worker_count)
+		return -EINVAL;
+
+	if (fcntl(srv_sock, F_SETFL, O_NONBLOCK) < 0)
+		return -errno;
+
+	listeners[listener_count].ops = ops;
+	listeners[listener_count].sock = srv_sock;
+	listeners[listener_count].worker = worker;
+
+	epfd = (worker < 0 ? accept_epfd : workers[worker].epfd);
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_LISTENER(listener_count);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, srv_sock, &ev) < 0)
+		return -errno;
+
+	listener_count++;
+
+	return 0;
+}
+
+static int worker_init(struct worker *worker)
+{
+	struct epoll_event ev;
+
+	worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epfd < 0)
+		return -errno;
+
+	worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wakefd < 0)
+		return -errno;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_WAKEUP;
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wakefd, &ev) < 0)
+		return -errno;
+
+	pthread_mutex_init(&worker->lock, NULL);
+
+	return -pthread_create(&worker->thread, NULL, worker_loop, worker);
+}
+
+int engine_start(unsigned int count)
+{
+	struct epoll_event ev;
+	unsigned int i;
+	int err;
+
+	if (count == 0 || count > ENGINE_WORKERS_MAX)
+		return -EINVAL;
+
+	accept_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (accept_epfd < 0)
+		return -errno;
+
+	accept_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (accept_wakefd < 0)
+		return -errno;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_WAKEUP;
+	if (epoll_ctl(accept_epfd, EPOLL_CTL_ADD, accept_wakefd, &ev) < 0)
+		return -errno;
+
+	workers = calloc(count, sizeof(*workers));
+	if (workers == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		workers[i].epfd = -1;
+		workers[i].wakefd = -1;
+	}
+
+	for (worker_count = 0; worker_count < count; worker_count++) {
+		err = worker_init(&workers[worker_count]);
+		if (err < 0)
+			return err;
+	}
+
+	return -pthread_create(&accept_thread, NULL, accept_loop, NULL);
+}
+
+void engine_stop(void)
+{
+	struct session *session;
+	uint64_t value = 1;
+	unsigned int i, j;
+
+	if (accept_wakefd >= 0 && write(accept_wakefd, &value,
+						sizeof(value)) > 0)
+		pthread_join(accept_thread, NULL);
+
+	for (i = 0; i < worker_count; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		workers[i].stop = true;
+		pthread_mutex_unlock(&workers[i].lock);
+
+		worker_wake(&workers[i]);
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	/* Workers are gone: release the sessions left */
+	for (i = 0; i < slab_count; i++) {
+		for (j = 0; j < ENGINE_SLAB_SIZE; j++) {
+			session = &slabs[i][j];
+			if (!session->in_use || session->worker == NULL)
+				continue;
+
+			session_close(session->worker, session);
+		}
+
+		free(slabs[i]);
+		slabs[i] = NULL;
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		close(workers[i].epfd);
+		close(workers[i].wakefd);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+	slab_count = 0;
+	free_list = NULL;
+	listener_count = 0;
+
+	close(accept_epfd);
+	close(accept_wakefd);
+	accept_epfd = -1;
+	accept_wakefd = -1;
+}
+
+void engine_get_stats(struct engine_stats *stats)
+{
+	struct engine_stats *ws;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->accepted = STAT_GET(&accept_stats, accepted);
+	stats->rejected = STAT_GET(&accept_stats, rejected);
+
+	for (i = 0; i < worker_count; i++) {
+		ws = &workers[i].stats;
+		stats->accepted += STAT_GET(ws, accepted);
+		stats->rejected += STAT_GET(ws, rejected);
+		stats->closed += STAT_GET(ws, closed);
+		stats->msgs_up += STAT_GET(ws, msgs_up);
+		stats->msgs_down += STAT_GET(ws, msgs_down);
+		stats->dropped += STAT_GET(ws, dropped);
+		stats->bytes_up += STAT_GET(ws, bytes_up);
+		stats->bytes_down += STAT_GET(ws, bytes_down);
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* Engine limits: sessions are allocated in slabs of ENGINE_SLAB_SIZE */
+#define ENGINE_SLAB_SIZE		256
+#define ENGINE_SLABS			256
+#define ENGINE_SESSIONS_MAX		(ENGINE_SLAB_SIZE * ENGINE_SLABS)
+#define ENGINE_WORKERS_MAX		64
+
+struct engine_stats {
+	uint64_t accepted;	/* Thing connections */
+	uint64_t closed;
+	uint64_t rejected;	/* No session or knotd unreachable */
+	uint64_t msgs_up;	/* Thing to knotd */
+	uint64_t msgs_down;	/* knotd to thing */
+	uint64_t dropped;	/* knotd messages the thing couldn't take */
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+};
+
+int engine_start(unsigned int workers);
+void engine_stop(void);
+
+/*
+ * Accepts clients of srv_sock calling ops->accept. worker -1: accept
+ * thread, sessions are spread over the workers. Otherwise the worker
+ * accepts and keeps the sessions: one SO_REUSEPORT listener per worker.
+ */
+int engine_add_listener(struct phy_driver *ops, int srv_sock, int worker);
+
+void engine_get_stats(struct engine_stats *stats);
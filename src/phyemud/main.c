@@ -14,9 +14,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/resource.h>
 #include <glib.h>
 
 #include "manager.h"
@@ -24,6 +27,9 @@
 static GMainLoop *main_loop;
 static const char *opt_serial = NULL;
 static gboolean opt_unix = FALSE;
+static const char *opt_tcp = NULL;
+static int opt_workers = 0;
+static int opt_stats = 0;
 
 static void sig_term(int sig)
 {
@@ -32,16 +38,35 @@ static void sig_term(int sig)
 
 static GOptionEntry options[] = {
 	{ "serial", 's', 0, G_OPTION_ARG_STRING, &opt_serial,
-					"serial", "Serial device" },
+					"serial", "Serial device: path[:baud]" },
 	{ "unix", 'u', 0, G_OPTION_ARG_NONE, &opt_unix,
 		"Unix socket", "Enable unix socket clients" },
+	{ "tcp", 'p', 0, G_OPTION_ARG_STRING, &opt_tcp,
+		"[host:]port", "Enable TCP clients" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &opt_workers,
+		"workers", "Session worker threads (default: CPUs)" },
+	{ "stats", 't', 0, G_OPTION_ARG_INT, &opt_stats,
+		"seconds", "Report session and message rates" },
 	{ NULL },
 };
 
+/* Each session takes two descriptors: thing and knotd */
+static void raise_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		return;
+
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
 	GError *gerr = NULL;
+	sigset_t mask;
 	int err;
 
 	context = g_option_context_new(NULL);
@@ -56,12 +81,35 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
-	if (!opt_unix && opt_serial == NULL) {
+	if (!opt_unix && opt_serial == NULL && opt_tcp == NULL) {
 		printf("Missing arguments\n");
 		return EXIT_FAILURE;
 	}
 
-	err = manager_start(opt_serial, opt_unix);
+	if (opt_workers <= 0)
+		opt_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (opt_stats < 0) {
+		printf("Invalid stats interval\n");
+		return EXIT_FAILURE;
+	}
+
+	raise_fd_limit();
+
+	/* Sessions write to sockets closed by the peer */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Worker threads inherit the mask: signals reach the main loop */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	err = manager_start(opt_serial, opt_unix, opt_tcp, opt_workers,
+								opt_stats);
+
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
 	if (err < 0)
 		return EXIT_FAILURE;
 
@@ -70,7 +118,6 @@ int main(int argc, char *argv[])
 
 	signal(SIGTERM, sig_term);
 	signal(SIGINT, sig_term);
-	signal(SIGPIPE, SIG_IGN);
 
 	main_loop = g_main_loop_new(NULL, FALSE);
 
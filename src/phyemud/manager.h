@@ -7,5 +7,6 @@
  *
  */
 
-int manager_start(const char *serial, gboolean unix_sock);
+int manager_start(const char *serial, gboolean unix_sock, const char *tcp,
+			unsigned int workers, unsigned int stats_interval);
 void manager_stop(void);
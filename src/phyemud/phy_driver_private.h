@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+ /**
+ * struct phy_driver - phyemud transport driver
+ * @name: driver name
+ * @probe: checks if the transport is available
+ * @remove: releases the resources allocated by probe
+ * @open: creates the server endpoint. Returns a socket or -errno
+ * @listen: starts accepting things on the endpoint
+ * @accept: non-blocking. Returns a thing socket or a negative value
+ * @connect: thing side: connects sock to the endpoint
+ * @recv: reads from a thing socket (read() semantics)
+ * @send: writes one message to a thing socket (write() semantics)
+ * @close: closes a socket returned by open or accept
+ * @frame: optional, stream transports. Returns the size of the frame
+ *	at the start of buffer (0: more bytes needed, -errno: invalid)
+ *	and the size of the transport header in hdrlen, stripped before
+ *	forwarding. If NULL, the KNoT header delimits the messages.
+ *
+ * Each thing socket is bridged to its own knotd connection.
+ */
+
+struct phy_driver {
+	const char *name;
+	int (*probe) (const char *spi, uint8_t tx_pwr);
+	void (*remove) (void);
+	int (*open) (const char *pathname);
+	int (*listen) (int sock, uint8_t channel);
+	int (*accept) (int srv_sockfd);
+	int (*connect) (int cli_sockfd, uint8_t to_addr);
+	ssize_t (*recv) (int sockfd, void *buffer, size_t len);
+	ssize_t (*send) (int sockfd, const void *buffer, size_t len);
+	void (*close) (int sock);
+	ssize_t (*frame) (const void *buffer, size_t len, size_t *hdrlen);
+};
@@ -10,26 +10,131 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
-#include <termios.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "phy_driver_private.h"
+#include "serial_link.h"
+
+/* Bounds a blocked tty write: 64 bytes at 9600 baud */
+#define SERIAL_TX_TIMEOUT_MS	100
+
+/*
+ * Each logical channel of the serial link is exposed to the manager
+ * as a SEQPACKET socket: 'outer' is returned by accept and behaves as
+ * a thing connection, 'inner' is fed with the frames demultiplexed
+ * from the tty.
+ */
+struct serial_channel {
+	int inner;
+	int outer;
+};
 
 struct serial_opts {
-	char	tty[24];
-	int	vmin;
-	int	virtualfd;
+	char	tty[64];	/* path[:baud] */
 	int	realfd;
-	int	knotd;
+	uint8_t	pending;	/* Channels not returned by accept yet */
+	struct serial_link_decoder dec;
+	struct serial_channel channels[SERIAL_LINK_CHANNELS];
 };
 
-static struct serial_opts serial_opts;
+static struct serial_opts serial_opts = { .realfd = -1 };
+/* Channels are opened by the accept thread and used by the workers */
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void channel_release(struct serial_channel *ch)
+{
+	if (ch->inner >= 0)
+		close(ch->inner);
+
+	ch->inner = -1;
+	ch->outer = -1;
+	serial_opts.pending &= ~(1 << (ch - serial_opts.channels));
+}
+
+static struct serial_channel *channel_lookup(int outer)
+{
+	int i;
+
+	for (i = 0; i < SERIAL_LINK_CHANNELS; i++) {
+		if (serial_opts.channels[i].outer == outer)
+			return &serial_opts.channels[i];
+	}
+
+	return NULL;
+}
+
+static int channel_create(uint8_t channel)
+{
+	struct serial_channel *ch = &serial_opts.channels[channel];
+	struct serial_channel *stale;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return -errno;
+
+	/* Outer fd number reused: its previous channel is gone */
+	stale = channel_lookup(sv[1]);
+	if (stale)
+		channel_release(stale);
+
+	ch->inner = sv[0];
+	ch->outer = sv[1];
+	serial_opts.pending |= (1 << channel);
+
+	return 0;
+}
+
+/* Hands a frame received from the tty to the channel socket */
+static void channel_deliver(uint8_t channel, const void *payload,
+								size_t len)
+{
+	struct serial_channel *ch;
+
+	if (channel >= SERIAL_LINK_CHANNELS)
+		return;
+
+	ch = &serial_opts.channels[channel];
+
+	if (ch->inner < 0 && channel_create(channel) < 0)
+		return;
+
+	if (send(ch->inner, payload, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+		return;
+
+	if (errno != EPIPE && errno != ECONNRESET)
+		return;
+
+	/* Session closed by the manager: thing started a new one */
+	channel_release(ch);
+	if (channel_create(channel) < 0)
+		return;
+
+	send(ch->inner, payload, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int channel_next_pending(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < SERIAL_LINK_CHANNELS; i++) {
+		if ((serial_opts.pending & (1 << i)) == 0)
+			continue;
+
+		serial_opts.pending &= ~(1 << i);
+		return serial_opts.channels[i].outer;
+	}
+
+	return -EAGAIN;
+}
 
 /* Check if tty path is available*/
 static int serial_probe(const char *spi, uint8_t tx_power)
@@ -37,23 +142,30 @@ static int serial_probe(const char *spi, uint8_t tx_power)
 	return 0;
 }
 
-
-/* Returns last character from the pathname, like 0 in /tty/ttyUSB0 */
+/* Returns last character from the tty name, like 0 in /dev/ttyUSB0 */
 static int serial_open(const char *pathname)
 {
+	char path[sizeof(serial_opts.tty)];
 	struct stat st;
+	char *sep;
 
 	/* Setting default value */
 	if (!pathname)
 		return -EINVAL;
 
-	strncpy(serial_opts.tty, pathname, sizeof(serial_opts.tty));
-	serial_opts.vmin = 8;
+	strncpy(serial_opts.tty, pathname, sizeof(serial_opts.tty) - 1);
+	serial_opts.tty[sizeof(serial_opts.tty) - 1] = '\0';
 
-	if (stat(serial_opts.tty, &st) < 0)
+	/* Strip the optional baud rate: /dev/ttyUSB0:1000000 */
+	strcpy(path, serial_opts.tty);
+	sep = strrchr(path, ':');
+	if (sep)
+		*sep = '\0';
+
+	if (stat(path, &st) < 0)
 		return -errno;
 
-	return serial_opts.tty[strlen(serial_opts.tty)-1] - '0';
+	return path[strlen(path) - 1] - '0';
 }
 
 static void serial_remove(void)
@@ -62,43 +174,58 @@ static void serial_remove(void)
 
 static int serial_listen(int sock, uint8_t channel)
 {
-	struct termios term;
-	int ttyfd;
-
-	memset(&term, 0, sizeof(term));
-	/*
-	 * 8-bit characters, no parity bit,no Bit mask for data bits
-	 * only need 1 stop bit
-	 */
-	term.c_cflag &= ~PARENB;
-	term.c_cflag &= ~CSTOPB;
-	term.c_cflag &= ~CSIZE;
-	term.c_cflag |= CS8;
-	/* No flow control*/
-	term.c_cflag &= ~CRTSCTS;
-	/* Read block until 2 bytes arrives */
-	term.c_cc[VMIN] = 2;
-	/* Or 0.075 seconds read timeout */
-	term.c_cc[VTIME] = 0.75;
-	/* Turn on READ & ignore ctrl lines */
-	term.c_cflag |= CREAD | CLOCAL;
-
-	cfsetospeed(&term, B9600);
-	cfsetispeed(&term, B9600);
-
-	ttyfd = open(serial_opts.tty, O_RDWR | O_NOCTTY);
-	if (ttyfd < 0)
-		return -errno;
-	tcflush(ttyfd, TCIFLUSH);
-	tcsetattr(ttyfd, TCSANOW, &term);
+	int i;
+
+	for (i = 0; i < SERIAL_LINK_CHANNELS; i++) {
+		serial_opts.channels[i].inner = -1;
+		serial_opts.channels[i].outer = -1;
+	}
+
+	serial_opts.pending = 0;
+	serial_link_decoder_init(&serial_opts.dec);
 
-	return ttyfd;
+	/* Raw, non-blocking: frames are delimited by the decoder */
+	serial_opts.realfd = serial_link_open(serial_opts.tty);
+
+	return serial_opts.realfd;
 }
 
+/*
+ * Called when the tty is readable: demultiplexes the received frames
+ * and returns the socket of a channel seen for the first time. Must be
+ * called until it fails: a single read may open several channels.
+ */
 static int serial_accept(int srv_sockfd)
 {
-	/* Map virtual fd to pipe */
-	return 0;
+	uint8_t buffer[512], payload[SERIAL_LINK_MTU], channel;
+	ssize_t nbytes, len, i;
+	int sock;
+
+	pthread_mutex_lock(&serial_lock);
+
+	sock = channel_next_pending();
+	if (sock >= 0)
+		goto done;
+
+	nbytes = read(srv_sockfd, buffer, sizeof(buffer));
+	if (nbytes < 0) {
+		sock = -errno;
+		goto done;
+	}
+
+	for (i = 0; i < nbytes; i++) {
+		len = serial_link_decode(&serial_opts.dec, buffer[i],
+					&channel, payload, sizeof(payload));
+		if (len >= 0)
+			channel_deliver(channel, payload, len);
+	}
+
+	sock = channel_next_pending();
+
+done:
+	pthread_mutex_unlock(&serial_lock);
+
+	return sock;
 }
 
 static int serial_connect(int sock, uint8_t to_addr)
@@ -112,16 +239,82 @@ static ssize_t serial_recv(int sockfd, void *buffer, size_t len)
 	return read(sockfd, buffer, len);
 }
 
+/* Encodes and writes a frame to the channel mapped to sockfd */
 static ssize_t serial_send(int sockfd, const void *buffer, size_t len)
 {
-	return write(sockfd, buffer, len);
+	uint8_t frame[SERIAL_LINK_FRAME_MAX];
+	struct pollfd pfd;
+	struct serial_channel *ch;
+	ssize_t flen, offset = 0, nbytes;
+
+	pthread_mutex_lock(&serial_lock);
+
+	ch = channel_lookup(sockfd);
+	if (ch == NULL) {
+		errno = EBADF;
+		goto fail;
+	}
+
+	flen = serial_link_encode(ch - serial_opts.channels, buffer, len,
+								frame);
+	if (flen < 0) {
+		errno = -flen;
+		goto fail;
+	}
+
+	/* Never leave a partial frame behind: it would corrupt the next */
+	while (offset < flen) {
+		nbytes = write(serial_opts.realfd, frame + offset,
+							flen - offset);
+		if (nbytes >= 0) {
+			offset += nbytes;
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EINTR)
+			goto fail;
+
+		pfd.fd = serial_opts.realfd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, SERIAL_TX_TIMEOUT_MS) == 0) {
+			errno = ETIMEDOUT;
+			goto fail;
+		}
+	}
+
+	pthread_mutex_unlock(&serial_lock);
+
+	return len;
+
+fail:
+	pthread_mutex_unlock(&serial_lock);
+
+	return -1;
 }
 
-/* close no virtual marca na tabela */
-/* close no real realmente fecha */
+/* Channel sockets release their mapping, the tty closes all of them */
 static void serial_close(int fd)
 {
+	struct serial_channel *ch;
+	int i;
+
+	pthread_mutex_lock(&serial_lock);
+
+	if (fd >= 0 && fd == serial_opts.realfd) {
+		for (i = 0; i < SERIAL_LINK_CHANNELS; i++)
+			channel_release(&serial_opts.channels[i]);
+
+		serial_opts.realfd = -1;
+		serial_opts.pending = 0;
+	} else {
+		ch = channel_lookup(fd);
+		if (ch)
+			channel_release(ch);
+	}
+
 	close(fd);
+
+	pthread_mutex_unlock(&serial_lock);
 }
 
 struct phy_driver phy_serial = {
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "phy_driver_private.h"
+
+/*
+ * TCP things: every KNoT message is prefixed by its length (16 bits,
+ * network order). The engine strips the prefix (see frame_tcp) and
+ * forwards plain messages to knotd, as for unix things.
+ */
+#define TCP_HDR_SIZE		2
+#define TCP_MSG_MAX		257	/* Largest KNoT message */
+#define TCP_DEFAULT_PORT	"9994"
+/* Bounds the completion of a partially written frame */
+#define TCP_TX_TIMEOUT_MS	100
+
+static struct sockaddr_storage tcp_addr;
+static socklen_t tcp_addrlen;
+
+/* "[host:]port", IPv6 literals as "[::1]:port" */
+static int parse_address(const char *pathname, struct addrinfo **res)
+{
+	struct addrinfo hints;
+	char buffer[128], *host = NULL, *port = buffer, *sep;
+	int err;
+
+	if (pathname == NULL)
+		pathname = TCP_DEFAULT_PORT;
+
+	strncpy(buffer, pathname, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+
+	sep = strrchr(buffer, ':');
+	if (sep) {
+		*sep = '\0';
+		host = buffer;
+		port = sep + 1;
+
+		if (host[0] == '[') {
+			host++;
+			sep = strchr(host, ']');
+			if (sep)
+				*sep = '\0';
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	err = getaddrinfo(host, port, &hints, res);
+	if (err)
+		return (err == EAI_SYSTEM ? -errno : -EINVAL);
+
+	return 0;
+}
+
+static int probe_tcp(const char *spi, uint8_t tx_pwr)
+{
+	return 0;
+}
+
+static void remove_tcp(void)
+{
+}
+
+/*
+ * Can be called once per worker: SO_REUSEPORT lets the kernel spread
+ * the incoming connections over the listeners bound to the address.
+ */
+static int open_tcp(const char *pathname)
+{
+	struct addrinfo *res;
+	int sock, err, on = 1;
+
+	err = parse_address(pathname, &res);
+	if (err < 0)
+		return err;
+
+	sock = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK |
+						SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on,
+						sizeof(on)) < 0 ||
+			setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on,
+						sizeof(on)) < 0 ||
+			bind(sock, res->ai_addr, res->ai_addrlen) < 0) {
+		err = -errno;
+		close(sock);
+		goto done;
+	}
+
+	memcpy(&tcp_addr, res->ai_addr, res->ai_addrlen);
+	tcp_addrlen = res->ai_addrlen;
+	err = sock;
+
+done:
+	freeaddrinfo(res);
+
+	return err;
+}
+
+static int listen_tcp(int sock, uint8_t channel)
+{
+	if (listen(sock, SOMAXCONN) < 0)
+		return -errno;
+
+	return sock;
+}
+
+static int accept_tcp(int srv_sock)
+{
+	int sock, on = 1;
+
+	sock = accept4(srv_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sock < 0)
+		return -errno;
+
+	/* Small messages: don't wait for coalescing */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return sock;
+}
+
+/* Connects sock to the address of the last open */
+static int connect_tcp(int sock, uint8_t to_addr)
+{
+	int on = 1;
+
+	if (connect(sock, (struct sockaddr *) &tcp_addr, tcp_addrlen) < 0)
+		return -errno;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return sock;
+}
+
+static ssize_t recv_tcp(int sock, void *buffer, size_t len)
+{
+	return read(sock, buffer, len);
+}
+
+static ssize_t send_tcp(int sock, const void *buffer, size_t len)
+{
+	uint8_t hdr[TCP_HDR_SIZE] = { len >> 8, len & 0xff };
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t nbytes, ret;
+	size_t total = len + TCP_HDR_SIZE;
+
+	if (len == 0 || len > TCP_MSG_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = TCP_HDR_SIZE;
+	iov[1].iov_base = (void *) buffer;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	nbytes = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (nbytes < 0)
+		return -1;
+
+	/* A partial frame would break the stream: complete it */
+	while ((size_t) nbytes < total) {
+		if ((size_t) nbytes < TCP_HDR_SIZE) {
+			iov[0].iov_base = hdr + nbytes;
+			iov[0].iov_len = TCP_HDR_SIZE - nbytes;
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+		} else {
+			iov[1].iov_base = (uint8_t *) buffer + nbytes -
+								TCP_HDR_SIZE;
+			iov[1].iov_len = total - nbytes;
+			msg.msg_iov = &iov[1];
+			msg.msg_iovlen = 1;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, TCP_TX_TIMEOUT_MS) == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		ret = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		nbytes += ret;
+	}
+
+	return len;
+}
+
+static void close_tcp(int sock)
+{
+	close(sock);
+}
+
+static ssize_t frame_tcp(const void *buffer, size_t len, size_t *hdrlen)
+{
+	const uint8_t *hdr = buffer;
+	size_t size;
+
+	*hdrlen = TCP_HDR_SIZE;
+
+	if (len < TCP_HDR_SIZE)
+		return 0;
+
+	size = (hdr[0] << 8) | hdr[1];
+	if (size == 0 || size > TCP_MSG_MAX)
+		return -EBADMSG;
+
+	return size + TCP_HDR_SIZE;
+}
+
+struct phy_driver phy_tcp = {
+	.name = "TCP",
+	.probe = probe_tcp,
+	.remove = remove_tcp,
+	.open = open_tcp,
+	.listen = listen_tcp,
+	.accept = accept_tcp,
+	.connect = connect_tcp,
+	.recv = recv_tcp,
+	.send = send_tcp,
+	.close = close_tcp,
+	.frame = frame_tcp,
+};
@@ -7,9 +7,11 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -54,7 +56,7 @@ static int listen_unix(int sock, uint8_t channel)
 {
 	int err;
 
-	if (listen(sock, 1) == -1) {
+	if (listen(sock, SOMAXCONN) == -1) {
 		err = -errno;
 		return err;
 	}
@@ -79,7 +81,7 @@ static int connect_unix(int sock, uint8_t to_addr)
 
 static int accept_unix(int srv_sock)
 {
-	return accept(srv_sock, NULL, NULL);
+	return accept4(srv_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 }
 
 static ssize_t recv_unix(int sock, void *buffer, size_t len)
@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <ucontext.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "phy_driver_sim.h"
+#include "simnet.h"
+#include "simthing.h"
+#include "stamp.h"
+#include "vclock.h"
+
+/*
+ * Capacity planner: a whole network on a virtual clock. The gateway runs
+ * comm_nrf24l01 on "SIM0" as nrfd does and every thing an instance of
+ * comm_nrf24l01 of its own (simthing), reporting stamped messages at a
+ * given rate. Simulated radios take their airtime, overlapping frames
+ * collide unless the stronger one is captured, and the retransmissions
+ * follow ARD/ARC. Each stack runs in a context of its own (simnet), as
+ * its next deadline (hal_comm_next_timeout()) or a frame received comes.
+ *
+ * Each point of the sweep (things x rate) reports the delivery ratio of
+ * the reports, their latency and the utilization of the channels. The
+ * clock being virtual, a point only depends on its parameters and the
+ * seed: ten minutes of network take seconds.
+ */
+
+#define STACK_NODE		0	/* "SIM0": first node */
+#define PEERS_MAX		5	/* comm_nrf24l01 data pipes */
+#define THINGS_MAX		(SIM_NODES_MAX - 1)
+#define POINTS_MAX		16	/* Per list */
+#define DRAIN_US		2000000	/* Reports still in flight */
+#define POWER_UP_US		1000000	/* Things start within */
+
+struct gw_peer {
+	int sockfd;
+	uint64_t mac;
+};
+
+struct cap_thing {
+	struct simnet_stack stack;
+	uint32_t id;
+	struct simthing sim;
+	int node;			/* -1: not powered up yet */
+	int level;
+	uint64_t power_us;		/* Powered up at */
+	uint64_t report_us;		/* Next report */
+	uint32_t seq;
+};
+
+struct point {
+	int things;
+	double rate;
+	uint64_t start_us;		/* Measurement window */
+	uint64_t end_us;
+	bool measuring;
+	uint32_t offered;		/* Reports in the window */
+	uint32_t refused;		/* Not connected or previous pending */
+	uint32_t delivered;
+	uint64_t air_mgmt;		/* Airtime (us) per channel */
+	uint64_t air_raw;
+	int connected;			/* At the end of the window */
+	struct hist latency;
+	struct sim_stats stats;
+};
+
+static struct gw_peer gw_peers[PEERS_MAX];
+static struct simnet_stack gw_stack;
+static struct cap_thing things[THINGS_MAX];
+static int nthings;
+static int powered;			/* Things powered up */
+static struct point point;
+static uint32_t random_state;
+
+static const char *opt_things = "1,2,5,10,20";
+static const char *opt_rates = "0.1,1,10";
+static int opt_size = 32;
+static int opt_duration = 600;
+static int opt_warmup = 30;
+static gboolean opt_periodic = FALSE;
+static int opt_capture = 9;
+static const char *opt_levels = "-80,-50";
+static double opt_loss = 0;
+static int opt_seed = 1;
+static gboolean opt_json = FALSE;
+
+static GOptionEntry options[] = {
+	{ "things", 'n', 0, G_OPTION_ARG_STRING, &opt_things,
+			"list", "Things per point (default 1,2,5,10,20)" },
+	{ "rate", 'r', 0, G_OPTION_ARG_STRING, &opt_rates,
+			"list", "Reports/s per thing (default 0.1,1,10)" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &opt_size,
+			"bytes", "Report size (default 32)" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration,
+			"seconds", "Measured per point (default 600)" },
+	{ "warmup", 'w', 0, G_OPTION_ARG_INT, &opt_warmup,
+			"seconds", "Connection setup (default 30)" },
+	{ "periodic", 'p', 0, G_OPTION_ARG_NONE, &opt_periodic,
+			NULL, "Periodic reports (default: Poisson)" },
+	{ "capture", 'c', 0, G_OPTION_ARG_INT, &opt_capture,
+			"dB", "Capture threshold (default 9)" },
+	{ "levels", 0, 0, G_OPTION_ARG_STRING, &opt_levels,
+			"min,max", "Levels of the things (default -80,-50)" },
+	{ "loss", 'l', 0, G_OPTION_ARG_DOUBLE, &opt_loss,
+			"percent", "Frame and ACK loss (default 0)" },
+	{ "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+			"seed", "Traffic and loss pattern (default 1)" },
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &opt_json,
+			NULL, "JSON output" },
+	{ NULL },
+};
+
+static int parse_list(const char *str, double *values, int max)
+{
+	char *list, *token, *saveptr, *end;
+	int count = 0, err = 0;
+
+	list = g_strdup(str);
+	for (token = strtok_r(list, ",", &saveptr); token;
+				token = strtok_r(NULL, ",", &saveptr)) {
+		if (count == max) {
+			err = -EINVAL;
+			break;
+		}
+
+		values[count] = strtod(token, &end);
+		if (end == token || *end != '\0') {
+			err = -EINVAL;
+			break;
+		}
+
+		count++;
+	}
+
+	g_free(list);
+
+	return err ? err : count;
+}
+
+/* Uniform in (0, 1]: same seed, same traffic */
+static double random_uniform(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+
+	return (random_state + 1.0) / 4294967296.0;
+}
+
+static uint64_t report_interval(void)
+{
+	double mean = 1000000.0 / point.rate;
+
+	if (opt_periodic)
+		return mean;
+
+	return -log(random_uniform()) * mean;
+}
+
+static void tap(const struct sim_frame *frame, int delivered, bool acked,
+							void *user_data)
+{
+	uint32_t airtime;
+
+	if (!point.measuring)
+		return;
+
+	airtime = sim_airtime(frame->len);
+	if (acked && frame->ack)
+		airtime += sim_airtime(0);
+
+	if (frame->channel == NRF24_MGMT_CHANNEL)
+		point.air_mgmt += airtime;
+	else
+		point.air_raw += airtime;
+}
+
+static struct gw_peer *gw_peer_get(uint64_t mac)
+{
+	int i;
+
+	for (i = 0; i < PEERS_MAX; i++) {
+		if (gw_peers[i].sockfd >= 0 && gw_peers[i].mac == mac)
+			return &gw_peers[i];
+	}
+
+	return NULL;
+}
+
+/* As nrfd: things beyond the data pipes stay in presence */
+static void gw_presence(const struct mgmt_evt_nrf24_bcast_presence *evt)
+{
+	uint64_t mac = evt->mac.address.uint64;
+	struct gw_peer *peer;
+	int sockfd, i;
+
+	/* Already connected: the thing didn't get CONNECT_REQ yet */
+	peer = gw_peer_get(mac);
+	if (peer) {
+		hal_comm_connect(peer->sockfd, &mac);
+		return;
+	}
+
+	for (i = 0; i < PEERS_MAX && gw_peers[i].sockfd >= 0; i++)
+		;
+
+	if (i == PEERS_MAX)
+		return;
+
+	sockfd = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (sockfd < 0)
+		return;
+
+	if (hal_comm_connect(sockfd, &mac) < 0) {
+		hal_comm_close(sockfd);
+		return;
+	}
+
+	gw_peers[i].sockfd = sockfd;
+	gw_peers[i].mac = mac;
+}
+
+static void gw_disconnected(const struct mgmt_evt_nrf24_disconnected *evt)
+{
+	struct gw_peer *peer;
+
+	peer = gw_peer_get(evt->mac.address.uint64);
+	if (!peer)
+		return;
+
+	hal_comm_close(peer->sockfd);
+	peer->sockfd = -1;
+}
+
+static void gw_report(const void *buffer, ssize_t len)
+{
+	const struct stamp_msg *msg;
+	uint64_t now = hal_time64_us();
+
+	msg = stamp_parse(buffer, len);
+	if (!msg || msg->time_us < point.start_us ||
+					msg->time_us >= point.end_us)
+		return;
+
+	point.delivered++;
+	hist_add(&point.latency, now - msg->time_us);
+}
+
+/* As nrfd: management events, then the reports of each link */
+static void gw_run(void)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	ssize_t len;
+	int i;
+
+	len = hal_comm_read(0, buffer, sizeof(buffer));
+	if (len > (ssize_t) sizeof(*mhdr)) {
+		if (mhdr->opcode == MGMT_EVT_NRF24_BCAST_PRESENCE)
+			gw_presence((void *) mhdr->payload);
+		else if (mhdr->opcode == MGMT_EVT_NRF24_DISCONNECTED)
+			gw_disconnected((void *) mhdr->payload);
+	}
+
+	for (i = 0; i < PEERS_MAX; i++) {
+		if (gw_peers[i].sockfd < 0)
+			continue;
+
+		len = hal_comm_read(gw_peers[i].sockfd, buffer,
+							sizeof(buffer));
+		if (len > 0)
+			gw_report(buffer, len);
+	}
+}
+
+static void gw_stack_run(struct simnet_stack *stack)
+{
+	gw_run();
+	simnet_schedule(stack, hal_comm_next_timeout());
+}
+
+/* SIM0 opens the lowest free node: the next one, none is freed meanwhile */
+static void thing_power_up(struct cap_thing *t)
+{
+	int err;
+
+	t->power_us = UINT64_MAX;
+
+	err = simthing_init(&t->sim, 0x0102030405060700ULL + t->id + 1, 0);
+	if (err < 0)
+		return;
+
+	t->node = ++powered;
+	sim_node_set_level(t->node, t->level);
+	sim_node_set_irq(t->node, simnet_irq, &t->stack);
+}
+
+/* Due at its deadline, its next report or its power up */
+static void thing_run(struct simnet_stack *stack)
+{
+	struct cap_thing *t = stack->user_data;
+	uint8_t buffer[SIMTHING_MSG_MAX];
+	uint64_t now = hal_time64_us();
+	ssize_t len;
+
+	if (t->node < 0 && now >= t->power_us)
+		thing_power_up(t);
+
+	if (t->node >= 0)
+		simthing_run(&t->sim);
+	now = hal_time64_us();
+
+	if (now >= t->report_us && now < point.end_us) {
+		t->report_us += report_interval();
+
+		len = stamp_fill(buffer, opt_size, t->id, t->seq++, now);
+		if ((t->node < 0 || simthing_write(&t->sim, buffer,
+					len) < 0) && now >= point.start_us)
+			point.refused++;
+
+		if (now >= point.start_us)
+			point.offered++;
+
+		/* Sent now rather than at the next deadline */
+		if (t->node >= 0)
+			simthing_run(&t->sim);
+	} else if (now >= point.end_us)
+		t->report_us = UINT64_MAX;
+
+	if (t->node >= 0)
+		simnet_schedule(stack, simthing_next(&t->sim));
+	else
+		stack->due_us = t->power_us;
+
+	if (t->report_us < stack->due_us)
+		stack->due_us = t->report_us;
+}
+
+static int point_setup(int count, int level_min, int level_max)
+{
+	struct nrf24_mac gw_mac = { .address.uint64 = 0xc0ffee0000000001ULL };
+	struct cap_thing *t;
+	uint64_t now;
+	int err, i;
+
+	err = hal_comm_init("SIM0", &gw_mac);
+	if (err < 0)
+		return err;
+
+	if (hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT) < 0) {
+		hal_comm_deinit();
+		return -EIO;
+	}
+
+	for (i = 0; i < PEERS_MAX; i++)
+		gw_peers[i].sockfd = -1;
+
+	now = hal_time64_us();
+
+	err = simnet_add(&gw_stack, gw_stack_run, NULL);
+	if (err < 0)
+		return err;
+
+	sim_node_set_irq(STACK_NODE, simnet_irq, &gw_stack);
+	gw_stack.due_us = now;
+	powered = 0;
+
+	for (nthings = 0; nthings < count; nthings++) {
+		t = &things[nthings];
+
+		err = simnet_add(&t->stack, thing_run, t);
+		if (err < 0)
+			return err;
+
+		t->id = nthings;
+
+		/* Spread between the nearest and the farthest thing */
+		t->level = level_max;
+		if (count > 1)
+			t->level -= (level_max - level_min) * nthings /
+								(count - 1);
+
+		/* Powered up apart: presences out of step */
+		t->node = -1;
+		t->power_us = now + random_uniform() * POWER_UP_US;
+
+		/* Periodic reports: random phases */
+		t->report_us = now + (opt_periodic ?
+				random_uniform() * 1000000.0 / point.rate :
+				report_interval());
+		t->seq = 0;
+
+		t->stack.due_us = t->power_us < t->report_us ?
+					t->power_us : t->report_us;
+	}
+
+	return 0;
+}
+
+static void point_cleanup(void)
+{
+	int i;
+
+	simnet_clear();
+
+	for (i = 0; i < nthings; i++) {
+		if (things[i].node >= 0)
+			simthing_deinit(&things[i].sim);
+	}
+
+	nthings = 0;
+	hal_comm_deinit();
+}
+
+static int point_run(int count, double rate, int level_min, int level_max)
+{
+	uint64_t now, stop, event;
+	int err, i;
+
+	memset(&point, 0, sizeof(point));
+	point.things = count;
+	point.rate = rate;
+	hist_init(&point.latency);
+
+	err = point_setup(count, level_min, level_max);
+	if (err < 0) {
+		point_cleanup();
+		return err;
+	}
+
+	now = hal_time64_us();
+	point.start_us = now + opt_warmup * 1000000ULL;
+	point.end_us = point.start_us + opt_duration * 1000000ULL;
+	stop = point.end_us + DRAIN_US;
+
+	for (;;) {
+		now = hal_time64_us();
+		if (now >= stop)
+			break;
+
+		if (!point.measuring && now >= point.start_us) {
+			point.measuring = true;
+			sim_reset_stats();
+		}
+
+		simnet_run(now);
+
+		/* Up to the next stack, the window bounds on time */
+		event = simnet_next();
+		if (!point.measuring && event > point.start_us)
+			event = point.start_us;
+		if (event > stop)
+			event = stop;
+
+		vclock_wait_until(event);
+	}
+
+	sim_get_stats(&point.stats);
+	simnet_finish();
+
+	for (i = 0; i < nthings; i++) {
+		if (things[i].node >= 0 && simthing_connected(&things[i].sim))
+			point.connected++;
+	}
+
+	point_cleanup();
+
+	return 0;
+}
+
+static void print_header(void)
+{
+	if (opt_json) {
+		printf("[\n");
+		return;
+	}
+
+	printf("%6s %7s %8s %8s %7s %8s %8s %6s %6s %8s %8s %8s %5s\n",
+		"Things", "Rate", "Offered", "Deliv", "Ratio", "p50 ms",
+		"p99 ms", "Mgmt", "Raw", "Collis", "Capture", "Retx",
+		"Conn");
+}
+
+static void print_point(bool last)
+{
+	double seconds = (point.end_us - point.start_us) / 1000000.0;
+	double ratio, p50, p99, mgmt, raw;
+
+	ratio = point.offered ? 100.0 * point.delivered / point.offered : 0;
+	p50 = hist_percentile(&point.latency, 500) / 1000.0;
+	p99 = hist_percentile(&point.latency, 990) / 1000.0;
+	mgmt = 100.0 * point.air_mgmt / (seconds * 1000000.0);
+	raw = 100.0 * point.air_raw / (seconds * 1000000.0);
+
+	if (!opt_json) {
+		printf("%6d %7.2f %8u %8u %6.1f%% %8.1f %8.1f %5.1f%% "
+			"%5.1f%% %8llu %8llu %8llu %5d\n", point.things,
+			point.rate, point.offered, point.delivered, ratio,
+			p50, p99, mgmt, raw,
+			(unsigned long long) point.stats.collisions,
+			(unsigned long long) point.stats.captures,
+			(unsigned long long) point.stats.retransmits,
+			point.connected);
+		fflush(stdout);
+		return;
+	}
+
+	printf("  { \"things\": %d, \"rate\": %.3f, \"offered\": %u, "
+		"\"refused\": %u, \"delivered\": %u, \"ratio\": %.4f, "
+		"\"latency_us_p50\": %llu, \"latency_us_p99\": %llu, "
+		"\"utilization_mgmt\": %.4f, \"utilization_raw\": %.4f, "
+		"\"frames\": %llu, \"collisions\": %llu, "
+		"\"captures\": %llu, \"retransmits\": %llu, "
+		"\"failed\": %llu, \"connected\": %d }%s\n",
+		point.things, point.rate, point.offered, point.refused,
+		point.delivered, ratio / 100,
+		(unsigned long long) hist_percentile(&point.latency, 500),
+		(unsigned long long) hist_percentile(&point.latency, 990),
+		mgmt / 100, raw / 100,
+		(unsigned long long) point.stats.frames,
+		(unsigned long long) point.stats.collisions,
+		(unsigned long long) point.stats.captures,
+		(unsigned long long) point.stats.retransmits,
+		(unsigned long long) point.stats.failed,
+		point.connected, last ? "" : ",");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct sim_params params;
+	double counts[POINTS_MAX], rates[POINTS_MAX], levels[2];
+	int ncounts, nrates, i, j, err;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	ncounts = parse_list(opt_things, counts, POINTS_MAX);
+	for (i = 0; i < ncounts; i++) {
+		if (counts[i] < 1 || counts[i] > THINGS_MAX)
+			ncounts = -EINVAL;
+	}
+
+	nrates = parse_list(opt_rates, rates, POINTS_MAX);
+	for (i = 0; i < nrates; i++) {
+		if (rates[i] <= 0 || rates[i] > 1000)
+			nrates = -EINVAL;
+	}
+
+	if (ncounts <= 0 || nrates <= 0 ||
+			parse_list(opt_levels, levels, 2) != 2 ||
+			levels[0] > levels[1] || levels[0] < -127 ||
+			levels[1] > 20 || opt_size < (int) STAMP_MSG_MIN ||
+			opt_size > SIMTHING_MSG_MAX || opt_duration < 1 ||
+			opt_warmup < 0 || opt_capture < 0 ||
+			opt_capture > 100 || opt_loss < 0 || opt_loss > 100) {
+		printf("Invalid arguments (things: 1 to %d per point, up to "
+			"%d points, report size: %zu to %d bytes)\n",
+			THINGS_MAX, POINTS_MAX, STAMP_MSG_MIN,
+			SIMTHING_MSG_MAX);
+		return EXIT_FAILURE;
+	}
+
+	sim_get_params(&params);
+	params.loss = opt_loss * 10000;
+	params.seed = opt_seed;
+	params.collisions = true;
+	params.capture = opt_capture;
+	sim_set_params(&params);
+	sim_set_tap(tap, NULL);
+
+	/* Points follow each other: the stack timers never go back */
+	vclock_init(0, opt_seed);
+	random_state = opt_seed ? opt_seed : 1;
+
+	if (!opt_json) {
+		printf("Capacity: %d s per point after %d s, %d bytes "
+			"%s reports, capture %d dB, %.2f%% loss\n",
+			opt_duration, opt_warmup, opt_size,
+			opt_periodic ? "periodic" : "Poisson", opt_capture,
+			opt_loss);
+		fflush(stdout);
+	}
+
+	print_header();
+
+	for (i = 0; i < ncounts; i++) {
+		for (j = 0; j < nrates; j++) {
+			err = point_run(counts[i], rates[j], levels[0],
+								levels[1]);
+			if (err < 0) {
+				printf("Point %d things, %.2f/s: %s\n",
+						(int) counts[i], rates[j],
+						strerror(-err));
+				return EXIT_FAILURE;
+			}
+
+			print_point(i == ncounts - 1 && j == nrates - 1);
+		}
+	}
+
+	if (opt_json)
+		printf("]\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "include/time.h"
+#include "phy_driver_air.h"
+
+/*
+ * Virtual air broker: "AIR0" radios (src/drivers/phy_driver_air.c) of
+ * any process on this host attach to it, nrfd and things alike. A frame
+ * is on the air during its airtime at --bitrate; frames overlapping on
+ * the same channel collide and nobody receives them. Otherwise every
+ * node listening on the channel with a pipe open on the destination
+ * address gets it, each copy and each ACK dropped with --loss. The
+ * transmitter gets the ACK status when the frame leaves the air.
+ */
+
+#define EVENTS_MAX		64
+#define FLIGHTS_MAX		4096
+#define SOCKET_BUFFER_SIZE	(4 * 1024 * 1024)
+#define SOCKET_DATA		0
+#define SIGNAL_DATA		1
+#define TIMER_DATA		2
+
+struct air_msg {
+	struct air_hdr hdr;
+	union {
+		struct air_radio radio;
+		struct air_tx tx;
+		struct air_tx_status status;
+		struct air_rx rx;
+	};
+} __attribute__ ((packed));
+
+/* Last packet accepted on a pipe: duplicate detection */
+struct last_rx {
+	uint32_t src;
+	uint8_t pid;
+	uint32_t crc;
+	bool valid;
+};
+
+struct node {
+	uint32_t id;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct air_radio radio;
+	bool transmitting;	/* PTX: doesn't receive */
+	bool gone;		/* Process exited without detaching */
+	struct last_rx last[AIR_PIPES];
+};
+
+struct flight {
+	struct node *src;	/* NULL: transmitter detached */
+	uint16_t seq;
+	struct air_tx tx;
+	uint64_t end_us;
+	bool collided;
+};
+
+struct counters {
+	uint64_t attached;
+	uint64_t detached;
+	uint64_t frames;
+	uint64_t acked;
+	uint64_t nacked;
+	uint64_t collisions;	/* Frames destroyed by an overlap */
+	uint64_t lost;		/* Copies and ACKs dropped by --loss */
+	uint64_t delivered;
+	uint64_t duplicates;	/* Retransmissions acked, not delivered */
+	uint64_t dropped;	/* Node socket full */
+	uint64_t airtime;	/* Sum of the frame airtimes (us) */
+};
+
+static GHashTable *nodes;	/* Socket name: struct node */
+static struct flight flights[FLIGHTS_MAX];
+static unsigned int flight_count;
+static struct counters counters;
+static uint32_t next_id = 1;
+static uint32_t random_state = 1;
+static int sock = -1;
+static int timerfd = -1;
+
+static char *opt_address = AIR_DEFAULT_ADDRESS;
+static double opt_loss = 0;
+static int opt_bitrate = 1000000;
+static gboolean opt_no_collisions = FALSE;
+static int opt_seed = 1;
+static int opt_stats = 0;
+
+static GOptionEntry options[] = {
+	{ "address", 'a', 0, G_OPTION_ARG_STRING, &opt_address,
+			"name", "Abstract socket name (default "
+						AIR_DEFAULT_ADDRESS ")" },
+	{ "loss", 'l', 0, G_OPTION_ARG_DOUBLE, &opt_loss,
+			"percent", "Frame and ACK loss (default 0)" },
+	{ "bitrate", 'b', 0, G_OPTION_ARG_INT, &opt_bitrate,
+		"bit/s", "Air data rate: 250000, 1000000 or 2000000" },
+	{ "no-collisions", 'C', 0, G_OPTION_ARG_NONE, &opt_no_collisions,
+			NULL, "Overlapping frames don't collide" },
+	{ "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+			"seed", "Loss pattern (default 1)" },
+	{ "stats", 't', 0, G_OPTION_ARG_INT, &opt_stats,
+			"seconds", "Statistics report interval (0: at exit)" },
+	{ NULL },
+};
+
+/* xorshift32: deterministic for a given seed */
+static bool lost(void)
+{
+	if (opt_loss <= 0)
+		return false;
+
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+
+	if (random_state % 1000000 >= opt_loss * 10000)
+		return false;
+
+	counters.lost++;
+
+	return true;
+}
+
+/* FNV-1a, stands for the packet CRC */
+static uint32_t frame_crc(const uint8_t *payload, size_t len)
+{
+	uint32_t crc = 2166136261U;
+
+	while (len--) {
+		crc ^= *payload++;
+		crc *= 16777619U;
+	}
+
+	return crc;
+}
+
+/* Preamble, address, 9 bits control field, payload and 16 bits CRC */
+static uint32_t airtime(size_t len)
+{
+	uint32_t bits = (1 + AIR_AA_SIZE + len + 2) * 8 + 9;
+
+	return (bits * 1000000ULL + opt_bitrate - 1) / opt_bitrate;
+}
+
+static char *node_key(const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	size_t len = addrlen - offsetof(struct sockaddr_un, sun_path);
+
+	/* Abstract: skips the leading NUL */
+	if (len > 0 && addr->sun_path[0] == '\0')
+		return g_strndup(addr->sun_path + 1, len - 1);
+
+	return g_strndup(addr->sun_path, len);
+}
+
+static int node_send(struct node *node, const struct air_msg *msg,
+								size_t len)
+{
+	if (sendto(sock, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+			(const struct sockaddr *) &node->addr,
+						node->addrlen) < 0) {
+		if (errno == EAGAIN)
+			counters.dropped++;
+		else if (errno == ECONNREFUSED || errno == ENOENT)
+			node->gone = true;
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void node_detach(const char *key)
+{
+	struct node *node = g_hash_table_lookup(nodes, key);
+	unsigned int i;
+
+	if (node == NULL)
+		return;
+
+	for (i = 0; i < flight_count; i++) {
+		if (flights[i].src == node)
+			flights[i].src = NULL;
+	}
+
+	g_hash_table_remove(nodes, key);
+	counters.detached++;
+}
+
+static gboolean node_gone(gpointer key, gpointer value, gpointer user_data)
+{
+	struct node *node = value;
+	unsigned int i;
+
+	if (!node->gone)
+		return FALSE;
+
+	for (i = 0; i < flight_count; i++) {
+		if (flights[i].src == node)
+			flights[i].src = NULL;
+	}
+
+	counters.detached++;
+
+	return TRUE;
+}
+
+static int match_pipe(const struct node *node, const uint8_t *aa)
+{
+	int pipe;
+
+	for (pipe = 0; pipe < AIR_PIPES; pipe++) {
+		if ((node->radio.pipe_en & (1 << pipe)) &&
+			memcmp(node->radio.aa[pipe], aa, AIR_AA_SIZE) == 0)
+			return pipe;
+	}
+
+	return -1;
+}
+
+static void timer_arm(void)
+{
+	struct itimerspec its;
+	uint64_t next = UINT64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < flight_count; i++) {
+		if (flights[i].end_us < next)
+			next = flights[i].end_us;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		/* Zero disarms: expired frames fire right away */
+		if (next == 0)
+			next = 1;
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = (next % 1000000) * 1000;
+	}
+
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void deliver(struct flight *f, struct air_tx_status *status)
+{
+	GHashTableIter iter;
+	gpointer value;
+	struct node *rx;
+	struct last_rx *last;
+	struct air_msg msg;
+	uint32_t crc = frame_crc(f->tx.payload, f->tx.len);
+	bool ack_rx;
+	int pipe;
+
+	memset(&msg.hdr, 0, sizeof(msg.hdr));
+	msg.hdr.op = AIR_OP_RX;
+	msg.rx.len = f->tx.len;
+	memcpy(msg.rx.payload, f->tx.payload, f->tx.len);
+
+	g_hash_table_iter_init(&iter, nodes);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		rx = value;
+		if (rx == f->src || rx->gone || !rx->radio.rx ||
+					rx->transmitting ||
+				rx->radio.channel != f->src->radio.channel)
+			continue;
+
+		pipe = match_pipe(rx, f->tx.aa);
+		if (pipe < 0 || lost())
+			continue;
+
+		ack_rx = f->tx.ack && (rx->radio.pipe_ack & (1 << pipe));
+		last = &rx->last[pipe];
+
+		/* Same PID and CRC: ACK lost, the copy isn't delivered */
+		if (ack_rx && last->valid && last->src == f->src->id &&
+				last->pid == f->tx.pid && last->crc == crc) {
+			counters.duplicates++;
+		} else {
+			msg.rx.pipe = pipe;
+			if (node_send(rx, &msg, sizeof(msg.hdr) +
+				offsetof(struct air_rx, payload) +
+						f->tx.len) < 0 && rx->gone)
+				continue;
+
+			counters.delivered++;
+
+			last->valid = true;
+			last->src = f->src->id;
+			last->pid = f->tx.pid;
+			last->crc = crc;
+		}
+
+		if (ack_rx && !lost())
+			status->acked = 1;
+	}
+}
+
+/* Frames leaving the air: delivered unless collided */
+static void complete(uint64_t now)
+{
+	struct air_msg msg;
+	struct flight *f;
+	unsigned int i = 0;
+
+	while (i < flight_count) {
+		f = &flights[i];
+		if (f->end_us > now) {
+			i++;
+			continue;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.hdr.op = AIR_OP_TX_STATUS;
+		msg.hdr.seq = f->seq;
+
+		if (f->src) {
+			f->src->transmitting = false;
+
+			if (f->collided)
+				msg.status.collided = 1;
+			else
+				deliver(f, &msg.status);
+
+			if (msg.status.acked)
+				counters.acked++;
+			else if (f->tx.ack)
+				counters.nacked++;
+
+			node_send(f->src, &msg, sizeof(msg.hdr) +
+						sizeof(msg.status));
+		}
+
+		*f = flights[--flight_count];
+	}
+
+	g_hash_table_foreach_remove(nodes, node_gone, NULL);
+	timer_arm();
+}
+
+static void transmit(struct node *node, const struct air_msg *msg,
+								size_t len)
+{
+	struct air_msg status;
+	struct flight *f;
+	uint64_t now = hal_time64_us();
+	unsigned int i;
+	bool collided = false;
+
+	if (len < sizeof(msg->hdr) + offsetof(struct air_tx, payload) ||
+				msg->tx.len == 0 ||
+				msg->tx.len > AIR_PAYLOAD_SIZE ||
+				len < sizeof(msg->hdr) +
+				offsetof(struct air_tx, payload) + msg->tx.len)
+		return;
+
+	counters.frames++;
+
+	if (flight_count == FLIGHTS_MAX || node->transmitting) {
+		/* Not on the air: the transmitter retries */
+		memset(&status, 0, sizeof(status));
+		status.hdr.op = AIR_OP_TX_STATUS;
+		status.hdr.seq = msg->hdr.seq;
+		node_send(node, &status, sizeof(status.hdr) +
+						sizeof(status.status));
+		return;
+	}
+
+	/* Overlap on the channel: both frames are destroyed */
+	for (i = 0; !opt_no_collisions && i < flight_count; i++) {
+		if (flights[i].src == NULL ||
+				flights[i].src->radio.channel !=
+						node->radio.channel)
+			continue;
+
+		if (!flights[i].collided)
+			counters.collisions++;
+		flights[i].collided = true;
+		collided = true;
+	}
+
+	if (collided)
+		counters.collisions++;
+
+	f = &flights[flight_count++];
+	f->src = node;
+	f->seq = msg->hdr.seq;
+	f->tx = msg->tx;
+	f->end_us = now + airtime(msg->tx.len);
+	f->collided = collided;
+
+	counters.airtime += airtime(msg->tx.len);
+	node->transmitting = true;
+
+	timer_arm();
+}
+
+static void input(void)
+{
+	struct sockaddr_un addr;
+	struct air_msg msg;
+	struct node *node;
+	socklen_t addrlen;
+	ssize_t len;
+	char *key;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		len = recvfrom(sock, &msg, sizeof(msg), MSG_DONTWAIT,
+				(struct sockaddr *) &addr, &addrlen);
+		if (len < 0)
+			return;
+
+		if (len < (ssize_t) sizeof(msg.hdr) ||
+				addrlen <= offsetof(struct sockaddr_un,
+								sun_path))
+			continue;
+
+		key = node_key(&addr, addrlen);
+		node = g_hash_table_lookup(nodes, key);
+
+		switch (msg.hdr.op) {
+		case AIR_OP_RADIO:
+			if (len < (ssize_t) (sizeof(msg.hdr) +
+						sizeof(msg.radio)))
+				break;
+
+			if (node == NULL) {
+				node = g_new0(struct node, 1);
+				node->id = next_id++;
+				node->addr = addr;
+				node->addrlen = addrlen;
+				g_hash_table_insert(nodes, key, node);
+				key = NULL;
+				counters.attached++;
+			}
+
+			/* Channel switch: FIFO flushed by the node */
+			node->radio = msg.radio;
+			break;
+		case AIR_OP_TX:
+			if (node)
+				transmit(node, &msg, len);
+			break;
+		case AIR_OP_DETACH:
+			node_detach(key);
+			break;
+		default:
+			break;
+		}
+
+		g_free(key);
+	}
+}
+
+static void report(uint64_t elapsed_us)
+{
+	if (elapsed_us == 0)
+		elapsed_us = 1;
+
+	printf("Nodes: %u attached (%llu attaches, %llu detaches)\n",
+				g_hash_table_size(nodes),
+				(unsigned long long) counters.attached,
+				(unsigned long long) counters.detached);
+	printf("Frames: %llu (%llu/s), %llu acked, %llu not acked, "
+		"%llu collisions\n", (unsigned long long) counters.frames,
+		(unsigned long long) (counters.frames * 1000000 / elapsed_us),
+		(unsigned long long) counters.acked,
+		(unsigned long long) counters.nacked,
+		(unsigned long long) counters.collisions);
+	printf("Copies: %llu delivered, %llu duplicates, %llu lost, "
+		"%llu dropped\n", (unsigned long long) counters.delivered,
+		(unsigned long long) counters.duplicates,
+		(unsigned long long) counters.lost,
+		(unsigned long long) counters.dropped);
+	printf("Airtime: %llu ms (%.1f%% of the time, all channels)\n",
+		(unsigned long long) counters.airtime / 1000,
+		100.0 * counters.airtime / elapsed_us);
+}
+
+static int air_listen(void)
+{
+	struct sockaddr_un addr;
+	int fd, size = SOCKET_BUFFER_SIZE, err;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	/* Same address length as the AIR0 driver connect() */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, opt_address, sizeof(addr.sun_path) - 2);
+
+	if (bind(fd, (struct sockaddr *) &addr,
+				offsetof(struct sockaddr_un, sun_path) + 1 +
+						strlen(opt_address)) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct epoll_event ev, events[EVENTS_MAX];
+	struct signalfd_siginfo si;
+	uint64_t start, last_report, ticks;
+	sigset_t mask;
+	int epfd, sigfd, timeout, n, i;
+	bool running = true;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_loss < 0 || opt_loss > 100 || opt_stats < 0 ||
+			(opt_bitrate != 250000 && opt_bitrate != 1000000 &&
+						opt_bitrate != 2000000)) {
+		printf("Invalid arguments\n");
+		return EXIT_FAILURE;
+	}
+
+	random_state = opt_seed ? opt_seed : 1;
+	nodes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+								g_free);
+
+	sock = air_listen();
+	if (sock < 0) {
+		printf("@%s: %s\n", opt_address, strerror(-sock));
+		g_hash_table_destroy(nodes);
+		return EXIT_FAILURE;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = SOCKET_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+	ev.data.u64 = SIGNAL_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+	ev.data.u64 = TIMER_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+
+	printf("Virtual air on @%s: %d bit/s, %.2f%% loss%s\n", opt_address,
+			opt_bitrate, opt_loss,
+			opt_no_collisions ? ", no collisions" : "");
+	fflush(stdout);
+
+	start = hal_time64_us();
+	last_report = start;
+
+	while (running) {
+		timeout = opt_stats ? 1000 : -1;
+		n = epoll_wait(epfd, events, EVENTS_MAX, timeout);
+
+		for (i = 0; i < n; i++) {
+			switch (events[i].data.u64) {
+			case SOCKET_DATA:
+				input();
+				break;
+			case TIMER_DATA:
+				if (read(timerfd, &ticks, sizeof(ticks)) > 0)
+					complete(hal_time64_us());
+				break;
+			case SIGNAL_DATA:
+				if (read(sigfd, &si, sizeof(si)) > 0)
+					running = false;
+				break;
+			}
+		}
+
+		if (opt_stats && hal_time64_us() - last_report >=
+						opt_stats * 1000000ULL) {
+			last_report = hal_time64_us();
+			report(last_report - start);
+			fflush(stdout);
+		}
+	}
+
+	report(hal_time64_us() - start);
+
+	close(epfd);
+	close(timerfd);
+	close(sigfd);
+	close(sock);
+	g_hash_table_destroy(nodes);
+
+	return EXIT_SUCCESS;
+}
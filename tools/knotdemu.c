@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <glib.h>
+
+#include "include/time.h"
+#include "stamp.h"
+
+/*
+ * knotd stand-in for end to end benchmarks: accepts the gateway
+ * sessions (nrfd, phyemud) on the knotd abstract socket and
+ *  - echo: sends every message back on its session
+ *  - sink: consumes the messages
+ *  - generate: also sends stamped messages to every session at --rate
+ * With --verify every message must be a stamp (see tools/stamp.h):
+ * the thing to knotd latency and the sequence gaps are reported, and
+ * invalid messages or losses make the exit status fail.
+ */
+
+#define KNOTD_UNIX_ADDRESS	"knot"
+#define EVENTS_MAX		256
+#define LISTEN_DATA		UINT64_MAX
+#define SIGNAL_DATA		(UINT64_MAX - 1)
+#define TIMER_DATA		(UINT64_MAX - 2)
+
+enum mode {
+	MODE_ECHO,
+	MODE_SINK,
+	MODE_GENERATE,
+};
+
+struct session {
+	int fd;			/* -1: free */
+	uint32_t id;
+	uint32_t tx_seq;	/* Generated messages */
+	uint32_t thing;		/* Last stamp received */
+	uint32_t rx_seq;
+	bool stamped;
+};
+
+struct counters {
+	uint64_t accepted;
+	uint64_t closed;
+	uint64_t msgs_rx;
+	uint64_t msgs_tx;
+	uint64_t bytes_rx;
+	uint64_t bytes_tx;
+	uint64_t dropped;	/* Session couldn't take the message */
+	uint64_t invalid;	/* Not a stamp (--verify) */
+	uint64_t gaps;		/* Missing sequence numbers */
+	uint64_t reordered;
+};
+
+static char *opt_mode = "echo";
+static char *opt_address = KNOTD_UNIX_ADDRESS;
+static double opt_rate = 1.0;
+static int opt_size = 32;
+static int opt_duration = 0;
+static int opt_stats = 0;
+static gboolean opt_verify = FALSE;
+
+static GOptionEntry options[] = {
+	{ "mode", 'm', 0, G_OPTION_ARG_STRING, &opt_mode,
+			"mode", "echo, sink or generate (default echo)" },
+	{ "address", 'a', 0, G_OPTION_ARG_STRING, &opt_address,
+			"name", "Abstract socket name (default "
+						KNOTD_UNIX_ADDRESS ")" },
+	{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+		"rate", "generate: messages per second per session" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &opt_size,
+			"bytes", "generate: message size (default 32)" },
+	{ "verify", 'v', 0, G_OPTION_ARG_NONE, &opt_verify,
+			NULL, "Check stamps, measure thing to knotd latency" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration,
+			"seconds", "Exit after seconds (default: on signal)" },
+	{ "stats", 't', 0, G_OPTION_ARG_INT, &opt_stats,
+			"seconds", "Statistics report interval (0: at exit)" },
+	{ NULL },
+};
+
+static enum mode mode;
+static struct session *sessions;	/* Indexed by fd */
+static unsigned int sessions_size;
+static struct counters counters;
+static struct hist uplink;
+
+static void session_close(struct session *s)
+{
+	close(s->fd);
+	s->fd = -1;
+	counters.closed++;
+}
+
+static void session_send(struct session *s, const void *buffer, size_t len)
+{
+	if (send(s->fd, buffer, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno == EAGAIN)
+			counters.dropped++;
+		else
+			session_close(s);
+		return;
+	}
+
+	counters.msgs_tx++;
+	counters.bytes_tx += len;
+}
+
+static void verify(struct session *s, const void *buffer, size_t len)
+{
+	const struct stamp_msg *stamp;
+	uint64_t now = hal_time64_us();
+
+	stamp = stamp_parse(buffer, len);
+	if (stamp == NULL) {
+		counters.invalid++;
+		return;
+	}
+
+	/* Same host: both sides read CLOCK_MONOTONIC */
+	if (stamp->time_us <= now)
+		hist_add(&uplink, now - stamp->time_us);
+
+	if (s->stamped && stamp->thing == s->thing) {
+		if (stamp->seq > s->rx_seq + 1)
+			counters.gaps += stamp->seq - s->rx_seq - 1;
+		else if (stamp->seq <= s->rx_seq)
+			counters.reordered++;
+	}
+
+	if (!s->stamped || stamp->thing != s->thing ||
+						stamp->seq > s->rx_seq) {
+		s->thing = stamp->thing;
+		s->rx_seq = stamp->seq;
+		s->stamped = true;
+	}
+}
+
+static void session_input(struct session *s)
+{
+	uint8_t buffer[STAMP_MSG_MAX + 1];
+	ssize_t len;
+
+	for (;;) {
+		len = recv(s->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (len <= 0) {
+			session_close(s);
+			return;
+		}
+
+		counters.msgs_rx++;
+		counters.bytes_rx += len;
+
+		if (opt_verify)
+			verify(s, buffer, len);
+
+		if (mode == MODE_ECHO)
+			session_send(s, buffer, len);
+
+		if (s->fd < 0)
+			return;
+	}
+}
+
+static void accept_sessions(int epfd, int srv_sock)
+{
+	struct epoll_event ev;
+	struct session *s;
+	static uint32_t next_id;
+	int sock;
+
+	for (;;) {
+		sock = accept4(srv_sock, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0)
+			return;
+
+		if ((unsigned int) sock >= sessions_size) {
+			close(sock);
+			continue;
+		}
+
+		s = &sessions[sock];
+		memset(s, 0, sizeof(*s));
+		s->fd = sock;
+		s->id = next_id++;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = sock;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+			session_close(s);
+			continue;
+		}
+
+		counters.accepted++;
+	}
+}
+
+static void generate(void)
+{
+	uint8_t buffer[STAMP_MSG_MAX];
+	struct session *s;
+	uint64_t now = hal_time64_us();
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < sessions_size; i++) {
+		s = &sessions[i];
+		if (s->fd < 0)
+			continue;
+
+		len = stamp_fill(buffer, opt_size, s->id, s->tx_seq++, now);
+		session_send(s, buffer, len);
+	}
+}
+
+static void report(uint64_t elapsed_us)
+{
+	if (elapsed_us == 0)
+		elapsed_us = 1;
+
+	printf("Sessions: %llu accepted, %llu closed\n",
+				(unsigned long long) counters.accepted,
+				(unsigned long long) counters.closed);
+	printf("Messages: %llu received (%llu/s), %llu sent (%llu/s), "
+				"%llu dropped\n",
+		(unsigned long long) counters.msgs_rx,
+		(unsigned long long) (counters.msgs_rx * 1000000 / elapsed_us),
+		(unsigned long long) counters.msgs_tx,
+		(unsigned long long) (counters.msgs_tx * 1000000 / elapsed_us),
+		(unsigned long long) counters.dropped);
+
+	if (!opt_verify)
+		return;
+
+	printf("Stamps: %llu invalid, %llu gaps, %llu reordered\n",
+				(unsigned long long) counters.invalid,
+				(unsigned long long) counters.gaps,
+				(unsigned long long) counters.reordered);
+
+	if (uplink.count == 0)
+		return;
+
+	printf("Thing to knotd: min %llu p50 %llu p99 %llu p999 %llu "
+			"max %llu us\n",
+			(unsigned long long) uplink.min,
+			(unsigned long long) hist_percentile(&uplink, 500),
+			(unsigned long long) hist_percentile(&uplink, 990),
+			(unsigned long long) hist_percentile(&uplink, 999),
+			(unsigned long long) uplink.max);
+}
+
+static int unix_listen(void)
+{
+	struct sockaddr_un addr;
+	int sock, err;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+									0);
+	if (sock < 0)
+		return -errno;
+
+	/* Same address length as the connect() of nrfd and phyemud */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, opt_address, sizeof(addr.sun_path) - 2);
+
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+					listen(sock, SOMAXCONN) < 0) {
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+static int timer_start(int epfd, double rate)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	uint64_t period_ns = 1000000000.0 / rate;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (period_ns == 0)
+		period_ns = 1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = period_ns / 1000000000;
+	its.it_interval.tv_nsec = period_ns % 1000000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(fd, 0, &its, NULL);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = TIMER_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct epoll_event ev, events[EVENTS_MAX];
+	struct rlimit rl;
+	sigset_t mask;
+	uint64_t start, last_report, end, next, now, ticks;
+	struct session *s;
+	int epfd, srv_sock, sigfd, timerfd = -1, timeout, n, i;
+	unsigned int fd;
+	bool running = true;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (strcmp(opt_mode, "echo") == 0)
+		mode = MODE_ECHO;
+	else if (strcmp(opt_mode, "sink") == 0)
+		mode = MODE_SINK;
+	else if (strcmp(opt_mode, "generate") == 0)
+		mode = MODE_GENERATE;
+	else {
+		printf("Unknown mode: %s\n", opt_mode);
+		return EXIT_FAILURE;
+	}
+
+	if (opt_duration < 0 || opt_stats < 0 ||
+			(mode == MODE_GENERATE && opt_rate <= 0) ||
+			opt_size < (int) STAMP_MSG_MIN ||
+			opt_size > STAMP_MSG_MAX) {
+		printf("Invalid arguments (message size: %zu to %d bytes)\n",
+					STAMP_MSG_MIN, STAMP_MSG_MAX);
+		return EXIT_FAILURE;
+	}
+
+	/* One session per gateway connection: up to the fd limit */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	sessions_size = rl.rlim_cur > 1048576 ? 1048576 : rl.rlim_cur;
+	sessions = g_new0(struct session, sessions_size);
+	for (fd = 0; fd < sessions_size; fd++)
+		sessions[fd].fd = -1;
+
+	hist_init(&uplink);
+	signal(SIGPIPE, SIG_IGN);
+
+	srv_sock = unix_listen();
+	if (srv_sock < 0) {
+		printf("@%s: %s\n", opt_address, strerror(-srv_sock));
+		g_free(sessions);
+		return EXIT_FAILURE;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = LISTEN_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, srv_sock, &ev);
+	ev.data.u64 = SIGNAL_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+	if (mode == MODE_GENERATE)
+		timerfd = timer_start(epfd, opt_rate);
+
+	printf("knotd emulator on @%s: %s%s\n", opt_address, opt_mode,
+					opt_verify ? ", verifying stamps" : "");
+	fflush(stdout);
+
+	start = hal_time64_us();
+	last_report = start;
+	end = opt_duration ? start + opt_duration * 1000000ULL : UINT64_MAX;
+
+	while (running) {
+		now = hal_time64_us();
+		if (now >= end)
+			break;
+
+		if (opt_stats && now - last_report >= opt_stats * 1000000ULL) {
+			report(now - start);
+			fflush(stdout);
+			last_report = now;
+		}
+
+		/* Wakes up for the next report or the end of the run */
+		next = end;
+		if (opt_stats && last_report + opt_stats * 1000000ULL < next)
+			next = last_report + opt_stats * 1000000ULL;
+		timeout = (next == UINT64_MAX ? -1 :
+					(int) ((next - now) / 1000 + 1));
+
+		n = epoll_wait(epfd, events, EVENTS_MAX, timeout);
+		for (i = 0; i < n; i++) {
+			switch (events[i].data.u64) {
+			case LISTEN_DATA:
+				accept_sessions(epfd, srv_sock);
+				break;
+			case SIGNAL_DATA:
+				running = false;
+				break;
+			case TIMER_DATA:
+				if (read(timerfd, &ticks, sizeof(ticks)) > 0)
+					generate();
+				break;
+			default:
+				s = &sessions[events[i].data.u64];
+				if (s->fd >= 0)
+					session_input(s);
+				break;
+			}
+		}
+	}
+
+	printf("\n");
+	report(hal_time64_us() - start);
+
+	for (fd = 0; fd < sessions_size; fd++)
+		if (sessions[fd].fd >= 0)
+			close(sessions[fd].fd);
+
+	if (timerfd >= 0)
+		close(timerfd);
+	close(sigfd);
+	close(epfd);
+	close(srv_sock);
+	g_free(sessions);
+
+	if (opt_verify && (counters.invalid || counters.gaps))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1363 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "serial_link.h"
+#include "stamp.h"
+
+/*
+ * Gateway load generator: spawns virtual things on the thing side of
+ * nrfd or phyemud and measures the round trip of stamped messages
+ * echoed by knotd (or tools/knotdemu). Things connect at a controlled
+ * rate, then follow a traffic profile:
+ *  - periodic: one message every 1/rate seconds
+ *  - burst: --burst messages back to back every 1/rate seconds
+ *  - reqresp: one request in flight, next one 1/rate seconds after the
+ *    reply (immediately if rate is 0)
+ * Statistics only cover the messages sent during the measurement
+ * window, which starts once every thing went through connect().
+ */
+
+#define THING_UNIX_ADDRESS	":thing:nrfd"
+#define AIR_MAC_BASE		0x4c47000000000000ULL	/* "LG" */
+#define AIR_MSG_MAX		128	/* comm_nrf24l01 DATA_SIZE */
+#define TCP_DEFAULT_ADDRESS	"127.0.0.1:9994"
+#define TCP_HDR_SIZE		2
+
+#define CONNECT_RETRY_US	10000	/* Listen backlog full */
+#define CONNECT_TIMEOUT_US	5000000
+#define DRAIN_US		500000	/* Waits late replies */
+#define EVENTS_MAX		256
+#define TIMER_DATA		UINT64_MAX
+#define PTY_FLAG		(1ULL << 32)
+
+enum profile {
+	PROFILE_PERIODIC,
+	PROFILE_BURST,
+	PROFILE_REQRESP,
+};
+
+enum thing_state {
+	THING_IDLE,		/* Waiting its connect time */
+	THING_CONNECTING,
+	THING_SETUP,		/* Connected, waiting the first reply */
+	THING_RUNNING,
+	THING_FAILED,
+};
+
+struct thing {
+	uint32_t id;
+	int fd;
+	enum thing_state state;
+	uint8_t channel;	/* Serial: link channel */
+	bool waiting;		/* Request in flight */
+	uint32_t seq;
+	uint64_t next_us;	/* Next event: connect, send or timeout */
+	uint64_t setup_start;
+	unsigned int heap_pos;
+	uint16_t rx_len;	/* TCP: partial frame */
+	uint8_t *rx;
+};
+
+struct transport {
+	const char *name;
+	int (*start)(void);
+	void (*stop)(void);
+	/* 0: connected, -EINPROGRESS: wait EPOLLOUT, -EAGAIN: retry */
+	int (*connect)(struct thing *t);
+	int (*send)(struct thing *t, const void *msg, size_t len);
+	void (*input)(uint64_t data);
+};
+
+struct run_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t bytes;
+	uint64_t stalls;	/* Transport would block */
+	uint64_t late;		/* Schedule slips */
+	uint64_t timeouts;	/* reqresp: no reply */
+	uint64_t unsolicited;	/* Not a stamp of the thing */
+	uint64_t disconnects;
+	unsigned int pending;	/* Idle or connecting */
+	unsigned int live;
+	unsigned int failed;
+	uint64_t start_us;
+	uint64_t all_live_us;
+	uint64_t window_start;
+	uint64_t window_end;
+	struct hist setup;
+	struct hist rtt;
+};
+
+static char *opt_transport = "unix";
+static char *opt_address = NULL;
+static char *opt_profile = "periodic";
+static char *opt_spawn = NULL;
+static int opt_things = 100;
+static double opt_rate = 1.0;
+static int opt_burst = 10;
+static int opt_size = 32;
+static int opt_duration = 10;
+static double opt_connect_rate = 0;
+static int opt_timeout = 1000;
+static int opt_baud = 115200;
+static int opt_settle = 500;
+static gboolean opt_poisson = FALSE;
+
+static GOptionEntry options[] = {
+	{ "transport", 't', 0, G_OPTION_ARG_STRING, &opt_transport,
+		"list", "Comma separated: unix, tcp, serial, air "
+							"(default unix)" },
+	{ "address", 'a', 0, G_OPTION_ARG_STRING, &opt_address,
+		"address", "TCP gateway [host:]port (default "
+						TCP_DEFAULT_ADDRESS ")" },
+	{ "things", 'n', 0, G_OPTION_ARG_INT, &opt_things,
+					"things", "Virtual things (default 100)" },
+	{ "profile", 'p', 0, G_OPTION_ARG_STRING, &opt_profile,
+			"profile", "periodic, burst or reqresp (default periodic)" },
+	{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+		"rate", "Messages, bursts or requests per second per thing" },
+	{ "poisson", 'P', 0, G_OPTION_ARG_NONE, &opt_poisson,
+			NULL, "Exponential inter-arrival times" },
+	{ "burst", 'b', 0, G_OPTION_ARG_INT, &opt_burst,
+				"count", "Messages per burst (default 10)" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &opt_size,
+				"bytes", "Message size (default 32)" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration,
+			"seconds", "Measurement window (default 10)" },
+	{ "connect-rate", 'c', 0, G_OPTION_ARG_DOUBLE, &opt_connect_rate,
+		"rate", "Thing connections per second (default: all at once)" },
+	{ "timeout", 'T', 0, G_OPTION_ARG_INT, &opt_timeout,
+			"ms", "Request timeout, reqresp (default 1000)" },
+	{ "baud", 'B', 0, G_OPTION_ARG_INT, &opt_baud,
+				"baud", "Serial baud rate (default 115200)" },
+	{ "spawn", 'x', 0, G_OPTION_ARG_STRING, &opt_spawn,
+		"command", "Gateway to run for each test, %s: serial pty" },
+	{ "settle", 'S', 0, G_OPTION_ARG_INT, &opt_settle,
+			"ms", "Wait after spawning the gateway (default 500)" },
+	{ NULL },
+};
+
+static enum profile profile;
+static const struct transport *transport;
+static struct thing *things;
+static struct thing **heap;
+static unsigned int heap_count;
+static struct run_stats run;
+static int epfd = -1;
+static int timerfd = -1;
+static pid_t *gateways;
+static unsigned int gateway_count;
+
+/* Schedule: binary min-heap of things ordered by next_us */
+
+static void heap_swap(unsigned int a, unsigned int b)
+{
+	struct thing *t = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = t;
+	heap[a]->heap_pos = a;
+	heap[b]->heap_pos = b;
+}
+
+static void heap_up(unsigned int i)
+{
+	while (i > 0 && heap[(i - 1) / 2]->next_us > heap[i]->next_us) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(unsigned int i)
+{
+	unsigned int min, child;
+
+	for (;;) {
+		min = i;
+		child = 2 * i + 1;
+		if (child < heap_count &&
+				heap[child]->next_us < heap[min]->next_us)
+			min = child;
+		if (child + 1 < heap_count &&
+				heap[child + 1]->next_us < heap[min]->next_us)
+			min = child + 1;
+		if (min == i)
+			return;
+
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static void heap_push(struct thing *t)
+{
+	t->heap_pos = heap_count;
+	heap[heap_count++] = t;
+	heap_up(t->heap_pos);
+}
+
+static void heap_remove(struct thing *t)
+{
+	unsigned int i = t->heap_pos;
+	struct thing *last;
+
+	heap_count--;
+	if (i == heap_count)
+		return;
+
+	heap_swap(i, heap_count);
+	last = heap[i];
+	heap_up(i);
+	heap_down(last->heap_pos);
+}
+
+static void schedule(struct thing *t, uint64_t next_us)
+{
+	t->next_us = next_us;
+	heap_up(t->heap_pos);
+	heap_down(t->heap_pos);
+}
+
+static uint64_t interval_us(void)
+{
+	double mean;
+
+	if (opt_rate <= 0)
+		return 0;
+
+	mean = 1000000.0 / opt_rate;
+	if (opt_poisson)
+		return -log(1.0 - drand48()) * mean;
+
+	return mean;
+}
+
+static void thing_fail(struct thing *t)
+{
+	switch (t->state) {
+	case THING_IDLE:
+	case THING_CONNECTING:
+		run.pending--;
+		break;
+	case THING_RUNNING:
+		run.live--;
+		break;
+	case THING_SETUP:
+		break;
+	case THING_FAILED:
+		return;
+	}
+
+	t->state = THING_FAILED;
+	run.failed++;
+	heap_remove(t);
+
+	if (t->fd >= 0) {
+		close(t->fd);
+		t->fd = -1;
+	}
+}
+
+static int thing_send(struct thing *t, uint64_t now)
+{
+	uint8_t buffer[STAMP_MSG_MAX];
+	size_t len;
+	int err;
+
+	len = stamp_fill(buffer, opt_size, t->id, t->seq, now);
+	err = transport->send(t, buffer, len);
+	if (err == -EAGAIN) {
+		run.stalls++;
+		return err;
+	}
+
+	if (err < 0) {
+		thing_fail(t);
+		return err;
+	}
+
+	t->seq++;
+	if (now >= run.window_start && now < run.window_end)
+		run.sent++;
+
+	return 0;
+}
+
+static void thing_receive(struct thing *t, const void *buffer, size_t len)
+{
+	const struct stamp_msg *stamp;
+	uint64_t now = hal_time64_us();
+
+	stamp = stamp_parse(buffer, len);
+	if (stamp == NULL || stamp->thing != t->id) {
+		run.unsolicited++;
+		return;
+	}
+
+	if (t->state == THING_SETUP) {
+		hist_add(&run.setup, now - t->setup_start);
+		t->state = THING_RUNNING;
+		run.live++;
+		if (run.setup.count == (uint64_t) opt_things)
+			run.all_live_us = now;
+	}
+
+	if (stamp->time_us >= run.window_start &&
+					stamp->time_us < run.window_end) {
+		hist_add(&run.rtt, now - stamp->time_us);
+		run.received++;
+		run.bytes += len;
+	}
+
+	if (profile == PROFILE_REQRESP && t->waiting &&
+						stamp->seq + 1 == t->seq) {
+		t->waiting = false;
+		schedule(t, now + interval_us());
+	}
+}
+
+/* Connected: the first message starts the setup measurement */
+static void thing_connected(struct thing *t, uint64_t now)
+{
+	t->state = THING_SETUP;
+	t->waiting = false;
+	run.pending--;
+
+	if (thing_send(t, now) == 0 && profile == PROFILE_REQRESP)
+		t->waiting = true;
+
+	if (t->state == THING_FAILED)
+		return;
+
+	schedule(t, now + (profile == PROFILE_REQRESP ?
+				opt_timeout * 1000ULL : interval_us()));
+}
+
+static void thing_connect(struct thing *t, uint64_t now)
+{
+	struct epoll_event ev;
+	int err;
+
+	if (t->setup_start == 0)
+		t->setup_start = now;
+
+	err = transport->connect(t);
+	if (err == -EAGAIN) {
+		schedule(t, now + CONNECT_RETRY_US);
+		return;
+	}
+
+	if (err < 0 && err != -EINPROGRESS) {
+		thing_fail(t);
+		return;
+	}
+
+	/* Serial things have no fd: demultiplexed from the pty */
+	if (t->fd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (err ? EPOLLOUT : 0);
+		ev.data.u64 = t->id;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0) {
+			thing_fail(t);
+			return;
+		}
+	}
+
+	if (err == -EINPROGRESS) {
+		t->state = THING_CONNECTING;
+		schedule(t, t->setup_start + CONNECT_TIMEOUT_US);
+		return;
+	}
+
+	thing_connected(t, now);
+}
+
+/* Non-blocking connect completed */
+static void thing_writable(struct thing *t)
+{
+	struct epoll_event ev;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		thing_fail(t);
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = t->id;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+
+	thing_connected(t, hal_time64_us());
+}
+
+static void thing_tick(struct thing *t, uint64_t now)
+{
+	uint64_t next;
+	int i;
+
+	switch (profile) {
+	case PROFILE_PERIODIC:
+	case PROFILE_BURST:
+		if (profile == PROFILE_BURST) {
+			for (i = 0; i < opt_burst; i++)
+				if (thing_send(t, now) < 0)
+					break;
+		} else {
+			thing_send(t, now);
+		}
+
+		if (t->state == THING_FAILED)
+			return;
+
+		/* Keep the arrival rate: don't catch up after a slip */
+		next = t->next_us + interval_us();
+		if (next <= now) {
+			run.late++;
+			next = now + interval_us();
+		}
+
+		schedule(t, next);
+		break;
+	case PROFILE_REQRESP:
+		if (t->waiting) {
+			t->waiting = false;
+			run.timeouts++;
+		}
+
+		if (thing_send(t, now) == 0)
+			t->waiting = true;
+
+		if (t->state != THING_FAILED)
+			schedule(t, now + opt_timeout * 1000ULL);
+		break;
+	}
+}
+
+/* Unix: one SEQPACKET socket per thing, as the phy_unix driver */
+
+static int unix_start(void)
+{
+	return 0;
+}
+
+static void unix_stop(void)
+{
+}
+
+static int unix_connect(struct thing *t)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+									0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, THING_UNIX_ADDRESS,
+					strlen(THING_UNIX_ADDRESS));
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = -errno;
+
+		close(sock);
+		return err;
+	}
+
+	t->fd = sock;
+
+	return 0;
+}
+
+static int unix_send(struct thing *t, const void *msg, size_t len)
+{
+	if (send(t->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void unix_input(uint64_t data)
+{
+	struct thing *t = &things[data];
+	uint8_t buffer[STAMP_MSG_MAX];
+	ssize_t len;
+
+	for (;;) {
+		len = recv(t->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (len > 0) {
+			thing_receive(t, buffer, len);
+			continue;
+		}
+
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		/* Gateway or knotd closed the session */
+		run.disconnects++;
+		thing_fail(t);
+		return;
+	}
+}
+
+static const struct transport unix_transport = {
+	.name = "unix",
+	.start = unix_start,
+	.stop = unix_stop,
+	.connect = unix_connect,
+	.send = unix_send,
+	.input = unix_input,
+};
+
+/* TCP: length prefixed messages, as the phyemud TCP driver */
+
+static struct sockaddr_storage tcp_addr;
+static socklen_t tcp_addrlen;
+
+static int tcp_start(void)
+{
+	struct addrinfo hints, *res;
+	char buffer[128], *host = NULL, *port = buffer, *sep;
+	int err;
+
+	strncpy(buffer, opt_address ? : TCP_DEFAULT_ADDRESS,
+							sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+
+	sep = strrchr(buffer, ':');
+	if (sep) {
+		*sep = '\0';
+		host = buffer;
+		port = sep + 1;
+
+		if (host[0] == '[') {
+			host++;
+			sep = strchr(host, ']');
+			if (sep)
+				*sep = '\0';
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err)
+		return (err == EAI_SYSTEM ? -errno : -EINVAL);
+
+	memcpy(&tcp_addr, res->ai_addr, res->ai_addrlen);
+	tcp_addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+static void tcp_stop(void)
+{
+	int i;
+
+	for (i = 0; i < opt_things; i++) {
+		g_free(things[i].rx);
+		things[i].rx = NULL;
+	}
+}
+
+static int tcp_connect(struct thing *t)
+{
+	int sock, on = 1;
+
+	sock = socket(tcp_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (t->rx == NULL)
+		t->rx = g_malloc(TCP_HDR_SIZE + STAMP_MSG_MAX);
+	t->rx_len = 0;
+	t->fd = sock;
+
+	if (connect(sock, (struct sockaddr *) &tcp_addr, tcp_addrlen) < 0) {
+		if (errno == EINPROGRESS)
+			return -EINPROGRESS;
+
+		t->fd = -1;
+		close(sock);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int tcp_send(struct thing *t, const void *msg, size_t len)
+{
+	uint8_t frame[TCP_HDR_SIZE + STAMP_MSG_MAX];
+	struct pollfd pfd = { .fd = t->fd, .events = POLLOUT };
+	size_t offset = 0, total = len + TCP_HDR_SIZE;
+	ssize_t nbytes;
+
+	frame[0] = len >> 8;
+	frame[1] = len & 0xff;
+	memcpy(frame + TCP_HDR_SIZE, msg, len);
+
+	while (offset < total) {
+		nbytes = send(t->fd, frame + offset, total - offset,
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes >= 0) {
+			offset += nbytes;
+			continue;
+		}
+
+		if (errno == EAGAIN && offset == 0)
+			return -EAGAIN;
+
+		if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		/* A partial frame would break the stream: complete it */
+		poll(&pfd, 1, 100);
+	}
+
+	return 0;
+}
+
+static void tcp_input(uint64_t data)
+{
+	struct thing *t = &things[data];
+	size_t size, frame = TCP_HDR_SIZE + STAMP_MSG_MAX;
+	ssize_t nbytes;
+
+	for (;;) {
+		nbytes = read(t->fd, t->rx + t->rx_len, frame - t->rx_len);
+		if (nbytes <= 0) {
+			if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+				return;
+
+			run.disconnects++;
+			thing_fail(t);
+			return;
+		}
+
+		t->rx_len += nbytes;
+
+		while (t->rx_len >= TCP_HDR_SIZE) {
+			size = (t->rx[0] << 8) | t->rx[1];
+			if (size == 0 || size > STAMP_MSG_MAX) {
+				thing_fail(t);
+				return;
+			}
+
+			if (t->rx_len < TCP_HDR_SIZE + size)
+				break;
+
+			thing_receive(t, t->rx + TCP_HDR_SIZE, size);
+			t->rx_len -= TCP_HDR_SIZE + size;
+			memmove(t->rx, t->rx + TCP_HDR_SIZE + size, t->rx_len);
+		}
+	}
+}
+
+static const struct transport tcp_transport = {
+	.name = "tcp",
+	.start = tcp_start,
+	.stop = tcp_stop,
+	.connect = tcp_connect,
+	.send = tcp_send,
+	.input = tcp_input,
+};
+
+/*
+ * Serial: things are channels of the serial link, SERIAL_LINK_CHANNELS
+ * per pty. Each pty needs its own gateway: see --spawn.
+ */
+
+struct pty {
+	int master;
+	int slave;		/* Keeps the raw mode while the gateway starts */
+	char pathname[64];
+	struct serial_link_decoder decoder;
+	struct thing *channel[SERIAL_LINK_CHANNELS];
+};
+
+static struct pty *ptys;
+static unsigned int pty_count;
+
+static int serial_start(void)
+{
+	struct epoll_event ev;
+	struct pty *pty;
+	unsigned int i;
+
+	pty_count = (opt_things + SERIAL_LINK_CHANNELS - 1) /
+							SERIAL_LINK_CHANNELS;
+	ptys = g_new0(struct pty, pty_count);
+
+	for (i = 0; i < pty_count; i++) {
+		pty = &ptys[i];
+		pty->slave = -1;
+		pty->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (pty->master < 0 || grantpt(pty->master) < 0 ||
+						unlockpt(pty->master) < 0)
+			return -errno;
+
+		snprintf(pty->pathname, sizeof(pty->pathname), "%s:%d",
+						ptsname(pty->master), opt_baud);
+
+		pty->slave = serial_link_open(pty->pathname);
+		if (pty->slave < 0)
+			return pty->slave;
+
+		serial_link_decoder_init(&pty->decoder);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = PTY_FLAG | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pty->master, &ev) < 0)
+			return -errno;
+
+		if (opt_spawn == NULL)
+			printf("Serial gateway expected on %s\n",
+								pty->pathname);
+	}
+
+	return 0;
+}
+
+static void serial_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < pty_count; i++) {
+		if (ptys[i].master >= 0)
+			close(ptys[i].master);
+		if (ptys[i].slave >= 0)
+			close(ptys[i].slave);
+	}
+
+	g_free(ptys);
+	ptys = NULL;
+	pty_count = 0;
+}
+
+static int serial_connect(struct thing *t)
+{
+	struct pty *pty = &ptys[t->id / SERIAL_LINK_CHANNELS];
+
+	t->channel = t->id % SERIAL_LINK_CHANNELS;
+	pty->channel[t->channel] = t;
+
+	return 0;
+}
+
+static int serial_send(struct thing *t, const void *msg, size_t len)
+{
+	int fd = ptys[t->id / SERIAL_LINK_CHANNELS].master;
+	uint8_t frame[SERIAL_LINK_FRAME_MAX];
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t flen, offset = 0, nbytes;
+
+	flen = serial_link_encode(t->channel, msg, len, frame);
+	if (flen < 0)
+		return flen;
+
+	while (offset < flen) {
+		nbytes = write(fd, frame + offset, flen - offset);
+		if (nbytes >= 0) {
+			offset += nbytes;
+			continue;
+		}
+
+		if (errno == EAGAIN && offset == 0)
+			return -EAGAIN;
+
+		if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		poll(&pfd, 1, 100);
+	}
+
+	return 0;
+}
+
+static void serial_input(uint64_t data)
+{
+	struct pty *pty = &ptys[data & ~PTY_FLAG];
+	uint8_t buffer[1024], payload[SERIAL_LINK_MTU], channel;
+	struct thing *t;
+	ssize_t nbytes, len, i;
+
+	for (;;) {
+		nbytes = read(pty->master, buffer, sizeof(buffer));
+		if (nbytes <= 0)
+			return;
+
+		for (i = 0; i < nbytes; i++) {
+			len = serial_link_decode(&pty->decoder, buffer[i],
+					&channel, payload, sizeof(payload));
+			if (len < 0)
+				continue;
+
+			t = pty->channel[channel];
+			if (t == NULL || t->state == THING_FAILED)
+				run.unsolicited++;
+			else
+				thing_receive(t, payload, len);
+		}
+	}
+}
+
+static const struct transport serial_transport = {
+	.name = "serial",
+	.start = serial_start,
+	.stop = serial_stop,
+	.connect = serial_connect,
+	.send = serial_send,
+	.input = serial_input,
+};
+
+/*
+ * Air: each thing is a process running the thing side of comm_nrf24l01
+ * on an "AIR0" radio, bridged to loadgen over a SEQPACKET socketpair.
+ * Needs tools/etherd and nrfd --radio AIR0 (see --spawn).
+ */
+
+static pid_t *air_pids;
+
+static int air_start(void)
+{
+	if (opt_size > AIR_MSG_MAX)
+		return -EMSGSIZE;
+
+	air_pids = g_new0(pid_t, opt_things);
+
+	return 0;
+}
+
+static void air_stop(void)
+{
+	int i;
+
+	for (i = 0; i < opt_things; i++) {
+		if (air_pids[i] <= 0)
+			continue;
+
+		kill(air_pids[i], SIGTERM);
+		waitpid(air_pids[i], NULL, 0);
+	}
+
+	g_free(air_pids);
+	air_pids = NULL;
+}
+
+/* Child: hal_comm thing until loadgen closes the socket */
+static int air_thing(int sock, uint64_t mac)
+{
+	struct nrf24_mac addr = { .address.uint64 = mac };
+	struct pollfd pfd = { .fd = sock };
+	uint8_t buffer[AIR_MSG_MAX], pending[AIR_MSG_MAX];
+	struct mgmt_nrf24_header *evt = (struct mgmt_nrf24_header *) buffer;
+	ssize_t len, pending_len = 0;
+	int mgmt, raw = -1;
+
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	if (hal_comm_init("AIR0", &addr) < 0)
+		return EXIT_FAILURE;
+
+	/* Thing side: the first socket is the management one */
+	mgmt = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	hal_comm_listen(mgmt);
+
+	for (;;) {
+		if (raw < 0) {
+			raw = hal_comm_accept(mgmt, &mac);
+			if (raw <= 0)
+				raw = -1;
+		} else {
+			if (pending_len == 0) {
+				len = recv(sock, pending, sizeof(pending),
+								MSG_DONTWAIT);
+				if (len == 0)
+					break;
+				if (len > 0)
+					pending_len = len;
+			}
+
+			if (pending_len && hal_comm_write(raw, pending,
+							pending_len) > 0)
+				pending_len = 0;
+
+			len = hal_comm_read(raw, buffer, sizeof(buffer));
+			if (len > 0)
+				send(sock, buffer, len, MSG_NOSIGNAL);
+
+			len = hal_comm_read(mgmt, buffer, sizeof(buffer));
+			if (len > 0 &&
+				evt->opcode == MGMT_EVT_NRF24_DISCONNECTED) {
+				hal_comm_close(raw);
+				raw = -1;
+				hal_comm_listen(mgmt);
+			}
+		}
+
+		/* Wakes up on loadgen messages or for the radio, 1 ms */
+		pfd.events = (pending_len ? 0 : POLLIN);
+		if (poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLHUP) &&
+						!(pfd.revents & POLLIN))
+			break;
+	}
+
+	hal_comm_deinit();
+
+	return EXIT_SUCCESS;
+}
+
+static int air_connect(struct thing *t)
+{
+	int sv[2], err, i;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return -errno;
+
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		close(epfd);
+		close(timerfd);
+		for (i = 0; i < opt_things; i++) {
+			if (things[i].fd >= 0)
+				close(things[i].fd);
+		}
+
+		_exit(air_thing(sv[1], AIR_MAC_BASE + t->id));
+	}
+
+	err = -errno;
+	close(sv[1]);
+
+	if (pid < 0) {
+		close(sv[0]);
+		return err;
+	}
+
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	air_pids[t->id] = pid;
+	t->fd = sv[0];
+
+	return 0;
+}
+
+static const struct transport air_transport = {
+	.name = "air",
+	.start = air_start,
+	.stop = air_stop,
+	.connect = air_connect,
+	.send = unix_send,
+	.input = unix_input,
+};
+
+static const struct transport *transports[] = {
+	&unix_transport,
+	&tcp_transport,
+	&serial_transport,
+	&air_transport,
+	NULL
+};
+
+/* Runs opt_spawn through the shell, %s replaced by pathname */
+static pid_t spawn(const char *pathname)
+{
+	GString *cmd;
+	const char *p;
+	pid_t pid;
+
+	cmd = g_string_new(NULL);
+	for (p = opt_spawn; *p; p++) {
+		if (p[0] == '%' && p[1] == 's') {
+			g_string_append(cmd, pathname ? : "");
+			p++;
+		} else {
+			g_string_append_c(cmd, *p);
+		}
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		/* Own process group: the gateway may fork too */
+		setpgid(0, 0);
+		execl("/bin/sh", "sh", "-c", cmd->str, (char *) NULL);
+		_exit(127);
+	}
+
+	g_string_free(cmd, TRUE);
+
+	return pid;
+}
+
+static void gateways_start(void)
+{
+	unsigned int i;
+
+	if (opt_spawn == NULL)
+		return;
+
+	gateway_count = (transport == &serial_transport ? pty_count : 1);
+	gateways = g_new0(pid_t, gateway_count);
+
+	for (i = 0; i < gateway_count; i++)
+		gateways[i] = spawn(transport == &serial_transport ?
+						ptys[i].pathname : NULL);
+
+	hal_delay_ms(opt_settle);
+}
+
+static void gateways_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < gateway_count; i++) {
+		if (gateways[i] <= 0)
+			continue;
+
+		kill(-gateways[i], SIGTERM);
+		waitpid(gateways[i], NULL, 0);
+	}
+
+	g_free(gateways);
+	gateways = NULL;
+	gateway_count = 0;
+}
+
+static void timer_arm(uint64_t when_us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	/* 0 would disarm: the timer is absolute, any past time fires */
+	if (when_us == 0)
+		when_us = 1;
+
+	its.it_value.tv_sec = when_us / 1000000;
+	its.it_value.tv_nsec = (when_us % 1000000) * 1000;
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void dispatch(struct epoll_event *ev)
+{
+	struct thing *t;
+	uint64_t expirations;
+
+	if (ev->data.u64 == TIMER_DATA) {
+		if (read(timerfd, &expirations, sizeof(expirations)) < 0)
+			return;
+		return;
+	}
+
+	if (ev->data.u64 & PTY_FLAG) {
+		transport->input(ev->data.u64);
+		return;
+	}
+
+	t = &things[ev->data.u64];
+	if (t->state == THING_FAILED)
+		return;
+
+	if (t->state == THING_CONNECTING) {
+		if (ev->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			thing_writable(t);
+		return;
+	}
+
+	transport->input(ev->data.u64);
+}
+
+static void report(void)
+{
+	uint64_t elapsed = run.window_end - run.window_start;
+	const struct hist *h = &run.rtt;
+
+	printf("Setup: %llu/%d things live",
+			(unsigned long long) run.setup.count, opt_things);
+	if (run.all_live_us)
+		printf(" after %llu ms", (unsigned long long)
+				(run.all_live_us - run.start_us) / 1000);
+	if (run.setup.count)
+		printf(", p50 %llu p99 %llu max %llu us",
+		(unsigned long long) hist_percentile(&run.setup, 500),
+		(unsigned long long) hist_percentile(&run.setup, 990),
+				(unsigned long long) run.setup.max);
+	printf("\n");
+
+	printf("Messages: %llu sent, %llu received, %llu lost in %.2f s\n",
+				(unsigned long long) run.sent,
+				(unsigned long long) run.received,
+				(unsigned long long) (run.sent > run.received ?
+						run.sent - run.received : 0),
+				elapsed / 1000000.0);
+
+	if (run.stalls || run.late || run.timeouts || run.unsolicited ||
+					run.disconnects || run.failed)
+		printf("Errors: %llu stalls, %llu late, %llu timeouts, "
+			"%llu unsolicited, %llu disconnects, %u failed\n",
+				(unsigned long long) run.stalls,
+				(unsigned long long) run.late,
+				(unsigned long long) run.timeouts,
+				(unsigned long long) run.unsolicited,
+				(unsigned long long) run.disconnects,
+				run.failed);
+
+	if (elapsed == 0)
+		elapsed = 1;
+
+	printf("Throughput: %llu msg/s, %llu KiB/s each way\n",
+		(unsigned long long) (run.received * 1000000 / elapsed),
+		(unsigned long long) (run.bytes * 1000000 / elapsed / 1024));
+
+	if (h->count == 0)
+		return;
+
+	printf("RTT: min %llu p50 %llu p99 %llu p999 %llu max %llu us\n",
+					(unsigned long long) h->min,
+					(unsigned long long) hist_percentile(h, 500),
+					(unsigned long long) hist_percentile(h, 990),
+					(unsigned long long) hist_percentile(h, 999),
+					(unsigned long long) h->max);
+}
+
+static int run_transport(const struct transport *ops)
+{
+	struct epoll_event ev, events[EVENTS_MAX];
+	uint64_t now, connect_us, drain_end = 0;
+	struct thing *t;
+	int i, n, err;
+
+	transport = ops;
+	memset(&run, 0, sizeof(run));
+	hist_init(&run.setup);
+	hist_init(&run.rtt);
+	run.window_start = UINT64_MAX;
+	run.window_end = UINT64_MAX;
+	run.pending = opt_things;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epfd < 0 || timerfd < 0)
+		return -errno;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = TIMER_DATA;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+
+	err = ops->start();
+	if (err < 0) {
+		printf("%s: %s\n", ops->name, strerror(-err));
+		goto done;
+	}
+
+	gateways_start();
+
+	printf("\nTransport %s: %d things, %s", ops->name, opt_things,
+								opt_profile);
+	if (profile != PROFILE_REQRESP || opt_rate > 0)
+		printf(" %.2f/s", opt_rate);
+	if (profile == PROFILE_BURST)
+		printf(" x %d", opt_burst);
+	printf(", %d bytes\n", opt_size);
+
+	/* Connections are spread at opt_connect_rate */
+	run.start_us = hal_time64_us();
+	heap_count = 0;
+	for (i = 0; i < opt_things; i++) {
+		t = &things[i];
+		memset(t, 0, sizeof(*t));
+		t->id = i;
+		t->fd = -1;
+		connect_us = opt_connect_rate > 0 ?
+					i * 1000000.0 / opt_connect_rate : 0;
+		t->next_us = run.start_us + connect_us;
+		heap_push(t);
+	}
+
+	for (;;) {
+		now = hal_time64_us();
+
+		/* Ramp done: the measurement window starts */
+		if (run.window_start == UINT64_MAX && run.pending == 0) {
+			run.window_start = now;
+			run.window_end = now + opt_duration * 1000000ULL;
+		}
+
+		while (drain_end == 0 && heap_count &&
+						heap[0]->next_us <= now) {
+			t = heap[0];
+
+			switch (t->state) {
+			case THING_IDLE:
+				thing_connect(t, now);
+				break;
+			case THING_CONNECTING:
+				thing_fail(t);
+				break;
+			case THING_SETUP:
+			case THING_RUNNING:
+				thing_tick(t, now);
+				break;
+			case THING_FAILED:
+				break;
+			}
+		}
+
+		if (drain_end == 0 && now >= run.window_end)
+			drain_end = now + DRAIN_US;
+
+		if (drain_end && (now >= drain_end ||
+					run.received >= run.sent))
+			break;
+
+		timer_arm(drain_end ? drain_end : heap_count ?
+					heap[0]->next_us : run.window_end);
+
+		n = epoll_wait(epfd, events, EVENTS_MAX, -1);
+		for (i = 0; i < n; i++)
+			dispatch(&events[i]);
+	}
+
+	report();
+
+	for (i = 0; i < opt_things; i++) {
+		if (things[i].fd >= 0)
+			close(things[i].fd);
+	}
+
+	gateways_stop();
+
+done:
+	ops->stop();
+	close(timerfd);
+	close(epfd);
+
+	return err;
+}
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	char *list, *name, *saveptr = NULL;
+	int i, err = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (strcmp(opt_profile, "periodic") == 0)
+		profile = PROFILE_PERIODIC;
+	else if (strcmp(opt_profile, "burst") == 0)
+		profile = PROFILE_BURST;
+	else if (strcmp(opt_profile, "reqresp") == 0)
+		profile = PROFILE_REQRESP;
+	else {
+		printf("Unknown profile: %s\n", opt_profile);
+		return EXIT_FAILURE;
+	}
+
+	if (opt_things <= 0 || opt_duration <= 0 || opt_burst <= 0 ||
+			opt_rate < 0 || opt_timeout <= 0 ||
+			(opt_rate == 0 && profile != PROFILE_REQRESP) ||
+			opt_size < (int) STAMP_MSG_MIN ||
+			opt_size > STAMP_MSG_MAX) {
+		printf("Invalid arguments (message size: %zu to %d bytes)\n",
+					STAMP_MSG_MIN, STAMP_MSG_MAX);
+		return EXIT_FAILURE;
+	}
+
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+	srand48(hal_time64_us());
+
+	things = g_new0(struct thing, opt_things);
+	heap = g_new0(struct thing *, opt_things);
+
+	list = g_strdup(opt_transport);
+	for (name = strtok_r(list, ",", &saveptr); name;
+				name = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; transports[i]; i++)
+			if (strcmp(transports[i]->name, name) == 0)
+				break;
+
+		if (transports[i] == NULL) {
+			printf("Unknown transport: %s\n", name);
+			err = -EINVAL;
+			continue;
+		}
+
+		if (run_transport(transports[i]) < 0)
+			err = -EIO;
+	}
+
+	g_free(list);
+	g_free(heap);
+	g_free(things);
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
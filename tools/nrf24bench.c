@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "nrf24l01.h"
+#include "nrf24l01_io.h"
+#include "nrf24l01_ll.h"
+#include "nrf24emu.h"
+
+/*
+ * Cost of the radio path per HAL operation: the SPI driver and
+ * comm_nrf24l01 run unmodified against the nRF24L01+ register model of
+ * tools/nrf24emu.c, linked in. Every operation is repeated --count
+ * times and reported as SPI transactions, bus bytes, syscalls (spidev
+ * ioctls and sleeps) and wall time. With --budget, any mean above its
+ * budget fails the run: the baseline for radio path optimizations.
+ */
+
+#define SPI_DEVICE		"/dev/spidev0.0"
+#define CHANNEL_RAW		10	/* comm_nrf24l01 channel_raw */
+#define OP_TIMEOUT_US		1000000
+#define COUNT_MAX		1000
+#define OPS_MAX			16
+
+struct result {
+	const char *name;
+	unsigned int count;
+	unsigned int failed;
+	double transactions;
+	double bytes;
+	double ioctls;
+	double sleeps;
+	double bus_us;
+	uint64_t wall_us[COUNT_MAX];
+	/* Budget: negative if none */
+	double max_transactions;
+	double max_bytes;
+	double max_syscalls;
+	double max_wall_us;
+	bool regressed;
+};
+
+struct sample {
+	struct nrf24emu_stats stats;
+	uint64_t start_us;
+};
+
+static struct result results[OPS_MAX];
+static unsigned int result_count;
+
+static const uint8_t aa_bcast[5] = { 0x8D, 0xD9, 0xBE, 0x96, 0xDE };
+/* comm_nrf24l01 aa_pipes[1]: first RAW socket */
+static const uint8_t aa_pipe1[5] = { 0x35, 0x96, 0xB6, 0xC1, 0x6B };
+
+static int opt_count = 20;
+static gboolean opt_json = FALSE;
+static char *opt_budget = NULL;
+
+static GOptionEntry options[] = {
+	{ "count", 'c', 0, G_OPTION_ARG_INT, &opt_count,
+			"count", "Iterations per operation (default 20)" },
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &opt_json,
+			NULL, "Machine readable results" },
+	{ "budget", 'b', 0, G_OPTION_ARG_STRING, &opt_budget,
+			"file", "Fail when an operation exceeds its budget" },
+	{ NULL },
+};
+
+static struct result *result_get(const char *name)
+{
+	struct result *r;
+	unsigned int i;
+
+	for (i = 0; i < result_count; i++) {
+		if (strcmp(results[i].name, name) == 0)
+			return &results[i];
+	}
+
+	r = &results[result_count++];
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->max_transactions = -1;
+	r->max_bytes = -1;
+	r->max_syscalls = -1;
+	r->max_wall_us = -1;
+
+	return r;
+}
+
+static void sample_begin(struct sample *s)
+{
+	nrf24emu_get_stats(&s->stats);
+	s->start_us = hal_time64_us();
+}
+
+static void sample_end(const char *name, const struct sample *s, bool ok)
+{
+	struct result *r = result_get(name);
+	struct nrf24emu_stats now;
+	uint64_t wall = hal_time64_us() - s->start_us;
+
+	nrf24emu_get_stats(&now);
+
+	if (!ok) {
+		r->failed++;
+		return;
+	}
+
+	r->transactions += now.transactions - s->stats.transactions;
+	r->bytes += now.bytes - s->stats.bytes;
+	r->ioctls += (now.messages + now.setup) -
+				(s->stats.messages + s->stats.setup);
+	r->sleeps += now.sleeps - s->stats.sleeps;
+	r->bus_us += (now.bus_ns - s->stats.bus_ns) / 1000.0;
+	r->wall_us[r->count++] = wall;
+}
+
+/* SPI driver: nrf24l01.h */
+
+static int bench_driver(void)
+{
+	uint8_t frame[NRF24_MTU];
+	struct sample s;
+	int8_t fd;
+	int i, injected;
+
+	for (i = 0; i < opt_count; i++) {
+		sample_begin(&s);
+		fd = nrf24l01_init(SPI_DEVICE, NRF24_PWR_0DBM);
+		sample_end("nrf24l01_init", &s, fd >= 0);
+		if (fd < 0)
+			return fd;
+
+		nrf24l01_deinit(fd);
+	}
+
+	fd = nrf24l01_init(SPI_DEVICE, NRF24_PWR_0DBM);
+	if (fd < 0)
+		return fd;
+
+	nrf24l01_set_channel(fd, CHANNEL_RAW);
+	nrf24l01_open_pipe(fd, 0, (uint8_t *) aa_bcast, false);
+	nrf24l01_open_pipe(fd, 1, (uint8_t *) aa_pipe1, true);
+
+	for (i = 0; i < opt_count; i++) {
+		sample_begin(&s);
+		nrf24l01_set_ptx(fd, 1);
+		sample_end("nrf24l01_set_ptx", &s, true);
+
+		sample_begin(&s);
+		nrf24l01_set_prx(fd, (uint8_t *) aa_bcast);
+		sample_end("nrf24l01_set_prx", &s, true);
+	}
+
+	/* Alternating: every call switches */
+	for (i = 0; i < opt_count; i++) {
+		sample_begin(&s);
+		nrf24l01_set_channel(fd, i % 2 ? CHANNEL_RAW :
+						NRF24_MGMT_CHANNEL);
+		sample_end("nrf24l01_set_channel", &s, true);
+	}
+
+	/* A frame left in the RX FIFO: counted as flushed, not read */
+	memset(frame, 0xaa, sizeof(frame));
+	for (i = 0; i < opt_count; i++) {
+		nrf24l01_set_prx(fd, (uint8_t *) aa_bcast);
+		injected = nrf24emu_inject(aa_pipe1, frame, sizeof(frame));
+
+		sample_begin(&s);
+		nrf24l01_set_channel(fd, i % 2 ? CHANNEL_RAW :
+						NRF24_MGMT_CHANNEL);
+		sample_end("nrf24l01_set_channel_flush", &s, injected == 1);
+	}
+
+	nrf24l01_deinit(fd);
+
+	return 0;
+}
+
+/* comm_nrf24l01: the gateway side, as nrfd */
+
+static bool poll_comm(int sockfd, uint64_t deadline)
+{
+	uint8_t buffer[128];
+
+	hal_comm_read(sockfd, buffer, sizeof(buffer));
+
+	return hal_time64_us() < deadline;
+}
+
+/* Waits the beginning of a MGMT or RAW slot: deterministic work */
+static bool wait_slot(int sockfd, uint8_t channel)
+{
+	uint64_t deadline = hal_time64_us() + OP_TIMEOUT_US;
+
+	while (nrf24emu_channel() == channel) {
+		if (!poll_comm(sockfd, deadline))
+			return false;
+	}
+
+	while (nrf24emu_channel() != channel) {
+		if (!poll_comm(sockfd, deadline))
+			return false;
+	}
+
+	return true;
+}
+
+/* Until the emulated radio transmitted 'frames' more frames */
+static bool wait_tx(int sockfd, uint64_t frames)
+{
+	uint64_t deadline = hal_time64_us() + OP_TIMEOUT_US;
+	struct nrf24emu_stats stats;
+	uint64_t target;
+
+	nrf24emu_get_stats(&stats);
+	target = stats.tx + frames;
+
+	for (;;) {
+		nrf24emu_get_stats(&stats);
+		if (stats.tx >= target)
+			return true;
+
+		if (!poll_comm(sockfd, deadline))
+			return false;
+	}
+}
+
+static void bench_connect(int sockfd)
+{
+	uint64_t thing = 0x1122334455667788ULL;
+	struct sample s;
+	bool ok;
+	int i;
+
+	for (i = 0; i < opt_count; i++) {
+		if (!wait_slot(sockfd, NRF24_MGMT_CHANNEL))
+			continue;
+
+		sample_begin(&s);
+		ok = hal_comm_connect(sockfd, &thing) == 0 &&
+						wait_tx(sockfd, 1);
+		sample_end("hal_comm_connect", &s, ok);
+	}
+}
+
+static void bench_write(int sockfd, const char *name, size_t len)
+{
+	uint8_t buffer[128];
+	size_t frames = (len + NRF24_PW_MSG_SIZE - 1) / NRF24_PW_MSG_SIZE;
+	struct sample s;
+	bool ok;
+	int i;
+
+	memset(buffer, 0x55, sizeof(buffer));
+
+	for (i = 0; i < opt_count; i++) {
+		if (!wait_slot(sockfd, CHANNEL_RAW))
+			continue;
+
+		sample_begin(&s);
+		ok = hal_comm_write(sockfd, buffer, len) == (ssize_t) len &&
+						wait_tx(sockfd, frames);
+		sample_end(name, &s, ok);
+	}
+}
+
+static void bench_read(int sockfd)
+{
+	uint8_t frame[NRF24_MTU], buffer[128];
+	struct nrf24_ll_data_pdu *pdu = (void *) frame;
+	uint64_t deadline;
+	struct sample s;
+	ssize_t len;
+	int i;
+
+	memset(frame, 0xaa, sizeof(frame));
+	pdu->lid = NRF24_PDU_LID_DATA_END;
+	pdu->nseq = 0;
+
+	for (i = 0; i < opt_count; i++) {
+		if (!wait_slot(sockfd, CHANNEL_RAW))
+			continue;
+
+		sample_begin(&s);
+		deadline = hal_time64_us() + OP_TIMEOUT_US;
+		len = -EAGAIN;
+		if (nrf24emu_inject(aa_pipe1, frame, sizeof(frame)) >= 0) {
+			while ((len = hal_comm_read(sockfd, buffer,
+					sizeof(buffer))) == -EAGAIN &&
+					hal_time64_us() < deadline)
+				;
+		}
+		sample_end("hal_comm_read", &s, len == NRF24_PW_MSG_SIZE);
+	}
+}
+
+static int bench_comm(void)
+{
+	struct nrf24_mac mac = { .address.uint64 = 0xc0ffee0000000001ULL };
+	int err, sockfd;
+
+	err = hal_comm_init("NRF0", &mac);
+	if (err < 0)
+		return err;
+
+	hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT);
+	sockfd = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (sockfd < 0) {
+		hal_comm_deinit();
+		return sockfd;
+	}
+
+	bench_connect(sockfd);
+	bench_write(sockfd, "hal_comm_write_1", 1);
+	bench_write(sockfd, "hal_comm_write_30", 30);
+	bench_write(sockfd, "hal_comm_write_128", 128);
+	bench_read(sockfd);
+
+	hal_comm_close(sockfd);
+	hal_comm_deinit();
+
+	return 0;
+}
+
+/* Budget file: name transactions bytes syscalls wall_us, '#' comments */
+static int budget_load(const char *path)
+{
+	char line[256], name[64];
+	double transactions, bytes, syscalls, wall;
+	struct result *r;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%63s %lf %lf %lf %lf",
+					name, &transactions, &bytes,
+					&syscalls, &wall) != 5)
+			continue;
+
+		for (i = 0; i < result_count; i++) {
+			r = &results[i];
+			if (strcmp(r->name, name) != 0)
+				continue;
+
+			r->max_transactions = transactions;
+			r->max_bytes = bytes;
+			r->max_syscalls = syscalls;
+			r->max_wall_us = wall;
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Means per iteration; wall time as median */
+static bool finish(struct result *r, uint64_t *p50, uint64_t *max)
+{
+	if (r->count == 0) {
+		*p50 = 0;
+		*max = 0;
+		return false;
+	}
+
+	qsort(r->wall_us, r->count, sizeof(r->wall_us[0]), compare_u64);
+	*p50 = r->wall_us[r->count / 2];
+	*max = r->wall_us[r->count - 1];
+
+	r->transactions /= r->count;
+	r->bytes /= r->count;
+	r->ioctls /= r->count;
+	r->sleeps /= r->count;
+	r->bus_us /= r->count;
+
+	/* Counts barely vary: the slack is in the budget file */
+	r->regressed =
+		(r->max_transactions >= 0 &&
+			r->transactions > r->max_transactions + 1e-6) ||
+		(r->max_bytes >= 0 && r->bytes > r->max_bytes + 1e-6) ||
+		(r->max_syscalls >= 0 &&
+			r->ioctls + r->sleeps > r->max_syscalls + 1e-6) ||
+		(r->max_wall_us >= 0 && *p50 > r->max_wall_us);
+
+	return true;
+}
+
+static const char *verdict(const struct result *r)
+{
+	if (r->failed || r->count == 0)
+		return "failed";
+	if (r->max_transactions < 0)
+		return "none";
+
+	return r->regressed ? "regressed" : "ok";
+}
+
+static bool report(void)
+{
+	struct result *r;
+	uint64_t p50, max;
+	unsigned int i;
+	bool pass = true;
+
+	if (opt_json)
+		printf("[\n");
+	else
+		printf("%-26s %5s %8s %8s %8s %8s %9s %9s %9s  %s\n",
+			"Operation", "Count", "SPI", "Bytes", "ioctls",
+			"Sleeps", "Bus us", "Wall p50", "Wall max",
+			"Budget");
+
+	for (i = 0; i < result_count; i++) {
+		r = &results[i];
+		finish(r, &p50, &max);
+
+		if (r->failed || r->count == 0 || r->regressed)
+			pass = false;
+
+		if (!opt_json) {
+			printf("%-26s %5u %8.1f %8.1f %8.1f %8.1f %9.1f "
+				"%9llu %9llu  %s\n", r->name, r->count,
+				r->transactions, r->bytes, r->ioctls,
+				r->sleeps, r->bus_us,
+				(unsigned long long) p50,
+				(unsigned long long) max, verdict(r));
+			continue;
+		}
+
+		printf("  { \"operation\": \"%s\", \"count\": %u, "
+			"\"failed\": %u, \"transactions\": %.2f, "
+			"\"bytes\": %.2f, \"syscalls\": %.2f, "
+			"\"ioctls\": %.2f, \"sleeps\": %.2f, "
+			"\"bus_us\": %.2f, \"wall_us_p50\": %llu, "
+			"\"wall_us_max\": %llu, \"budget\": \"%s\" }%s\n",
+			r->name, r->count, r->failed, r->transactions,
+			r->bytes, r->ioctls + r->sleeps, r->ioctls,
+			r->sleeps, r->bus_us, (unsigned long long) p50,
+			(unsigned long long) max, verdict(r),
+			i + 1 < result_count ? "," : "");
+	}
+
+	if (opt_json)
+		printf("]\n");
+
+	return pass;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	int err;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_count < 1 || opt_count > COUNT_MAX) {
+		printf("Invalid count: 1 to %d\n", COUNT_MAX);
+		return EXIT_FAILURE;
+	}
+
+	/* A scripted peer: no broker, every frame acknowledged */
+	nrf24emu_set_alone(true);
+	nrf24emu_set_report(false);
+
+	err = bench_driver();
+	if (err < 0) {
+		printf("SPI driver: %s (%d)\n", strerror(-err), -err);
+		return EXIT_FAILURE;
+	}
+
+	err = bench_comm();
+	if (err < 0) {
+		printf("comm_nrf24l01: %s (%d)\n", strerror(-err), -err);
+		return EXIT_FAILURE;
+	}
+
+	if (opt_budget) {
+		err = budget_load(opt_budget);
+		if (err < 0) {
+			printf("%s: %s\n", opt_budget, strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return report() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
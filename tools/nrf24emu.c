@@ -0,0 +1,1389 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <linux/spi/spidev.h>
+
+#include "nrf24l01_io.h"
+#include "phy_driver_air.h"
+#include "nrf24emu.h"
+
+/*
+ * nRF24L01+ emulator, preloaded into unmodified binaries:
+ *
+ *   LD_PRELOAD=nrf24emu.so src/nrfd/nrfd
+ *
+ * open() of /dev/spidev* and /dev/mem is intercepted: the SPI messages
+ * are decoded as nRF24 commands against a register file (FIFOs, STATUS,
+ * DYNPD, auto-ack, ARC/ARD), and the GPIO page mapped by
+ * nrf24l01_io_linux.c is plain memory sampled for CE at every SPI
+ * message. The radio side attaches to tools/etherd as any "AIR0" node,
+ * or stays alone when no broker is running. Every SPI message, command
+ * and byte is counted, the report goes to stderr (or $NRF24EMU_STATS)
+ * when the process exits. Linked into a program, nrf24emu.h drives it.
+ *
+ * Not thread safe: a single radio, driven by one thread, as the driver.
+ */
+
+#define SPI_PATH_DEFAULT	"/dev/spidev"
+#define GPIO_CE_DEFAULT		25	/* nrf24l01_io_linux.c CE */
+#define GPIO_BLOCK_SIZE		(4 * 1024)
+#define GPIO_RPI2_BASE		0x3F200000
+#define GPIO_RPI_BASE		0x20200000
+#define GPSET0			7	/* Words of the GPIO page */
+#define GPCLR0			10
+#define GPLEV0			13
+
+#define FDS_MAX			8
+#define FIFO_SIZE		3
+#define ADDR_SIZE		5
+#define PAYLOAD_SIZE		32
+#define CMD_SIZE_MAX		(1 + ADDR_SIZE + PAYLOAD_SIZE)
+
+/* Not in nrf24l01_io.h: read only */
+#define RPD			0x09
+
+/* Statistics slots: registers, then the other commands */
+#define OP_R_REGISTER		0
+#define OP_W_REGISTER		32
+#define OP_R_RX_PAYLOAD		64
+#define OP_W_TX_PAYLOAD		65
+#define OP_FLUSH_TX		66
+#define OP_FLUSH_RX		67
+#define OP_REUSE_TX_PL		68
+#define OP_R_RX_PL_WID		69
+#define OP_W_ACK_PAYLOAD	70
+#define OP_W_TX_PAYLOAD_NOACK	71
+#define OP_NOP			72
+#define OP_ACTIVATE		73
+#define OP_UNKNOWN		74
+#define OP_MAX			75
+
+struct air_msg {
+	struct air_hdr hdr;
+	union {
+		struct air_radio radio;
+		struct air_tx tx;
+		struct air_tx_status status;
+		struct air_rx rx;
+	};
+} __attribute__ ((packed));
+
+struct fifo_entry {
+	uint8_t pipe;
+	uint8_t len;
+	bool noack;
+	uint8_t payload[PAYLOAD_SIZE];
+};
+
+struct fifo {
+	struct fifo_entry entry[FIFO_SIZE];
+	uint8_t head;
+	uint8_t count;
+};
+
+struct chip {
+	uint8_t reg[32];
+	uint8_t rx_addr_p0[ADDR_SIZE];
+	uint8_t rx_addr_p1[ADDR_SIZE];
+	uint8_t tx_addr[ADDR_SIZE];
+	struct fifo rx;
+	struct fifo tx;
+	bool ce;
+	bool ce_pulse;		/* CE pulsed between two SPI messages */
+	bool rx_on;		/* PRX and CE high */
+	bool rpd;
+	bool reuse;
+	bool tx_busy;		/* On the air, waiting the broker status */
+	bool tx_ack;		/* ACK requested for the frame on the air */
+	bool tx_flushed;	/* FLUSH_TX while on the air */
+	bool tx_new;		/* Next transmission is a new packet */
+	uint8_t pid;
+	uint8_t arc_cnt;
+	uint8_t plos_cnt;
+	uint16_t seq;
+	uint64_t retry_us;
+};
+
+struct op_stats {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t bus_ns;
+};
+
+struct counters {
+	uint64_t messages;	/* SPI_IOC_MESSAGE ioctls */
+	uint64_t setup;		/* Other spidev ioctls: mode, speed ... */
+	uint64_t sleeps;	/* clock_nanosleep(): delay_us() and co */
+	uint64_t transactions;	/* CSN low to high: one command */
+	uint64_t bytes;
+	uint64_t bus_ns;
+	uint64_t ce_edges;
+	uint64_t tx;
+	uint64_t retransmits;
+	uint64_t tx_acked;
+	uint64_t max_rt;
+	uint64_t rx;
+	uint64_t rx_full;	/* RX FIFO full: frame lost */
+	uint64_t rx_mismatch;	/* Static payload width differs */
+};
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off64_t);
+static int (*real_munmap)(void *, size_t);
+static int (*real_clock_nanosleep)(clockid_t, int, const struct timespec *,
+						struct timespec *);
+
+static int spi_fds[FDS_MAX];
+static int mem_fds[FDS_MAX];
+static volatile uint32_t *gpio;
+static int gpio_ce = GPIO_CE_DEFAULT;
+static int gpio_irq = -1;
+static const char *spi_path = SPI_PATH_DEFAULT;
+
+static struct chip chip;
+static bool chip_ready;
+static int air_fd = -1;
+static bool alone;
+static bool autoack;
+static bool report_enabled = true;
+static struct air_radio radio_sent;
+static bool radio_valid;
+
+static uint8_t spi_mode;
+static uint8_t spi_bits = 8;
+static uint32_t spi_speed = 500000;
+
+static struct op_stats ops[OP_MAX];
+static struct counters counters;
+static uint64_t start_us;
+
+static const char *reg_names[32] = {
+	"CONFIG", "EN_AA", "EN_RXADDR", "SETUP_AW", "SETUP_RETR", "RF_CH",
+	"RF_SETUP", "STATUS", "OBSERVE_TX", "RPD", "RX_ADDR_P0",
+	"RX_ADDR_P1", "RX_ADDR_P2", "RX_ADDR_P3", "RX_ADDR_P4",
+	"RX_ADDR_P5", "TX_ADDR", "RX_PW_P0", "RX_PW_P1", "RX_PW_P2",
+	"RX_PW_P3", "RX_PW_P4", "RX_PW_P5", "FIFO_STATUS", NULL, NULL,
+	NULL, NULL, "DYNPD", "FEATURE", NULL, NULL
+};
+
+static const char *cmd_names[OP_MAX - OP_R_RX_PAYLOAD] = {
+	"R_RX_PAYLOAD", "W_TX_PAYLOAD", "FLUSH_TX", "FLUSH_RX",
+	"REUSE_TX_PL", "R_RX_PL_WID", "W_ACK_PAYLOAD",
+	"W_TX_PAYLOAD_NOACK", "NOP", "ACTIVATE", "unknown"
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void resolve(void)
+{
+	const char *env;
+
+	if (real_open)
+		return;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_mmap = dlsym(RTLD_NEXT, "mmap64");
+	real_munmap = dlsym(RTLD_NEXT, "munmap");
+	real_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+
+	env = getenv("NRF24EMU_SPI");
+	if (env && *env)
+		spi_path = env;
+
+	env = getenv("NRF24EMU_CE");
+	if (env && *env)
+		gpio_ce = atoi(env) & 31;
+
+	/* IRQ output: GPLEV0 bit low while an unmasked flag is set */
+	env = getenv("NRF24EMU_IRQ");
+	if (env && *env)
+		gpio_irq = atoi(env) & 31;
+}
+
+static bool fd_find(const int *fds, int fd)
+{
+	int i;
+
+	for (i = 0; i < FDS_MAX; i++) {
+		if (fds[i] == fd + 1)
+			return true;
+	}
+
+	return false;
+}
+
+/* Slots hold fd + 1: zero is free */
+static int fd_add(int *fds, int fd)
+{
+	int i;
+
+	for (i = 0; i < FDS_MAX; i++) {
+		if (fds[i] == 0) {
+			fds[i] = fd + 1;
+			return 0;
+		}
+	}
+
+	return -EMFILE;
+}
+
+static int fd_remove(int *fds, int fd)
+{
+	int i, left = 0;
+
+	for (i = 0; i < FDS_MAX; i++) {
+		if (fds[i] == fd + 1)
+			fds[i] = 0;
+		else if (fds[i])
+			left++;
+	}
+
+	return left;
+}
+
+/* Register file */
+
+static void fifo_flush(struct fifo *f)
+{
+	f->head = 0;
+	f->count = 0;
+}
+
+static struct fifo_entry *fifo_head(struct fifo *f)
+{
+	return f->count ? &f->entry[f->head] : NULL;
+}
+
+static struct fifo_entry *fifo_push(struct fifo *f)
+{
+	struct fifo_entry *e;
+
+	if (f->count == FIFO_SIZE)
+		return NULL;
+
+	e = &f->entry[(f->head + f->count) % FIFO_SIZE];
+	f->count++;
+
+	return e;
+}
+
+static void fifo_pop(struct fifo *f)
+{
+	if (f->count == 0)
+		return;
+
+	f->head = (f->head + 1) % FIFO_SIZE;
+	f->count--;
+}
+
+static void chip_reset(void)
+{
+	memset(&chip, 0, sizeof(chip));
+
+	chip.reg[NRF24_CONFIG] = NRF24_CONFIG_RST;
+	chip.reg[NRF24_EN_AA] = NRF24_EN_AA_RST;
+	chip.reg[NRF24_EN_RXADDR] = NRF24_EN_RXADDR_RST;
+	chip.reg[NRF24_SETUP_AW] = NRF24_SETUP_AW_RST;
+	chip.reg[NRF24_SETUP_RETR] = NRF24_SETUP_RETR_RST;
+	chip.reg[NRF24_RF_CH] = NRF24_RF_CH_RST;
+	chip.reg[NRF24_RF_SETUP] = NRF24_RF_SETUP_RST;
+	chip.reg[NRF24_RX_ADDR_P2] = NRF24_RX_ADDR_P2_RST;
+	chip.reg[NRF24_RX_ADDR_P3] = NRF24_RX_ADDR_P3_RST;
+	chip.reg[NRF24_RX_ADDR_P4] = NRF24_RX_ADDR_P4_RST;
+	chip.reg[NRF24_RX_ADDR_P5] = NRF24_RX_ADDR_P5_RST;
+	memset(chip.rx_addr_p0, NRF24_RX_ADDR_P0_RST, ADDR_SIZE);
+	memset(chip.rx_addr_p1, NRF24_RX_ADDR_P1_RST, ADDR_SIZE);
+	memset(chip.tx_addr, NRF24_TX_ADDR_RST, ADDR_SIZE);
+	chip.tx_new = true;
+
+	chip_ready = true;
+}
+
+static uint8_t addr_width(void)
+{
+	uint8_t aw = chip.reg[NRF24_SETUP_AW] & NRF24_SETUP_AW_MASK;
+
+	/* '00' is illegal, the radio keeps working at 3 bytes */
+	return aw ? aw + 2 : 3;
+}
+
+static uint8_t *addr_reg(uint8_t reg)
+{
+	switch (reg) {
+	case NRF24_RX_ADDR_P0:
+		return chip.rx_addr_p0;
+	case NRF24_RX_ADDR_P1:
+		return chip.rx_addr_p1;
+	case NRF24_TX_ADDR:
+		return chip.tx_addr;
+	default:
+		return NULL;
+	}
+}
+
+static uint8_t status_reg(void)
+{
+	struct fifo_entry *e = fifo_head(&chip.rx);
+	uint8_t status;
+
+	status = chip.reg[NRF24_STATUS] &
+			(NRF24_ST_RX_DR | NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
+	status |= (e ? e->pipe : NRF24_RX_FIFO_EMPTY) << 1;
+	if (chip.tx.count == FIFO_SIZE)
+		status |= NRF24_ST_TX_FULL;
+
+	return status;
+}
+
+static uint8_t fifo_status_reg(void)
+{
+	uint8_t value = 0;
+
+	if (chip.reuse)
+		value |= NRF24_FIFO_TX_REUSE;
+	if (chip.tx.count == FIFO_SIZE)
+		value |= NRF24_FIFO_TX_FULL;
+	if (chip.tx.count == 0)
+		value |= NRF24_FIFO_TX_EMPTY;
+	if (chip.rx.count == FIFO_SIZE)
+		value |= NRF24_FIFO_RX_FULL;
+	if (chip.rx.count == 0)
+		value |= NRF24_FIFO_RX_EMPTY;
+
+	return value;
+}
+
+static uint8_t reg_read(uint8_t reg, uint8_t offset)
+{
+	uint8_t *addr = addr_reg(reg);
+
+	if (addr)
+		return offset < addr_width() ? addr[offset] : 0;
+
+	if (offset)
+		return 0;
+
+	switch (reg) {
+	case NRF24_STATUS:
+		return status_reg();
+	case NRF24_FIFO_STATUS:
+		return fifo_status_reg();
+	case NRF24_OBSERVE_TX:
+		return (chip.plos_cnt << 4) | chip.arc_cnt;
+	case RPD:
+		return chip.rpd ? 1 : 0;
+	default:
+		return chip.reg[reg];
+	}
+}
+
+static void reg_write(uint8_t reg, const uint8_t *data, size_t len)
+{
+	uint8_t *addr = addr_reg(reg);
+	uint8_t value = data[0];
+
+	if (len == 0)
+		return;
+
+	if (addr) {
+		/* LSByte first, AW bytes */
+		memcpy(addr, data, len < addr_width() ? len : addr_width());
+		return;
+	}
+
+	switch (reg) {
+	case NRF24_CONFIG:
+		chip.reg[reg] = value & NRF24_CONFIG_MASK;
+		break;
+	case NRF24_EN_AA:
+	case NRF24_EN_RXADDR:
+	case NRF24_DYNPD:
+		chip.reg[reg] = value & 0x3f;
+		break;
+	case NRF24_SETUP_AW:
+		chip.reg[reg] = value & NRF24_SETUP_AW_MASK;
+		break;
+	case NRF24_SETUP_RETR:
+		chip.reg[reg] = value;
+		break;
+	case NRF24_RF_CH:
+		chip.reg[reg] = value & NRF24_RF_CH_MASK;
+		/* Writing RF_CH resets the lost packets count */
+		chip.plos_cnt = 0;
+		break;
+	case NRF24_RF_SETUP:
+		chip.reg[reg] = value & NRF24_RF_SETUP_MASK;
+		break;
+	case NRF24_STATUS:
+		/* Write 1 to clear */
+		chip.reg[reg] &= ~(value & (NRF24_ST_RX_DR | NRF24_ST_TX_DS |
+							NRF24_ST_MAX_RT));
+		break;
+	case NRF24_RX_ADDR_P2:
+	case NRF24_RX_ADDR_P3:
+	case NRF24_RX_ADDR_P4:
+	case NRF24_RX_ADDR_P5:
+		chip.reg[reg] = value;
+		break;
+	case NRF24_RX_PW_P0:
+	case NRF24_RX_PW_P1:
+	case NRF24_RX_PW_P2:
+	case NRF24_RX_PW_P3:
+	case NRF24_RX_PW_P4:
+	case NRF24_RX_PW_P5:
+		chip.reg[reg] = value & 0x3f;
+		break;
+	case NRF24_FEATURE:
+		/* ACK payloads aren't emulated: reads back as disabled */
+		chip.reg[reg] = value & NRF24_FEATURE_MASK &
+						~NRF24_FT_EN_ACK_PAY;
+		break;
+	default:
+		/* Read only or reserved */
+		break;
+	}
+}
+
+static bool dynamic_payload(uint8_t pipe)
+{
+	return (chip.reg[NRF24_FEATURE] & NRF24_FT_EN_DPL) &&
+				(chip.reg[NRF24_DYNPD] & (1 << pipe));
+}
+
+static bool powered(void)
+{
+	return chip.reg[NRF24_CONFIG] & NRF24_CFG_PWR_UP;
+}
+
+static bool prx(void)
+{
+	return powered() && (chip.reg[NRF24_CONFIG] & NRF24_CFG_PRIM_RX) &&
+								chip.ce;
+}
+
+static bool ptx(void)
+{
+	return powered() && !(chip.reg[NRF24_CONFIG] & NRF24_CFG_PRIM_RX) &&
+						(chip.ce || chip.ce_pulse);
+}
+
+/* Radio: etherd broker */
+
+static void air_attach(void)
+{
+	struct sockaddr_un addr;
+	const char *name;
+	socklen_t len;
+	int sockfd;
+
+	name = getenv(AIR_ADDRESS_ENV);
+	if (name == NULL || *name == '\0')
+		name = AIR_DEFAULT_ADDRESS;
+
+	sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (bind(sockfd, (struct sockaddr *) &addr, sizeof(sa_family_t)) < 0)
+		goto fail;
+
+	strncpy(addr.sun_path + 1, name, sizeof(addr.sun_path) - 2);
+	len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+	if (connect(sockfd, (struct sockaddr *) &addr, len) < 0) {
+		fprintf(stderr, "nrf24emu: no air broker on @%s (%s), "
+				"the radio is alone\n", name, strerror(errno));
+		goto fail;
+	}
+
+	air_fd = sockfd;
+	radio_valid = false;
+
+	return;
+
+fail:
+	real_close(sockfd);
+}
+
+static void air_detach(void)
+{
+	struct air_hdr hdr = { .op = AIR_OP_DETACH };
+
+	if (air_fd < 0)
+		return;
+
+	send(air_fd, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_DONTWAIT);
+	real_close(air_fd);
+	air_fd = -1;
+}
+
+/* Full address of a pipe: P2 to P5 share the MSBytes of P1 */
+static void pipe_address(uint8_t pipe, uint8_t *aa)
+{
+	uint8_t aw = addr_width();
+
+	memset(aa, 0, AIR_AA_SIZE);
+
+	if (pipe == 0) {
+		memcpy(aa, chip.rx_addr_p0, aw);
+	} else {
+		memcpy(aa, chip.rx_addr_p1, aw);
+		if (pipe > 1)
+			aa[0] = chip.reg[NRF24_RX_ADDR_P0 + pipe];
+	}
+}
+
+static void radio_update(void)
+{
+	struct air_msg msg;
+	uint8_t pipe;
+
+	if (air_fd < 0)
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.op = AIR_OP_RADIO;
+	msg.radio.channel = chip.reg[NRF24_RF_CH];
+	msg.radio.rx = chip.rx_on;
+	msg.radio.pipe_en = chip.reg[NRF24_EN_RXADDR];
+	msg.radio.pipe_ack = chip.reg[NRF24_EN_AA];
+	for (pipe = 0; pipe < AIR_PIPES; pipe++)
+		pipe_address(pipe, msg.radio.aa[pipe]);
+
+	if (radio_valid && memcmp(&msg.radio, &radio_sent,
+						sizeof(radio_sent)) == 0)
+		return;
+
+	if (send(air_fd, &msg, sizeof(msg.hdr) + sizeof(msg.radio),
+					MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return;
+
+	radio_sent = msg.radio;
+	radio_valid = true;
+}
+
+static void rx_frame(const struct air_rx *rx)
+{
+	struct fifo_entry *e;
+
+	if (rx->pipe >= AIR_PIPES || rx->len == 0 ||
+						rx->len > PAYLOAD_SIZE)
+		return;
+
+	chip.rpd = true;
+
+	/* Static payload: a different width fails the CRC */
+	if (!dynamic_payload(rx->pipe) &&
+			chip.reg[NRF24_RX_PW_P0 + rx->pipe] != rx->len) {
+		counters.rx_mismatch++;
+		return;
+	}
+
+	e = fifo_push(&chip.rx);
+	if (e == NULL) {
+		counters.rx_full++;
+		return;
+	}
+
+	e->pipe = rx->pipe;
+	e->len = rx->len;
+	memcpy(e->payload, rx->payload, rx->len);
+
+	chip.reg[NRF24_STATUS] |= NRF24_ST_RX_DR;
+	counters.rx++;
+}
+
+static void tx_status(bool ack, bool acked, uint64_t now)
+{
+	uint8_t retr = chip.reg[NRF24_SETUP_RETR];
+
+	chip.tx_busy = false;
+
+	/* Flushed while on the air: nothing left to complete */
+	if (chip.tx_flushed) {
+		chip.tx_flushed = false;
+		chip.tx_new = true;
+		return;
+	}
+
+	if (!ack || acked) {
+		if (ack)
+			counters.tx_acked++;
+		if (!chip.reuse)
+			fifo_pop(&chip.tx);
+		chip.reg[NRF24_STATUS] |= NRF24_ST_TX_DS;
+		chip.tx_new = true;
+		return;
+	}
+
+	if (chip.arc_cnt < NRF24_RETR_ARC(retr)) {
+		chip.arc_cnt++;
+		chip.retry_us = now + (NRF24_RETR_ARD_RD(retr) + 1) *
+							NRF24_ARD_FACTOR_US;
+		counters.retransmits++;
+		return;
+	}
+
+	/* The payload stays in the TX FIFO until FLUSH_TX */
+	chip.reg[NRF24_STATUS] |= NRF24_ST_MAX_RT;
+	if (chip.plos_cnt < 15)
+		chip.plos_cnt++;
+	counters.max_rt++;
+}
+
+static void air_input(uint64_t now)
+{
+	struct air_msg msg;
+	ssize_t len;
+
+	if (air_fd < 0)
+		return;
+
+	for (;;) {
+		len = recv(air_fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (len < (ssize_t) sizeof(msg.hdr))
+			break;
+
+		switch (msg.hdr.op) {
+		case AIR_OP_RX:
+			/* The broker delivered it while listening */
+			if (radio_valid && radio_sent.rx)
+				rx_frame(&msg.rx);
+			break;
+		case AIR_OP_TX_STATUS:
+			if (!chip.tx_busy || msg.hdr.seq != chip.seq)
+				break;
+
+			tx_status(chip.tx_ack, msg.status.acked, now);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* PTX: sends the TX FIFO head, retransmissions after ARD */
+static void tx_run(uint64_t now)
+{
+	struct fifo_entry *e = fifo_head(&chip.tx);
+	struct air_msg msg;
+	bool ack;
+
+	if (!ptx() || e == NULL || chip.tx_busy || now < chip.retry_us ||
+			(chip.reg[NRF24_STATUS] & NRF24_ST_MAX_RT))
+		return;
+
+	if (chip.tx_new) {
+		chip.pid = (chip.pid + 1) & 0x03;
+		chip.arc_cnt = 0;
+		chip.tx_new = false;
+	}
+
+	/* The ACK comes back on pipe 0 */
+	ack = !e->noack && (chip.reg[NRF24_EN_AA] & NRF24_AA_P0);
+
+	counters.tx++;
+	chip.seq++;
+	chip.tx_ack = ack;
+
+	if (air_fd < 0) {
+		/* Alone: nobody acknowledges, unless autoack */
+		chip.tx_busy = true;
+		tx_status(ack, autoack, now);
+		return;
+	}
+
+	memset(&msg.hdr, 0, sizeof(msg.hdr));
+	msg.hdr.op = AIR_OP_TX;
+	msg.hdr.seq = chip.seq;
+	memset(msg.tx.aa, 0, AIR_AA_SIZE);
+	memcpy(msg.tx.aa, chip.tx_addr, addr_width());
+	msg.tx.ack = ack;
+	msg.tx.pid = chip.pid;
+	msg.tx.len = e->len;
+	memcpy(msg.tx.payload, e->payload, e->len);
+
+	if (send(air_fd, &msg, sizeof(msg.hdr) +
+				offsetof(struct air_tx, payload) + e->len,
+					MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		/* Broker gone: same as a lost frame */
+		chip.tx_busy = true;
+		tx_status(ack, false, now);
+		return;
+	}
+
+	chip.tx_busy = true;
+}
+
+static void irq_update(void)
+{
+	uint8_t flags = chip.reg[NRF24_STATUS] &
+			(NRF24_ST_RX_DR | NRF24_ST_TX_DS | NRF24_ST_MAX_RT);
+	uint32_t lev;
+
+	if (gpio == NULL)
+		return;
+
+	lev = gpio[GPLEV0];
+	if (chip.ce)
+		lev |= 1U << gpio_ce;
+	else
+		lev &= ~(1U << gpio_ce);
+
+	/* Active low, the CONFIG MASK_* bits mask the flags */
+	if (gpio_irq >= 0) {
+		if (flags & ~chip.reg[NRF24_CONFIG])
+			lev &= ~(1U << gpio_irq);
+		else
+			lev |= 1U << gpio_irq;
+	}
+
+	gpio[GPLEV0] = lev;
+}
+
+/*
+ * CE: GPSET0/GPCLR0 writes since the last SPI message. Both seen: a
+ * pulse, which still starts one transmission in PTX.
+ */
+static void gpio_sample(void)
+{
+	uint32_t bit = 1U << gpio_ce;
+	bool rise, fall;
+
+	if (gpio == NULL)
+		return;
+
+	rise = gpio[GPSET0] & bit;
+	fall = gpio[GPCLR0] & bit;
+	gpio[GPSET0] &= ~bit;
+	gpio[GPCLR0] &= ~bit;
+
+	if (rise && !chip.ce)
+		counters.ce_edges++;
+	if (rise)
+		chip.ce = true;
+
+	if (fall) {
+		if (chip.ce)
+			counters.ce_edges++;
+		chip.ce = false;
+		chip.ce_pulse = rise;
+	}
+}
+
+/* Mode changes reach the broker: RPD restarts with every RX period */
+static void chip_update(uint64_t now)
+{
+	bool rx_on;
+
+	tx_run(now);
+	chip.ce_pulse = false;
+
+	rx_on = prx();
+	if (rx_on && !chip.rx_on)
+		chip.rpd = false;
+	chip.rx_on = rx_on;
+
+	radio_update();
+	irq_update();
+}
+
+/* SPI commands */
+
+static int op_index(uint8_t cmd)
+{
+	if ((cmd & 0xe0) == NRF24_R_REGISTER(0))
+		return OP_R_REGISTER + (cmd & NRF24_REGISTER_MASK);
+	if ((cmd & 0xe0) == NRF24_W_REGISTER(0))
+		return OP_W_REGISTER + (cmd & NRF24_REGISTER_MASK);
+	if ((cmd & ~NRF24_W_ACK_PAYLOAD_MASK) == NRF24_W_ACK_PAYLOAD(0))
+		return OP_W_ACK_PAYLOAD;
+
+	switch (cmd) {
+	case NRF24_R_RX_PAYLOAD:
+		return OP_R_RX_PAYLOAD;
+	case NRF24_W_TX_PAYLOAD:
+		return OP_W_TX_PAYLOAD;
+	case NRF24_FLUSH_TX:
+		return OP_FLUSH_TX;
+	case NRF24_FLUSH_RX:
+		return OP_FLUSH_RX;
+	case NRF24_REUSE_TX_PL:
+		return OP_REUSE_TX_PL;
+	case NRF24_R_RX_PL_WID:
+		return OP_R_RX_PL_WID;
+	case NRF24_W_TX_PAYLOAD_NOACK:
+		return OP_W_TX_PAYLOAD_NOACK;
+	case NRF24_NOP:
+		return OP_NOP;
+	case NRF24_ACTIVATE:
+		return OP_ACTIVATE;
+	default:
+		return OP_UNKNOWN;
+	}
+}
+
+static void tx_write(const uint8_t *data, size_t len, bool noack)
+{
+	struct fifo_entry *e;
+
+	if (len == 0)
+		return;
+
+	e = fifo_push(&chip.tx);
+	if (e == NULL)
+		return;
+
+	if (len > PAYLOAD_SIZE)
+		len = PAYLOAD_SIZE;
+
+	e->pipe = 0;
+	e->len = len;
+	e->noack = noack;
+	memcpy(e->payload, data, len);
+	chip.reuse = false;
+}
+
+/*
+ * One command: MOSI bytes in, MISO bytes out. STATUS is shifted out
+ * while the command byte is shifted in.
+ */
+static void command(const uint8_t *mosi, uint8_t *miso, size_t len)
+{
+	struct fifo_entry *e;
+	uint8_t cmd = mosi[0];
+	int op = op_index(cmd);
+	size_t i;
+
+	miso[0] = status_reg();
+	memset(miso + 1, 0, len - 1);
+
+	switch (op) {
+	case OP_R_RX_PAYLOAD:
+		e = fifo_head(&chip.rx);
+		if (e == NULL)
+			break;
+
+		for (i = 1; i < len && i - 1 < e->len; i++)
+			miso[i] = e->payload[i - 1];
+		fifo_pop(&chip.rx);
+		break;
+	case OP_W_TX_PAYLOAD:
+		tx_write(mosi + 1, len - 1, false);
+		break;
+	case OP_W_TX_PAYLOAD_NOACK:
+		if (chip.reg[NRF24_FEATURE] & NRF24_FT_EN_DYN_ACK)
+			tx_write(mosi + 1, len - 1, true);
+		break;
+	case OP_W_ACK_PAYLOAD:
+		/* The broker doesn't carry ACK payloads: discarded */
+		break;
+	case OP_FLUSH_TX:
+		fifo_flush(&chip.tx);
+		chip.reuse = false;
+		chip.tx_new = true;
+		if (chip.tx_busy)
+			chip.tx_flushed = true;
+		break;
+	case OP_FLUSH_RX:
+		fifo_flush(&chip.rx);
+		break;
+	case OP_REUSE_TX_PL:
+		if (chip.tx.count)
+			chip.reuse = true;
+		break;
+	case OP_R_RX_PL_WID:
+		e = fifo_head(&chip.rx);
+		if (len > 1 && e)
+			miso[1] = dynamic_payload(e->pipe) ? e->len :
+				chip.reg[NRF24_RX_PW_P0 + e->pipe];
+		break;
+	case OP_NOP:
+	case OP_ACTIVATE:
+	case OP_UNKNOWN:
+		break;
+	default:
+		if (op >= OP_W_REGISTER)
+			reg_write(cmd & NRF24_REGISTER_MASK, mosi + 1, len - 1);
+		else
+			for (i = 1; i < len; i++)
+				miso[i] = reg_read(cmd & NRF24_REGISTER_MASK,
+								i - 1);
+		break;
+	}
+}
+
+static void account(const uint8_t *mosi, size_t len, uint64_t bus_ns)
+{
+	int op = op_index(mosi[0]);
+
+	ops[op].count++;
+	ops[op].bytes += len;
+	ops[op].bus_ns += bus_ns;
+
+	counters.transactions++;
+	counters.bytes += len;
+	counters.bus_ns += bus_ns;
+}
+
+/*
+ * SPI_IOC_MESSAGE: CSN stays low across the transfers unless cs_change
+ * is set on a transfer that isn't the last one.
+ */
+static int spi_message(const struct spi_ioc_transfer *xfer, unsigned int n)
+{
+	uint8_t mosi[CMD_SIZE_MAX], miso[CMD_SIZE_MAX];
+	uint8_t *rx_buf[CMD_SIZE_MAX];
+	uint64_t now = now_us();
+	uint64_t bus_ns = 0;
+	size_t len = 0, total = 0, j;
+	unsigned int i;
+	uint32_t speed;
+	const uint8_t *tx;
+	uint8_t *rx;
+
+	counters.messages++;
+
+	gpio_sample();
+	air_input(now);
+	chip_update(now);
+
+	for (i = 0; i < n; i++) {
+		tx = (const uint8_t *) (uintptr_t) xfer[i].tx_buf;
+		rx = (uint8_t *) (uintptr_t) xfer[i].rx_buf;
+		speed = xfer[i].speed_hz ? xfer[i].speed_hz : spi_speed;
+
+		bus_ns += xfer[i].len * 8ULL * 1000000000ULL / speed +
+						xfer[i].delay_usecs * 1000ULL;
+
+		for (j = 0; j < xfer[i].len; j++, total++) {
+			/* Longer than any command: clocked, ignored */
+			if (len == CMD_SIZE_MAX)
+				continue;
+
+			mosi[len] = tx ? tx[j] : 0;
+			rx_buf[len] = rx ? &rx[j] : NULL;
+			len++;
+		}
+
+		if (i + 1 < n && !xfer[i].cs_change)
+			continue;
+
+		if (len) {
+			command(mosi, miso, len);
+			for (j = 0; j < len; j++) {
+				if (rx_buf[j])
+					*rx_buf[j] = miso[j];
+			}
+
+			account(mosi, total, bus_ns);
+		}
+
+		len = 0;
+		total = 0;
+		bus_ns = 0;
+	}
+
+	chip_update(now);
+
+	return 0;
+}
+
+static int spi_ioctl(unsigned long request, void *arg)
+{
+	unsigned int size;
+
+	if (_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 &&
+				_IOC_DIR(request) == _IOC_WRITE) {
+		size = _IOC_SIZE(request);
+		if (size % sizeof(struct spi_ioc_transfer)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		return spi_message(arg, size /
+					sizeof(struct spi_ioc_transfer));
+	}
+
+	counters.setup++;
+
+	switch (request) {
+	case SPI_IOC_WR_MODE:
+		spi_mode = *(uint8_t *) arg;
+		break;
+	case SPI_IOC_RD_MODE:
+		*(uint8_t *) arg = spi_mode;
+		break;
+	case SPI_IOC_WR_BITS_PER_WORD:
+		spi_bits = *(uint8_t *) arg;
+		break;
+	case SPI_IOC_RD_BITS_PER_WORD:
+		*(uint8_t *) arg = spi_bits;
+		break;
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		spi_speed = *(uint32_t *) arg;
+		break;
+	case SPI_IOC_RD_MAX_SPEED_HZ:
+		*(uint32_t *) arg = spi_speed;
+		break;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Statistics */
+
+static void report(void)
+{
+	const char *path = getenv("NRF24EMU_STATS");
+	uint64_t elapsed = now_us() - start_us;
+	char name[32];
+	FILE *fp = stderr;
+	int op;
+
+	if (!report_enabled ||
+			(counters.messages == 0 && counters.setup == 0))
+		return;
+
+	if (path && *path && strcmp(path, "-") != 0) {
+		fp = fopen(path, "a");
+		if (fp == NULL)
+			fp = stderr;
+	}
+
+	fprintf(fp, "nrf24emu: %llu SPI transactions, %llu bytes, "
+			"%llu messages, %llu setup ioctls, %llu sleeps "
+			"in %.3f s\n",
+			(unsigned long long) counters.transactions,
+			(unsigned long long) counters.bytes,
+			(unsigned long long) counters.messages,
+			(unsigned long long) counters.setup,
+			(unsigned long long) counters.sleeps,
+			elapsed / 1000000.0);
+	fprintf(fp, "nrf24emu: bus %.3f ms (%.2f%% of the time), "
+			"%.1f us per transaction\n",
+			counters.bus_ns / 1000000.0,
+			elapsed ? counters.bus_ns / (elapsed * 10.0) : 0,
+			counters.transactions ? counters.bus_ns /
+				(counters.transactions * 1000.0) : 0);
+	fprintf(fp, "nrf24emu: %llu TX (%llu retransmits, %llu acked, "
+			"%llu max RT), %llu RX (%llu FIFO full, "
+			"%llu width mismatch), %llu CE edges\n",
+			(unsigned long long) counters.tx,
+			(unsigned long long) counters.retransmits,
+			(unsigned long long) counters.tx_acked,
+			(unsigned long long) counters.max_rt,
+			(unsigned long long) counters.rx,
+			(unsigned long long) counters.rx_full,
+			(unsigned long long) counters.rx_mismatch,
+			(unsigned long long) counters.ce_edges);
+
+	fprintf(fp, "  %-24s %10s %10s %10s\n", "Command", "Count", "Bytes",
+								"Bus ms");
+	for (op = 0; op < OP_MAX; op++) {
+		if (ops[op].count == 0)
+			continue;
+
+		if (op < OP_W_REGISTER)
+			snprintf(name, sizeof(name), "R_REGISTER %s",
+				reg_names[op] ? reg_names[op] : "reserved");
+		else if (op < OP_R_RX_PAYLOAD)
+			snprintf(name, sizeof(name), "W_REGISTER %s",
+				reg_names[op - OP_W_REGISTER] ?
+				reg_names[op - OP_W_REGISTER] : "reserved");
+		else
+			snprintf(name, sizeof(name), "%s",
+					cmd_names[op - OP_R_RX_PAYLOAD]);
+
+		fprintf(fp, "  %-24s %10llu %10llu %10.3f\n", name,
+				(unsigned long long) ops[op].count,
+				(unsigned long long) ops[op].bytes,
+				ops[op].bus_ns / 1000000.0);
+	}
+
+	if (fp != stderr)
+		fclose(fp);
+}
+
+static void __attribute__ ((constructor)) nrf24emu_init(void)
+{
+	resolve();
+	start_us = now_us();
+}
+
+static void __attribute__ ((destructor)) nrf24emu_exit(void)
+{
+	air_detach();
+	report();
+}
+
+/* Linked in: nrf24emu.h */
+
+void nrf24emu_get_stats(struct nrf24emu_stats *stats)
+{
+	stats->transactions = counters.transactions;
+	stats->bytes = counters.bytes;
+	stats->messages = counters.messages;
+	stats->setup = counters.setup;
+	stats->sleeps = counters.sleeps;
+	stats->bus_ns = counters.bus_ns;
+	stats->tx = counters.tx;
+	stats->rx = counters.rx;
+}
+
+void nrf24emu_set_alone(bool ack)
+{
+	alone = true;
+	autoack = ack;
+	air_detach();
+}
+
+void nrf24emu_set_report(bool enable)
+{
+	report_enabled = enable;
+}
+
+uint8_t nrf24emu_channel(void)
+{
+	return chip.reg[NRF24_RF_CH];
+}
+
+int nrf24emu_inject(const uint8_t *aa, const void *payload, size_t len)
+{
+	struct air_rx rx;
+	uint8_t pipe_aa[AIR_AA_SIZE];
+	uint64_t now = now_us();
+	uint8_t pipe;
+
+	if (len == 0 || len > PAYLOAD_SIZE)
+		return -EINVAL;
+
+	/* CE may have changed since the last SPI message */
+	gpio_sample();
+	chip_update(now);
+
+	if (!chip.rx_on)
+		return -EAGAIN;
+
+	for (pipe = 0; pipe < AIR_PIPES; pipe++) {
+		if (!(chip.reg[NRF24_EN_RXADDR] & (1 << pipe)))
+			continue;
+
+		pipe_address(pipe, pipe_aa);
+		if (memcmp(pipe_aa, aa, AIR_AA_SIZE) == 0)
+			break;
+	}
+
+	if (pipe == AIR_PIPES)
+		return -ENOENT;
+
+	rx.pipe = pipe;
+	rx.len = len;
+	memcpy(rx.payload, payload, len);
+	rx_frame(&rx);
+	irq_update();
+
+	return pipe;
+}
+
+/* Interposed libc calls */
+
+static bool gpio_offset(off64_t offset)
+{
+	return offset == GPIO_RPI2_BASE || offset == GPIO_RPI_BASE;
+}
+
+static int emu_open(const char *pathname, int flags, mode_t mode)
+{
+	int fd;
+
+	resolve();
+
+	if (pathname == NULL)
+		return real_open(pathname, flags, mode);
+
+	if (strncmp(pathname, spi_path, strlen(spi_path)) == 0) {
+		fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+		if (fd < 0)
+			return fd;
+
+		if (fd_add(spi_fds, fd) < 0) {
+			real_close(fd);
+			errno = EMFILE;
+			return -1;
+		}
+
+		/* Powered while the process runs: registers survive */
+		if (!chip_ready)
+			chip_reset();
+		if (air_fd < 0 && !alone)
+			air_attach();
+
+		return fd;
+	}
+
+	if (strcmp(pathname, "/dev/mem") == 0 ||
+				strcmp(pathname, "/dev/gpiomem") == 0) {
+		fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+		if (fd >= 0 && fd_add(mem_fds, fd) < 0) {
+			real_close(fd);
+			errno = EMFILE;
+			return -1;
+		}
+
+		return fd;
+	}
+
+	return real_open(pathname, flags, mode);
+}
+
+int open(const char *pathname, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open(pathname, flags, mode);
+}
+
+int open64(const char *pathname, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open(pathname, flags | O_LARGEFILE, mode);
+}
+
+int close(int fd)
+{
+	resolve();
+
+	if (fd >= 0 && fd_find(spi_fds, fd)) {
+		if (fd_remove(spi_fds, fd) == 0)
+			air_detach();
+	} else if (fd >= 0 && fd_find(mem_fds, fd)) {
+		fd_remove(mem_fds, fd);
+	}
+
+	return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	resolve();
+
+	if (fd >= 0 && fd_find(spi_fds, fd))
+		return spi_ioctl(request, arg);
+
+	return real_ioctl(fd, request, arg);
+}
+
+static void *emu_mmap(void *addr, size_t length, int prot, int flags,
+						int fd, off64_t offset)
+{
+	void *page;
+
+	resolve();
+
+	if (fd < 0 || !fd_find(mem_fds, fd))
+		return real_mmap(addr, length, prot, flags, fd, offset);
+
+	/* Peripherals: zeroed memory, the GPIO page is watched */
+	page = real_mmap(addr, length, prot, MAP_SHARED | MAP_ANONYMOUS,
+								-1, 0);
+	if (page != MAP_FAILED && gpio_offset(offset) &&
+					length >= GPIO_BLOCK_SIZE)
+		gpio = page;
+
+	return page;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+								off_t offset)
+{
+	return emu_mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+								off64_t offset)
+{
+	return emu_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void *addr, size_t length)
+{
+	resolve();
+
+	if (gpio && addr == (void *) gpio)
+		gpio = NULL;
+
+	return real_munmap(addr, length);
+}
+
+/* Counted only: hal_delay_us() sleeps are syscalls on the real radio too */
+int clock_nanosleep(clockid_t clockid, int flags,
+			const struct timespec *request, struct timespec *remain)
+{
+	resolve();
+
+	counters.sleeps++;
+
+	return real_clock_nanosleep(clockid, flags, request, remain);
+}
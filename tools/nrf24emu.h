@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Control of the nRF24L01+ emulator (tools/nrf24emu.c) when it is linked
+ * into a program instead of preloaded: tools/nrf24bench.
+ */
+
+struct nrf24emu_stats {
+	uint64_t transactions;	/* SPI commands: CSN low to high */
+	uint64_t bytes;		/* Clocked on the bus */
+	uint64_t messages;	/* SPI_IOC_MESSAGE ioctls */
+	uint64_t setup;		/* Other spidev ioctls */
+	uint64_t sleeps;	/* clock_nanosleep() calls */
+	uint64_t bus_ns;	/* Estimated from speed and delays */
+	uint64_t tx;		/* Transmissions, retransmissions included */
+	uint64_t rx;		/* Frames queued in the RX FIFO */
+};
+
+void nrf24emu_get_stats(struct nrf24emu_stats *stats);
+
+/* No broker: every acknowledged frame gets its ACK if autoack is set */
+void nrf24emu_set_alone(bool autoack);
+
+/* Statistics report at exit, enabled by default */
+void nrf24emu_set_report(bool enable);
+
+/* Current RF_CH */
+uint8_t nrf24emu_channel(void);
+
+/* Frame from the air: returns the pipe, -EAGAIN if not listening */
+int nrf24emu_inject(const uint8_t *aa, const void *payload, size_t len);
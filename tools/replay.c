@@ -0,0 +1,1029 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "include/timer.h"
+#include "nrf24l01_ll.h"
+#include "phy_driver_sim.h"
+#include "sniff.h"
+#include "vclock.h"
+#include "stamp.h"
+
+/*
+ * Replay of a sniffer capture into the gateway stack: comm_nrf24l01 runs
+ * on "SIM0" as nrfd does (connects every thing announcing its presence,
+ * reads the messages) and a simulated radio transmits the captured
+ * frames at their capture time, on their channel and address. Frames
+ * are received by read_mgmt() and read_raw() as they would be from the
+ * air: a frame sent while the gateway listens to the other slot is lost.
+ *
+ * The trace is open loop: the things don't react to the replayed
+ * gateway, they only acknowledge its frames (a node listens on each
+ * channel of the capture). Frames sent by the captured gateway are not
+ * replayed: CONNECT_REQ and KEEPALIVE_RSP are recognized, data frames
+ * can't be told apart by a sniffer and are all replayed (captures
+ * written by replay mark the frames of the stack, SNIFF_F_TX). The
+ * access addresses the captured gateway gave to each thing are mapped
+ * to the ones the stack gives.
+ *
+ * The stack runs on tools/vclock.c, --speed times faster than real
+ * time. Speed 0 runs on a virtual clock advanced by the replay: the
+ * stack is polled every --poll us and idle periods are skipped, results
+ * only depend on the capture.
+ */
+
+#define PIPES			6
+#define MACS_MAX		32
+#define ACKERS_MAX		8	/* Channels the things listen to */
+#define LEAD_IN_US		100000	/* Stack up before the first frame */
+#define SYNC_US			1000000	/* Longest wait for the channel */
+#define STACK_NODE		0	/* First node: hal_comm_init() */
+#define DRAIN_US		1000000	/* Running after the last frame */
+#define RETRANSMIT_US		4500	/* ARD max (4000us) and airtime */
+#define QUIET_POLLS		12	/* Both slots, every pipe polled */
+#define POLL_US			100
+
+struct trace_frame {
+	uint64_t time_us;		/* From the first frame */
+	uint8_t channel;
+	uint8_t pipe;			/* Sniffer RX pipe */
+	uint8_t aa[SNIFF_AA_SIZE];
+	bool ack;
+	bool gateway;			/* Sent by the captured gateway */
+	uint8_t attempt;		/* Copies of the same packet before */
+	uint8_t len;
+	uint8_t payload[SIM_PAYLOAD_SIZE];
+};
+
+/* Thing: address given by the captured gateway and by the stack */
+struct mac_map {
+	uint64_t mac;
+	uint8_t rec_aa[SNIFF_AA_SIZE];
+	uint8_t live_aa[SNIFF_AA_SIZE];
+	bool rec;
+	bool live;
+	uint64_t presence_us;		/* Presence delivered, not connected */
+};
+
+struct gw_peer {
+	int sockfd;
+	uint64_t mac;
+};
+
+static struct trace_frame *trace;
+static unsigned int ntrace;
+static uint64_t epoch_us;		/* Wall clock of the first frame */
+static uint64_t start_us;		/* Stack time of the first frame */
+
+static struct mac_map maps[MACS_MAX];
+static struct gw_peer gw_peers[PIPES - 1];
+static struct nrf24_mac gw_mac;
+
+/* Per stack pipe: request delivered, waiting for the stack */
+static uint64_t keepalive_us[PIPES];
+static uint64_t message_us[PIPES];
+
+static struct hist lat_connect;
+static struct hist lat_keepalive;
+static struct hist lat_message;
+
+static int injector = -1;
+static int ackers[ACKERS_MAX];
+static unsigned int nackers;
+static uint8_t injector_aa[2][SNIFF_AA_SIZE];
+static int injected_delivered;
+static bool stack_active;
+static FILE *out;
+
+static struct {
+	uint32_t frames;
+	uint32_t skipped;		/* Gateway or stack frames */
+	uint32_t retransmits;
+	uint32_t injected;
+	uint32_t delivered;
+	uint32_t stack_frames;
+	uint32_t connect_req;
+	uint32_t keepalive_rsp;
+	uint32_t presences;
+	uint32_t connects;
+	uint32_t disconnects;
+	uint32_t messages;
+} counters;
+
+static char *opt_read = NULL;
+static char *opt_write = NULL;
+static char *opt_mac = NULL;
+static double opt_speed = 1;
+static int opt_poll = POLL_US;
+static double opt_loss = 0;
+static int opt_seed = 1;
+static gboolean opt_all = FALSE;
+
+static volatile sig_atomic_t quit;
+
+/* Access Address for each pipe, as comm_nrf24l01 */
+static uint8_t aa_pipes[PIPES][SNIFF_AA_SIZE] = {
+	{0x8D, 0xD9, 0xBE, 0x96, 0xDE},
+	{0x35, 0x96, 0xB6, 0xC1, 0x6B},
+	{0x77, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xD3, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xE7, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xF0, 0x96, 0xB6, 0xC1, 0x6B}
+};
+
+static GOptionEntry options[] = {
+	{ "read", 'r', 0, G_OPTION_ARG_STRING, &opt_read,
+			"file", "Capture to replay (tools/sniffer -w)" },
+	{ "write", 'w', 0, G_OPTION_ARG_STRING, &opt_write,
+			"file", "pcap of the replayed and the stack frames" },
+	{ "speed", 's', 0, G_OPTION_ARG_DOUBLE, &opt_speed,
+			"factor", "Clock speed (default 1), 0: virtual clock" },
+	{ "poll", 'p', 0, G_OPTION_ARG_INT, &opt_poll,
+			"us", "Virtual clock: poll period (default 100)" },
+	{ "mac", 'm', 0, G_OPTION_ARG_STRING, &opt_mac,
+			"address", "Gateway address (default: from capture)" },
+	{ "all", 'a', 0, G_OPTION_ARG_NONE, &opt_all,
+			NULL, "Replay the frames of the gateway too" },
+	{ "loss", 'l', 0, G_OPTION_ARG_DOUBLE, &opt_loss,
+			"percent", "Frame and ACK loss (default 0)" },
+	{ "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+			"seed", "Loss pattern (default 1)" },
+	{ NULL },
+};
+
+static uint64_t real_ns(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (uint64_t) spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+static void sig_term(int sig)
+{
+	quit = 1;
+}
+
+static int aa_pipe(const uint8_t *aa)
+{
+	int i;
+
+	for (i = 0; i < PIPES; i++) {
+		if (memcmp(aa, aa_pipes[i], SNIFF_AA_SIZE) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+static struct mac_map *map_get(uint64_t mac)
+{
+	int i;
+
+	for (i = 0; i < MACS_MAX && maps[i].mac; i++) {
+		if (maps[i].mac == mac)
+			return &maps[i];
+	}
+
+	if (i == MACS_MAX)
+		return NULL;
+
+	maps[i].mac = mac;
+
+	return &maps[i];
+}
+
+static struct mac_map *map_by_rec_aa(const uint8_t *aa)
+{
+	int i;
+
+	for (i = 0; i < MACS_MAX && maps[i].mac; i++) {
+		if (maps[i].rec && memcmp(maps[i].rec_aa, aa,
+						SNIFF_AA_SIZE) == 0)
+			return &maps[i];
+	}
+
+	return NULL;
+}
+
+/* CONNECT_REQ: the address now belongs to this thing only */
+static void map_connect(uint64_t mac, const uint8_t *aa, bool live)
+{
+	struct mac_map *map;
+	int i;
+
+	for (i = 0; i < MACS_MAX && maps[i].mac; i++) {
+		if (live && memcmp(maps[i].live_aa, aa, SNIFF_AA_SIZE) == 0)
+			maps[i].live = false;
+		if (!live && memcmp(maps[i].rec_aa, aa, SNIFF_AA_SIZE) == 0)
+			maps[i].rec = false;
+	}
+
+	map = map_get(mac);
+	if (!map)
+		return;
+
+	if (live) {
+		memcpy(map->live_aa, aa, SNIFF_AA_SIZE);
+		map->live = true;
+	} else {
+		memcpy(map->rec_aa, aa, SNIFF_AA_SIZE);
+		map->rec = true;
+	}
+}
+
+static bool frame_is_mgmt(const uint8_t *aa)
+{
+	return memcmp(aa, aa_pipes[0], SNIFF_AA_SIZE) == 0;
+}
+
+/* Control PDU opcode of a data pipe frame, -EINVAL if not control */
+static int frame_ctrl_op(const uint8_t *payload, size_t len)
+{
+	const struct nrf24_ll_data_pdu *ipdu = (const void *) payload;
+	const struct nrf24_ll_crtl_pdu *ctrl = (const void *) ipdu->payload;
+
+	if (len < DATA_HDR_SIZE + sizeof(*ctrl) ||
+			ipdu->lid != NRF24_PDU_LID_CONTROL)
+		return -EINVAL;
+
+	return ctrl->opcode;
+}
+
+static const struct nrf24_ll_keepalive *frame_keepalive(
+					const uint8_t *payload, size_t len)
+{
+	const struct nrf24_ll_data_pdu *ipdu = (const void *) payload;
+	const struct nrf24_ll_crtl_pdu *ctrl = (const void *) ipdu->payload;
+
+	if (len < DATA_HDR_SIZE + sizeof(*ctrl) +
+				sizeof(struct nrf24_ll_keepalive))
+		return NULL;
+
+	return (const void *) ctrl->payload;
+}
+
+static const struct nrf24_ll_mgmt_connect *frame_connect(
+					const uint8_t *payload, size_t len)
+{
+	const struct nrf24_ll_mgmt_pdu *ipdu = (const void *) payload;
+
+	if (len < sizeof(*ipdu) + sizeof(struct nrf24_ll_mgmt_connect) ||
+				ipdu->type != NRF24_PDU_TYPE_CONNECT_REQ)
+		return NULL;
+
+	return (const void *) ipdu->payload;
+}
+
+/* Frames only the gateway sends: CONNECT_REQ and KEEPALIVE_RSP */
+static bool frame_from_gateway(const struct trace_frame *f)
+{
+	if (frame_is_mgmt(f->aa))
+		return frame_connect(f->payload, f->len) != NULL;
+
+	return frame_ctrl_op(f->payload, f->len) ==
+					NRF24_LL_CRTL_OP_KEEPALIVE_RSP;
+}
+
+/* A copy of the previous frame on the address is a retransmission */
+static void trace_mark_attempt(unsigned int index)
+{
+	struct trace_frame *f = &trace[index], *prev;
+	unsigned int i;
+
+	if (!f->ack)
+		return;
+
+	for (i = index; i-- > 0; ) {
+		prev = &trace[i];
+		if (f->time_us - prev->time_us > RETRANSMIT_US)
+			return;
+
+		if (memcmp(prev->aa, f->aa, SNIFF_AA_SIZE) != 0)
+			continue;
+
+		if (prev->channel == f->channel && prev->len == f->len &&
+				prev->attempt < 15 &&
+				memcmp(prev->payload, f->payload, f->len) == 0) {
+			f->attempt = prev->attempt + 1;
+			counters.retransmits++;
+		}
+
+		return;
+	}
+}
+
+static int trace_load(const char *path)
+{
+	struct pcap_file_hdr fhdr;
+	struct pcap_rec_hdr rec;
+	struct sniff_hdr hdr;
+	struct trace_frame *f;
+	uint8_t payload[SIM_PAYLOAD_SIZE];
+	unsigned int size = 0;
+	uint64_t time_us;
+	size_t len;
+	int err = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (fread(&fhdr, sizeof(fhdr), 1, fp) != 1 ||
+				fhdr.magic != PCAP_MAGIC ||
+				fhdr.linktype != LINKTYPE_USER0) {
+		err = -EPROTO;
+		goto done;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.incl_len < sizeof(hdr) ||
+				rec.incl_len > sizeof(hdr) + sizeof(payload) ||
+				fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+			err = -EPROTO;
+			break;
+		}
+
+		len = rec.incl_len - sizeof(hdr);
+		if (fread(payload, 1, len, fp) != len) {
+			err = -EPROTO;
+			break;
+		}
+
+		counters.frames++;
+
+		/* Undecoded air frames and frames of a replayed stack */
+		if (hdr.version != SNIFF_VERSION || len == 0 ||
+				((hdr.flags & SNIFF_F_PROMISC) &&
+				!(hdr.flags & SNIFF_F_DECODED)) ||
+				(hdr.flags & SNIFF_F_TX)) {
+			counters.skipped++;
+			continue;
+		}
+
+		time_us = rec.ts_sec * 1000000ULL + rec.ts_usec;
+		if (ntrace == 0)
+			epoch_us = time_us;
+
+		/* Merged captures may be slightly out of order */
+		if (time_us < epoch_us)
+			time_us = epoch_us;
+
+		if (ntrace == size) {
+			size = size ? size * 2 : 1024;
+			trace = g_renew(struct trace_frame, trace, size);
+		}
+
+		f = &trace[ntrace];
+		memset(f, 0, sizeof(*f));
+		f->time_us = time_us - epoch_us;
+		f->channel = hdr.channel;
+		f->pipe = hdr.pipe;
+		memcpy(f->aa, hdr.aa, SNIFF_AA_SIZE);
+		f->len = len;
+		memcpy(f->payload, payload, len);
+
+		if (hdr.flags & SNIFF_F_DECODED)
+			f->ack = !hdr.no_ack;
+		else
+			f->ack = !frame_is_mgmt(f->aa);
+
+		f->gateway = frame_from_gateway(f);
+		trace_mark_attempt(ntrace);
+		ntrace++;
+	}
+
+done:
+	fclose(fp);
+
+	return err;
+}
+
+/* Gateway address: source of CONNECT_REQ, destination of KEEPALIVE_REQ */
+static uint64_t trace_gateway_mac(void)
+{
+	const struct nrf24_ll_mgmt_connect *connect;
+	const struct nrf24_ll_keepalive *kpalive;
+	struct trace_frame *f;
+	unsigned int i;
+
+	for (i = 0; i < ntrace; i++) {
+		f = &trace[i];
+
+		connect = frame_connect(f->payload, f->len);
+		if (frame_is_mgmt(f->aa) && connect)
+			return connect->src_addr.address.uint64;
+
+		kpalive = frame_keepalive(f->payload, f->len);
+		if (!frame_is_mgmt(f->aa) && kpalive &&
+				frame_ctrl_op(f->payload, f->len) ==
+					NRF24_LL_CRTL_OP_KEEPALIVE_REQ)
+			return kpalive->dst_addr.address.uint64;
+	}
+
+	return 0;
+}
+
+static void pcap_open(FILE *fp)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = sizeof(struct sniff_hdr) + SIM_PAYLOAD_SIZE,
+		.linktype = LINKTYPE_USER0,
+	};
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+}
+
+/* Replayed frames are radio 0, frames of the stack radio 1 */
+static void pcap_write(FILE *fp, const struct sim_frame *frame,
+						uint8_t pipe, bool stack)
+{
+	uint64_t time_us = epoch_us + hal_time64_us() - start_us;
+	struct pcap_rec_hdr rec;
+	struct sniff_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = SNIFF_VERSION;
+	hdr.flags = stack ? SNIFF_F_TX : 0;
+	hdr.radio = stack ? 1 : 0;
+	hdr.channel = frame->channel;
+	hdr.pipe = pipe;
+	memcpy(hdr.aa, frame->aa, sizeof(hdr.aa));
+	hdr.no_ack = !frame->ack;
+
+	rec.ts_sec = time_us / 1000000;
+	rec.ts_usec = time_us % 1000000;
+	rec.incl_len = sizeof(hdr) + frame->len;
+	rec.orig_len = rec.incl_len;
+
+	fwrite(&rec, sizeof(rec), 1, fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(frame->payload, frame->len, 1, fp);
+}
+
+/* Frame of the stack: latency from the request it answers */
+static void stack_frame(const struct sim_frame *frame)
+{
+	const struct nrf24_ll_mgmt_connect *connect;
+	const struct nrf24_ll_keepalive *kpalive;
+	uint64_t now = hal_time64_us();
+	struct mac_map *map;
+	int pipe;
+
+	counters.stack_frames++;
+	stack_active = true;
+
+	if (frame_is_mgmt(frame->aa)) {
+		connect = frame_connect(frame->payload, frame->len);
+		if (!connect)
+			return;
+
+		counters.connect_req++;
+		map_connect(connect->dst_addr.address.uint64, connect->aa,
+									true);
+
+		map = map_get(connect->dst_addr.address.uint64);
+		if (map && map->presence_us) {
+			hist_add(&lat_connect, now - map->presence_us);
+			map->presence_us = 0;
+		}
+
+		return;
+	}
+
+	pipe = aa_pipe(frame->aa);
+	if (pipe < 0 || frame_ctrl_op(frame->payload, frame->len) !=
+					NRF24_LL_CRTL_OP_KEEPALIVE_RSP)
+		return;
+
+	counters.keepalive_rsp++;
+	kpalive = frame_keepalive(frame->payload, frame->len);
+	if (kpalive && keepalive_us[pipe]) {
+		hist_add(&lat_keepalive, now - keepalive_us[pipe]);
+		keepalive_us[pipe] = 0;
+	}
+}
+
+static void tap(const struct sim_frame *frame, int delivered, bool acked,
+							void *user_data)
+{
+	uint8_t payload[SIM_PAYLOAD_SIZE];
+	unsigned int i;
+	int pipe;
+
+	if (frame->src == injector) {
+		injected_delivered = delivered;
+		if (out)
+			pcap_write(out, frame, frame->ack ? 1 : 0, false);
+		return;
+	}
+
+	if (out) {
+		pipe = aa_pipe(frame->aa);
+		pcap_write(out, frame, pipe < 0 ? 0 : pipe, true);
+	}
+
+	stack_frame(frame);
+
+	/* Things only acknowledge: RX FIFOs are never full */
+	for (i = 0; i < nackers; i++) {
+		while (sim_node_recv(ackers[i], NULL, payload,
+						sizeof(payload)) > 0)
+			;
+	}
+}
+
+/* Replayed frame delivered: starts the latency of the stack answer */
+static void inject_delivered(const struct trace_frame *f,
+					const uint8_t *aa, uint64_t now)
+{
+	const struct nrf24_ll_mgmt_pdu *mpdu = (const void *) f->payload;
+	const struct nrf24_ll_data_pdu *dpdu = (const void *) f->payload;
+	const struct nrf24_mac *mac = (const void *) mpdu->payload;
+	struct mac_map *map;
+	int pipe;
+
+	if (frame_is_mgmt(aa)) {
+		if (mpdu->type != NRF24_PDU_TYPE_PRESENCE ||
+				f->len < sizeof(*mpdu) + sizeof(*mac))
+			return;
+
+		map = map_get(mac->address.uint64);
+		if (map && map->presence_us == 0)
+			map->presence_us = now;
+		return;
+	}
+
+	pipe = aa_pipe(aa);
+	if (pipe <= 0)
+		return;
+
+	if (frame_ctrl_op(f->payload, f->len) ==
+				NRF24_LL_CRTL_OP_KEEPALIVE_REQ &&
+				keepalive_us[pipe] == 0)
+		keepalive_us[pipe] = now;
+
+	if (dpdu->lid == NRF24_PDU_LID_DATA_END && message_us[pipe] == 0)
+		message_us[pipe] = now;
+}
+
+static void inject(const struct trace_frame *f)
+{
+	const struct nrf24_ll_mgmt_connect *connect;
+	struct mac_map *map;
+	uint8_t aa[SNIFF_AA_SIZE];
+	uint8_t pipe = f->ack ? 1 : 0;
+	unsigned int i;
+
+	/* CONNECT_REQ of the captured gateway: address of the thing */
+	connect = frame_connect(f->payload, f->len);
+	if (frame_is_mgmt(f->aa) && connect)
+		map_connect(connect->dst_addr.address.uint64, connect->aa,
+									false);
+
+	if (f->gateway && !opt_all) {
+		counters.skipped++;
+		return;
+	}
+
+	memcpy(aa, f->aa, sizeof(aa));
+	map = map_by_rec_aa(f->aa);
+	if (map && map->live)
+		memcpy(aa, map->live_aa, sizeof(aa));
+
+	/* Pipe 0 sends broadcasts, pipe 1 acknowledged frames */
+	if (memcmp(injector_aa[pipe], aa, sizeof(aa)) != 0) {
+		sim_node_close_pipe(injector, pipe);
+		sim_node_open_pipe(injector, pipe, aa, f->ack);
+		memcpy(injector_aa[pipe], aa, sizeof(aa));
+	}
+
+	sim_node_set_channel(injector, f->channel);
+
+	/* Only the stack receives the replayed frames */
+	for (i = 0; i < nackers; i++)
+		sim_node_set_rx(ackers[i], false);
+
+	injected_delivered = 0;
+	sim_node_send(injector, pipe, f->payload, f->len, f->attempt);
+
+	for (i = 0; i < nackers; i++)
+		sim_node_set_rx(ackers[i], true);
+
+	counters.injected++;
+	if (injected_delivered == 0)
+		return;
+
+	counters.delivered++;
+	inject_delivered(f, aa, hal_time64_us());
+}
+
+/* A thing on each channel of the capture, listening to the data pipes */
+static int ackers_new(void)
+{
+	unsigned int i, j;
+	int node;
+	uint8_t pipe;
+
+	for (i = 0; i < ntrace; i++) {
+		for (j = 0; j < nackers; j++) {
+			if (sim_node_get_channel(ackers[j]) ==
+							trace[i].channel)
+				break;
+		}
+
+		if (j < nackers)
+			continue;
+
+		if (nackers == ACKERS_MAX)
+			return -ENOSPC;
+
+		node = sim_node_new();
+		if (node < 0)
+			return node;
+
+		ackers[nackers++] = node;
+		sim_node_set_channel(node, trace[i].channel);
+		for (pipe = 1; pipe < PIPES; pipe++)
+			sim_node_open_pipe(node, pipe, aa_pipes[pipe], true);
+		sim_node_set_rx(node, true);
+	}
+
+	return 0;
+}
+
+static struct gw_peer *gw_peer_get(uint64_t mac)
+{
+	int i;
+
+	for (i = 0; i < PIPES - 1; i++) {
+		if (gw_peers[i].sockfd >= 0 && gw_peers[i].mac == mac)
+			return &gw_peers[i];
+	}
+
+	return NULL;
+}
+
+static void gw_presence(uint64_t mac)
+{
+	struct gw_peer *peer;
+	int sockfd, i;
+
+	counters.presences++;
+
+	/* Already connected: the thing didn't get CONNECT_REQ yet */
+	peer = gw_peer_get(mac);
+	if (peer) {
+		hal_comm_connect(peer->sockfd, &mac);
+		return;
+	}
+
+	for (i = 0; i < PIPES - 1 && gw_peers[i].sockfd >= 0; i++)
+		;
+
+	if (i == PIPES - 1)
+		return;
+
+	sockfd = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (sockfd < 0)
+		return;
+
+	if (hal_comm_connect(sockfd, &mac) < 0) {
+		hal_comm_close(sockfd);
+		return;
+	}
+
+	gw_peers[i].sockfd = sockfd;
+	gw_peers[i].mac = mac;
+	counters.connects++;
+}
+
+static void gw_disconnected(uint64_t mac)
+{
+	struct gw_peer *peer = gw_peer_get(mac);
+
+	counters.disconnects++;
+
+	if (!peer)
+		return;
+
+	hal_comm_close(peer->sockfd);
+	peer->sockfd = -1;
+}
+
+/* As nrfd: management events and messages knotd would get */
+static bool gw_run(void)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	const struct mgmt_evt_nrf24_bcast_presence *presence;
+	const struct mgmt_evt_nrf24_disconnected *disconnected;
+	struct gw_peer *peer;
+	bool active = false;
+	ssize_t len;
+	int i;
+
+	len = hal_comm_read(0, buffer, sizeof(buffer));
+	if (len > (ssize_t) sizeof(*mhdr)) {
+		active = true;
+		presence = (const void *) mhdr->payload;
+		disconnected = (const void *) mhdr->payload;
+
+		if (mhdr->opcode == MGMT_EVT_NRF24_BCAST_PRESENCE)
+			gw_presence(presence->mac.address.uint64);
+		else if (mhdr->opcode == MGMT_EVT_NRF24_DISCONNECTED)
+			gw_disconnected(disconnected->mac.address.uint64);
+	}
+
+	for (i = 0; i < PIPES - 1; i++) {
+		peer = &gw_peers[i];
+		if (peer->sockfd < 0)
+			continue;
+
+		len = hal_comm_read(peer->sockfd, buffer, sizeof(buffer));
+		if (len <= 0)
+			continue;
+
+		active = true;
+		counters.messages++;
+
+		if (message_us[peer->sockfd]) {
+			hist_add(&lat_message, hal_time64_us() -
+						message_us[peer->sockfd]);
+			message_us[peer->sockfd] = 0;
+		}
+	}
+
+	return active;
+}
+
+/* Next replayed frame or stack timer, stack time */
+static uint64_t next_event(unsigned int next, uint64_t now)
+{
+	uint64_t event = UINT64_MAX, expires;
+	uint32_t now_ms = now / 1000, timer;
+
+	if (start_us && next < ntrace)
+		event = start_us + trace[next].time_us;
+	else if (start_us == 0)
+		event = now < LEAD_IN_US ? LEAD_IN_US : LEAD_IN_US + SYNC_US;
+
+	timer = hal_timer_next(now_ms);
+	if (timer == HAL_TIMER_NONE)
+		return event;
+
+	expires = now / 1000 * 1000;
+	if ((int32_t) (timer - now_ms) > 0)
+		expires += (timer - now_ms) * 1000ULL;
+
+	return expires < event ? expires : event;
+}
+
+static void print_hist(const char *name, const struct hist *h)
+{
+	if (h->count == 0) {
+		printf("%s: none\n", name);
+		return;
+	}
+
+	printf("%s: %llu, min %llu p50 %llu p99 %llu max %llu us\n", name,
+			(unsigned long long) h->count,
+			(unsigned long long) h->min,
+			(unsigned long long) hist_percentile(h, 500),
+			(unsigned long long) hist_percentile(h, 990),
+			(unsigned long long) h->max);
+}
+
+static void report(uint64_t elapsed_ns)
+{
+	struct sim_stats stats;
+
+	sim_get_stats(&stats);
+
+	printf("Trace: %u frames, %u skipped, %u retransmissions\n",
+			counters.frames, counters.skipped,
+			counters.retransmits);
+	printf("Replayed: %u frames, %u received by the stack in %.2f s "
+		"(%.2f s stack time)\n", counters.injected,
+		counters.delivered, elapsed_ns / 1000000000.0,
+		hal_time64_us() / 1000000.0);
+	printf("Stack: %u frames, %u CONNECT_REQ, %u KEEPALIVE_RSP, "
+		"%llu failed\n", counters.stack_frames, counters.connect_req,
+		counters.keepalive_rsp, (unsigned long long) stats.failed);
+	printf("Gateway: %u presences, %u connects, %u disconnects, "
+		"%u messages\n", counters.presences, counters.connects,
+		counters.disconnects, counters.messages);
+
+	print_hist("Presence to CONNECT_REQ", &lat_connect);
+	print_hist("KEEPALIVE_REQ to RSP", &lat_keepalive);
+	print_hist("Message to hal_comm_read", &lat_message);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct sim_params params;
+	uint64_t start_ns, now, event, end;
+	unsigned int next = 0, quiet = 0;
+	int err, i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (!opt_read || opt_speed < 0 || opt_poll < 1 ||
+				opt_loss < 0 || opt_loss > 100) {
+		printf("Invalid arguments: --read is required\n");
+		return EXIT_FAILURE;
+	}
+
+	err = trace_load(opt_read);
+	if (err < 0) {
+		printf("%s: %s\n", opt_read, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (ntrace == 0) {
+		printf("%s: no frames to replay\n", opt_read);
+		return EXIT_FAILURE;
+	}
+
+	gw_mac.address.uint64 = trace_gateway_mac();
+	if (opt_mac && nrf24_str2mac(opt_mac, &gw_mac) < 0) {
+		printf("Invalid address: %s\n", opt_mac);
+		return EXIT_FAILURE;
+	}
+
+	if (gw_mac.address.uint64 == 0)
+		gw_mac.address.uint64 = 0xc0ffee0000000001ULL;
+
+	if (opt_write) {
+		out = strcmp(opt_write, "-") == 0 ? stdout :
+							fopen(opt_write, "w");
+		if (!out) {
+			printf("%s: %s\n", opt_write, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		pcap_open(out);
+	}
+
+	signal(SIGTERM, sig_term);
+	signal(SIGINT, sig_term);
+
+	/* Replayed frames take their airtime */
+	sim_get_params(&params);
+	params.loss = opt_loss * 10000;
+	params.seed = opt_seed;
+	params.realtime = true;
+	sim_set_params(&params);
+	sim_set_tap(tap, NULL);
+
+	vclock_init(opt_speed, opt_seed);
+
+	err = hal_comm_init("SIM0", &gw_mac);
+	if (err < 0) {
+		printf("hal_comm_init(): %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT) < 0) {
+		printf("Can't open management socket\n");
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < PIPES - 1; i++)
+		gw_peers[i].sockfd = -1;
+
+	injector = sim_node_new();
+	if (injector < 0) {
+		printf("sim_node_new(): %s\n", strerror(-injector));
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	err = ackers_new();
+	if (err < 0) {
+		printf("Can't create the things: %s\n", strerror(-err));
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	hist_init(&lat_connect);
+	hist_init(&lat_keepalive);
+	hist_init(&lat_message);
+
+	end = UINT64_MAX;
+
+	if (out != stdout) {
+		printf("Replay: %u frames, %.2f s, gateway %016llx, ", ntrace,
+				trace[ntrace - 1].time_us / 1000000.0,
+				(unsigned long long) gw_mac.address.uint64);
+		if (vclock_virtual())
+			printf("virtual clock\n");
+		else
+			printf("speed %.2f\n", opt_speed);
+		fflush(stdout);
+	}
+
+	start_ns = real_ns();
+
+	while (!quit) {
+		now = hal_time64_us();
+		if (now >= end)
+			break;
+
+		stack_active = false;
+
+		/*
+		 * Slots of the captured gateway and things are unknown: the
+		 * first frame is sent when the stack listens to its channel.
+		 */
+		if (start_us == 0 && now >= LEAD_IN_US &&
+				(sim_node_get_channel(STACK_NODE) ==
+						trace[0].channel ||
+				now >= LEAD_IN_US + SYNC_US)) {
+			start_us = now;
+			end = start_us + trace[ntrace - 1].time_us + DRAIN_US;
+		}
+
+		while (start_us && next < ntrace &&
+				start_us + trace[next].time_us <= now) {
+			inject(&trace[next++]);
+			stack_active = true;
+		}
+
+		if (gw_run())
+			stack_active = true;
+
+		quiet = stack_active ? 0 : quiet + 1;
+
+		/* Busy stack: polled as nrfd polls it */
+		if (quiet < QUIET_POLLS) {
+			if (vclock_virtual())
+				vclock_wait_until(now + opt_poll);
+			continue;
+		}
+
+		/* Idle stack: up to the next frame or timer */
+		event = next_event(next, now);
+		if (event > end)
+			event = end;
+
+		if (event <= now)
+			event = now + opt_poll;
+
+		vclock_wait_until(event);
+
+		quiet = 0;
+	}
+
+	if (out && out != stdout)
+		fclose(out);
+
+	if (out != stdout)
+		report(real_ns() - start_ns);
+
+	hal_comm_deinit();
+	sim_node_free(injector);
+	for (i = 0; i < (int) nackers; i++)
+		sim_node_free(ackers[i]);
+	g_free(trace);
+
+	return EXIT_SUCCESS;
+}
@@ -12,13 +12,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
 #include <glib.h>
 #include <stdbool.h>
 
 #include "spi.h"
 #include "nrf24l01.h"
 #include "nrf24l01_io.h"
+#include "include/nrf24.h"
+#include "include/comm.h"
 #include "include/time.h"
+#include "stamp.h"
 
 #define MAXRETRIES 20
 #define PIPE0		0
@@ -31,9 +36,24 @@ static GMainLoop *main_loop;
 
 static int spi_fd =  -1;
 
+static gboolean opt_bench = FALSE;
+static char *opt_path = "phy";
+static char *opt_device = NULL;
+static char *opt_sizes = "32";
+static char *opt_rates = "1M";
+static char *opt_ards = NULL;
+static char *opt_arcs = NULL;
+static char *opt_acks = "on";
+static int opt_count = 200;
+static gboolean opt_json = FALSE;
+
+static volatile sig_atomic_t quit;
+
 static void sig_term(int sig)
 {
-	g_main_loop_quit(main_loop);
+	quit = 1;
+	if (main_loop)
+		g_main_loop_quit(main_loop);
 
 }
 
@@ -205,6 +225,802 @@ static gboolean timeout_watch_server(gpointer user_data)
 	return TRUE;
 }
 
+/*
+ * Benchmark mode (--bench): the server echoes, the client runs one test
+ * per combination of --size, --rate, --ard, --arc and --ack:
+ *  - setup: the new parameters are agreed on the base setup (1Mbps,
+ *    ACK, first ARD/ARC), then both ends switch
+ *  - stream: --count packets back to back, the server counts them
+ *  - report: the server returns its count, giving loss and goodput
+ *  - ping: --count echoes one at a time, giving the round trip time
+ * The server returns to the base setup when the client says done or
+ * after BENCH_IDLE_MS of silence. The phy path drives the nRF24L01
+ * directly on pipe 1; the comm path measures hal_comm, where the
+ * client connects the server as nrfd connects a thing, and the radio
+ * setup belongs to comm_nrf24l01.
+ */
+#define BENCH_PIPE		1
+#define BENCH_IDLE_MS		1000
+#define BENCH_TRIES		20
+#define BENCH_MAC_SERVER	0x5250494543484f53ULL	/* "RPIECHOS" */
+#define BENCH_MAC_CLIENT	0x5250494543484f43ULL	/* "RPIECHOC" */
+#define BENCH_SIZE_MAX		128	/* comm_nrf24l01 DATA_SIZE */
+
+enum bench_type {
+	BENCH_SETUP = 1,
+	BENCH_SETUP_RSP,
+	BENCH_DATA,
+	BENCH_END,
+	BENCH_REPORT,
+	BENCH_PING,
+	BENCH_PONG,
+	BENCH_DONE,
+};
+
+struct bench_hdr {
+	uint8_t type;
+	uint16_t seq;
+} __attribute__ ((packed));
+
+struct bench_setup {
+	struct bench_hdr hdr;
+	uint8_t rate;
+	uint8_t ack;
+	uint8_t ard;
+	uint8_t arc;
+} __attribute__ ((packed));
+
+struct bench_report {
+	struct bench_hdr hdr;
+	uint32_t received;
+	uint32_t bytes;
+} __attribute__ ((packed));
+
+struct bench_point {
+	uint8_t size;
+	uint8_t rate;		/* NRF24_DR_* */
+	bool ack;
+	uint8_t ard;		/* NRF24_ARD_*: (ard + 1) * 250us */
+	uint8_t arc;
+};
+
+struct bench_result {
+	struct bench_point point;
+	bool failed;		/* Setup not acknowledged */
+	uint32_t sent;
+	uint32_t tx_failed;	/* MAX_RT */
+	uint32_t retransmits;
+	uint32_t received;
+	uint32_t bytes;
+	uint64_t stream_us;
+	uint32_t pongs;
+	struct hist rtt;
+};
+
+struct bench_path {
+	const char *name;
+	size_t size_max;
+	uint32_t reply_ms;	/* Waiting an answer, retransmissions apart */
+	uint32_t poll_us;	/* Idle sleep, 0: busy poll */
+	bool radio_setup;	/* Rate, ARD/ARC and ACK can change */
+	bool observe;		/* Retransmissions known */
+	int (*init)(bool server);
+	void (*stop)(void);
+	int (*configure)(const struct bench_point *point);
+	/* Blocking: returns 0 once sent or -ETIMEDOUT after MAX_RT */
+	int (*send)(const void *buffer, size_t len, unsigned int *retries);
+	/* Non-blocking: returns -EAGAIN if nothing was received */
+	ssize_t (*recv)(void *buffer, size_t len);
+};
+
+static uint8_t bench_pipe0[5] = {0x8D, 0xD9, 0xBE, 0x96, 0xDE};
+static struct bench_point bench_base = {
+	.rate = NRF24_DR_1MBPS,
+	.ack = true,
+	.ard = ((BENCH_PIPE * 2) + 5),	/* nrf24l01_set_ptx default */
+	.arc = NRF24_ARC,
+};
+
+static const struct bench_path *path;
+static uint32_t reply_ms;
+static bool comm_server;
+static int comm_sockfd = -1;
+static uint16_t bench_seq;
+
+static int phy_configure(const struct bench_point *point)
+{
+	nrf24l01_set_standby(spi_fd);
+
+	if (nrf24l01_set_data_rate(spi_fd, point->rate) < 0 ||
+		nrf24l01_set_retr(spi_fd, BENCH_PIPE, point->ard,
+							point->arc) < 0)
+		return -EINVAL;
+
+	/* Auto Acknowledgment is only set when the pipe opens */
+	nrf24l01_close_pipe(spi_fd, BENCH_PIPE);
+	nrf24l01_open_pipe(spi_fd, BENCH_PIPE, addr, point->ack);
+	nrf24l01_set_prx(spi_fd, bench_pipe0);
+
+	return 0;
+}
+
+static int phy_init(bool server)
+{
+	spi_fd = nrf24l01_init(opt_device ? opt_device : "/dev/spidev0.0",
+							NRF24_PWR_0DBM);
+	if (spi_fd < 0)
+		return spi_fd;
+
+	nrf24l01_set_channel(spi_fd, NRF24_CHANNEL_DEFAULT);
+
+	return phy_configure(&bench_base);
+}
+
+static void phy_stop(void)
+{
+	nrf24l01_set_retr(spi_fd, BENCH_PIPE, NRF24_RETR_DEFAULT, 0);
+	nrf24l01_deinit(spi_fd);
+}
+
+static int phy_send(const void *buffer, size_t len, unsigned int *retries)
+{
+	int err;
+
+	nrf24l01_set_ptx(spi_fd, BENCH_PIPE);
+	nrf24l01_ptx_data(spi_fd, (void *) buffer, len);
+	err = nrf24l01_ptx_wait_datasent(spi_fd);
+	*retries = NRF24_OBSERVE_TX_ARC(nrf24l01_observe_tx(spi_fd));
+	nrf24l01_set_prx(spi_fd, bench_pipe0);
+
+	return err < 0 ? -ETIMEDOUT : 0;
+}
+
+static ssize_t phy_recv(void *buffer, size_t len)
+{
+	uint8_t drop[NRF24_PAYLOAD_SIZE];
+	int8_t pipe;
+
+	pipe = nrf24l01_prx_pipe_available(spi_fd);
+	if (pipe == NRF24_NO_PIPE)
+		return -EAGAIN;
+
+	/* Nothing is expected on pipe 0: don't let it block the FIFO */
+	if (pipe != BENCH_PIPE) {
+		nrf24l01_prx_data(spi_fd, drop, sizeof(drop));
+		return -EAGAIN;
+	}
+
+	return nrf24l01_prx_data(spi_fd, buffer, len);
+}
+
+/* Client: connects the server on its presence, as nrfd does */
+static void comm_presence(void)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct mgmt_evt_nrf24_bcast_presence *evt =
+		(struct mgmt_evt_nrf24_bcast_presence *) mhdr->payload;
+	uint64_t mac = BENCH_MAC_SERVER;
+	ssize_t len;
+
+	len = hal_comm_read(0, buffer, sizeof(buffer));
+	if (len < (ssize_t) (sizeof(*mhdr) + sizeof(*evt)) ||
+			mhdr->opcode != MGMT_EVT_NRF24_BCAST_PRESENCE ||
+			evt->mac.address.uint64 != mac)
+		return;
+
+	/* Still broadcasting: CONNECT_REQ lost, send it again */
+	if (comm_sockfd < 0)
+		comm_sockfd = hal_comm_socket(HAL_COMM_PF_NRF24,
+							HAL_COMM_PROTO_RAW);
+	if (comm_sockfd >= 0)
+		hal_comm_connect(comm_sockfd, &mac);
+}
+
+static int comm_init(bool server)
+{
+	struct nrf24_mac mac;
+	uint64_t self = BENCH_MAC_SERVER;
+	int err, sockfd;
+
+	comm_server = server;
+	mac.address.uint64 = server ? BENCH_MAC_SERVER : BENCH_MAC_CLIENT;
+
+	err = hal_comm_init(opt_device ? opt_device : "NRF0", &mac);
+	if (err < 0)
+		return err;
+
+	hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT);
+
+	if (!server)
+		return 0;
+
+	hal_comm_listen(0);
+	while (!quit) {
+		sockfd = hal_comm_accept(0, &self);
+		if (sockfd >= 0) {
+			comm_sockfd = sockfd;
+			return 0;
+		}
+		usleep(path->poll_us);
+	}
+
+	return -EINTR;
+}
+
+static void comm_stop(void)
+{
+	if (comm_sockfd >= 0)
+		hal_comm_close(comm_sockfd);
+
+	hal_comm_deinit();
+}
+
+static int comm_configure(const struct bench_point *point)
+{
+	return 0;
+}
+
+/* hal_comm_write() queues: returns once the previous message left */
+static int comm_send(const void *buffer, size_t len, unsigned int *retries)
+{
+	ssize_t err;
+
+	*retries = 0;
+
+	while (!quit) {
+		if (!comm_server)
+			comm_presence();
+
+		if (comm_sockfd < 0) {
+			usleep(path->poll_us);
+			continue;
+		}
+
+		err = hal_comm_write(comm_sockfd, buffer, len);
+		if (err != -EBUSY)
+			return err < 0 ? err : 0;
+
+		usleep(path->poll_us);
+	}
+
+	return -EINTR;
+}
+
+static ssize_t comm_recv(void *buffer, size_t len)
+{
+	if (!comm_server)
+		comm_presence();
+
+	if (comm_sockfd < 0)
+		return -EAGAIN;
+
+	return hal_comm_read(comm_sockfd, buffer, len);
+}
+
+static const struct bench_path bench_paths[] = {
+	{
+		.name = "phy",
+		.size_max = NRF24_PAYLOAD_SIZE,
+		.reply_ms = 50,
+		.poll_us = 0,
+		.radio_setup = true,
+		.observe = true,
+		.init = phy_init,
+		.stop = phy_stop,
+		.configure = phy_configure,
+		.send = phy_send,
+		.recv = phy_recv,
+	},
+	{
+		/* RAW slot every 70ms, shared by the connected peers */
+		.name = "comm",
+		.size_max = BENCH_SIZE_MAX,
+		.reply_ms = 1000,
+		.poll_us = 200,
+		.radio_setup = false,
+		.observe = false,
+		.init = comm_init,
+		.stop = comm_stop,
+		.configure = comm_configure,
+		.send = comm_send,
+		.recv = comm_recv,
+	},
+};
+
+/* Waits a packet of type and seq: returns its length or -ETIMEDOUT */
+static ssize_t bench_wait(uint8_t type, uint16_t seq, void *buffer,
+							size_t size)
+{
+	struct bench_hdr *hdr = buffer;
+	uint32_t start = hal_time_ms();
+	ssize_t len;
+
+	while (!quit && !hal_timeout(hal_time_ms(), start, reply_ms)) {
+		len = path->recv(buffer, size);
+		if (len >= (ssize_t) sizeof(*hdr) && hdr->type == type &&
+							hdr->seq == seq)
+			return len;
+
+		if (len < 0 && path->poll_us)
+			usleep(path->poll_us);
+	}
+
+	return -ETIMEDOUT;
+}
+
+/* Both ways may go through every retransmission */
+static void bench_set_timeout(const struct bench_point *point)
+{
+	reply_ms = path->reply_ms;
+
+	if (path->radio_setup && point->ack)
+		reply_ms += 2 * (point->arc + 1) * (point->ard + 1) *
+					NRF24_ARD_FACTOR_US / 1000;
+}
+
+static size_t bench_fill(void *buffer, uint8_t type, size_t size)
+{
+	struct bench_hdr *hdr = buffer;
+
+	hdr->type = type;
+	hdr->seq = ++bench_seq;
+	memset((uint8_t *) buffer + sizeof(*hdr), 0x55, size - sizeof(*hdr));
+
+	return size;
+}
+
+static void bench_server(void)
+{
+	uint8_t buffer[BENCH_SIZE_MAX];
+	struct bench_hdr *hdr = (struct bench_hdr *) buffer;
+	struct bench_setup *setup = (struct bench_setup *) buffer;
+	struct bench_report report;
+	struct bench_point point;
+	uint32_t received = 0, bytes = 0;
+	uint32_t last = hal_time_ms();
+	unsigned int retries;
+	bool base = true;
+	ssize_t len;
+
+	printf("Waiting for the client...\n");
+
+	while (!quit) {
+		len = path->recv(buffer, sizeof(buffer));
+		if (len < (ssize_t) sizeof(*hdr)) {
+			/* Client gone: back where it looks for us */
+			if (!base && hal_timeout(hal_time_ms(), last,
+							BENCH_IDLE_MS)) {
+				path->configure(&bench_base);
+				base = true;
+			}
+
+			if (path->poll_us)
+				usleep(path->poll_us);
+			continue;
+		}
+
+		last = hal_time_ms();
+
+		switch (hdr->type) {
+		case BENCH_SETUP:
+			if (len < (ssize_t) sizeof(*setup))
+				break;
+
+			point = bench_base;
+			point.rate = setup->rate;
+			point.ack = setup->ack;
+			point.ard = setup->ard;
+			point.arc = setup->arc;
+
+			hdr->type = BENCH_SETUP_RSP;
+			if (path->send(buffer, sizeof(*setup), &retries) < 0)
+				break;
+
+			if (path->configure(&point) < 0) {
+				path->configure(&bench_base);
+				break;
+			}
+
+			base = false;
+			received = 0;
+			bytes = 0;
+			break;
+		case BENCH_DATA:
+			received++;
+			bytes += len;
+			break;
+		case BENCH_END:
+			report.hdr.type = BENCH_REPORT;
+			report.hdr.seq = hdr->seq;
+			report.received = received;
+			report.bytes = bytes;
+			path->send(&report, sizeof(report), &retries);
+			break;
+		case BENCH_PING:
+			hdr->type = BENCH_PONG;
+			path->send(buffer, len, &retries);
+			break;
+		case BENCH_DONE:
+			path->configure(&bench_base);
+			base = true;
+			break;
+		}
+	}
+}
+
+/* Agrees the point on the base setup, then switches to it */
+static int bench_setup(const struct bench_point *point)
+{
+	uint8_t buffer[BENCH_SIZE_MAX];
+	struct bench_setup setup;
+	uint32_t start = hal_time_ms();
+	unsigned int retries;
+	uint16_t seq;
+
+	bench_set_timeout(&bench_base);
+
+	/* Long enough for a server left on the previous point to idle */
+	while (!quit && !hal_timeout(hal_time_ms(), start,
+						3 * BENCH_IDLE_MS)) {
+		bench_fill(&setup, BENCH_SETUP, sizeof(setup));
+		setup.rate = point->rate;
+		setup.ack = point->ack;
+		setup.ard = point->ard;
+		setup.arc = point->arc;
+		/* The SPI transfer overwrites what it sends */
+		seq = setup.hdr.seq;
+
+		if (path->send(&setup, sizeof(setup), &retries) < 0)
+			continue;
+
+		if (bench_wait(BENCH_SETUP_RSP, seq, buffer,
+						sizeof(buffer)) > 0) {
+			bench_set_timeout(point);
+			return path->configure(point);
+		}
+	}
+
+	return -ETIMEDOUT;
+}
+
+static void bench_point_run(struct bench_result *r)
+{
+	const struct bench_point *point = &r->point;
+	uint8_t buffer[BENCH_SIZE_MAX];
+	struct bench_hdr *hdr = (struct bench_hdr *) buffer;
+	struct bench_report *report = (struct bench_report *) buffer;
+	unsigned int retries;
+	uint64_t start;
+	uint16_t seq;
+	int i, err;
+
+	hist_init(&r->rtt);
+
+	if (bench_setup(point) < 0) {
+		r->failed = true;
+		path->configure(&bench_base);
+		return;
+	}
+
+	start = hal_time64_us();
+	for (i = 0; i < opt_count && !quit; i++) {
+		err = path->send(buffer, bench_fill(buffer, BENCH_DATA,
+						point->size), &retries);
+		r->sent++;
+		r->retransmits += retries;
+		if (err < 0)
+			r->tx_failed++;
+	}
+	r->stream_us = hal_time64_us() - start;
+
+	for (i = 0; i < BENCH_TRIES && !quit; i++) {
+		bench_fill(buffer, BENCH_END, sizeof(*hdr));
+		seq = hdr->seq;
+		if (path->send(buffer, sizeof(*hdr), &retries) < 0)
+			continue;
+
+		if (bench_wait(BENCH_REPORT, seq, buffer,
+					sizeof(buffer)) >= (ssize_t) sizeof(*report)) {
+			r->received = report->received;
+			r->bytes = report->bytes;
+			break;
+		}
+	}
+
+	for (i = 0; i < opt_count && !quit; i++) {
+		bench_fill(buffer, BENCH_PING, point->size);
+		seq = hdr->seq;
+		start = hal_time64_us();
+		if (path->send(buffer, point->size, &retries) < 0)
+			continue;
+
+		if (bench_wait(BENCH_PONG, seq, buffer, sizeof(buffer)) < 0)
+			continue;
+
+		hist_add(&r->rtt, hal_time64_us() - start);
+		r->pongs++;
+	}
+
+	/* If lost, the server goes back to the base setup when idle */
+	path->send(buffer, bench_fill(buffer, BENCH_DONE, sizeof(*hdr)),
+								&retries);
+	path->configure(&bench_base);
+}
+
+static const char *rate_str(uint8_t rate)
+{
+	switch (rate) {
+	case NRF24_DR_250KBPS:
+		return "250k";
+	case NRF24_DR_2MBPS:
+		return "2M";
+	default:
+		return "1M";
+	}
+}
+
+static void bench_print(const struct bench_result *r, bool first)
+{
+	const struct bench_point *p = &r->point;
+	double secs = r->stream_us / 1e6;
+	double pps = secs > 0 ? r->received / secs : 0;
+	double kbps = secs > 0 ? r->bytes * 8 / secs / 1000 : 0;
+	double retr = r->sent ? (double) r->retransmits / r->sent : 0;
+
+	if (opt_json) {
+		printf("%s\n  {\"path\": \"%s\", \"size\": %u, \"rate\": \"%s\", "
+			"\"ard_us\": %u, \"arc\": %u, \"ack\": %s, "
+			"\"failed\": %s,\n   \"sent\": %u, \"tx_failed\": %u, "
+			"\"received\": %u, \"seconds\": %.6f, "
+			"\"pps\": %.1f, \"goodput_kbps\": %.1f,\n   ",
+			first ? "[" : ",", path->name, p->size,
+			rate_str(p->rate),
+			(p->ard + 1) * NRF24_ARD_FACTOR_US, p->arc,
+			p->ack ? "true" : "false",
+			r->failed ? "true" : "false", r->sent, r->tx_failed,
+			r->received, secs, pps, kbps);
+
+		if (path->observe)
+			printf("\"retransmits\": %u, \"retransmit_rate\": %.3f, ",
+							r->retransmits, retr);
+		else
+			printf("\"retransmits\": null, "
+					"\"retransmit_rate\": null, ");
+
+		printf("\"pings\": %u, \"pongs\": %u, \"rtt_us\": {\"p50\": %llu, "
+			"\"p90\": %llu, \"p99\": %llu, \"max\": %llu}}",
+			opt_count, r->pongs,
+			(unsigned long long) hist_percentile(&r->rtt, 500),
+			(unsigned long long) hist_percentile(&r->rtt, 900),
+			(unsigned long long) hist_percentile(&r->rtt, 990),
+			(unsigned long long) r->rtt.max);
+		return;
+	}
+
+	if (first)
+		printf("%-4s %4s %4s %5s %3s %3s %6s %6s %6s %8s %8s %7s "
+			"%7s %7s %7s %7s\n", "path", "size", "rate", "ard",
+			"arc", "ack", "sent", "failed", "recvd", "pps",
+			"kbit/s", "retr/p", "rtt50", "rtt90", "rtt99",
+			"rttmax");
+
+	printf("%-4s %4u %4s %5u %3u %3s ", path->name, p->size,
+			rate_str(p->rate), (p->ard + 1) * NRF24_ARD_FACTOR_US,
+			p->arc, p->ack ? "on" : "off");
+
+	if (r->failed) {
+		printf("setup failed: server unreachable\n");
+		return;
+	}
+
+	printf("%6u %6u %6u %8.1f %8.1f ", r->sent, r->tx_failed,
+						r->received, pps, kbps);
+	if (path->observe)
+		printf("%7.3f ", retr);
+	else
+		printf("%7s ", "-");
+
+	printf("%7llu %7llu %7llu %7llu\n",
+			(unsigned long long) hist_percentile(&r->rtt, 500),
+			(unsigned long long) hist_percentile(&r->rtt, 900),
+			(unsigned long long) hist_percentile(&r->rtt, 990),
+			(unsigned long long) r->rtt.max);
+}
+
+/* Comma separated list: returns the number of values or -EINVAL */
+static int parse_list(const char *str, int *values, int max,
+				int (*parse)(const char *token))
+{
+	char *list, *token, *saveptr;
+	int count = 0, err = 0;
+
+	list = g_strdup(str);
+	for (token = strtok_r(list, ",", &saveptr); token;
+				token = strtok_r(NULL, ",", &saveptr)) {
+		if (count == max) {
+			err = -EINVAL;
+			break;
+		}
+
+		values[count] = parse(token);
+		if (values[count] < 0) {
+			err = -EINVAL;
+			break;
+		}
+
+		count++;
+	}
+
+	g_free(list);
+
+	return err ? err : count;
+}
+
+static int parse_size(const char *token)
+{
+	int size = atoi(token);
+
+	if (size < (int) sizeof(struct bench_setup) ||
+					size > (int) path->size_max)
+		return -EINVAL;
+
+	return size;
+}
+
+static int parse_rate(const char *token)
+{
+	if (strcmp(token, "250k") == 0)
+		return NRF24_DR_250KBPS;
+	if (strcmp(token, "1M") == 0)
+		return NRF24_DR_1MBPS;
+	if (strcmp(token, "2M") == 0)
+		return NRF24_DR_2MBPS;
+
+	return -EINVAL;
+}
+
+static int parse_ard(const char *token)
+{
+	int us = atoi(token);
+
+	if (us < NRF24_ARD_FACTOR_US || us > 16 * NRF24_ARD_FACTOR_US ||
+					us % NRF24_ARD_FACTOR_US)
+		return -EINVAL;
+
+	return us / NRF24_ARD_FACTOR_US - 1;
+}
+
+static int parse_arc(const char *token)
+{
+	int arc = atoi(token);
+
+	return arc < 0 || arc > NRF24_RETR_ARC_MASK ? -EINVAL : arc;
+}
+
+static int parse_ack(const char *token)
+{
+	if (strcmp(token, "on") == 0)
+		return 1;
+	if (strcmp(token, "off") == 0)
+		return 0;
+
+	return -EINVAL;
+}
+
+#define LIST_MAX	16
+
+static int bench_client(void)
+{
+	int sizes[LIST_MAX], rates[LIST_MAX], ards[LIST_MAX];
+	int arcs[LIST_MAX], acks[LIST_MAX];
+	int nsizes, nrates, nards, narcs, nacks;
+	int i, total, failed = 0;
+	struct bench_result *result;
+
+	nsizes = parse_list(opt_sizes, sizes, LIST_MAX, parse_size);
+	nrates = parse_list(opt_rates, rates, LIST_MAX, parse_rate);
+	nards = opt_ards ? parse_list(opt_ards, ards, LIST_MAX, parse_ard) : 0;
+	narcs = opt_arcs ? parse_list(opt_arcs, arcs, LIST_MAX, parse_arc) : 0;
+	nacks = parse_list(opt_acks, acks, LIST_MAX, parse_ack);
+
+	if (nsizes <= 0 || nrates <= 0 || nards < 0 || narcs < 0 ||
+								nacks <= 0) {
+		fprintf(stderr, "Invalid size, rate, ARD, ARC or ack list\n");
+		return -EINVAL;
+	}
+
+	/* Defaults: nrf24l01_set_ptx setup of the benchmark pipe */
+	if (nards == 0) {
+		ards[0] = bench_base.ard;
+		nards = 1;
+	}
+
+	if (narcs == 0) {
+		arcs[0] = bench_base.arc;
+		narcs = 1;
+	}
+
+	if (!path->radio_setup && (nrates > 1 || nards > 1 || narcs > 1 ||
+			nacks > 1 || rates[0] != NRF24_DR_1MBPS || !acks[0])) {
+		fprintf(stderr, "comm path: rate, ARD/ARC and ACK belong "
+						"to hal_comm, sweep size only\n");
+		return -EINVAL;
+	}
+
+	/* Setup exchanges use the first ARD/ARC */
+	bench_base.ard = ards[0];
+	bench_base.arc = arcs[0];
+	path->configure(&bench_base);
+
+	result = g_new0(struct bench_result, 1);
+
+	/* Innermost: ACK, then ARC, ARD, rate and size */
+	total = nsizes * nrates * nards * narcs * nacks;
+	for (i = 0; i < total && !quit; i++) {
+		memset(result, 0, sizeof(*result));
+		result->point.ack = acks[i % nacks];
+		result->point.arc = arcs[i / nacks % narcs];
+		result->point.ard = ards[i / (nacks * narcs) % nards];
+		result->point.rate = rates[i / (nacks * narcs * nards) %
+									nrates];
+		result->point.size = sizes[i / (nacks * narcs * nards *
+								nrates)];
+
+		bench_point_run(result);
+		if (quit)
+			break;
+
+		bench_print(result, i == 0);
+		fflush(stdout);
+		if (result->failed)
+			failed++;
+	}
+
+	if (opt_json)
+		printf("%s]\n", i ? "\n" : "[");
+
+	g_free(result);
+
+	return failed ? -EHOSTUNREACH : 0;
+}
+
+static int bench_run(bool server)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < sizeof(bench_paths) / sizeof(bench_paths[0]); i++)
+		if (strcmp(opt_path, bench_paths[i].name) == 0)
+			path = &bench_paths[i];
+
+	if (path == NULL) {
+		fprintf(stderr, "Unknown path: %s (phy or comm)\n", opt_path);
+		return -EINVAL;
+	}
+
+	if (opt_count <= 0 || opt_count > UINT16_MAX) {
+		fprintf(stderr, "Invalid count: %d\n", opt_count);
+		return -EINVAL;
+	}
+
+	err = path->init(server);
+	if (err < 0) {
+		fprintf(stderr, "%s init: %s (%d)\n", path->name,
+						strerror(-err), -err);
+		return err;
+	}
+
+	if (server)
+		bench_server();
+	else
+		err = bench_client();
+
+	path->stop();
+
+	return err;
+}
+
 static void radio_stop(void)
 {
 	/* Deinit the radio */
@@ -230,6 +1046,30 @@ static int radio_init(void)
 static GOptionEntry options[] = {
 	{ "mode", 'm', 0, G_OPTION_ARG_STRING, &opt_mode,
 					"mode", "Operation mode: server or client" },
+	{ "bench", 'b', 0, G_OPTION_ARG_NONE, &opt_bench,
+				NULL, "Throughput and latency benchmark" },
+	{ "path", 'p', 0, G_OPTION_ARG_STRING, &opt_path,
+		"path", "Benchmark path: phy (nRF24L01, default) or comm "
+							"(hal_comm)" },
+	{ "device", 'd', 0, G_OPTION_ARG_STRING, &opt_device,
+		"device", "SPI device (phy, default /dev/spidev0.0) or "
+					"radio (comm, default NRF0)" },
+	{ "size", 's', 0, G_OPTION_ARG_STRING, &opt_sizes,
+		"list", "Payload sizes, comma separated (default 32)" },
+	{ "rate", 'r', 0, G_OPTION_ARG_STRING, &opt_rates,
+		"list", "Data rates: 250k, 1M, 2M (default 1M)" },
+	{ "ard", 'D', 0, G_OPTION_ARG_STRING, &opt_ards,
+		"list", "Auto retransmit delays in us, 250 to 4000 "
+							"(default 2000)" },
+	{ "arc", 'R', 0, G_OPTION_ARG_STRING, &opt_arcs,
+		"list", "Auto retransmit counts, 0 to 15 (default 15)" },
+	{ "ack", 'a', 0, G_OPTION_ARG_STRING, &opt_acks,
+		"list", "Auto acknowledgment: on, off (default on)" },
+	{ "count", 'c', 0, G_OPTION_ARG_INT, &opt_count,
+		"count", "Packets per stream and pings per test "
+							"(default 200)" },
+	{ "json", 'j', 0, G_OPTION_ARG_NONE, &opt_json,
+				NULL, "JSON output" },
 	{ NULL },
 };
 
@@ -237,6 +1077,8 @@ static GOptionEntry options[] = {
  * First run the tool "./rpiecho -m server" to
  * enter in server mode and then, in another rpi,
  * run "./rpiecho -m client" to enter in client mode.
+ * With --bench on both ends the client measures the link, e.g.
+ * "./rpiecho -b -m client -s 8,16,32 -r 250k,1M,2M -a on,off -j".
  */
 
 int main(int argc, char *argv[])
@@ -261,6 +1103,11 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (opt_bench) {
+		err = bench_run(strcmp(opt_mode, "client") != 0);
+		return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	main_loop = g_main_loop_new(NULL, FALSE);
 
 	printf("RPi nRF24L01 Radio test tool %s mode\n", opt_mode);
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "serial_link.h"
+
+/*
+ * End to end serial link benchmark over a pty pair: a child process
+ * runs the thing side (hal_comm over comm_serial) echoing every
+ * channel, the parent plays the gateway with the same framing used by
+ * physerial. A pty doesn't enforce the baud rate: the wire time column
+ * shows the time the same frame takes on a real UART.
+ */
+
+#define RX_TIMEOUT_MS		1000
+
+static int opt_baud = 1000000;
+static int opt_count = 1000;
+static int opt_channels = 1;
+static int opt_window = 8;
+
+static const size_t sizes[] = { 8, 32, 64, 128, 257 };
+
+static GOptionEntry options[] = {
+	{ "baud", 'b', 0, G_OPTION_ARG_INT, &opt_baud,
+					"baud", "Baud rate (default 1000000)" },
+	{ "count", 'n', 0, G_OPTION_ARG_INT, &opt_count,
+					"count", "Messages per payload size" },
+	{ "channels", 'c', 0, G_OPTION_ARG_INT, &opt_channels,
+					"channels", "Logical channels" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &opt_window,
+			"window", "Messages in flight (throughput test)" },
+	{ NULL },
+};
+
+static struct serial_link_decoder decoder;
+static uint8_t rx_buffer[1024];
+static size_t rx_pos, rx_len;
+
+/* Thing side: echoes every message back on its channel */
+static void thing_run(const char *pathname)
+{
+	uint8_t buffer[SERIAL_LINK_MTU];
+	int sock[SERIAL_LINK_CHANNELS];
+	bool idle;
+	ssize_t len;
+	int i;
+
+	if (hal_comm_init(pathname, NULL) < 0)
+		_exit(EXIT_FAILURE);
+
+	for (i = 0; i < opt_channels; i++) {
+		sock[i] = hal_comm_socket(HAL_COMM_PF_SERIAL,
+						HAL_COMM_PROTO_RAW);
+		if (sock[i] < 0)
+			_exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		idle = true;
+		for (i = 0; i < opt_channels; i++) {
+			len = hal_comm_read(sock[i], buffer, sizeof(buffer));
+			if (len == -EAGAIN)
+				continue;
+
+			if (len < 0)
+				_exit(EXIT_FAILURE);
+
+			hal_comm_write(sock[i], buffer, len);
+			idle = false;
+		}
+
+		/* Things run a busy loop: leave the CPU to the gateway */
+		if (idle)
+			sched_yield();
+	}
+}
+
+static int frame_write(int fd, uint8_t channel, const uint8_t *payload,
+								size_t len)
+{
+	uint8_t frame[SERIAL_LINK_FRAME_MAX];
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	ssize_t flen, offset = 0, nbytes;
+
+	flen = serial_link_encode(channel, payload, len, frame);
+	if (flen < 0)
+		return flen;
+
+	while (offset < flen) {
+		nbytes = write(fd, frame + offset, flen - offset);
+		if (nbytes >= 0) {
+			offset += nbytes;
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		poll(&pfd, 1, RX_TIMEOUT_MS);
+	}
+
+	return 0;
+}
+
+static ssize_t frame_read(int fd, uint8_t *channel, uint8_t *payload,
+								size_t size)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	ssize_t nbytes, len;
+
+	for (;;) {
+		while (rx_pos < rx_len) {
+			len = serial_link_decode(&decoder, rx_buffer[rx_pos++],
+						channel, payload, size);
+			if (len >= 0)
+				return len;
+		}
+
+		rx_pos = 0;
+		rx_len = 0;
+
+		nbytes = read(fd, rx_buffer, sizeof(rx_buffer));
+		if (nbytes > 0) {
+			rx_len = nbytes;
+			continue;
+		}
+
+		if (nbytes < 0 && errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		if (poll(&pfd, 1, RX_TIMEOUT_MS) == 0)
+			return -ETIMEDOUT;
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int latency(int fd, size_t size)
+{
+	uint8_t payload[SERIAL_LINK_MTU], reply[SERIAL_LINK_MTU], channel;
+	uint64_t *rtt, start;
+	ssize_t len;
+	size_t wire;
+	int i;
+
+	rtt = g_new0(uint64_t, opt_count);
+	memset(payload, 0, sizeof(payload));
+
+	for (i = 0; i < opt_count; i++) {
+		payload[0] = i;
+		start = hal_time64_us();
+
+		if (frame_write(fd, i % opt_channels, payload, size) < 0)
+			goto fail;
+
+		len = frame_read(fd, &channel, reply, sizeof(reply));
+		if (len != (ssize_t) size || reply[0] != payload[0])
+			goto fail;
+
+		rtt[i] = hal_time64_us() - start;
+	}
+
+	qsort(rtt, opt_count, sizeof(rtt[0]), cmp_u64);
+
+	/* Round trip on a real UART: frame sent and echoed, 10 bits/byte */
+	wire = (size + 3 + (size + 3) / 254 + 2) * 2 * 10 * 1000000ULL /
+								opt_baud;
+
+	printf("%4zu bytes: rtt min %llu p50 %llu p99 %llu max %llu us"
+					" (wire %zu us)\n", size,
+			(unsigned long long) rtt[0],
+			(unsigned long long) rtt[opt_count / 2],
+			(unsigned long long) rtt[opt_count * 99 / 100],
+			(unsigned long long) rtt[opt_count - 1], wire);
+
+	g_free(rtt);
+
+	return 0;
+
+fail:
+	printf("%4zu bytes: echo failed at message %d\n", size, i);
+	g_free(rtt);
+
+	return -EIO;
+}
+
+static int throughput(int fd, size_t size)
+{
+	uint8_t payload[SERIAL_LINK_MTU], channel;
+	int sent = 0, received = 0;
+	uint64_t start, elapsed;
+	ssize_t len;
+
+	memset(payload, 0x55, sizeof(payload));
+	start = hal_time64_us();
+
+	while (received < opt_count) {
+		while (sent < opt_count && sent - received < opt_window) {
+			if (frame_write(fd, sent % opt_channels, payload,
+								size) < 0)
+				return -EIO;
+			sent++;
+		}
+
+		len = frame_read(fd, &channel, payload, sizeof(payload));
+		if (len != (ssize_t) size) {
+			printf("%4zu bytes: %d of %d messages echoed\n",
+						size, received, opt_count);
+			return -EIO;
+		}
+
+		received++;
+	}
+
+	elapsed = hal_time64_us() - start;
+	if (elapsed == 0)
+		elapsed = 1;
+
+	printf("%4zu bytes: %llu msg/s, %llu KiB/s payload each way\n",
+		size, (unsigned long long) opt_count * 1000000 / elapsed,
+		(unsigned long long) opt_count * size * 1000000 /
+							elapsed / 1024);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	char pathname[64];
+	int master, slave, status, err = 0;
+	unsigned int i;
+	pid_t pid;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_count <= 0 || opt_window <= 0 || opt_channels <= 0 ||
+				opt_channels > SERIAL_LINK_CHANNELS) {
+		printf("Invalid arguments\n");
+		return EXIT_FAILURE;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+		printf("pty: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	snprintf(pathname, sizeof(pathname), "%s:%d", ptsname(master),
+								opt_baud);
+
+	/* Raw mode before the thing starts: no echo or line editing */
+	slave = serial_link_open(pathname);
+	if (slave < 0) {
+		printf("%s: %s\n", pathname, strerror(-slave));
+		return EXIT_FAILURE;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		printf("fork: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0) {
+		close(master);
+		thing_run(pathname);
+	}
+
+	serial_link_decoder_init(&decoder);
+
+	printf("Serial link %s, %d channel(s)\n\nLatency, %d messages:\n",
+					pathname, opt_channels, opt_count);
+	for (i = 0; err == 0 && i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		err = latency(master, sizes[i]);
+
+	printf("\nThroughput, window %d:\n", opt_window);
+	for (i = 0; err == 0 && i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		err = throughput(master, sizes[i]);
+
+	if (decoder.errors)
+		printf("\n%u invalid frames\n", decoder.errors);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(slave);
+	close(master);
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
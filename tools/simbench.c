@@ -0,0 +1,742 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "phy_driver_sim.h"
+#include "simthing.h"
+#include "stamp.h"
+
+/*
+ * Link layer benchmark on simulated radios: the gateway runs
+ * comm_nrf24l01 on "SIM0" as nrfd does, echoing every message, and up to
+ * five things, each on an instance of comm_nrf24l01 of its own
+ * (simthing), send stamped requests, one in flight each. No
+ * hardware nor daemons: throughput, latency and CPU cost of the comm
+ * layer under configurable loss. --levels spreads the things between
+ * two levels, close to the sensitivity: with --rate, the gateway adapts
+ * the data rate of each link. --stats prints the counters the gateway
+ * reports for each link (MGMT_EVT_NRF24_LINK_STATS). --retr selects the
+ * ARD and ARC policy of the gateway frames, the things keep sim_ard().
+ * --power lowers the TX power of the links heard strong: a path is as
+ * strong as its weaker end, --gw-level raises the gateway one.
+ * --channels spreads the links over data channels, --hop moves them
+ * along the channels, --jam drops the frames of one channel. --survey
+ * has the gateway sample the data channels (MGMT_CMD_NRF24_SURVEY)
+ * during the run, which then lasts until the survey ends.
+ */
+
+#define THINGS_MAX		5	/* comm_nrf24l01 data pipes */
+#define SETUP_TIMEOUT_US	10000000
+#define REPLY_TIMEOUT_US	1000000
+
+struct gw_peer {
+	int sockfd;
+	uint64_t mac;
+	uint8_t buffer[SIMTHING_MSG_MAX];
+	ssize_t len;			/* Echo pending */
+};
+
+struct bench_thing {
+	struct simthing sim;
+	uint64_t connected_us;
+	uint32_t seq;
+	uint64_t sent_us;
+	bool waiting;
+	uint32_t sent;
+	uint32_t received;
+	uint32_t lost;
+	uint32_t invalid;
+	struct mgmt_evt_nrf24_link_stats stats;	/* Of the thing */
+	bool stats_valid;
+};
+
+static struct gw_peer gw_peers[THINGS_MAX];
+static struct bench_thing things[THINGS_MAX];
+static struct hist rtt;
+static uint64_t comm_us;		/* Gateway: spent in hal_comm */
+static uint8_t survey_busy[NRF24_DATA_CH_MAX + 1];
+static bool survey_done;
+
+static int opt_things = 1;
+static int opt_count = 1000;
+static int opt_size = 32;
+static double opt_loss = 0;
+static int opt_arc = 15;
+static int opt_ard = 0;
+static int opt_seed = 1;
+static gboolean opt_realtime = FALSE;
+static gboolean opt_ack_payload = FALSE;
+static gboolean opt_rate = FALSE;
+static gboolean opt_power = FALSE;
+static gboolean opt_stats = FALSE;
+static char *opt_levels = NULL;
+static int opt_gw_level = SIM_LEVEL_DEFAULT;
+static char *opt_retr = NULL;
+static char *opt_channels = NULL;
+static gboolean opt_hop = FALSE;
+static char *opt_jam = NULL;
+static gboolean opt_survey = FALSE;
+
+static GOptionEntry options[] = {
+	{ "things", 'n', 0, G_OPTION_ARG_INT, &opt_things,
+			"things", "Things connected to the gateway (1 to 5)" },
+	{ "count", 'c', 0, G_OPTION_ARG_INT, &opt_count,
+			"messages", "Requests per thing (default 1000)" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &opt_size,
+			"bytes", "Message size (default 32)" },
+	{ "loss", 'l', 0, G_OPTION_ARG_DOUBLE, &opt_loss,
+			"percent", "Frame and ACK loss (default 0)" },
+	{ "arc", 0, 0, G_OPTION_ARG_INT, &opt_arc,
+			"count", "Retransmissions (default 15)" },
+	{ "ard", 0, 0, G_OPTION_ARG_INT, &opt_ard,
+			"us", "Retransmit delay (default: per pipe)" },
+	{ "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+			"seed", "Loss pattern (default 1)" },
+	{ "realtime", 'r', 0, G_OPTION_ARG_NONE, &opt_realtime,
+			NULL, "Transmissions take their airtime" },
+	{ "ack-payload", 'a', 0, G_OPTION_ARG_NONE, &opt_ack_payload,
+			NULL, "Answers ride the ACKs of the thing frames" },
+	{ "rate", 'R', 0, G_OPTION_ARG_NONE, &opt_rate,
+			NULL, "Data rate adapted per link" },
+	{ "power", 'P', 0, G_OPTION_ARG_NONE, &opt_power,
+			NULL, "TX power adapted per link" },
+	{ "levels", 0, 0, G_OPTION_ARG_STRING, &opt_levels,
+			"min,max", "Levels of the things, dBm (default -60)" },
+	{ "gw-level", 0, 0, G_OPTION_ARG_INT, &opt_gw_level,
+			"dBm", "Level of the gateway (default -60)" },
+	{ "stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats,
+			NULL, "Gateway counters of each link at the end" },
+	{ "retr", 0, 0, G_OPTION_ARG_STRING, &opt_retr,
+			"policy", "Gateway ARD and ARC: pipe (default), "
+							"adaptive" },
+	{ "channels", 0, 0, G_OPTION_ARG_STRING, &opt_channels,
+			"ch,ch,...", "Data channels of the links "
+						"(default: 10)" },
+	{ "hop", 0, 0, G_OPTION_ARG_NONE, &opt_hop,
+			NULL, "Links hop along the data channels" },
+	{ "jam", 0, 0, G_OPTION_ARG_STRING, &opt_jam,
+			"ch[,percent]", "Interference on a channel "
+						"(default 50%)" },
+	{ "survey", 0, 0, G_OPTION_ARG_NONE, &opt_survey,
+			NULL, "Busy data channels, as the gateway hears them" },
+	{ NULL },
+};
+
+static struct gw_peer *gw_peer_get(uint64_t mac)
+{
+	int i;
+
+	for (i = 0; i < THINGS_MAX; i++) {
+		if (gw_peers[i].sockfd >= 0 && gw_peers[i].mac == mac)
+			return &gw_peers[i];
+	}
+
+	return NULL;
+}
+
+static void gw_presence(const struct mgmt_evt_nrf24_bcast_presence *evt)
+{
+	uint64_t mac = evt->mac.address.uint64;
+	struct gw_peer *peer;
+	int sockfd, i;
+
+	/* Already connected: the thing didn't get CONNECT_REQ yet */
+	peer = gw_peer_get(mac);
+	if (peer) {
+		hal_comm_connect(peer->sockfd, &mac);
+		return;
+	}
+
+	for (i = 0; i < THINGS_MAX && gw_peers[i].sockfd >= 0; i++)
+		;
+
+	if (i == THINGS_MAX)
+		return;
+
+	sockfd = hal_comm_socket(HAL_COMM_PF_NRF24,
+						HAL_COMM_PROTO_RAW);
+	if (sockfd < 0)
+		return;
+
+	if (hal_comm_connect(sockfd, &mac) < 0) {
+		hal_comm_close(sockfd);
+		return;
+	}
+
+	gw_peers[i].sockfd = sockfd;
+	gw_peers[i].mac = mac;
+	gw_peers[i].len = 0;
+}
+
+static void gw_survey_evt(const struct mgmt_evt_nrf24_survey *evt)
+{
+	if (evt->first < NRF24_DATA_CH_MIN || evt->count >
+				NRF24_DATA_CH_MAX - evt->first + 1)
+		return;
+
+	memcpy(&survey_busy[evt->first], evt->busy, evt->count);
+	if (evt->first + evt->count > evt->last)
+		survey_done = true;
+}
+
+/* As nrfd: management events, then echoes knotd would send back */
+static void gw_run(void)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct gw_peer *peer;
+	ssize_t len;
+	int i;
+
+	len = hal_comm_read(0, buffer, sizeof(buffer));
+	if (len > (ssize_t) sizeof(*mhdr) &&
+			mhdr->opcode == MGMT_EVT_NRF24_BCAST_PRESENCE)
+		gw_presence((void *) mhdr->payload);
+	else if (len > (ssize_t) sizeof(*mhdr) &&
+			mhdr->opcode == MGMT_EVT_NRF24_SURVEY)
+		gw_survey_evt((void *) mhdr->payload);
+
+	for (i = 0; i < THINGS_MAX; i++) {
+		peer = &gw_peers[i];
+		if (peer->sockfd < 0)
+			continue;
+
+		if (peer->len > 0) {
+			if (hal_comm_write(peer->sockfd,
+					peer->buffer, peer->len) < 0)
+				continue;
+			peer->len = 0;
+		}
+
+		len = hal_comm_read(peer->sockfd, peer->buffer,
+						sizeof(peer->buffer));
+		if (len > 0)
+			peer->len = len;
+	}
+}
+
+static void thing_run(struct bench_thing *t, uint32_t id)
+{
+	uint8_t buffer[SIMTHING_MSG_MAX];
+	const struct stamp_msg *msg;
+	uint64_t now;
+	ssize_t len;
+
+	simthing_run(&t->sim);
+	now = hal_time64_us();
+
+	if (!simthing_connected(&t->sim))
+		return;
+
+	if (t->connected_us == 0)
+		t->connected_us = now;
+
+	len = simthing_read(&t->sim, buffer, sizeof(buffer));
+	if (len > 0 && t->waiting) {
+		msg = stamp_parse(buffer, len);
+		if (msg && msg->thing == id && msg->seq == t->seq) {
+			hist_add(&rtt, now - msg->time_us);
+			t->received++;
+			t->waiting = false;
+			t->seq++;
+		} else
+			t->invalid++;
+	}
+
+	if (t->waiting && now - t->sent_us > REPLY_TIMEOUT_US) {
+		t->lost++;
+		t->waiting = false;
+		t->seq++;
+	}
+
+	if (t->waiting || t->sent == (uint32_t) opt_count)
+		return;
+
+	len = stamp_fill(buffer, opt_size, id, t->seq, now);
+	if (simthing_write(&t->sim, buffer, len) < 0)
+		return;
+
+	t->sent_us = now;
+	t->waiting = true;
+	t->sent++;
+}
+
+static uint64_t cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+				ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void report(uint64_t start, uint64_t elapsed, uint64_t cpu)
+{
+	struct sim_stats stats;
+	uint64_t sent = 0, received = 0, lost = 0, invalid = 0, setup_max = 0;
+	uint32_t disconnects = 0;
+	static const char *rate_str[] = { "250k", "1M", "2M" };
+	const struct mgmt_evt_nrf24_link_stats *ts;
+	double seconds = elapsed / 1000000.0;
+	int i;
+
+	for (i = 0; i < opt_things; i++) {
+		sent += things[i].sent;
+		received += things[i].received;
+		lost += things[i].lost;
+		invalid += things[i].invalid;
+		disconnects += things[i].sim.disconnects;
+		if (things[i].connected_us &&
+				things[i].connected_us - start > setup_max)
+			setup_max = things[i].connected_us - start;
+	}
+
+	sim_get_stats(&stats);
+
+	printf("Setup: %d things connected after %llu ms\n", opt_things,
+				(unsigned long long) setup_max / 1000);
+	printf("Messages: %llu sent, %llu echoed, %llu lost, %llu invalid "
+		"in %.2f s\n", (unsigned long long) sent,
+		(unsigned long long) received, (unsigned long long) lost,
+		(unsigned long long) invalid, seconds);
+	printf("Throughput: %.0f msg/s, %.0f B/s each way\n",
+				received / seconds, received * opt_size / seconds);
+
+	if (rtt.count)
+		printf("RTT: min %llu p50 %llu p99 %llu p999 %llu "
+			"max %llu us\n", (unsigned long long) rtt.min,
+			(unsigned long long) hist_percentile(&rtt, 500),
+			(unsigned long long) hist_percentile(&rtt, 990),
+			(unsigned long long) hist_percentile(&rtt, 999),
+			(unsigned long long) rtt.max);
+
+	printf("CPU: %.1f%%, %.1f us per message, gateway hal_comm "
+		"%.1f us per message\n", 100.0 * cpu / elapsed,
+		received ? (double) cpu / received : 0,
+		received ? (double) comm_us / received : 0);
+	printf("Air: %llu frames, %llu retransmits, %llu lost, "
+		"%llu overflows, %llu failed, %llu ms airtime (%.1f%%), "
+		"%.0f us per message\n",
+		(unsigned long long) stats.frames,
+		(unsigned long long) stats.retransmits,
+		(unsigned long long) stats.lost,
+		(unsigned long long) stats.overflows,
+		(unsigned long long) stats.failed,
+		(unsigned long long) stats.airtime / 1000,
+		100.0 * stats.airtime / elapsed,
+		received ? (double) stats.airtime / received : 0);
+	printf("Link: %u keepalive timeouts\n", disconnects);
+	if (stats.flushed)
+		printf("Retuning: %llu frames flushed from the RX FIFOs\n",
+				(unsigned long long) stats.flushed);
+	if (stats.ack_missed)
+		printf("ARD: %llu ACKs longer than the wait\n",
+				(unsigned long long) stats.ack_missed);
+	if (opt_ack_payload)
+		printf("ACK payloads: %llu delivered\n",
+				(unsigned long long) stats.ack_payloads);
+
+	if (!opt_rate && !opt_power && !opt_channels && !opt_hop)
+		return;
+
+	/* As the things see their link: -, disconnected at the end */
+	printf("Things:");
+	for (i = 0; i < opt_things; i++) {
+		ts = &things[i].stats;
+		if (!things[i].stats_valid)
+			printf(" -");
+		else
+			printf(" %s ch %u %d dBm", ts->rate <= NRF24_RATE_2M ?
+				rate_str[ts->rate] : "?", ts->channel,
+				(ts->power - NRF24_POWER_0DBM) * 6);
+		printf("%s", i + 1 < opt_things ? "," : "\n");
+	}
+}
+
+/* MGMT_CMD_NRF24_LINK_STATS of every link: the first starts the counters */
+static ssize_t gw_stats_request(void)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_link_stats)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = MGMT_CMD_NRF24_LINK_STATS;
+
+	return hal_comm_write(0, buffer, sizeof(buffer));
+}
+
+/* As nrfd --stats: counters the gateway keeps for each link */
+static void gw_link_stats(void)
+{
+	static const char *rate_str[] = { "250k", "1M", "2M" };
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	const struct mgmt_evt_nrf24_link_stats *evt = (void *) hdr->payload;
+	ssize_t len;
+	int i;
+
+	if (gw_stats_request() < 0)
+		return;
+
+	/* One event per read, a presence may come first */
+	for (i = 0; i < THINGS_MAX * 2; i++) {
+		len = hal_comm_read(0, buffer, sizeof(buffer));
+		if (len < 0)
+			break;
+
+		if (len < (ssize_t) (sizeof(*hdr) + sizeof(*evt)) ||
+				hdr->opcode != MGMT_EVT_NRF24_LINK_STATS)
+			continue;
+
+		printf("Link %016llX: TX %u frames %u B, %u lost, "
+			"%u retransmits; RX %u frames %u B, %u dropped, "
+			"%u flushed; RPD %u/%u; airtime %u ms (%.1f%%), %s, "
+			"%d dBm, channel %u\n",
+			(unsigned long long) evt->mac.address.uint64,
+			evt->tx_frames, evt->tx_bytes, evt->tx_lost,
+			evt->retransmits, evt->rx_frames, evt->rx_bytes,
+			evt->rx_dropped, evt->rx_flushed, evt->rpd_high,
+			evt->rpd_samples, evt->airtime / 1000, evt->duration ?
+			evt->airtime / 10.0 / evt->duration : 0,
+			evt->rate <= NRF24_RATE_2M ? rate_str[evt->rate] : "?",
+			(evt->power - NRF24_POWER_0DBM) * 6, evt->channel);
+	}
+}
+
+/* Gateway offers ACK payloads to the things connecting */
+static int gw_link_features(uint8_t features)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_link_features)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_link_features *cmd = (void *) hdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = MGMT_CMD_NRF24_LINK_FEATURES;
+	cmd->features = features;
+
+	len = hal_comm_write(0, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* ARD and ARC of the gateway frames */
+static int gw_retr_policy(uint8_t policy)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_retr_policy)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_retr_policy *cmd = (void *) hdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = MGMT_CMD_NRF24_RETR_POLICY;
+	cmd->policy = policy;
+
+	len = hal_comm_write(0, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* Data channels of the links, in turn by pipe */
+static int gw_data_channels(const char *list)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_data_channels)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_data_channels *cmd = (void *) hdr->payload;
+	const char *p = list;
+	char *end;
+	ssize_t len;
+	long ch;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = MGMT_CMD_NRF24_DATA_CHANNELS;
+
+	for (;;) {
+		ch = strtol(p, &end, 10);
+		if (end == p || ch < 0 || ch > 255 ||
+				cmd->count == NRF24_DATA_CHANNELS_MAX)
+			return -EINVAL;
+
+		cmd->channels[cmd->count++] = ch;
+		if (*end == '\0')
+			break;
+
+		if (*end != ',')
+			return -EINVAL;
+
+		p = end + 1;
+	}
+
+	len = hal_comm_write(0, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+/* One slot per channel: a sweep of the data channels takes ~7.5s */
+static int gw_survey(void)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_survey)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_survey *cmd = (void *) hdr->payload;
+	ssize_t len;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = MGMT_CMD_NRF24_SURVEY;
+	cmd->first = NRF24_DATA_CH_MIN;
+	cmd->last = NRF24_DATA_CH_MAX;
+	cmd->samples = 16;
+	cmd->slots = 1;
+
+	len = hal_comm_write(0, buffer, sizeof(buffer));
+
+	return (len < 0 ? len : 0);
+}
+
+static void survey_report(void)
+{
+	int ch, quiet = 0;
+
+	printf("Survey (busy):");
+	for (ch = NRF24_DATA_CH_MIN; ch <= NRF24_DATA_CH_MAX; ch++) {
+		if (survey_busy[ch])
+			printf(" %d %u%%", ch, survey_busy[ch]);
+		else
+			quiet++;
+	}
+	printf(", %d channels quiet\n", quiet);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct sim_params params;
+	struct nrf24_mac gw_mac = { .address.uint64 = 0xc0ffee0000000001ULL };
+	uint64_t start, now, cpu;
+	int err, i, connected, done;
+	int level_min = SIM_LEVEL_DEFAULT, level_max = SIM_LEVEL_DEFAULT;
+	int jam_channel = -1, jam_percent = 50;
+	uint8_t features = 0, policy = NRF24_RETR_POLICY_PIPE;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_things < 1 || opt_things > THINGS_MAX || opt_count < 1 ||
+			opt_size < (int) STAMP_MSG_MIN ||
+			opt_size > SIMTHING_MSG_MAX ||
+			opt_loss < 0 || opt_loss > 100 ||
+			opt_arc < 0 || opt_arc > 15 || opt_ard < 0 ||
+			opt_ard > 4000 || (opt_levels &&
+			(sscanf(opt_levels, "%d,%d", &level_min,
+						&level_max) != 2 ||
+			level_min > level_max || level_min < -127 ||
+			level_max > 20)) || opt_gw_level < -127 ||
+			opt_gw_level > 20 || (opt_retr &&
+			strcmp(opt_retr, "pipe") != 0 &&
+			strcmp(opt_retr, "adaptive") != 0) || (opt_jam &&
+			(sscanf(opt_jam, "%d,%d", &jam_channel,
+						&jam_percent) < 1 ||
+			jam_channel < 0 || jam_channel > SIM_CHANNEL_MAX ||
+			jam_percent < 0 || jam_percent > 100))) {
+		printf("Invalid arguments (things: 1 to %d, message size: "
+			"%zu to %d bytes)\n", THINGS_MAX, STAMP_MSG_MIN,
+							SIMTHING_MSG_MAX);
+		return EXIT_FAILURE;
+	}
+
+	sim_get_params(&params);
+	params.loss = opt_loss * 10000;
+	params.arc = opt_arc;
+	params.ard = opt_ard;
+	params.seed = opt_seed;
+	params.realtime = opt_realtime;
+	sim_set_params(&params);
+	if (jam_channel >= 0)
+		sim_set_interference(jam_channel, jam_percent * 10000);
+
+	err = hal_comm_init("SIM0", &gw_mac);
+	if (err < 0) {
+		printf("hal_comm_init(): %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	/* SIM0 opens the first node */
+	sim_node_set_level(0, opt_gw_level);
+
+	if (hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT) < 0) {
+		printf("Can't open management socket\n");
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	if (opt_ack_payload)
+		features |= NRF24_LINK_F_ACK_PAY;
+	if (opt_rate)
+		features |= NRF24_LINK_F_RATE;
+	if (opt_power)
+		features |= NRF24_LINK_F_POWER;
+	if (opt_hop)
+		features |= NRF24_LINK_F_HOP;
+
+	if (features) {
+		err = gw_link_features(features);
+		if (err < 0) {
+			printf("Link features: %s\n", strerror(-err));
+			hal_comm_deinit();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opt_channels) {
+		err = gw_data_channels(opt_channels);
+		if (err < 0) {
+			printf("Data channels: %s\n", strerror(-err));
+			hal_comm_deinit();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opt_retr && strcmp(opt_retr, "adaptive") == 0)
+		policy = NRF24_RETR_POLICY_ADAPTIVE;
+
+	err = gw_retr_policy(policy);
+	if (err < 0) {
+		printf("Retransmission policy: %s\n", strerror(-err));
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	if (opt_stats)
+		gw_stats_request();
+
+	if (opt_survey) {
+		err = gw_survey();
+		if (err < 0) {
+			printf("Survey: %s\n", strerror(-err));
+			hal_comm_deinit();
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < THINGS_MAX; i++)
+		gw_peers[i].sockfd = -1;
+
+	for (i = 0; i < opt_things; i++) {
+		err = simthing_init(&things[i].sim,
+				0x0102030405060700ULL + i + 1, features);
+		if (err < 0) {
+			printf("Thing %d: %s\n", i, strerror(-err));
+			break;
+		}
+
+		/* Node i + 1, after the gateway: strongest to weakest */
+		sim_node_set_level(i + 1, opt_things > 1 ?
+				level_max - (level_max - level_min) * i /
+				(opt_things - 1) : level_min);
+	}
+
+	if (i < opt_things) {
+		while (i--)
+			simthing_deinit(&things[i].sim);
+		hal_comm_deinit();
+		return EXIT_FAILURE;
+	}
+
+	hist_init(&rtt);
+
+	printf("Simulated link: %d things, %d x %d bytes, %.2f%% loss, "
+		"ARC %d, %s%s%s%s%s%s\n", opt_things, opt_count, opt_size,
+		opt_loss, opt_arc,
+		opt_realtime ? "real time" : "no airtime delays",
+		opt_ack_payload ? ", ACK payloads" : "",
+		opt_rate ? ", rate adaptation" : "",
+		opt_power ? ", power control" : "",
+		policy == NRF24_RETR_POLICY_ADAPTIVE ?
+					", adaptive retransmissions" : "",
+		opt_hop ? ", channel hopping" : "");
+	fflush(stdout);
+
+	/* Each thing sends its first request once connected */
+	start = hal_time64_us();
+	cpu = cpu_us();
+	sim_reset_stats();
+
+	for (;;) {
+		now = hal_time64_us();
+
+		gw_run();
+		comm_us += hal_time64_us() - now;
+
+		for (i = 0, connected = 0, done = 0; i < opt_things; i++) {
+			thing_run(&things[i], i);
+			if (things[i].connected_us)
+				connected++;
+			if (things[i].sent == (uint32_t) opt_count &&
+							!things[i].waiting)
+				done++;
+		}
+
+		if (done == opt_things && (!opt_survey || survey_done))
+			break;
+
+		if (connected < opt_things &&
+				now - start > SETUP_TIMEOUT_US) {
+			printf("Setup timeout: %d/%d things connected\n",
+						connected, opt_things);
+			break;
+		}
+	}
+
+	now = hal_time64_us();
+	cpu = cpu_us() - cpu;
+
+	for (i = 0; i < opt_things; i++)
+		things[i].stats_valid = (simthing_link_stats(&things[i].sim,
+						&things[i].stats) == 0);
+
+	report(start, now - start, cpu);
+	if (opt_stats)
+		gw_link_stats();
+	if (opt_survey)
+		survey_report();
+
+	for (i = 0; i < opt_things; i++)
+		simthing_deinit(&things[i].sim);
+
+	hal_comm_deinit();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ucontext.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "include/time.h"
+#include "phy_driver_sim.h"
+#include "simnet.h"
+#include "simthing.h"
+#include "stamp.h"
+#include "vclock.h"
+
+/*
+ * Link feature check: each link feature end to end, the slave side as
+ * much as the master one. The gateway runs comm_nrf24l01 on "SIM0" as
+ * nrfd does and each thing an instance of its own (simthing), all of
+ * them on the virtual clock (simnet). A check offers a feature on both
+ * sides, places the things so that it has something to do, and runs
+ * messages the gateway echoes: past the warmup, the counters both sides
+ * keep of the link (MGMT_CMD_NRF24_LINK_STATS) and the echoes tell if
+ * the feature worked. Exits with EXIT_FAILURE if a check failed.
+ */
+
+#define STACK_NODE		0	/* "SIM0": first node */
+#define THINGS_MAX		2	/* Per check */
+#define GW_MAC			0xc0ffee0000000001ULL
+#define THING_MAC(i)		(0x0102030405060700ULL + (i) + 1)
+#define MSG_SIZE		64	/* Fragments: 3 */
+#define MSG_INTERVAL_US		100000
+#define WARMUP_US		10000000	/* Connection, features */
+#define SAMPLE_US		250000	/* Thing link: channel */
+#define ECHOES_MIN		95	/* % of the messages past the warmup */
+#define CHANNELS_MAX		3	/* Data channels per check */
+
+struct check_thing {
+	struct simnet_stack stack;
+	struct simthing sim;
+	int id;
+	int node;
+	uint64_t send_us;		/* Next message */
+	uint64_t sample_us;		/* Next channel sample */
+	uint32_t seq;
+	uint32_t sent;			/* Past the warmup */
+	uint32_t echoed;
+	uint8_t channel;		/* Of the link, last sample */
+	uint32_t hops;			/* Channel changes seen */
+	struct mgmt_evt_nrf24_link_stats stats;
+	struct mgmt_evt_nrf24_link_stats gw_stats;
+};
+
+struct check {
+	const char *name;
+	uint8_t features;
+	uint8_t channels[CHANNELS_MAX];	/* Gateway data channels, 0: end */
+	int jam_channel;		/* -1: none */
+	int jam_percent;
+	int things;
+	int levels[THINGS_MAX];		/* dBm */
+	int duration;			/* s, past the warmup */
+	bool (*verify)(const struct check *check);
+};
+
+static struct simnet_stack gw_stack;
+static int gw_sockfd[THINGS_MAX];
+static uint64_t gw_mac[THINGS_MAX];
+static struct check_thing things[THINGS_MAX];
+static int nthings;
+static uint64_t start_us;		/* Past the warmup */
+static uint64_t end_us;
+
+static const char *opt_check = NULL;
+static int opt_seed = 1;
+static gboolean opt_verbose = FALSE;
+
+static GOptionEntry options[] = {
+	{ "check", 'c', 0, G_OPTION_ARG_STRING, &opt_check,
+			"name", "Single check (default: all)" },
+	{ "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+			"seed", "Loss pattern (default 1)" },
+	{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose,
+			NULL, "Counters of each link, both sides" },
+	{ NULL },
+};
+
+static void gw_presence(const struct mgmt_evt_nrf24_bcast_presence *evt)
+{
+	uint64_t mac = evt->mac.address.uint64;
+	int sockfd, i;
+
+	/* Already connected: the thing didn't get CONNECT_REQ yet */
+	for (i = 0; i < THINGS_MAX; i++) {
+		if (gw_sockfd[i] >= 0 && gw_mac[i] == mac) {
+			hal_comm_connect(gw_sockfd[i], &mac);
+			return;
+		}
+	}
+
+	for (i = 0; i < THINGS_MAX && gw_sockfd[i] >= 0; i++)
+		;
+
+	if (i == THINGS_MAX)
+		return;
+
+	sockfd = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (sockfd < 0)
+		return;
+
+	if (hal_comm_connect(sockfd, &mac) < 0) {
+		hal_comm_close(sockfd);
+		return;
+	}
+
+	gw_sockfd[i] = sockfd;
+	gw_mac[i] = mac;
+}
+
+static void gw_disconnected(const struct mgmt_evt_nrf24_disconnected *evt)
+{
+	int i;
+
+	for (i = 0; i < THINGS_MAX; i++) {
+		if (gw_sockfd[i] >= 0 &&
+				gw_mac[i] == evt->mac.address.uint64) {
+			hal_comm_close(gw_sockfd[i]);
+			gw_sockfd[i] = -1;
+		}
+	}
+}
+
+/* As nrfd: management events, then echoes knotd would send back */
+static void gw_run(struct simnet_stack *stack)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	ssize_t len;
+	int i;
+
+	len = hal_comm_read(0, buffer, sizeof(buffer));
+	if (len > (ssize_t) sizeof(*mhdr)) {
+		if (mhdr->opcode == MGMT_EVT_NRF24_BCAST_PRESENCE)
+			gw_presence((void *) mhdr->payload);
+		else if (mhdr->opcode == MGMT_EVT_NRF24_DISCONNECTED)
+			gw_disconnected((void *) mhdr->payload);
+	}
+
+	for (i = 0; i < THINGS_MAX; i++) {
+		if (gw_sockfd[i] < 0)
+			continue;
+
+		len = hal_comm_read(gw_sockfd[i], buffer, sizeof(buffer));
+		if (len > 0)
+			hal_comm_write(gw_sockfd[i], buffer, len);
+	}
+
+	simnet_schedule(stack, hal_comm_next_timeout());
+}
+
+/* Gateway counters of the link to mac */
+static int gw_link_stats(uint64_t mac, struct mgmt_evt_nrf24_link_stats *stats)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_link_stats *cmd = (void *) hdr->payload;
+	ssize_t len;
+	int i;
+
+	memset(buffer, 0, sizeof(*hdr) + sizeof(*cmd));
+	hdr->opcode = MGMT_CMD_NRF24_LINK_STATS;
+	cmd->mac.address.uint64 = mac;
+	len = hal_comm_write(0, buffer, sizeof(*hdr) + sizeof(*cmd));
+	if (len < 0)
+		return len;
+
+	/* One event per read, a presence may come first */
+	for (i = 0; i < 4; i++) {
+		len = hal_comm_read(0, buffer, sizeof(buffer));
+		if (len >= (ssize_t) (sizeof(*hdr) + sizeof(*stats)) &&
+				hdr->opcode == MGMT_EVT_NRF24_LINK_STATS) {
+			memcpy(stats, hdr->payload, sizeof(*stats));
+			return 0;
+		}
+	}
+
+	return -EAGAIN;
+}
+
+static int gw_command(uint16_t opcode, const void *cmd, size_t len)
+{
+	uint8_t buffer[64];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	ssize_t err;
+
+	memset(buffer, 0, sizeof(buffer));
+	hdr->opcode = opcode;
+	memcpy(hdr->payload, cmd, len);
+
+	err = hal_comm_write(0, buffer, sizeof(*hdr) + len);
+
+	return (err < 0 ? err : 0);
+}
+
+static int gw_data_channels(const uint8_t *channels)
+{
+	struct mgmt_cmd_nrf24_data_channels cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	while (cmd.count < CHANNELS_MAX && channels[cmd.count]) {
+		cmd.channels[cmd.count] = channels[cmd.count];
+		cmd.count++;
+	}
+
+	return gw_command(MGMT_CMD_NRF24_DATA_CHANNELS, &cmd, sizeof(cmd));
+}
+
+/* Data channel of the link, as the thing has it */
+static void thing_sample(struct check_thing *t)
+{
+	struct mgmt_evt_nrf24_link_stats stats;
+
+	t->sample_us += SAMPLE_US;
+	if (simthing_link_stats(&t->sim, &stats) < 0)
+		return;
+
+	if (t->channel && stats.channel != t->channel)
+		t->hops++;
+	t->channel = stats.channel;
+}
+
+/* A message every MSG_INTERVAL_US, refused while the previous is pending */
+static void thing_run(struct simnet_stack *stack)
+{
+	struct check_thing *t = stack->user_data;
+	uint8_t buffer[SIMTHING_MSG_MAX];
+	const struct stamp_msg *msg;
+	uint64_t now;
+	ssize_t len;
+
+	simthing_run(&t->sim);
+	now = hal_time64_us();
+
+	if (now >= t->sample_us)
+		thing_sample(t);
+
+	len = simthing_read(&t->sim, buffer, sizeof(buffer));
+	msg = (len > 0 ? stamp_parse(buffer, len) : NULL);
+	if (msg && msg->thing == (uint32_t) t->id &&
+					msg->time_us >= start_us)
+		t->echoed++;
+
+	if (now >= t->send_us && now < end_us) {
+		t->send_us += MSG_INTERVAL_US;
+
+		len = stamp_fill(buffer, MSG_SIZE, t->id, t->seq++, now);
+		if (now >= start_us)
+			t->sent++;
+
+		/* Sent now rather than at the next deadline */
+		simthing_write(&t->sim, buffer, len);
+		simthing_run(&t->sim);
+	}
+
+	simnet_schedule(stack, simthing_next(&t->sim));
+	if (t->send_us < stack->due_us)
+		stack->due_us = t->send_us;
+	if (t->sample_us < stack->due_us)
+		stack->due_us = t->sample_us;
+}
+
+static void print_stats(const char *side,
+			const struct mgmt_evt_nrf24_link_stats *stats)
+{
+	printf("  %s: TX %u frames, %u lost, %u retransmits; RX %u frames, "
+		"%u dropped; rate %u, power %u, channel %u\n",
+		side, stats->tx_frames, stats->tx_lost, stats->retransmits,
+		stats->rx_frames, stats->rx_dropped, stats->rate,
+		stats->power, stats->channel);
+}
+
+static bool echoes_ok(const struct check_thing *t)
+{
+	return t->sent > 0 && t->echoed * 100 >= t->sent * ECHOES_MIN;
+}
+
+static bool fail(const struct check_thing *t, const char *why)
+{
+	printf("  thing %d: %s\n", t->id, why);
+
+	return false;
+}
+
+/*
+ * ACK payloads: the echoes ride the ACKs of the thing messages and of
+ * its ACK_POLLs, the gateway sends next to no frames of its own.
+ */
+static bool verify_ack_payload(const struct check *check)
+{
+	const struct check_thing *t = &things[0];
+
+	if (!echoes_ok(t))
+		return fail(t, "echoes missing");
+
+	if (t->gw_stats.tx_frames * 4 > t->sent)
+		return fail(t, "echoes sent as gateway frames");
+
+	return true;
+}
+
+static const struct check checks[] = {
+	{ "ack-payload", NRF24_LINK_F_ACK_PAY, { 0 }, -1, 0,
+			1, { -60 }, 20, verify_ack_payload },
+	{ NULL },
+};
+
+static int check_setup(const struct check *check)
+{
+	struct nrf24_mac mac = { .address.uint64 = GW_MAC };
+	struct mgmt_cmd_nrf24_link_features features;
+	struct check_thing *t;
+	uint64_t now;
+	int err, i;
+
+	err = hal_comm_init("SIM0", &mac);
+	if (err < 0)
+		return err;
+
+	/* The level of a thing stands for its link */
+	sim_node_set_level(STACK_NODE, 0);
+	sim_node_set_irq(STACK_NODE, simnet_irq, &gw_stack);
+
+	if (hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_MGMT) < 0)
+		return -EIO;
+
+	memset(&features, 0, sizeof(features));
+	features.features = check->features;
+	err = gw_command(MGMT_CMD_NRF24_LINK_FEATURES, &features,
+							sizeof(features));
+	if (err < 0)
+		return err;
+
+	if (check->channels[0]) {
+		err = gw_data_channels(check->channels);
+		if (err < 0)
+			return err;
+	}
+
+	if (check->jam_channel >= 0)
+		sim_set_interference(check->jam_channel,
+						check->jam_percent * 10000);
+
+	for (i = 0; i < THINGS_MAX; i++)
+		gw_sockfd[i] = -1;
+
+	now = hal_time64_us();
+	start_us = now + WARMUP_US;
+	end_us = start_us + check->duration * 1000000ULL;
+
+	err = simnet_add(&gw_stack, gw_run, NULL);
+	if (err < 0)
+		return err;
+
+	gw_stack.due_us = now;
+
+	for (nthings = 0; nthings < check->things; nthings++) {
+		t = &things[nthings];
+		memset(t, 0, sizeof(*t));
+		t->id = nthings;
+
+		err = simthing_init(&t->sim, THING_MAC(nthings),
+							check->features);
+		if (err < 0)
+			return err;
+
+		/* SIM0 opens the lowest free node: after the gateway */
+		t->node = nthings + 1;
+		sim_node_set_level(t->node, check->levels[nthings]);
+		sim_node_set_irq(t->node, simnet_irq, &t->stack);
+
+		err = simnet_add(&t->stack, thing_run, t);
+		if (err < 0) {
+			simthing_deinit(&t->sim);
+			return err;
+		}
+
+		/* Messages of the things out of step */
+		t->send_us = now + nthings * MSG_INTERVAL_US / THINGS_MAX;
+		t->sample_us = now;
+		t->stack.due_us = now;
+	}
+
+	return 0;
+}
+
+static void check_cleanup(const struct check *check)
+{
+	int i;
+
+	simnet_clear();
+
+	for (i = 0; i < nthings; i++)
+		simthing_deinit(&things[i].sim);
+	nthings = 0;
+
+	if (check->jam_channel >= 0)
+		sim_set_interference(check->jam_channel, 0);
+
+	hal_comm_deinit();
+}
+
+static bool check_run(const struct check *check)
+{
+	uint64_t now, event;
+	bool passed;
+	int err, i;
+
+	printf("%s: ", check->name);
+	fflush(stdout);
+
+	err = check_setup(check);
+	if (err < 0) {
+		printf("FAIL (setup: %s)\n", strerror(-err));
+		check_cleanup(check);
+		return false;
+	}
+
+	for (;;) {
+		now = hal_time64_us();
+		if (now >= end_us)
+			break;
+
+		simnet_run(now);
+
+		event = simnet_next();
+		if (event > end_us)
+			event = end_us;
+
+		vclock_wait_until(event);
+	}
+
+	simnet_finish();
+
+	for (i = 0; i < nthings; i++) {
+		simthing_link_stats(&things[i].sim, &things[i].stats);
+		gw_link_stats(THING_MAC(i), &things[i].gw_stats);
+	}
+
+	passed = check->verify(check);
+	printf("%s (", passed ? "PASS" : "FAIL");
+	for (i = 0; i < nthings; i++)
+		printf("%s%u/%u echoes", i ? ", " : "", things[i].echoed,
+							things[i].sent);
+	printf(")\n");
+
+	for (i = 0; opt_verbose && i < nthings; i++) {
+		printf("  thing %d, %d dBm: %u connections, %u hops\n", i,
+				check->levels[i], things[i].sim.connects,
+				things[i].hops);
+		print_stats("gateway", &things[i].gw_stats);
+		print_stats("thing", &things[i].stats);
+	}
+
+	check_cleanup(check);
+
+	return passed;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct sim_params params;
+	const struct check *check;
+	int run = 0, failed = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	sim_get_params(&params);
+	params.seed = opt_seed;
+	params.collisions = true;
+	sim_set_params(&params);
+
+	/* Checks follow each other: the stack timers never go back */
+	vclock_init(0, opt_seed);
+
+	for (check = checks; check->name; check++) {
+		if (opt_check && strcmp(opt_check, check->name) != 0)
+			continue;
+
+		if (!check_run(check))
+			failed++;
+		run++;
+	}
+
+	if (run == 0) {
+		printf("Unknown check: %s\n", opt_check);
+		return EXIT_FAILURE;
+	}
+
+	printf("%d/%d checks passed\n", run - failed, run);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ucontext.h>
+
+#include "include/nrf24.h"
+#include "include/time.h"
+#include "phy_driver_sim.h"
+#include "simnet.h"
+#include "vclock.h"
+
+#define CONTEXT_SIZE		(64 * 1024)	/* Stack of each context */
+
+static struct simnet_stack *stacks[SIMNET_STACKS_MAX];
+static int nstacks;
+static struct simnet_stack *current;	/* Running, NULL: the scheduler */
+static ucontext_t scheduler;
+
+/* Context of a stack: a run each time the scheduler switches to it */
+static void stack_main(void)
+{
+	struct simnet_stack *stack = current;
+
+	for (;;) {
+		stack->irq = false;
+		stack->run(stack);
+
+		stack->running = false;
+		swapcontext(&stack->context, &scheduler);
+	}
+}
+
+/* Runs the stack, or resumes it after its delay, up to its next delay */
+static void stack_switch(struct simnet_stack *stack)
+{
+	stack->running = true;
+	current = stack;
+	swapcontext(&scheduler, &stack->context);
+	current = NULL;
+}
+
+/*
+ * Delays of a stack (airtime, ARD): the others run meanwhile. The
+ * hal_comm instance selected is the one of the stack delayed: the others
+ * start on the built in one, the stack resumes on its own.
+ */
+static void delay_func(uint64_t until_us, void *user_data)
+{
+	struct simnet_stack *stack = current;
+	struct nrf24_comm *comm;
+
+	/* Setup and cleanup, out of the contexts */
+	if (stack == NULL)
+		return;
+
+	stack->wake_us = until_us;
+	comm = nrf24_comm_select(NULL);
+	swapcontext(&stack->context, &scheduler);
+	nrf24_comm_select(comm);
+}
+
+static uint64_t stack_due(const struct simnet_stack *stack)
+{
+	return stack->running ? stack->wake_us : stack->due_us;
+}
+
+/* Next stack to run or to resume: the first added on ties */
+static struct simnet_stack *next_stack(bool delayed_only)
+{
+	struct simnet_stack *next = NULL;
+	int i;
+
+	for (i = 0; i < nstacks; i++) {
+		if (delayed_only && !stacks[i]->running)
+			continue;
+
+		if (next == NULL || stack_due(stacks[i]) < stack_due(next))
+			next = stacks[i];
+	}
+
+	return next;
+}
+
+int simnet_add(struct simnet_stack *stack, simnet_run_t run,
+							void *user_data)
+{
+	if (nstacks == SIMNET_STACKS_MAX)
+		return -ENOSPC;
+
+	stack->memory = malloc(CONTEXT_SIZE);
+	if (stack->memory == NULL)
+		return -ENOMEM;
+
+	getcontext(&stack->context);
+	stack->context.uc_stack.ss_sp = stack->memory;
+	stack->context.uc_stack.ss_size = CONTEXT_SIZE;
+	stack->context.uc_link = NULL;
+	makecontext(&stack->context, stack_main, 0);
+
+	stack->run = run;
+	stack->user_data = user_data;
+	stack->due_us = UINT64_MAX;
+	stack->irq = false;
+	stack->running = false;
+
+	if (nstacks == 0)
+		vclock_set_delay_func(delay_func, NULL);
+
+	stacks[nstacks++] = stack;
+
+	return 0;
+}
+
+void simnet_clear(void)
+{
+	while (nstacks > 0) {
+		nstacks--;
+		free(stacks[nstacks]->memory);
+		stacks[nstacks]->memory = NULL;
+	}
+
+	vclock_set_delay_func(NULL, NULL);
+}
+
+/* IRQ line: the stack of the node reads the frame as soon as it can */
+void simnet_irq(int node, void *user_data)
+{
+	struct simnet_stack *stack = user_data;
+
+	stack->irq = true;
+	stack->due_us = hal_time64_us();
+}
+
+void simnet_schedule(struct simnet_stack *stack, int timeout)
+{
+	uint64_t now = hal_time64_us();
+
+	if (stack->irq || timeout == 0)
+		stack->due_us = now;
+	else if (timeout < 0)
+		stack->due_us = UINT64_MAX;
+	else
+		stack->due_us = now / 1000 * 1000 + timeout * 1000ULL;
+}
+
+uint64_t simnet_next(void)
+{
+	struct simnet_stack *stack = next_stack(false);
+
+	return stack ? stack_due(stack) : UINT64_MAX;
+}
+
+void simnet_run(uint64_t until_us)
+{
+	struct simnet_stack *stack;
+	uint64_t due;
+
+	for (;;) {
+		stack = next_stack(false);
+		if (stack == NULL)
+			return;
+
+		due = stack_due(stack);
+		if (due > until_us)
+			return;
+
+		vclock_wait_until(due);
+		stack_switch(stack);
+	}
+}
+
+void simnet_finish(void)
+{
+	struct simnet_stack *stack;
+
+	while ((stack = next_stack(true)) != NULL) {
+		vclock_wait_until(stack_due(stack));
+		stack_switch(stack);
+	}
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Network of stacks (a gateway, things) on the virtual clock of
+ * tools/vclock.c. Each stack runs in a context of its own, as its next
+ * deadline or a frame received comes: its delays (airtime, retransmit
+ * delays) give way to the other stacks until their end, so that their
+ * frames overlap as on the air.
+ */
+
+#define SIMNET_STACKS_MAX	SIM_NODES_MAX
+
+struct simnet_stack;
+
+/* A run: hal_comm calls, then simnet_schedule() or due_us set */
+typedef void (*simnet_run_t) (struct simnet_stack *stack);
+
+struct simnet_stack {
+	simnet_run_t run;
+	void *user_data;
+	uint64_t due_us;		/* Next run, UINT64_MAX: none */
+	/* Scheduler */
+	ucontext_t context;
+	void *memory;
+	uint64_t wake_us;		/* Delayed: end of the delay */
+	bool irq;			/* Frame received while running */
+	bool running;			/* Run started, not over */
+};
+
+/* In the order of the runs on ties: the gateway first */
+int simnet_add(struct simnet_stack *stack, simnet_run_t run,
+							void *user_data);
+/* The runs over (simnet_finish()): drops every stack */
+void simnet_clear(void);
+
+/* sim_node_set_irq() callback, user_data the stack of the node */
+void simnet_irq(int node, void *user_data);
+/* After a run: hal_comm_next_timeout(), on the ticks of hal_time_ms() */
+void simnet_schedule(struct simnet_stack *stack, int timeout);
+
+/* Next run or end of a delay, UINT64_MAX: none */
+uint64_t simnet_next(void);
+/* Runs the stacks due up to until_us, earliest first */
+void simnet_run(uint64_t until_us);
+/* The stacks in a delay complete their run */
+void simnet_finish(void);
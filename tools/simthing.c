@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "include/nrf24.h"
+#include "include/comm.h"
+#include "simthing.h"
+
+#define MGMT_SOCKET		0
+#define EVT_READS		4	/* An event may come first */
+
+/* Keepalive timeout: listens again, as a thing does */
+static void mgmt_evt(struct simthing *thing,
+			const struct mgmt_nrf24_header *evt, ssize_t len)
+{
+	if (len < (ssize_t) sizeof(*evt) ||
+			evt->opcode != MGMT_EVT_NRF24_DISCONNECTED ||
+			thing->sockfd < 0)
+		return;
+
+	hal_comm_close(thing->sockfd);
+	thing->sockfd = -1;
+	thing->disconnects++;
+	hal_comm_listen(MGMT_SOCKET);
+}
+
+int simthing_init(struct simthing *thing, uint64_t mac, uint8_t features)
+{
+	uint8_t buffer[sizeof(struct mgmt_nrf24_header) +
+			sizeof(struct mgmt_cmd_nrf24_link_features)];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_link_features *cmd = (void *) hdr->payload;
+	struct nrf24_mac addr = { .address.uint64 = mac };
+	struct nrf24_comm *prev;
+	ssize_t len;
+	int err;
+
+	memset(thing, 0, sizeof(*thing));
+	thing->mac = mac;
+	thing->sockfd = -1;
+
+	thing->comm = nrf24_comm_new();
+	if (thing->comm == NULL)
+		return -ENOMEM;
+
+	prev = nrf24_comm_select(thing->comm);
+
+	err = hal_comm_init("SIM0", &addr);
+	if (err < 0)
+		goto fail;
+
+	/* Thing side: the first socket is the management one */
+	err = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
+	if (err < 0)
+		goto deinit;
+
+	if (features) {
+		memset(buffer, 0, sizeof(buffer));
+		hdr->opcode = MGMT_CMD_NRF24_LINK_FEATURES;
+		cmd->features = features;
+
+		len = hal_comm_write(MGMT_SOCKET, buffer, sizeof(buffer));
+		if (len < 0) {
+			err = len;
+			goto deinit;
+		}
+	}
+
+	hal_comm_listen(MGMT_SOCKET);
+	nrf24_comm_select(prev);
+
+	return 0;
+
+deinit:
+	hal_comm_deinit();
+fail:
+	nrf24_comm_select(prev);
+	nrf24_comm_free(thing->comm);
+	thing->comm = NULL;
+
+	return err;
+}
+
+void simthing_deinit(struct simthing *thing)
+{
+	struct nrf24_comm *prev;
+
+	if (thing->comm == NULL)
+		return;
+
+	prev = nrf24_comm_select(thing->comm);
+	hal_comm_deinit();
+	nrf24_comm_select(prev);
+
+	nrf24_comm_free(thing->comm);
+	thing->comm = NULL;
+	thing->sockfd = -1;
+}
+
+void simthing_run(struct simthing *thing)
+{
+	uint8_t buffer[SIMTHING_MSG_MAX];
+	struct nrf24_comm *prev;
+	uint64_t mac = thing->mac;
+	ssize_t len;
+	int sockfd;
+
+	prev = nrf24_comm_select(thing->comm);
+
+	if (thing->sockfd < 0) {
+		sockfd = hal_comm_accept(MGMT_SOCKET, &mac);
+		if (sockfd > 0) {
+			thing->sockfd = sockfd;
+			thing->connects++;
+		}
+	} else {
+		len = hal_comm_read(MGMT_SOCKET, buffer, sizeof(buffer));
+		mgmt_evt(thing, (void *) buffer, len);
+	}
+
+	nrf24_comm_select(prev);
+}
+
+int simthing_next(struct simthing *thing)
+{
+	struct nrf24_comm *prev;
+	int timeout;
+
+	prev = nrf24_comm_select(thing->comm);
+	timeout = hal_comm_next_timeout();
+	nrf24_comm_select(prev);
+
+	return timeout;
+}
+
+ssize_t simthing_write(struct simthing *thing, const void *buffer,
+								size_t len)
+{
+	struct nrf24_comm *prev;
+	ssize_t ret;
+
+	if (thing->sockfd < 0)
+		return -ENOTCONN;
+
+	prev = nrf24_comm_select(thing->comm);
+	ret = hal_comm_write(thing->sockfd, buffer, len);
+	nrf24_comm_select(prev);
+
+	return ret;
+}
+
+ssize_t simthing_read(struct simthing *thing, void *buffer, size_t len)
+{
+	struct nrf24_comm *prev;
+	ssize_t ret;
+
+	if (thing->sockfd < 0)
+		return -EAGAIN;
+
+	prev = nrf24_comm_select(thing->comm);
+	ret = hal_comm_read(thing->sockfd, buffer, len);
+	nrf24_comm_select(prev);
+
+	return ret;
+}
+
+int simthing_link_stats(struct simthing *thing,
+			struct mgmt_evt_nrf24_link_stats *stats)
+{
+	uint8_t buffer[256];
+	struct mgmt_nrf24_header *hdr = (void *) buffer;
+	struct mgmt_cmd_nrf24_link_stats *cmd = (void *) hdr->payload;
+	struct nrf24_comm *prev;
+	ssize_t len;
+	int err = -EAGAIN, i;
+
+	if (thing->sockfd < 0)
+		return -ENOTCONN;
+
+	prev = nrf24_comm_select(thing->comm);
+
+	/* Its only link: the gateway */
+	memset(buffer, 0, sizeof(*hdr) + sizeof(*cmd));
+	hdr->opcode = MGMT_CMD_NRF24_LINK_STATS;
+	len = hal_comm_write(MGMT_SOCKET, buffer,
+				sizeof(*hdr) + sizeof(*cmd));
+	if (len < 0) {
+		err = len;
+		goto done;
+	}
+
+	for (i = 0; i < EVT_READS && thing->sockfd >= 0; i++) {
+		len = hal_comm_read(MGMT_SOCKET, buffer, sizeof(buffer));
+		if (len >= (ssize_t) (sizeof(*hdr) + sizeof(*stats)) &&
+				hdr->opcode == MGMT_EVT_NRF24_LINK_STATS) {
+			memcpy(stats, hdr->payload, sizeof(*stats));
+			err = 0;
+			break;
+		}
+
+		mgmt_evt(thing, hdr, len);
+	}
+
+done:
+	nrf24_comm_select(prev);
+
+	return err;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Thing on a simulated radio node: comm_nrf24l01 on "SIM0" as a thing
+ * runs it, in an instance of its own (nrf24_comm_new()), so that a
+ * benchmark runs its gateway and its things in the same process. Each
+ * function selects the instance of the thing and restores the previous
+ * one: the gateway stays on the built in instance.
+ */
+
+#define SIMTHING_MSG_MAX	128	/* comm_nrf24l01 DATA_SIZE */
+
+struct simthing {
+	struct nrf24_comm *comm;
+	uint64_t mac;
+	int sockfd;		/* Link to the gateway, -1: listening */
+	uint32_t connects;
+	uint32_t disconnects;	/* Keepalive timeouts */
+};
+
+/* Opens a node, offers features (NRF24_LINK_F_*) and listens */
+int simthing_init(struct simthing *thing, uint64_t mac, uint8_t features);
+void simthing_deinit(struct simthing *thing);
+
+/* Non-blocking: runs the stack, accepts the gateway, reconnects */
+void simthing_run(struct simthing *thing);
+/* ms simthing_run() has something to do in, -1: nothing */
+int simthing_next(struct simthing *thing);
+
+static inline bool simthing_connected(const struct simthing *thing)
+{
+	return thing->sockfd >= 0;
+}
+
+/* -ENOTCONN, -EBUSY: previous message not sent yet */
+ssize_t simthing_write(struct simthing *thing, const void *buffer,
+							size_t len);
+/* -EAGAIN: no message */
+ssize_t simthing_read(struct simthing *thing, void *buffer, size_t len);
+
+/* Counters the thing keeps for its link (MGMT_CMD_NRF24_LINK_STATS) */
+int simthing_link_stats(struct simthing *thing,
+			struct mgmt_evt_nrf24_link_stats *stats);
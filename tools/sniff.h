@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Capture file format shared by tools/sniffer (writer) and tools/replay
+ * (reader and writer): pcap, link type LINKTYPE_USER0, each packet is a
+ * struct sniff_hdr followed by the payload. Time stamps are wall clock
+ * microseconds.
+ */
+
+#define LINKTYPE_USER0		147
+#define PCAP_MAGIC		0xa1b2c3d4	/* Microsecond time stamps */
+#define SNIFF_VERSION		1
+#define SNIFF_AA_SIZE		5
+
+#define SNIFF_F_PROMISC		0x01	/* Captured in promiscuous mode */
+#define SNIFF_F_DECODED		0x02	/* Promiscuous: control field, CRC ok */
+#define SNIFF_F_TX		0x04	/* Sent by the stack under replay */
+
+struct sniff_hdr {
+	uint8_t version;	/* SNIFF_VERSION */
+	uint8_t flags;		/* SNIFF_F_* */
+	uint8_t radio;		/* Index in --device */
+	uint8_t channel;
+	uint8_t pipe;		/* RX pipe */
+	uint8_t aa[SNIFF_AA_SIZE];	/* LSB first, as RX_ADDR_Px */
+	uint8_t pid;		/* Decoded: packet id */
+	uint8_t no_ack;		/* Decoded: NO_ACK flag */
+} __attribute__ ((packed));
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __attribute__ ((packed));
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} __attribute__ ((packed));
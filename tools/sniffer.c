@@ -12,152 +12,618 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <glib.h>
 
-#include "phy_driver.h"
+#include "include/time.h"
 #include "nrf24l01.h"
+#include "nrf24l01_io.h"
 #include "nrf24l01_ll.h"
 #include "phy_driver_nrf24.h"
+#include "sniff.h"
 
-static char *opt_mode = "mgmt";
+/*
+ * Capture: one thread per radio drains the RX FIFO into a lock-free
+ * single producer/single consumer ring, a dump thread merges the rings
+ * by time and writes pcap (or prints the decoded PDUs). A frame is
+ * stamped when read out of the FIFO: the RX FIFO keeps three frames, the
+ * capture thread polls it without sleeping.
+ *
+ * pcap link type is LINKTYPE_USER0, each packet is a struct sniff_hdr
+ * (sniff.h) followed by the payload. In promiscuous mode
+ * (nrf24l01_set_promisc) the payload is the raw air frame; frames whose
+ * control field and CRC match a 5 bytes address are decoded, the others
+ * are kept raw.
+ *
+ * Radios share the CE line (nrf24l01_io_linux.c): a channel switch on
+ * one radio pauses the others for about 200us. Give each radio its own
+ * channel (as many --device as --channel) to capture without gaps.
+ */
 
-int cli_fd;
-int quit;
+#define RADIOS_MAX		4
+#define RING_SIZE		4096	/* Frames, power of two */
+#define DWELL_MS		50	/* Default time on each channel */
+#define FLUSH_MS		100
+
+/* Promiscuous air frame: 5 bytes address, PCF and 2 bytes CRC */
+#define AIR_AA_SIZE		SNIFF_AA_SIZE
+#define AIR_PCF_BITS		9
+#define AIR_CRC_BITS		16
+
+struct frame {
+	uint64_t time_us;
+	uint8_t channel;
+	uint8_t pipe;
+	uint8_t len;
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
+};
 
-static int channel_mgmt = 20;
-static int channel_raw = 10;
+struct ring {
+	struct frame slot[RING_SIZE];
+	uint32_t head;		/* Written by the capture thread only */
+	uint32_t tail;		/* Written by the dump thread only */
+	uint64_t frames;
+	uint64_t drops;		/* Ring full */
+};
+
+struct radio {
+	unsigned int index;
+	const char *dev;
+	int spi_fd;
+	int channels[NRF24_CH_MAX_1MBPS + 1];
+	unsigned int nchannels;
+	unsigned int current;
+	pthread_t thread;
+	struct ring ring;
+};
 
-/* Access Address for each pipe */
-static uint8_t aa_pipes[2][5] = {
+static char *opt_mode = "mgmt";
+static char *opt_write = NULL;
+static char *opt_channels = NULL;
+static char *opt_devices = "/dev/spidev0.0";
+static int opt_dwell = DWELL_MS;
+static gboolean opt_promisc = FALSE;
+
+static volatile sig_atomic_t quit;
+
+/* Access Address for each pipe, as comm_nrf24l01 */
+static uint8_t aa_pipes[6][5] = {
 	{0x8D, 0xD9, 0xBE, 0x96, 0xDE},
 	{0x35, 0x96, 0xB6, 0xC1, 0x6B},
+	{0x77, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xD3, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xE7, 0x96, 0xB6, 0xC1, 0x6B},
+	{0xF0, 0x96, 0xB6, 0xC1, 0x6B}
 };
 
+static int channel_mgmt = 20;
+static int channel_raw = 10;
+
+static struct radio radios[RADIOS_MAX];
+static unsigned int nradios;
+
+/* Frames are stamped with hal_time64_us(): monotonic */
+static uint64_t epoch_us;
+
 static void sig_term(int sig)
 {
 	quit = 1;
-	phy_close(cli_fd);
 }
 
-
-static void listen_raw(void)
+static void print_raw(const uint8_t *payload, size_t len)
 {
-	struct nrf24_io_pack p;
-	ssize_t ilen;
-	const struct nrf24_ll_data_pdu *ipdu = (void *)p.payload;
+	const struct nrf24_ll_data_pdu *ipdu = (void *) payload;
+	int plen = len > DATA_HDR_SIZE ? len - DATA_HDR_SIZE : 0;
 
-	p.pipe = 1;
-	while (!quit) {
-		ilen = phy_read(cli_fd, &p, NRF24_MTU);
-		if (ilen < 0)
-			continue;
+	switch (ipdu->lid) {
 
-		switch (ipdu->lid) {
+	/* If is Control */
+	case NRF24_PDU_LID_CONTROL:
+	{
+		struct nrf24_ll_crtl_pdu *ctrl =
+			(struct nrf24_ll_crtl_pdu *) ipdu->payload;
 
-		/* If is Control */
-		case NRF24_PDU_LID_CONTROL:
-		{
-			struct nrf24_ll_crtl_pdu *ctrl =
-				(struct nrf24_ll_crtl_pdu *) ipdu->payload;
+		struct nrf24_ll_keepalive *kpalive =
+			(struct nrf24_ll_keepalive *) ctrl->payload;
 
-			struct nrf24_ll_keepalive *kpalive =
-				(struct nrf24_ll_keepalive *) ctrl->payload;
+		printf("NRF24_PDU_LID_CONTROL\n");
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_RSP)
+			printf("NRF24_LL_CRTL_OP_KEEPALIVE_RSP\n");
 
-			printf("NRF24_PDU_LID_CONTROL\n");
-			if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_RSP)
-				printf("NRF24_LL_CRTL_OP_KEEPALIVE_RSP\n");
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ)
+			printf("NRF24_LL_CRTL_OP_KEEPALIVE_REQ\n");
 
-			if (ctrl->opcode == NRF24_LL_CRTL_OP_KEEPALIVE_REQ)
-				printf("NRF24_LL_CRTL_OP_KEEPALIVE_REQ\n");
-
-			printf("src_addr : %llX\n",
-			(long long int) kpalive->src_addr.address.uint64);
-			printf("dst_addr : %llX\n",
-			(long long int)kpalive->dst_addr.address.uint64);
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_FEATURE_IND) {
+			struct nrf24_ll_feature_ind *ind =
+				(struct nrf24_ll_feature_ind *) ctrl->payload;
 
+			printf("NRF24_LL_CRTL_OP_FEATURE_IND\n");
+			printf("features : %02X\n", ind->features);
+			break;
 		}
+
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_ACK_POLL) {
+			struct nrf24_ll_ack_poll *poll =
+				(struct nrf24_ll_ack_poll *) ctrl->payload;
+
+			printf("NRF24_LL_CRTL_OP_ACK_POLL\n");
+			printf("next : %d msg : %d\n", poll->next, poll->msg);
 			break;
+		}
+
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_RATE_IND) {
+			struct nrf24_ll_rate_ind *ind =
+				(struct nrf24_ll_rate_ind *) ctrl->payload;
 
-		/* If is Data */
-		case NRF24_PDU_LID_DATA_FRAG:
-		{
-			printf("NRF24_PDU_LID_DATA_FRAG\n");
-			printf("nseq : %d\n", ipdu->nseq);
-			printf("payload: %s\n", ipdu->payload);
+			printf("NRF24_LL_CRTL_OP_RATE_IND\n");
+			printf("rate : %d\n", ind->rate);
+			break;
 		}
+
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_CHANNEL_IND) {
+			struct nrf24_ll_channel_ind *ind =
+				(struct nrf24_ll_channel_ind *) ctrl->payload;
+
+			printf("NRF24_LL_CRTL_OP_CHANNEL_IND\n");
+			printf("channel : %d\n", ind->channel);
 			break;
-		case NRF24_PDU_LID_DATA_END:
-		{
-			printf("NRF24_PDU_LID_DATA_END\n");
-			printf("nseq : %d\n", ipdu->nseq);
-			printf("payload: %s\n", ipdu->payload);
 		}
+
+		if (ctrl->opcode == NRF24_LL_CRTL_OP_POWER_IND) {
+			struct nrf24_ll_power_ind *ind =
+				(struct nrf24_ll_power_ind *) ctrl->payload;
+
+			printf("NRF24_LL_CRTL_OP_POWER_IND\n");
+			printf("rpd : %d%%\n", ind->rpd);
 			break;
-		default:
-			printf("CODE INVALID %d\n", ipdu->lid);
 		}
-		printf("\n\n");
+
+		printf("src_addr : %llX\n",
+		(long long int) kpalive->src_addr.address.uint64);
+		printf("dst_addr : %llX\n",
+		(long long int)kpalive->dst_addr.address.uint64);
+
+	}
+		break;
+
+	/* If is Data */
+	case NRF24_PDU_LID_DATA_FRAG:
+	{
+		printf("NRF24_PDU_LID_DATA_FRAG\n");
+		printf("nseq : %d\n", ipdu->nseq);
+		printf("payload: %.*s\n", plen, ipdu->payload);
+	}
+		break;
+	case NRF24_PDU_LID_DATA_END:
+	{
+		printf("NRF24_PDU_LID_DATA_END\n");
+		printf("nseq : %d\n", ipdu->nseq);
+		printf("payload: %.*s\n", plen, ipdu->payload);
+	}
+		break;
+	default:
+		printf("CODE INVALID %d\n", ipdu->lid);
 	}
+	printf("\n\n");
 }
 
-static void listen_mgmt(void)
+static void print_mgmt(const uint8_t *payload, size_t len)
 {
-	struct nrf24_io_pack p;
-	ssize_t ilen;
-	struct nrf24_ll_mgmt_pdu *ipdu =
-				(struct nrf24_ll_mgmt_pdu *)p.payload;
+	const struct nrf24_ll_mgmt_pdu *ipdu = (void *) payload;
 	int i;
-	/* Read from management pipe */
-	p.pipe = 0;
+
+	switch (ipdu->type) {
+	/* If is a presente type */
+	case NRF24_PDU_TYPE_PRESENCE:
+	{
+		/* Mac address structure */
+		struct nrf24_mac *mac =
+			(struct nrf24_mac *)ipdu->payload;
+		printf("NRF24_PDU_TYPE_PRESENCE\n");
+		printf("mac: %llX", (long long int)
+			mac->address.uint64);
+		printf("\n");
+	}
+		break;
+	/* If is a connect request type */
+	case NRF24_PDU_TYPE_CONNECT_REQ:
+	{
+		/* Link layer connect structure */
+		struct nrf24_ll_mgmt_connect *connect =
+			(struct nrf24_ll_mgmt_connect *) ipdu->payload;
+
+		/* Header type is a connect request type */
+		printf("NRF24_PDU_TYPE_CONNECT_REQ\n");
+		printf("src_addr = %llX\n",
+		(long long int) connect->src_addr.address.uint64);
+		printf("dst_addr = %llX\n",
+		(long long int) connect->dst_addr.address.uint64);
+		printf("channel = %d\n", connect->channel);
+		printf("Access Address: ");
+		for (i = 0; i < 5; i++)
+			printf("%llX", (long long int) connect->aa[i]);
+		printf("\n");
+	}
+		break;
+	default:
+		printf("CODE INVALID %d\n", ipdu->type);
+	}
+	printf("\n\n");
+}
+
+/* Bit i of an air frame, MSB first */
+static inline unsigned int air_bit(const uint8_t *air, unsigned int i)
+{
+	return (air[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* CRC-16-CCITT over the first bits of the air frame */
+static uint16_t air_crc(const uint8_t *air, unsigned int bits)
+{
+	uint16_t crc = 0xffff;
+	unsigned int i;
+
+	for (i = 0; i < bits; i++) {
+		if (((crc >> 15) & 1) ^ air_bit(air, i))
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+
+	return crc;
+}
+
+/*
+ * Promiscuous frame: address (5 bytes, MSB first on air), PCF (6 bits
+ * length, 2 bits PID, NO_ACK), payload and CRC, unaligned after the PCF.
+ * Returns the payload length or -EBADMSG when the CRC doesn't match.
+ */
+static int air_decode(const uint8_t *air, struct sniff_hdr *hdr,
+							uint8_t *payload)
+{
+	unsigned int len, bits, i, pcf = AIR_AA_SIZE * 8;
+	uint16_t crc = 0;
+
+	for (i = 0, len = 0; i < 6; i++)
+		len = (len << 1) | air_bit(air, pcf + i);
+
+	bits = pcf + AIR_PCF_BITS + len * 8;
+	if (len > NRF24_PAYLOAD_SIZE ||
+			bits + AIR_CRC_BITS > NRF24_PAYLOAD_SIZE * 8)
+		return -EBADMSG;
+
+	for (i = 0; i < AIR_CRC_BITS; i++)
+		crc = (crc << 1) | air_bit(air, bits + i);
+
+	if (crc != air_crc(air, bits))
+		return -EBADMSG;
+
+	for (i = 0; i < AIR_AA_SIZE; i++)
+		hdr->aa[i] = air[AIR_AA_SIZE - 1 - i];
+
+	hdr->pid = (air_bit(air, pcf + 6) << 1) | air_bit(air, pcf + 7);
+	hdr->no_ack = air_bit(air, pcf + 8);
+
+	memset(payload, 0, len);
+	for (i = 0; i < len * 8; i++)
+		payload[i / 8] |= air_bit(air, pcf + AIR_PCF_BITS + i) <<
+								(7 - i % 8);
+
+	return len;
+}
+
+static void ring_push(struct ring *ring, const struct frame *frame)
+{
+	uint32_t head = ring->head;
+
+	ring->frames++;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+								RING_SIZE) {
+		ring->drops++;
+		return;
+	}
+
+	ring->slot[head & (RING_SIZE - 1)] = *frame;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static struct frame *ring_peek(struct ring *ring)
+{
+	uint32_t tail = ring->tail;
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+		return NULL;
+
+	return &ring->slot[tail & (RING_SIZE - 1)];
+}
+
+static void ring_pop(struct ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void radio_tune(struct radio *radio)
+{
+	nrf24l01_set_channel(radio->spi_fd,
+					radio->channels[radio->current]);
+	nrf24l01_set_prx(radio->spi_fd, aa_pipes[0]);
+}
+
+static void *capture_loop(void *user_data)
+{
+	struct radio *radio = user_data;
+	struct frame frame;
+	uint64_t hop_us;
+	int8_t pipe;
+
+	radio_tune(radio);
+	hop_us = hal_time64_us() + opt_dwell * 1000;
+
 	while (!quit) {
-		ilen = phy_read(cli_fd, &p, NRF24_MTU);
-		if (ilen < 0)
+		if (radio->nchannels > 1 && hal_time64_us() >= hop_us) {
+			radio->current = (radio->current + 1) %
+							radio->nchannels;
+			radio_tune(radio);
+			hop_us = hal_time64_us() + opt_dwell * 1000;
+		}
+
+		pipe = nrf24l01_prx_pipe_available(radio->spi_fd);
+		if (pipe == NRF24_NO_PIPE)
 			continue;
 
-		switch (ipdu->type) {
-		/* If is a presente type */
-		case NRF24_PDU_TYPE_PRESENCE:
-		{
-			/* Mac address structure */
-			struct nrf24_mac *mac =
-				(struct nrf24_mac *)ipdu->payload;
-			printf("NRF24_PDU_TYPE_PRESENCE\n");
-			printf("mac: %llX", (long long int)
-				mac->address.uint64);
-			printf("\n");
+		frame.time_us = hal_time64_us();
+		frame.channel = radio->channels[radio->current];
+		frame.pipe = pipe;
+
+		if (opt_promisc)
+			frame.len = nrf24l01_prx_raw(radio->spi_fd,
+							frame.payload);
+		else
+			frame.len = nrf24l01_prx_data(radio->spi_fd,
+					frame.payload, sizeof(frame.payload));
+
+		ring_push(&radio->ring, &frame);
+	}
+
+	return NULL;
+}
+
+static void pcap_write(FILE *fp, unsigned int index, const struct frame *f)
+{
+	uint8_t payload[NRF24_PAYLOAD_SIZE];
+	struct pcap_rec_hdr rec;
+	struct sniff_hdr hdr;
+	const uint8_t *data = f->payload;
+	int len = f->len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = SNIFF_VERSION;
+	hdr.radio = index;
+	hdr.channel = f->channel;
+	hdr.pipe = f->pipe;
+
+	if (opt_promisc) {
+		hdr.flags = SNIFF_F_PROMISC;
+		len = air_decode(f->payload, &hdr, payload);
+		if (len >= 0) {
+			hdr.flags |= SNIFF_F_DECODED;
+			data = payload;
+		} else
+			len = f->len;
+	} else if (f->pipe <= NRF24_PIPE_MAX)
+		memcpy(hdr.aa, aa_pipes[f->pipe], sizeof(hdr.aa));
+
+	rec.ts_sec = (epoch_us + f->time_us) / 1000000;
+	rec.ts_usec = (epoch_us + f->time_us) % 1000000;
+	rec.incl_len = sizeof(hdr) + len;
+	rec.orig_len = rec.incl_len;
+
+	fwrite(&rec, sizeof(rec), 1, fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(data, len, 1, fp);
+}
+
+static void print_frame(unsigned int index, const struct frame *f)
+{
+	uint64_t time_us = epoch_us + f->time_us;
+
+	printf("%llu.%06llu radio %u channel %u pipe %u len %u\n",
+			(unsigned long long) (time_us / 1000000),
+			(unsigned long long) (time_us % 1000000),
+			index, f->channel, f->pipe, f->len);
+
+	if (opt_promisc) {
+		printf("\n");
+		return;
+	}
+
+	if (f->pipe == 0)
+		print_mgmt(f->payload, f->len);
+	else
+		print_raw(f->payload, f->len);
+}
+
+/* Writes the frames in time order across the radios */
+static void dump_loop(FILE *fp)
+{
+	uint64_t flush_us = 0;
+	struct frame *f, *first;
+	unsigned int i, index = 0;
+
+	while (true) {
+		first = NULL;
+		for (i = 0; i < nradios; i++) {
+			f = ring_peek(&radios[i].ring);
+			if (f && (first == NULL ||
+					f->time_us < first->time_us)) {
+				first = f;
+				index = i;
+			}
 		}
-			break;
-		/* If is a connect request type */
-		case NRF24_PDU_TYPE_CONNECT_REQ:
-		{
-			/* Link layer connect structure */
-			struct nrf24_ll_mgmt_connect *connect =
-				(struct nrf24_ll_mgmt_connect *) ipdu->payload;
-
-			/* Header type is a connect request type */
-			printf("NRF24_PDU_TYPE_CONNECT_REQ\n");
-			printf("src_addr = %llX\n",
-			(long long int) connect->src_addr.address.uint64);
-			printf("dst_addr = %llX\n",
-			(long long int) connect->dst_addr.address.uint64);
-			printf("channel = %d\n", connect->channel);
-			printf("Access Address: ");
-			for (i = 0; i < 5; i++)
-				printf("%llX", (long long int) connect->aa[i]);
-			printf("\n");
+
+		if (first == NULL) {
+			/* Capture threads stopped: rings are drained */
+			if (quit)
+				break;
+
+			if (fp && hal_time64_us() >= flush_us) {
+				fflush(fp);
+				flush_us = hal_time64_us() + FLUSH_MS * 1000;
+			}
+
+			usleep(1000);
+			continue;
 		}
+
+		if (fp)
+			pcap_write(fp, index, first);
+		else
+			print_frame(index, first);
+
+		ring_pop(&radios[index].ring);
+	}
+}
+
+static FILE *pcap_open(const char *path)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC,
+		.version_major = 2,
+		.version_minor = 4,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = sizeof(struct sniff_hdr) + NRF24_PAYLOAD_SIZE,
+		.linktype = LINKTYPE_USER0,
+	};
+	FILE *fp;
+
+	fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+	if (fp == NULL)
+		return NULL;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	return fp;
+}
+
+static int parse_channels(const char *str, int *channels, int max)
+{
+	char *list, *token, *saveptr;
+	int ch, count = 0, err = 0;
+
+	if (strcmp(str, "all") == 0) {
+		for (ch = NRF24_CH_MIN; ch <= NRF24_CH_MAX_1MBPS; ch++)
+			channels[count++] = ch;
+		return count;
+	}
+
+	list = g_strdup(str);
+	for (token = strtok_r(list, ",", &saveptr); token;
+				token = strtok_r(NULL, ",", &saveptr)) {
+		ch = atoi(token);
+		if (count == max || ch < NRF24_CH_MIN ||
+						ch > NRF24_CH_MAX_1MBPS) {
+			err = -EINVAL;
 			break;
-		default:
-			printf("CODE INVALID %d\n", ipdu->type);
 		}
-		printf("\n\n");
+
+		channels[count++] = ch;
+	}
+
+	g_free(list);
+
+	return err ? err : count;
+}
+
+static int radio_open(struct radio *radio)
+{
+	int pipe;
+
+	radio->spi_fd = nrf24l01_init(radio->dev, NRF24_PWR_0DBM);
+	if (radio->spi_fd < 0)
+		return radio->spi_fd;
+
+	nrf24l01_set_standby(radio->spi_fd);
+
+	if (opt_promisc)
+		return nrf24l01_set_promisc(radio->spi_fd);
+
+	/* Sniffing: frames must not be acknowledged */
+	for (pipe = 0; pipe <= NRF24_PIPE_MAX; pipe++)
+		nrf24l01_open_pipe(radio->spi_fd, pipe, aa_pipes[pipe],
+								false);
+
+	return 0;
+}
+
+/* Channels of each radio: one each, or a share to hop through */
+static int radios_setup(void)
+{
+	int channels[NRF24_CH_MAX_1MBPS + 1];
+	char *list, *token, *saveptr;
+	int nchannels, i;
+
+	if (opt_channels)
+		nchannels = parse_channels(opt_channels, channels,
+						NRF24_CH_MAX_1MBPS + 1);
+	else {
+		channels[0] = strcmp(opt_mode, "mgmt") == 0 ?
+						channel_mgmt : channel_raw;
+		nchannels = 1;
 	}
+
+	if (nchannels <= 0) {
+		printf("Invalid channels: %s\n", opt_channels);
+		return -EINVAL;
+	}
+
+	list = g_strdup(opt_devices);
+	for (token = strtok_r(list, ",", &saveptr); token && nradios <
+			RADIOS_MAX; token = strtok_r(NULL, ",", &saveptr)) {
+		radios[nradios].index = nradios;
+		radios[nradios].dev = g_strdup(token);
+		radios[nradios].spi_fd = -1;
+		nradios++;
+	}
+	g_free(list);
+
+	if (nradios == 0) {
+		printf("Invalid devices: %s\n", opt_devices);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nchannels; i++) {
+		struct radio *radio = &radios[i % nradios];
+
+		radio->channels[radio->nchannels++] = channels[i];
+	}
+
+	/* More radios than channels: the extra ones repeat a channel */
+	for (i = nchannels; i < (int) nradios; i++)
+		radios[i].channels[radios[i].nchannels++] =
+						channels[i % nchannels];
+
+	return 0;
 }
 
 static GOptionEntry options[] = {
 	{ "mode", 'm', 0, G_OPTION_ARG_STRING, &opt_mode,
-				"mode", "Operation mode: server or client" },
+		"mode", "Default channel: mgmt (20) or raw (10)" },
+	{ "write", 'w', 0, G_OPTION_ARG_STRING, &opt_write,
+		"file", "pcap capture file, - for stdout (default: print)" },
+	{ "channel", 'c', 0, G_OPTION_ARG_STRING, &opt_channels,
+		"list", "Channels, comma separated, or all" },
+	{ "dwell", 't', 0, G_OPTION_ARG_INT, &opt_dwell,
+		"ms", "Time on each channel when hopping (default 50)" },
+	{ "device", 'd', 0, G_OPTION_ARG_STRING, &opt_devices,
+		"list", "SPI devices, comma separated (default "
+						"/dev/spidev0.0)" },
+	{ "promisc", 'p', 0, G_OPTION_ARG_NONE, &opt_promisc,
+		NULL, "Any access address (no CRC check by the radio)" },
 	{ NULL },
 };
 
@@ -166,7 +632,10 @@ int main(int argc, char *argv[])
 {
 	GOptionContext *context;
 	GError *gerr = NULL;
-	struct addr_pipe adrrp;
+	struct timeval tv;
+	FILE *fp = NULL;
+	unsigned int i, j;
+	int err = 0;
 
 	signal(SIGTERM, sig_term);
 	signal(SIGINT, sig_term);
@@ -182,48 +651,72 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	cli_fd = phy_open("NRF0");
-	if (cli_fd < 0) {
-		printf("error open");
+	g_option_context_free(context);
+
+	if (opt_dwell <= 0 || radios_setup() < 0)
 		return EXIT_FAILURE;
+
+	gettimeofday(&tv, NULL);
+	epoch_us = tv.tv_sec * 1000000ULL + tv.tv_usec - hal_time64_us();
+
+	if (opt_write) {
+		fp = pcap_open(opt_write);
+		if (fp == NULL) {
+			printf("%s: %s\n", opt_write, strerror(errno));
+			return EXIT_FAILURE;
+		}
 	}
 
-	if (cli_fd < 0)
-		return -1;
+	/* pcap on stdout: messages go to stderr */
+	fprintf(fp == stdout ? stderr : stdout, "Sniffer nrfd knot%s\n",
+					opt_promisc ? " promiscuous" : "");
 
-	g_option_context_free(context);
+	for (i = 0; i < nradios; i++) {
+		err = radio_open(&radios[i]);
+		if (err < 0) {
+			fprintf(stderr, "%s: open error %d\n",
+						radios[i].dev, err);
+			goto done;
+		}
 
-	printf("Sniffer nrfd knot %s\n", opt_mode);
-
-	/* Sniffer in broadcast channel*/
-	if (strcmp(opt_mode, "mgmt") == 0) {
-		printf("listen mgmt\n");
-		/* Set Channel */
-		phy_ioctl(cli_fd, NRF24_CMD_SET_CHANNEL, &channel_mgmt);
-		adrrp.pipe = 0;
-		adrrp.ack = false;
-		memcpy(adrrp.aa, aa_pipes[0], sizeof(aa_pipes[0]));
-		phy_ioctl(cli_fd, NRF24_CMD_SET_PIPE, &adrrp);
-		listen_mgmt();
-
-	} else{
-		/*Sniffer in data channel*/
-		printf("listen raw\n");
-		/* Set Channel */
-		phy_ioctl(cli_fd, NRF24_CMD_SET_CHANNEL, &channel_raw);
-		/* Open pipe zero */
-		adrrp.pipe = 0;
-		adrrp.ack = false;
-		memcpy(adrrp.aa, aa_pipes[0], sizeof(aa_pipes[0]));
-		phy_ioctl(cli_fd, NRF24_CMD_SET_PIPE, &adrrp);
-		/* Open pipe 1 */
-		adrrp.pipe = 1;
-		adrrp.ack = false;
-		memcpy(adrrp.aa, aa_pipes[1], sizeof(aa_pipes[1]));
-		phy_ioctl(cli_fd, NRF24_CMD_SET_PIPE, &adrrp);
-		listen_raw();
+		fprintf(fp == stdout ? stderr : stdout, "%s: channel",
+							radios[i].dev);
+		for (j = 0; j < radios[i].nchannels; j++)
+			fprintf(fp == stdout ? stderr : stdout, " %d",
+						radios[i].channels[j]);
+		fprintf(fp == stdout ? stderr : stdout, "\n");
 	}
 
-	return 0;
-}
+	for (i = 0; i < nradios; i++) {
+		err = -pthread_create(&radios[i].thread, NULL, capture_loop,
+								&radios[i]);
+		if (err < 0) {
+			quit = 1;
+			break;
+		}
+	}
+
+	dump_loop(fp);
+
+	for (j = 0; j < i; j++)
+		pthread_join(radios[j].thread, NULL);
 
+	/* Frames captured after quit was seen */
+	dump_loop(fp);
+
+	for (i = 0; i < nradios; i++)
+		fprintf(stderr, "%s: %llu frames, %llu dropped\n",
+			radios[i].dev,
+			(unsigned long long) radios[i].ring.frames,
+			(unsigned long long) radios[i].ring.drops);
+
+done:
+	for (i = 0; i < nradios; i++)
+		if (radios[i].spi_fd >= 0)
+			nrf24l01_deinit(radios[i].spi_fd);
+
+	if (fp && fp != stdout)
+		fclose(fp);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
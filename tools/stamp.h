@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Load test messages and latency histogram shared by the gateway
+ * benchmark tools. A stamp message looks like a KNoT message (type and
+ * payload length) so that it crosses nrfd and phyemud unchanged: the
+ * payload carries the sender thing, a sequence number and the send
+ * time, then padding up to the requested size.
+ */
+
+#ifndef __STAMP_H__
+#define __STAMP_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define STAMP_MSG_TYPE		0x7e	/* Not used by the KNoT protocol */
+#define STAMP_HDR_SIZE		2
+#define STAMP_MSG_MAX		257	/* Largest KNoT message */
+
+struct stamp_msg {
+	uint8_t type;
+	uint8_t payload_len;
+	uint32_t thing;
+	uint32_t seq;
+	uint64_t time_us;	/* Sender clock, hal_time64_us() */
+} __attribute__ ((packed));
+
+#define STAMP_MSG_MIN		sizeof(struct stamp_msg)
+
+/* Builds a stamp message of size bytes in buffer. Returns the size */
+static inline size_t stamp_fill(void *buffer, size_t size, uint32_t thing,
+					uint32_t seq, uint64_t time_us)
+{
+	struct stamp_msg *msg = buffer;
+
+	if (size < STAMP_MSG_MIN)
+		size = STAMP_MSG_MIN;
+	if (size > STAMP_MSG_MAX)
+		size = STAMP_MSG_MAX;
+
+	msg->type = STAMP_MSG_TYPE;
+	msg->payload_len = size - STAMP_HDR_SIZE;
+	msg->thing = thing;
+	msg->seq = seq;
+	msg->time_us = time_us;
+	memset((uint8_t *) buffer + STAMP_MSG_MIN, 0x55, size - STAMP_MSG_MIN);
+
+	return size;
+}
+
+/* Returns the stamp carried by buffer or NULL for other messages */
+static inline const struct stamp_msg *stamp_parse(const void *buffer,
+								size_t len)
+{
+	const struct stamp_msg *msg = buffer;
+
+	if (len < STAMP_MSG_MIN || msg->type != STAMP_MSG_TYPE ||
+			(size_t) msg->payload_len + STAMP_HDR_SIZE != len)
+		return NULL;
+
+	return msg;
+}
+
+/*
+ * Log-linear histogram: values below 2 * HIST_SUB are exact, above
+ * every power of two is split in HIST_SUB buckets (1.6% resolution).
+ */
+#define HIST_SUB_BITS		6
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint32_t bucket[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+};
+
+static inline void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline unsigned int hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < 2 * HIST_SUB)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+
+	return (shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+}
+
+/* Lowest value of a bucket */
+static inline uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < 2 * HIST_SUB)
+		return index;
+
+	shift = index / HIST_SUB - 1;
+
+	return (uint64_t) (HIST_SUB + index % HIST_SUB) << shift;
+}
+
+static inline void hist_add(struct hist *h, uint64_t value)
+{
+	h->bucket[hist_index(value)]++;
+	h->count++;
+
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+/* Value below which permille / 1000 of the samples fall */
+static inline uint64_t hist_percentile(const struct hist *h,
+						unsigned int permille)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (h->count * permille + 999) / 1000;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/* Clamp the bucket bounds to the samples seen */
+	if (i >= HIST_BUCKETS || hist_value(i) > h->max)
+		return h->max;
+
+	return hist_value(i) < h->min ? h->min : hist_value(i);
+}
+
+#endif /* __STAMP_H__ */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "include/nrf24.h"
+#include "nrf24l01_io.h"
+#include "phy_driver.h"
+#include "phy_driver_nrf24.h"
+#include "phy_driver_sim.h"
+
+/*
+ * Channel survey: sweeps the channels of the radio, NRF24_CH_MIN to
+ * NRF24_CH_MAX_1MBPS at 1Mbps, sampling the carrier detector (RPD:
+ * above -64dBm) of each, and prints their occupancy histogram. The
+ * sweeps spread the samples of a channel over time: Wi-Fi and the other
+ * networks send in bursts. NRF0 must be free (nrfd stopped). SIM0
+ * surveys the simulator, --jam keeps a channel busy.
+ */
+
+#define BAR_WIDTH		50	/* 100% */
+#define QUIET_COUNT		3
+
+static char *opt_radio = "NRF0";
+static int opt_sweeps = 16;
+static int opt_samples = 8;
+static char *opt_jam = NULL;
+
+static GOptionEntry options[] = {
+	{ "radio", 'r', 0, G_OPTION_ARG_STRING, &opt_radio,
+		"name", "Radio driver: NRF0 or SIM0 (default NRF0)" },
+	{ "sweeps", 's', 0, G_OPTION_ARG_INT, &opt_sweeps,
+		"count", "Sweeps over the channels (default 16)" },
+	{ "samples", 'n', 0, G_OPTION_ARG_INT, &opt_samples,
+		"count", "RPD samples of a channel per sweep (default 8)" },
+	{ "jam", 0, 0, G_OPTION_ARG_STRING, &opt_jam,
+		"ch[,percent]", "SIM0: channel busy that share of the time "
+							"(default 50)" },
+	{ NULL },
+};
+
+/* A 2Mbps link takes two channels, and carriers spill over */
+static uint32_t hits_around(const uint32_t *hits, int ch)
+{
+	uint32_t max = hits[ch];
+
+	if (ch > NRF24_CH_MIN && hits[ch - 1] > max)
+		max = hits[ch - 1];
+	if (ch < NRF24_CH_MAX_1MBPS && hits[ch + 1] > max)
+		max = hits[ch + 1];
+
+	return max;
+}
+
+/*
+ * The quietest data channels, QUIET_COUNT at most: at least 3 apart,
+ * from each other and from the management channel
+ */
+static void print_quiet(const uint32_t *hits, uint32_t total)
+{
+	uint8_t quiet[QUIET_COUNT];
+	int i, j, ch, best, count = 0;
+
+	for (i = 0; i < QUIET_COUNT; i++) {
+		best = -1;
+		for (ch = NRF24_DATA_CH_MIN; ch <= NRF24_DATA_CH_MAX; ch++) {
+			if (abs(ch - NRF24_MGMT_CHANNEL) < 3)
+				continue;
+
+			for (j = 0; j < count; j++) {
+				if (abs(ch - quiet[j]) < 3)
+					break;
+			}
+
+			if (j < count)
+				continue;
+
+			if (best < 0 || hits_around(hits, ch) <
+						hits_around(hits, best))
+				best = ch;
+		}
+
+		if (best < 0)
+			break;
+
+		quiet[count++] = best;
+	}
+
+	printf("Quietest data channels:");
+	for (i = 0; i < count; i++)
+		printf(" %u (%u%%)", quiet[i],
+				hits_around(hits, quiet[i]) * 100 / total);
+	printf("\n");
+
+	printf("Management channel %d: %u%% busy\n", NRF24_MGMT_CHANNEL,
+					hits[NRF24_MGMT_CHANNEL] * 100 / total);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	struct nrf24_survey sample;
+	uint32_t hits[NRF24_CH_MAX_1MBPS + 1];
+	uint32_t total, i;
+	int jam_channel = -1, jam_percent = 50;
+	int fd, ch, sweep, err = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_sweeps < 1 || opt_samples < 1 ||
+			opt_samples > NRF24_SURVEY_SAMPLES_MAX || (opt_jam &&
+			(sscanf(opt_jam, "%d,%d", &jam_channel,
+						&jam_percent) < 1 ||
+			jam_channel < 0 || jam_channel > SIM_CHANNEL_MAX ||
+			jam_percent < 0 || jam_percent > 100))) {
+		printf("Invalid arguments (samples: 1 to %d)\n",
+						NRF24_SURVEY_SAMPLES_MAX);
+		return EXIT_FAILURE;
+	}
+
+	if (jam_channel >= 0)
+		sim_set_interference(jam_channel, jam_percent * 10000);
+
+	fd = phy_open(opt_radio);
+	if (fd < 0) {
+		printf("%s: %s\n", opt_radio, strerror(-fd));
+		return EXIT_FAILURE;
+	}
+
+	memset(hits, 0, sizeof(hits));
+
+	for (sweep = 0; sweep < opt_sweeps; sweep++) {
+		for (ch = NRF24_CH_MIN; ch <= NRF24_CH_MAX_1MBPS; ch++) {
+			sample.channel = ch;
+			sample.samples = opt_samples;
+			err = phy_ioctl(fd, NRF24_CMD_SURVEY, &sample);
+			if (err < 0) {
+				printf("%s: channel %d: %s\n", opt_radio, ch,
+							strerror(-err));
+				goto done;
+			}
+
+			hits[ch] += sample.hits;
+		}
+	}
+
+	total = opt_sweeps * opt_samples;
+
+	printf("%s: %d sweeps of %d samples, channels %d to %d\n",
+			opt_radio, opt_sweeps, opt_samples, NRF24_CH_MIN,
+			NRF24_CH_MAX_1MBPS);
+
+	for (ch = NRF24_CH_MIN; ch <= NRF24_CH_MAX_1MBPS; ch++) {
+		printf("%3d %3u%% ", ch, hits[ch] * 100 / total);
+		for (i = 0; i < hits[ch] * BAR_WIDTH / total; i++)
+			putchar('#');
+		putchar('\n');
+	}
+
+	print_quiet(hits, total);
+
+done:
+	phy_close(fd);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "include/time.h"
+
+/* Histogram: 10us buckets, last bucket collects everything above */
+#define BUCKET_US		10
+#define BUCKETS			21
+
+static int opt_samples = 1000;
+static gboolean opt_usleep = FALSE;
+
+/* Delays exercised by the HAL: TSTBY2A, fragment gap and TPD2STBY */
+static const uint32_t delays[] = { 10, 50, 130, 512, 1000, 5000 };
+
+static GOptionEntry options[] = {
+	{ "samples", 'n', 0, G_OPTION_ARG_INT, &opt_samples,
+					"samples", "Samples per delay value" },
+	{ "usleep", 'u', 0, G_OPTION_ARG_NONE, &opt_usleep,
+			"usleep", "Measure usleep() instead of hal_delay_us()" },
+	{ NULL },
+};
+
+static void measure(uint32_t delay)
+{
+	uint32_t hist[BUCKETS];
+	uint64_t start, elapsed, sum = 0, max = 0, min = UINT64_MAX;
+	unsigned int bucket;
+	int i;
+
+	memset(hist, 0, sizeof(hist));
+
+	for (i = 0; i < opt_samples; i++) {
+		start = hal_time64_us();
+
+		if (opt_usleep)
+			usleep(delay);
+		else
+			hal_delay_us(delay);
+
+		/* Overshoot: time spent after the requested delay */
+		elapsed = hal_time64_us() - start;
+		elapsed = elapsed > delay ? elapsed - delay : 0;
+
+		bucket = elapsed / BUCKET_US;
+		if (bucket >= BUCKETS)
+			bucket = BUCKETS - 1;
+
+		hist[bucket]++;
+		sum += elapsed;
+		if (elapsed > max)
+			max = elapsed;
+		if (elapsed < min)
+			min = elapsed;
+	}
+
+	printf("\ndelay %uus: overshoot min %llu avg %llu max %llu (us)\n",
+				delay, (unsigned long long) min,
+				(unsigned long long) (sum / opt_samples),
+				(unsigned long long) max);
+
+	for (bucket = 0; bucket < BUCKETS; bucket++) {
+		if (hist[bucket] == 0)
+			continue;
+
+		if (bucket == BUCKETS - 1)
+			printf("  >=%4uus: %u\n", bucket * BUCKET_US,
+							hist[bucket]);
+		else
+			printf("  %4u-%4uus: %u\n", bucket * BUCKET_US,
+					(bucket + 1) * BUCKET_US - 1,
+					hist[bucket]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *gerr = NULL;
+	unsigned int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &gerr)) {
+		printf("Invalid arguments: %s\n", gerr->message);
+		g_error_free(gerr);
+		g_option_context_free(context);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (opt_samples <= 0) {
+		printf("Invalid number of samples\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("Delay accuracy: %s, %d samples\n",
+		opt_usleep ? "usleep()" : "hal_delay_us()", opt_samples);
+
+	for (i = 0; i < sizeof(delays) / sizeof(delays[0]); i++)
+		measure(delays[i]);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "include/time.h"
+#include "vclock.h"
+
+#define NSEC_PER_USEC		1000ULL
+#define NSEC_PER_SEC		1000000000ULL
+
+static double speed = 1;
+static uint64_t real_base_ns;
+static uint64_t virtual_us;
+static uint32_t random_state = 1;
+static vclock_func_t delay_func;
+static void *delay_data;
+
+static uint64_t real_ns(void)
+{
+	struct timespec spec;
+
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (uint64_t) spec.tv_sec * NSEC_PER_SEC + spec.tv_nsec;
+}
+
+void vclock_init(double new_speed, uint32_t seed)
+{
+	speed = new_speed;
+	real_base_ns = real_ns();
+	virtual_us = 0;
+	random_state = seed ? seed : 1;
+}
+
+bool vclock_virtual(void)
+{
+	return speed == 0;
+}
+
+void vclock_wait_until(uint64_t time_us)
+{
+	struct timespec deadline;
+	uint64_t ns;
+
+	if (speed == 0) {
+		if (time_us > virtual_us)
+			virtual_us = time_us;
+		return;
+	}
+
+	/* A signal ends the wait: the program checks its quit flag */
+	ns = real_base_ns + (uint64_t) (time_us * NSEC_PER_USEC / speed);
+	deadline.tv_sec = ns / NSEC_PER_SEC;
+	deadline.tv_nsec = ns % NSEC_PER_SEC;
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+}
+
+void vclock_set_delay_func(vclock_func_t func, void *user_data)
+{
+	delay_func = func;
+	delay_data = user_data;
+}
+
+uint64_t hal_time64_us(void)
+{
+	if (speed == 0)
+		return virtual_us;
+
+	return (real_ns() - real_base_ns) * speed / NSEC_PER_USEC;
+}
+
+uint64_t hal_time64_ms(void)
+{
+	return hal_time64_us() / 1000;
+}
+
+uint32_t hal_time_us(void)
+{
+	return (uint32_t) hal_time64_us();
+}
+
+uint32_t hal_time_ms(void)
+{
+	return (uint32_t) hal_time64_ms();
+}
+
+void hal_delay_us(uint32_t us)
+{
+	uint64_t end = hal_time64_us() + us;
+
+	if (speed == 0 && delay_func)
+		delay_func(end, delay_data);
+
+	/* Restarted after a signal: the caller expects the full delay */
+	while (hal_time64_us() < end)
+		vclock_wait_until(end);
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+	hal_delay_us(ms * 1000);
+}
+
+int hal_timeout(uint32_t current,  uint32_t start,  uint32_t timeout)
+{
+	/* Time overflow */
+	if (current < start)
+		/* Fit time overflow and compute time elapsed */
+		current += (ULONG_MAX - start);
+	else
+		/* Compute time elapsed */
+		current -= start;
+
+	/* Timeout is flagged */
+	return (current >= timeout);
+}
+
+/* Same sequence on every run: runs are reproducible */
+int hal_getrandom(void *buf, size_t buflen)
+{
+	uint8_t *ptr = buf;
+	size_t i;
+
+	for (i = 0; i < buflen; i++) {
+		random_state = random_state * 1103515245 + 12345;
+		ptr[i] = random_state >> 16;
+	}
+
+	return buflen;
+}
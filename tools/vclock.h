@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2016, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Clock of the tools running hal_comm on simulated radios (replay,
+ * capsim): tools/vclock.c provides the hal_time functions instead of
+ * src/hal/time/time_linux.c. The clock runs speed times faster than
+ * real time, or is virtual (speed 0): it only moves when the program
+ * waits or the stack delays, so runs only depend on their inputs.
+ */
+
+/* Runs what is due before until_us: nodes driven by the program */
+typedef void (*vclock_func_t) (uint64_t until_us, void *user_data);
+
+void vclock_init(double speed, uint32_t seed);
+bool vclock_virtual(void);
+
+/* Virtual: jumps to time_us, otherwise sleeps until then */
+void vclock_wait_until(uint64_t time_us);
+
+/*
+ * Virtual: called by hal_delay_us() and hal_delay_ms() with the end of
+ * the delay. The program moves the clock (vclock_wait_until()) to each
+ * event it runs meanwhile; the caller of the delay resumes at its end.
+ */
+void vclock_set_delay_func(vclock_func_t func, void *user_data);